@@ -0,0 +1,429 @@
+﻿#include "LoadGenerator.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+typedef SOCKET socket_t;
+#define CLOSESOCKET(s) closesocket(s)
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define CLOSESOCKET(s) close(s)
+#endif
+
+namespace Bench
+{
+
+#ifdef _WIN32
+double now()
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return double(count.QuadPart) / double(freq.QuadPart);
+}
+
+static double filetimeSeconds(FILETIME const & a, FILETIME const & b)
+{
+    ULARGE_INTEGER ua, ub;
+    ua.LowPart = a.dwLowDateTime;
+    ua.HighPart = a.dwHighDateTime;
+    ub.LowPart = b.dwLowDateTime;
+    ub.HighPart = b.dwHighDateTime;
+    return double(ua.QuadPart + ub.QuadPart) * 1e-7;
+}
+
+double processCpuTime()
+{
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(),&creation,&exit,&kernel,&user);
+    return filetimeSeconds(kernel,user);
+}
+
+double threadCpuTime()
+{
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(),&creation,&exit,&kernel,&user);
+    return filetimeSeconds(kernel,user);
+}
+#else
+static double clockSeconds(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id,&ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+double now()
+{
+    return clockSeconds(CLOCK_MONOTONIC);
+}
+
+double processCpuTime()
+{
+    return clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+double threadCpuTime()
+{
+    return clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+}
+#endif
+
+double Result::percentile(double p) const
+{
+    if( latency.empty() ) return 0;
+
+    size_t i = size_t(p / 100.0 * (latency.size() - 1) + 0.5);
+    return latency[std::min(i,latency.size() - 1)];
+}
+
+namespace
+{
+
+// consecutive failed connects after which a worker stops
+unsigned const maxConnectFailures = 20;
+
+struct Worker
+{
+    std::string const * host;
+    int port;
+    std::string const * request;
+    double deadline;
+    unsigned long long requests;
+    unsigned long long errors;
+    double cpu;
+    std::vector<unsigned> latency;
+};
+
+socket_t connectTo(std::string const & host, int port)
+{
+    socket_t sock = socket(AF_INET,SOCK_STREAM,0);
+    if( sock == INVALID_SOCKET ) return sock;
+
+    struct sockaddr_in sa;
+    std::memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)port);
+    sa.sin_addr.s_addr = inet_addr(host.c_str());
+    int on = 1;
+    setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,(char const *)&on,sizeof(on));
+    if( connect(sock,(struct sockaddr *)&sa,sizeof(sa)) != 0 )
+    {
+        CLOSESOCKET(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+void sleepMs(unsigned ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+bool sendAll(socket_t sock, std::string const & data)
+{
+    size_t sent = 0;
+    while( sent < data.size() )
+    {
+        int n = send(sock,data.data() + sent,int(data.size() - sent),0);
+        if( n <= 0 ) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// case insensitive search for a header, returns a pointer to its value
+char const * findHeader(char const * begin, char const * end, char const * name)
+{
+    size_t len = std::strlen(name);
+    for( char const * p = begin ; p + len < end ; ++p )
+    {
+        if( p[-1] != '\n' ) continue;
+
+        size_t i = 0;
+        while( i < len && std::tolower((unsigned char)p[i]) == name[i] ) ++i;
+        if( i == len && p[len] == ':' ) return p + len + 1;
+    }
+    return 0;
+}
+
+// Receive into buf until at least need bytes are buffered.
+bool fill(socket_t sock, std::vector<char> & buf, size_t & buffered, size_t need)
+{
+    if( buf.size() < need ) buf.resize(std::max(need,buf.size() * 2));
+    while( buffered < need )
+    {
+        int n = recv(sock,&buf[buffered],int(buf.size() - buffered),0);
+        if( n <= 0 ) return false;
+        buffered += n;
+    }
+    return true;
+}
+
+// Receive until a CRLF is buffered at or after pos, return the offset just
+// past it.
+bool readLine(socket_t sock, std::vector<char> & buf, size_t & buffered, size_t pos, size_t & lineEnd)
+{
+    for( ;; )
+    {
+        for( size_t i = pos + 1 ; i < buffered ; ++i )
+        {
+            if( buf[i - 1] == '\r' && buf[i] == '\n' )
+            {
+                lineEnd = i + 1;
+                return true;
+            }
+        }
+        if( ! fill(sock,buf,buffered,buffered + 1) ) return false;
+    }
+}
+
+// Walk a chunked body starting at pos, return the offset past its end.
+bool readChunked(socket_t sock, std::vector<char> & buf, size_t & buffered, size_t pos, size_t & total)
+{
+    for( ;; )
+    {
+        size_t lineEnd;
+        if( ! readLine(sock,buf,buffered,pos,lineEnd) ) return false;
+
+        char * sizeEnd;
+        unsigned long size = std::strtoul(&buf[pos],&sizeEnd,16);
+        if( sizeEnd == &buf[pos] ) return false;
+        pos = lineEnd;
+
+        if( size == 0 ) break;
+
+        // chunk data and its CRLF
+        pos += size + 2;
+        if( ! fill(sock,buf,buffered,pos) ) return false;
+    }
+
+    // trailer lines up to the empty one
+    for( ;; )
+    {
+        size_t lineEnd;
+        if( ! readLine(sock,buf,buffered,pos,lineEnd) ) return false;
+
+        bool empty = lineEnd - pos == 2;
+        pos = lineEnd;
+        if( empty ) break;
+    }
+    total = pos;
+    return true;
+}
+
+// Read one response from sock. buf carries bytes of the next response that
+// arrived with this one. Return false if the connection must be dropped.
+// The response itself is copied to copy if given.
+bool readResponse(socket_t sock, std::vector<char> & buf, size_t & buffered, bool & keepAlive, std::string * copy = 0)
+{
+    size_t headerEnd = 0;
+    for( ;; )
+    {
+        for( size_t i = 3 ; i < buffered && ! headerEnd ; ++i )
+        {
+            if( std::memcmp(&buf[i - 3],"\r\n\r\n",4) == 0 ) headerEnd = i + 1;
+        }
+        if( headerEnd ) break;
+
+        if( ! fill(sock,buf,buffered,buffered + 1) ) return false;
+    }
+
+    char const * head = &buf[0];
+    if( buffered < 12 || std::memcmp(head,"HTTP/1.1 2",10) != 0 ) return false;
+
+    auto connection = findHeader(head + 1,head + headerEnd,"connection");
+    keepAlive = ! (connection && std::strncmp(connection," close",6) == 0);
+
+    size_t total;
+    auto length = findHeader(head + 1,head + headerEnd,"content-length");
+    auto encoding = findHeader(head + 1,head + headerEnd,"transfer-encoding");
+    if( length )
+    {
+        total = headerEnd + std::strtoul(length,0,10);
+        if( ! fill(sock,buf,buffered,total) ) return false;
+    }
+    else if( encoding && std::strncmp(encoding," chunked",8) == 0 )
+    {
+        if( ! readChunked(sock,buf,buffered,headerEnd,total) ) return false;
+    }
+    else
+    {
+        // the body ends with the connection
+        for( ;; )
+        {
+            if( buffered == buf.size() ) buf.resize(buf.size() * 2);
+            int n = recv(sock,&buf[buffered],int(buf.size() - buffered),0);
+            if( n < 0 ) return false;
+            if( n == 0 ) break;
+            buffered += n;
+        }
+        keepAlive = false;
+        total = buffered;
+    }
+
+    if( copy ) copy->assign(&buf[0],total);
+
+    // keep pipelined leftovers for the next round
+    std::memmove(&buf[0],&buf[total],buffered - total);
+    buffered -= total;
+    return true;
+}
+
+void runWorker(Worker & w)
+{
+    double cpuStart = threadCpuTime();
+    std::vector<char> buf(16384);
+    socket_t sock = INVALID_SOCKET;
+    size_t buffered = 0;
+    unsigned failures = 0;
+    w.latency.reserve(1 << 16);
+
+    while( now() < w.deadline )
+    {
+        if( sock == INVALID_SOCKET )
+        {
+            buffered = 0;
+            if( (sock = connectTo(*w.host,w.port)) == INVALID_SOCKET )
+            {
+                // back off 1, 2, 4 ... 128ms, and give up if the server
+                // stays unreachable
+                ++w.errors;
+                if( ++failures == maxConnectFailures ) break;
+                sleepMs(1u << std::min(failures - 1,7u));
+                continue;
+            }
+            failures = 0;
+        }
+
+        bool keepAlive = false;
+        double start = now();
+        if( ! sendAll(sock,*w.request) || ! readResponse(sock,buf,buffered,keepAlive) )
+        {
+            ++w.errors;
+            CLOSESOCKET(sock);
+            sock = INVALID_SOCKET;
+            continue;
+        }
+        w.latency.push_back(unsigned((now() - start) * 1e6));
+        ++w.requests;
+
+        if( ! keepAlive )
+        {
+            CLOSESOCKET(sock);
+            sock = INVALID_SOCKET;
+        }
+    }
+    if( sock != INVALID_SOCKET ) CLOSESOCKET(sock);
+    w.cpu = threadCpuTime() - cpuStart;
+}
+
+#ifdef _WIN32
+DWORD WINAPI workerEntry(LPVOID arg)
+{
+    runWorker(*static_cast<Worker *>(arg));
+    return 0;
+}
+#else
+void * workerEntry(void * arg)
+{
+    runWorker(*static_cast<Worker *>(arg));
+    return 0;
+}
+#endif
+
+}
+
+LoadGenerator::LoadGenerator(std::string const & host, int port):
+    host(host),
+    port(port)
+{}
+
+std::string LoadGenerator::fetch(std::string const & request) const
+{
+    std::string response;
+    std::vector<char> buf(16384);
+    size_t buffered = 0;
+    bool keepAlive;
+    socket_t sock = connectTo(host,port);
+    if( sock == INVALID_SOCKET ) return response;
+
+    if( ! sendAll(sock,request) || ! readResponse(sock,buf,buffered,keepAlive,&response) )
+    {
+        response.clear();
+    }
+    CLOSESOCKET(sock);
+    return response;
+}
+
+Result LoadGenerator::run(std::string const & request, int threads, double seconds) const
+{
+    std::vector<Worker> workers(threads);
+    double start = now();
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        Worker & w = workers[i];
+        w.host = &host;
+        w.port = port;
+        w.request = &request;
+        w.deadline = start + seconds;
+        w.requests = w.errors = 0;
+        w.cpu = 0;
+    }
+
+#ifdef _WIN32
+    std::vector<HANDLE> handles(threads);
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        handles[i] = CreateThread(0,0,&workerEntry,&workers[i],0,0);
+    }
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        WaitForSingleObject(handles[i],INFINITE);
+        CloseHandle(handles[i]);
+    }
+#else
+    std::vector<pthread_t> handles(threads);
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        pthread_create(&handles[i],0,&workerEntry,&workers[i]);
+    }
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        pthread_join(handles[i],0);
+    }
+#endif
+
+    Result result;
+    result.seconds = now() - start;
+    result.requests = result.errors = 0;
+    result.clientCpu = 0;
+    for( int i = 0 ; i < threads ; ++i )
+    {
+        Worker const & w = workers[i];
+        result.requests += w.requests;
+        result.errors += w.errors;
+        result.clientCpu += w.cpu;
+        result.latency.insert(result.latency.end(),w.latency.begin(),w.latency.end());
+    }
+    std::sort(result.latency.begin(),result.latency.end());
+    return result;
+}
+
+}
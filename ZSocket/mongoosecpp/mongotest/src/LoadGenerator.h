@@ -0,0 +1,41 @@
+﻿#ifndef LOADGENERATOR_H_GUARD_d8s7a6m2k1
+#define LOADGENERATOR_H_GUARD_d8s7a6m2k1
+
+#include <string>
+#include <vector>
+
+namespace Bench
+{
+
+// Monotonic wall clock and CPU clocks, in seconds.
+double now();
+double processCpuTime();
+double threadCpuTime();
+
+struct Result
+{
+    unsigned long long requests;
+    unsigned long long errors;
+    double seconds;
+    double clientCpu;               // CPU spent by the load generator threads
+    std::vector<unsigned> latency;  // microseconds, sorted
+    double percentile(double p) const;
+};
+
+// Closed loop HTTP/1.1 client: every thread owns one keep-alive connection
+// and sends the next request as soon as the previous response is complete.
+class LoadGenerator
+{
+    std::string host;
+    int port;
+public:
+    LoadGenerator(std::string const & host, int port);
+    Result run(std::string const & request, int threads, double seconds) const;
+    // One request on a new connection: the whole 2xx response, or "" on
+    // failure.
+    std::string fetch(std::string const & request) const;
+};
+
+}
+
+#endif
@@ -1,54 +1,256 @@
 ﻿#include "../../src/MongoServer.h"
+#include "../../src/MongoDispatcher.h"
+#include "../../src/Template.h"
+#include "LoadGenerator.h"
 
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
-#include <fstream>
+#include <vector>
+
+// Benchmark for the server core. Starts a Mongo::Server with a few
+// representative handlers and drives each of them over loopback with the
+// built-in keep-alive load generator.
+//
+// usage: mongotest [-p port] [-c client threads] [-w server threads]
+//                  [-d seconds per scenario] [-s scenario] [-f fixtures dir]
+//        mongotest -t cache [-p port]
+//
+// -t runs a functional check instead, the exit status tells the result.
+
+namespace
+{
+
+struct Options
+{
+    int port;
+    int clients;
+    int workers;
+    double seconds;
+    std::string only;
+    std::string fixtures;
+    std::string check;
+};
+
+struct Scenario
+{
+    char const * name;
+    std::string request;
+};
+
+Options parseOptions(int argc, char * argv[])
+{
+    Options opt;
+    opt.port = 18080;
+    opt.clients = 8;
+    opt.workers = 16;
+    opt.seconds = 5;
+    opt.fixtures = ".";
+    for( int i = 1 ; i + 1 < argc ; i += 2 )
+    {
+        std::string flag = argv[i];
+        char const * value = argv[i + 1];
+        if( flag == "-p" ) opt.port = std::atoi(value);
+        else if( flag == "-c" ) opt.clients = std::atoi(value);
+        else if( flag == "-w" ) opt.workers = std::atoi(value);
+        else if( flag == "-d" ) opt.seconds = std::atof(value);
+        else if( flag == "-s" ) opt.only = value;
+        else if( flag == "-f" ) opt.fixtures = value;
+        else if( flag == "-t" ) opt.check = value;
+        else std::cerr << "ignoring unknown option " << flag << std::endl;
+    }
+    return opt;
+}
+
+// files served by the static and template scenarios
+void writeFixtures(std::string const & dir)
+{
+    std::ofstream css((dir + "/bench.css").c_str(),std::ios::binary);
+    for( int i = 0 ; i < 128 ; ++i )
+    {
+        css << ".rule" << i << " { margin: 0 auto; padding: 4px; color: #333; }\n";
+    }
+
+    std::ofstream page((dir + "/bench.tpl").c_str(),std::ios::binary);
+    page << "<html><head><title>%</title></head><body>\n"
+         << "<h1>Hello %</h1><p>You have % new messages.</p>\n"
+         << "<ul><li>%</li><li>%</li></ul></body></html>\n";
+}
+
+std::string get(char const * uri)
+{
+    return std::string("GET ") + uri + " HTTP/1.1\r\nHost: localhost\r\n"
+           "User-Agent: mongotest\r\nAccept: */*\r\n\r\n";
+}
+
+std::string post(char const * uri, char const * body)
+{
+    std::ostringstream os;
+    os << "POST " << uri << " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: mongotest\r\n"
+       << "Content-Type: application/x-www-form-urlencoded\r\n"
+       << "Content-Length: " << std::strlen(body) << "\r\n\r\n" << body;
+    return os.str();
+}
+
+std::string body(std::string const & response)
+{
+    size_t pos = response.find("\r\n\r\n");
+    return pos == std::string::npos ? std::string() : response.substr(pos + 4);
+}
+
+bool expect(bool ok, char const * what)
+{
+    std::printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+    return ok;
+}
+
+// Responses for one client must not be replayed from the response cache:
+// every request of these routes runs the handler and gets its own answer.
+int checkCache(Options const & opt)
+{
+    std::ostringstream port;
+    port << opt.port;
+
+    Mongo::Server server;
+    server.setOption("listening_ports",port.str());
+
+    std::atomic<int> counter(0);
+    Mongo::Dispatcher dispatcher(server);
+    dispatcher.serveCached("/shared",Mongo::CachePolicy(60),[&counter](Mongo::Request, Mongo::Response response) -> bool
+    {
+        response.printf("%d",++counter);
+        return true;
+    });
+    dispatcher.serveCached("/session",Mongo::CachePolicy(60),[&counter](Mongo::Request, Mongo::Response response) -> bool
+    {
+        int n = ++counter;
+        char cookie[32];
+        std::sprintf(cookie,"session=%d",n);
+        response.header("Set-Cookie",cookie).printf("%d",n);
+        return true;
+    });
+    dispatcher.serveCached("/nostore",Mongo::CachePolicy(60),[&counter](Mongo::Request, Mongo::Response response) -> bool
+    {
+        response.header("Cache-Control","No-Store").printf("%d",++counter);
+        return true;
+    });
+    server.start();
+
+    Bench::LoadGenerator client("127.0.0.1",opt.port);
+    bool ok = true;
+
+    auto a = client.fetch(get("/shared"));
+    auto b = client.fetch(get("/shared"));
+    ok &= expect(! a.empty() && body(a) == body(b),"a plain response is served from the cache");
+
+    a = client.fetch(get("/session"));
+    b = client.fetch(get("/session"));
+    ok &= expect(! a.empty() && ! b.empty() && body(a) != body(b),"a response with Set-Cookie is not cached");
+    ok &= expect(b.find("session=" + body(a) + "\r\n") == std::string::npos,"another client's cookie is not replayed");
+
+    a = client.fetch(get("/nostore"));
+    b = client.fetch(get("/nostore"));
+    ok &= expect(! a.empty() && ! b.empty() && body(a) != body(b),"a Cache-Control: no-store response is not cached");
+
+    server.stop();
+    return ok ? 0 : 1;
+}
+
+void report(char const * name, Bench::Result const & r, double serverCpu)
+{
+    double rps = r.seconds > 0 ? r.requests / r.seconds : 0;
+    double cpuPerReq = r.requests ? serverCpu / r.requests * 1e6 : 0;
+    std::printf("%-10s %10.0f %9.0f %9.0f %9.0f %10.1f %8llu\n",
+                name, rps, r.percentile(50), r.percentile(99), r.percentile(99.9),
+                cpuPerReq, r.errors);
+}
+
+}
 
 int main(int argc, char * argv[])
 {
-    std::string path = argc >=2 ? argv[1] : "";
+    Options opt = parseOptions(argc,argv);
+    if( opt.check == "cache" ) return checkCache(opt);
+    if( ! opt.check.empty() )
+    {
+        std::cerr << "unknown check " << opt.check << std::endl;
+        return 2;
+    }
+    writeFixtures(opt.fixtures);
+
+    std::ostringstream port;
+    port << opt.port;
+    std::ostringstream workers;
+    workers << opt.workers;
+
     Mongo::Server server;
     server
-    .setOption("listening_ports","8080")
-    .setStart([&](Mongo::Request request, Mongo::Response response) -> bool
-    {
-        static int i = 1;
-        std::string img = request.get("img");
-        if( ! img.empty() )
-        {
-            img = path + img;
-            std::ifstream fs(img.c_str(),std::ios::binary);
-            if( fs )
-            {
-                response.contentType("image/jpeg");
-                std::vector<char> buf(4096);
-                while( fs.read(&buf[0],buf.size()) )
-                {
-                    response.write(&buf[0],fs.gcount());
-                }
-            }
-            else
-            {
-                response
-                .status(404)
-                .printf("image not found");
-            }
-        }
-        else if( request.hasGet("alt") )
-        {
-            response.printf("U SUCK %d TIMES",i++);
-        }
-        else {
-            response
-            .status(200)
-            .contentType("text/plain")
-            .printf("U SUCK %d",i++)
-            ;
-        }
+    .setOption("listening_ports",port.str())
+    .setOption("num_threads",workers.str())
+    .setOption("enable_keep_alive","yes");
+
+    Mongo::Dispatcher dispatcher(server);
+    dispatcher.staticFile("/static/bench.css",opt.fixtures + "/bench.css");
+    dispatcher.serve("/json",[](Mongo::Request request, Mongo::Response response) -> bool
+    {
+        response
+        .contentType("application/json")
+        .printf("{\"id\":%d,\"name\":\"%s\",\"active\":true}",
+                std::atoi(request.get_ref("id").data()),"mongoose");
+        return true;
+    });
+    std::string fixtures = opt.fixtures;
+    dispatcher.serve("/page",[fixtures](Mongo::Request request, Mongo::Response response) -> bool
+    {
+        response.contentType("text/html");
+        Mongo::Template tpl(response,fixtures);
+        tpl.print("bench.tpl",request.get("user"),request.get("user"),42,"first","second");
         return true;
-    })
-    .start();
-    std::cout << "type something and press enter to exit";
-    int x;
-    std::cin >> x;
+    });
+    dispatcher.serve("/form",[](Mongo::Request request, Mongo::Response response) -> bool
+    {
+        response
+        .contentType("text/plain")
+        .printf("%s %s %s",request.post("name").c_str(),request.post("email").c_str(),
+                request.post("comment").c_str());
+        return true;
+    });
+    server.start();
+
+    std::vector<Scenario> scenarios;
+    Scenario s1 = { "static", get("/static/bench.css") };
+    Scenario s2 = { "json", get("/json?id=17&verbose=0") };
+    Scenario s3 = { "template", get("/page?user=alice") };
+    Scenario s4 = { "form", post("/form","name=alice&email=alice%40example.com&comment=hello+world") };
+    scenarios.push_back(s1);
+    scenarios.push_back(s2);
+    scenarios.push_back(s3);
+    scenarios.push_back(s4);
+
+    Bench::LoadGenerator load("127.0.0.1",opt.port);
+    std::printf("%d client threads, %d server threads, %.0fs per scenario\n",
+                opt.clients, opt.workers, opt.seconds);
+    std::printf("%-10s %10s %9s %9s %9s %10s %8s\n",
+                "scenario", "req/s", "p50 us", "p99 us", "p99.9 us", "cpu us/req", "errors");
+    for( size_t i = 0 ; i < scenarios.size() ; ++i )
+    {
+        Scenario const & s = scenarios[i];
+        if( ! opt.only.empty() && opt.only != s.name ) continue;
+
+        // short warm-up so connection setup and page faults stay out of the numbers
+        load.run(s.request,opt.clients,opt.seconds / 10);
+
+        double cpuStart = Bench::processCpuTime();
+        Bench::Result r = load.run(s.request,opt.clients,opt.seconds);
+        double serverCpu = Bench::processCpuTime() - cpuStart - r.clientCpu;
+        report(s.name,r,serverCpu);
+    }
+
+    server.stop();
+    return 0;
 }
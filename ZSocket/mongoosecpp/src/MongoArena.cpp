@@ -0,0 +1,79 @@
+﻿#include "MongoArena.h"
+#include "mongoose.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace Mongo
+{
+
+static size_t const ALIGNMENT = sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double);
+
+static size_t align(size_t size)
+{
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+Arena::Arena(struct mg_connection * conn):
+    conn(conn),
+    cur(0),
+    end(0),
+    blocks(0)
+{}
+
+Arena::~Arena()
+{
+    while( blocks )
+    {
+        auto next = blocks->next;
+        std::free(blocks);
+        blocks = next;
+    }
+}
+
+void * Arena::allocate(size_t size)
+{
+    size = align(size);
+    if( conn )
+    {
+        auto result = mg_arena_alloc(conn,size);
+        if( result ) return result;
+    }
+    return allocateOwn(size);
+}
+
+void * Arena::allocateOwn(size_t size)
+{
+    if( size <= size_t(end - cur) )
+    {
+        void * result = cur;
+        cur += size;
+        return result;
+    }
+
+    // does not fit: chain a new block, big ones get a block of their own
+    size_t header = align(sizeof(Block));
+    size_t blockSize = header + (size > BLOCK_SIZE ? size : size_t(BLOCK_SIZE));
+    auto block = static_cast<Block *>(std::malloc(blockSize));
+    if( ! block ) throw std::bad_alloc();
+
+    block->next = blocks;
+    blocks = block;
+    char * result = reinterpret_cast<char *>(block) + header;
+    if( size < BLOCK_SIZE )
+    {
+        cur = result + size;
+        end = reinterpret_cast<char *>(block) + blockSize;
+    }
+    return result;
+}
+
+StringRef Arena::copy(char const * str, size_t size)
+{
+    auto dst = static_cast<char *>(allocate(size + 1));
+    std::memcpy(dst,str,size);
+    dst[size] = '\0';
+    return StringRef(dst,size);
+}
+
+}
@@ -0,0 +1,39 @@
+﻿#ifndef MONGOOSE_ARENA_H_GUARD_f93kdm2nc8qz
+#define MONGOOSE_ARENA_H_GUARD_f93kdm2nc8qz
+
+#include <cstddef>
+#include "StringRef.h"
+
+struct mg_connection;
+
+namespace Mongo
+{
+
+// Allocator for per-request temporaries. Memory comes from the request
+// arena of the mongoose connection, which is rewound in bulk between
+// keep-alive requests; without a connection (e.g. MG_INIT_SSL) it falls back
+// to blocks of its own. Allocations are never freed individually.
+class Arena
+{
+    struct Block
+    {
+        Block * next;
+    };
+    enum { BLOCK_SIZE = 4096 };
+    struct mg_connection * conn;
+    char * cur;
+    char * end;
+    Block * blocks;
+    void * allocateOwn(size_t size);
+    Arena(Arena const &);
+    Arena & operator=(Arena const &);
+public:
+    explicit Arena(struct mg_connection * conn);
+    ~Arena();
+    void * allocate(size_t size);
+    StringRef copy(char const * str, size_t size);
+};
+
+}
+
+#endif
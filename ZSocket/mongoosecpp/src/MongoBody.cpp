@@ -0,0 +1,349 @@
+﻿#include "MongoBody.h"
+#include "mongoose.h"
+#include <cctype>
+#include <cstring>
+
+namespace Mongo
+{
+
+int const BUFSIZE = 16384;
+
+static bool equalsNoCase(StringRef a, char const * b)
+{
+    size_t len = std::strlen(b);
+    if( a.size() != len ) return false;
+
+    for( size_t i = 0 ; i < len ; ++i )
+    {
+        if( std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i]) ) return false;
+    }
+    return true;
+}
+
+static StringRef trim(char const * begin, char const * end)
+{
+    while( begin < end && (*begin == ' ' || *begin == '\t') ) ++begin;
+    while( end > begin && (end[-1] == ' ' || end[-1] == '\t') ) --end;
+    return StringRef(begin,end - begin);
+}
+
+// Value of a "; name=value" parameter of a header value such as
+// Content-Type or Content-Disposition. Quoted values are unquoted.
+static bool headerParam(StringRef header, char const * name, std::string & value)
+{
+    char const * p = header.begin();
+    char const * e = header.end();
+    while( p < e && *p != ';' ) ++p;
+    while( p < e )
+    {
+        ++p;  // ';'
+        char const * eq = p;
+        while( eq < e && *eq != '=' && *eq != ';' ) ++eq;
+        if( eq == e || *eq == ';' )
+        {
+            p = eq;
+            continue;
+        }
+        bool match = equalsNoCase(trim(p,eq),name);
+        p = eq + 1;
+        while( p < e && (*p == ' ' || *p == '\t') ) ++p;
+
+        std::string v;
+        if( p < e && *p == '"' )
+        {
+            for( ++p ; p < e && *p != '"' ; ++p )
+            {
+                if( *p == '\\' && p + 1 < e ) ++p;
+                v += *p;
+            }
+            while( p < e && *p != ';' ) ++p;
+        }
+        else
+        {
+            char const * begin = p;
+            while( p < e && *p != ';' ) ++p;
+            StringRef t = trim(begin,p);
+            v.assign(t.data(),t.size());
+        }
+        if( match )
+        {
+            value.swap(v);
+            return true;
+        }
+    }
+    return false;
+}
+
+BodyReader::BodyReader(struct mg_connection * conn):
+    conn(conn),
+    count(0)
+{}
+
+size_t BodyReader::read(char * buf, size_t size)
+{
+    if( ! conn ) return 0;
+
+    // mg_read() counts in ints
+    size_t const limit = 1u << 30;
+    int n = mg_read(conn,buf,size < limit ? size : limit);
+    if( n <= 0 ) return 0;
+
+    count += n;
+    return (size_t)n;
+}
+
+bool BodyReader::complete() const
+{
+    return ! conn || mg_body_status(conn) == 1;
+}
+
+bool BodyReader::failed() const
+{
+    return conn && mg_body_status(conn) < 0;
+}
+
+unsigned long long BodyReader::bytesRead() const
+{
+    return count;
+}
+
+BodySpool::BodySpool(size_t threshold):
+    spill(0),
+    length(0),
+    threshold(threshold)
+{}
+
+BodySpool::~BodySpool()
+{
+    if( spill )
+    {
+        std::fclose(spill);
+    }
+}
+
+bool BodySpool::load(BodyReader & reader)
+{
+    char buf[BUFSIZE];
+    size_t n;
+    while( (n = reader.read(buf,sizeof(buf))) > 0 )
+    {
+        if( ! spill && memory.size() + n > threshold )
+        {
+            // tmpfile() is deleted by the system once closed
+            spill = std::tmpfile();
+            if( ! spill ) return false;
+            if( ! memory.empty() && std::fwrite(&memory[0],1,memory.size(),spill) != memory.size() ) return false;
+            std::vector<char>().swap(memory);
+        }
+        if( spill )
+        {
+            if( std::fwrite(buf,1,n,spill) != n ) return false;
+        }
+        else
+        {
+            memory.insert(memory.end(),buf,buf + n);
+        }
+        length += n;
+    }
+
+    if( spill && (std::fflush(spill) != 0 || std::fseek(spill,0,SEEK_SET) != 0) ) return false;
+    return reader.complete();
+}
+
+unsigned long long BodySpool::size() const
+{
+    return length;
+}
+
+bool BodySpool::inMemory() const
+{
+    return spill == 0;
+}
+
+StringRef BodySpool::data() const
+{
+    return memory.empty() ? StringRef() : StringRef(&memory[0],memory.size());
+}
+
+std::FILE * BodySpool::file() const
+{
+    return spill;
+}
+
+MultipartParser::MultipartParser(StringRef boundary, MultipartHandler & handler):
+    handler(handler),
+    delimiter("\r\n--" + boundary.str()),
+    pending("\r\n"),  // the first boundary has no line break before it
+    state(boundary.empty() ? FAILED : PREAMBLE)
+{}
+
+std::string MultipartParser::boundaryOf(StringRef contentType)
+{
+    std::string boundary;
+    if( contentType.size() < 10 || ! equalsNoCase(StringRef(contentType.data(),10),"multipart/") ) return boundary;
+
+    // RFC 2046 limits boundaries to 70 characters
+    if( ! headerParam(contentType,"boundary",boundary) || boundary.size() > 70 )
+    {
+        boundary.clear();
+    }
+    return boundary;
+}
+
+bool MultipartParser::fail()
+{
+    state = FAILED;
+    std::string().swap(pending);
+    return false;
+}
+
+bool MultipartParser::feed(char const * data, size_t size)
+{
+    if( state == FAILED ) return false;
+    if( state == EPILOGUE ) return true;
+
+    pending.append(data,size);
+    return process();
+}
+
+// Consume as much of pending as can be parsed. Data that could be the start
+// of a delimiter, or an incomplete header block, waits for the next piece.
+bool MultipartParser::process()
+{
+    size_t pos = 0;
+    bool more = true;
+    while( more )
+    {
+        switch( state )
+        {
+        case PREAMBLE:
+        case DATA:
+        {
+            size_t found = pending.find(delimiter,pos);
+            size_t end = found;
+            if( found == std::string::npos )
+            {
+                size_t keep = pending.size() - pos;
+                if( keep > delimiter.size() - 1 ) keep = delimiter.size() - 1;
+                end = pending.size() - keep;
+                more = false;
+            }
+            if( state == DATA && end > pos && ! handler.partData(pending.data() + pos,end - pos) ) return fail();
+            pos = end;
+            if( found != std::string::npos )
+            {
+                if( state == DATA && ! handler.partEnd() ) return fail();
+                pos += delimiter.size();
+                state = BOUNDARY;
+            }
+            break;
+        }
+        case BOUNDARY:
+        {
+            // "--" closes the body, anything else is whitespace and a line break
+            size_t p = pos;
+            while( p < pending.size() && (pending[p] == ' ' || pending[p] == '\t') ) ++p;
+            if( p - pos > 64 ) return fail();
+            if( pending.size() - p < 2 )
+            {
+                more = false;
+            }
+            else if( p == pos && pending.compare(p,2,"--") == 0 )
+            {
+                pos = pending.size();
+                state = EPILOGUE;
+                more = false;
+            }
+            else if( pending.compare(p,2,"\r\n") == 0 )
+            {
+                pos = p + 2;
+                state = HEADERS;
+            }
+            else
+            {
+                return fail();
+            }
+            break;
+        }
+        case HEADERS:
+        {
+            size_t end = pos;
+            if( pending.compare(pos,2,"\r\n") != 0 )
+            {
+                end = pending.find("\r\n\r\n",pos);
+                if( end == std::string::npos )
+                {
+                    if( pending.size() - pos > MAX_HEADERS_SIZE ) return fail();
+                    more = false;
+                    break;
+                }
+                end += 2;
+            }
+            if( end - pos > MAX_HEADERS_SIZE ) return fail();
+
+            MultipartPart part;
+            part.headers.assign(pending,pos,end - pos);
+            part.contentType = "text/plain";
+            char const * line = pending.data() + pos;
+            char const * e = pending.data() + end;
+            while( line < e )
+            {
+                char const * eol = static_cast<char const *>(std::memchr(line,'\r',e - line));
+                char const * colon = static_cast<char const *>(std::memchr(line,':',eol - line));
+                if( colon )
+                {
+                    StringRef name = trim(line,colon);
+                    StringRef value = trim(colon + 1,eol);
+                    if( equalsNoCase(name,"Content-Disposition") )
+                    {
+                        headerParam(value,"name",part.name);
+                        headerParam(value,"filename",part.filename);
+                    }
+                    else if( equalsNoCase(name,"Content-Type") )
+                    {
+                        part.contentType.assign(value.data(),value.size());
+                    }
+                }
+                line = eol + 2;
+            }
+
+            pos = end + 2;
+            state = DATA;
+            if( ! handler.partBegin(part) ) return fail();
+            break;
+        }
+        case EPILOGUE:
+            pos = pending.size();
+            more = false;
+            break;
+        case FAILED:
+            return false;
+        }
+    }
+
+    pending.erase(0,pos);
+    return true;
+}
+
+bool MultipartParser::finish()
+{
+    // a truncated part is not ended, the handler has to drop it
+    if( state != EPILOGUE )
+    {
+        fail();
+    }
+    return state == EPILOGUE;
+}
+
+bool MultipartParser::parse(BodyReader & reader)
+{
+    char buf[BUFSIZE];
+    size_t n;
+    while( (n = reader.read(buf,sizeof(buf))) > 0 )
+    {
+        if( ! feed(buf,n) ) return false;
+    }
+    return ! reader.failed() && finish();
+}
+
+}
@@ -0,0 +1,111 @@
+﻿#ifndef MONGOOSE_BODY_H_GUARD_x7c2mq94hd1s
+#define MONGOOSE_BODY_H_GUARD_x7c2mq94hd1s
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "StringRef.h"
+
+struct mg_connection;
+
+namespace Mongo
+{
+
+// Sequential reader of the request body, plain or chunked. Data is taken off
+// the socket only when read() asks for it, so a handler that processes an
+// upload slower than it arrives holds the client back through TCP flow
+// control instead of buffering for it. The body can be read only once,
+// either through a reader or through Request::post().
+class BodyReader
+{
+    struct mg_connection * conn;
+    unsigned long long count;
+public:
+    explicit BodyReader(struct mg_connection * conn);
+    // Fills buf as far as the body goes; 0 at the end of the body or on error.
+    size_t read(char * buf, size_t size);
+    // The whole body has been read.
+    bool complete() const;
+    // The body is malformed or the client went away before sending it all.
+    bool failed() const;
+    unsigned long long bytesRead() const;
+};
+
+// The whole body, kept in memory up to a threshold and spilled to an
+// anonymous temporary file beyond it, for handlers that need to see all of
+// it before acting (checksums, validation) without holding gigabytes in a
+// worker.
+class BodySpool
+{
+    std::vector<char> memory;
+    std::FILE * spill;
+    unsigned long long length;
+    size_t threshold;
+    BodySpool(BodySpool const &);
+    BodySpool & operator=(BodySpool const &);
+public:
+    enum { DEFAULT_THRESHOLD = 1024 * 1024 };
+    explicit BodySpool(size_t threshold = DEFAULT_THRESHOLD);
+    ~BodySpool();
+    // Read the rest of the body. False if it is broken or the temporary
+    // file can't be written.
+    bool load(BodyReader & reader);
+    unsigned long long size() const;
+    bool inMemory() const;
+    // The body, if it is in memory.
+    StringRef data() const;
+    // The temporary file, positioned at the start, if the body was spilled.
+    // It is deleted when the spool goes away.
+    std::FILE * file() const;
+};
+
+// Content-Disposition and Content-Type of a multipart/form-data part.
+struct MultipartPart
+{
+    std::string name;
+    std::string filename;     // Empty unless the part is a file upload
+    std::string contentType;  // Defaults to text/plain
+    std::string headers;      // All header lines, as sent
+};
+
+// Receives the parts of a multipart body as they are parsed. Returning false
+// from any of the functions stops the parse.
+class MultipartHandler
+{
+public:
+    virtual ~MultipartHandler() {}
+    virtual bool partBegin(MultipartPart const & part) = 0;
+    // Part contents, in as many pieces as they arrive in.
+    virtual bool partData(char const * data, size_t size) = 0;
+    virtual bool partEnd() = 0;
+};
+
+// Incremental multipart/form-data parser. Data can be fed in pieces of any
+// size; part contents are passed on as soon as they can't be the start of a
+// boundary, so no part is ever held in memory as a whole.
+class MultipartParser
+{
+    enum State { PREAMBLE, BOUNDARY, HEADERS, DATA, EPILOGUE, FAILED };
+    MultipartHandler & handler;
+    std::string delimiter;
+    std::string pending;
+    State state;
+    bool process();
+    bool fail();
+public:
+    enum { MAX_HEADERS_SIZE = 16 * 1024 };
+    MultipartParser(StringRef boundary, MultipartHandler & handler);
+    // False once the body is found malformed or the handler stopped.
+    bool feed(char const * data, size_t size);
+    // Call after the last piece. False unless the closing boundary was seen;
+    // a part cut short gets no partEnd().
+    bool finish();
+    // Boundary parameter of a multipart Content-Type, empty if there is none.
+    static std::string boundaryOf(StringRef contentType);
+    // Read the body from reader and feed it all through.
+    bool parse(BodyReader & reader);
+};
+
+}
+
+#endif
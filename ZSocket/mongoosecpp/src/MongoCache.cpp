@@ -0,0 +1,363 @@
+﻿#include "MongoCache.h"
+#include "mongoose.h"
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+namespace Mongo
+{
+
+CachePolicy::CachePolicy(unsigned ttl):
+    ttl(ttl)
+{}
+
+CachePolicy & CachePolicy::param(std::string const & name)
+{
+    params.push_back(name);
+    return *this;
+}
+
+CachePolicy & CachePolicy::vary(std::string const & name)
+{
+    headers.push_back(name);
+    return *this;
+}
+
+// FNV-1a, 64 bits
+static unsigned long long hash64(unsigned long long h, std::string const & data)
+{
+    for( auto it = data.begin() ; it != data.end() ; ++it )
+    {
+        h ^= (unsigned char)*it;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Value of a header line in a captured head, which starts with the status line
+static bool findHeader(std::string const & head, char const * name, std::string & value)
+{
+    size_t len = std::strlen(name);
+    size_t pos = head.find("\r\n");
+    while( pos != std::string::npos && pos + 2 < head.size() )
+    {
+        pos += 2;
+        size_t eol = head.find("\r\n",pos);
+        if( eol == std::string::npos ) eol = head.size();
+        if( eol - pos > len && head[pos + len] == ':' )
+        {
+            size_t i = 0;
+            while( i < len && std::tolower((unsigned char)head[pos + i]) == std::tolower((unsigned char)name[i]) ) ++i;
+            if( i == len )
+            {
+                size_t v = pos + len + 1;
+                while( v < eol && head[v] == ' ' ) ++v;
+                value.assign(head,v,eol - v);
+                return true;
+            }
+        }
+        pos = eol;
+    }
+    return false;
+}
+
+// Responses meant for one client: a cookie or Cache-Control that rules out
+// a shared cache
+static bool shareable(std::string const & head)
+{
+    std::string value;
+    if( findHeader(head,"Set-Cookie",value) ) return false;
+    if( ! findHeader(head,"Cache-Control",value) ) return true;
+    for( auto it = value.begin() ; it != value.end() ; ++it )
+    {
+        *it = (char)std::tolower((unsigned char)*it);
+    }
+    return value.find("no-store") == std::string::npos &&
+           value.find("private") == std::string::npos &&
+           value.find("no-cache") == std::string::npos;
+}
+
+// If-None-Match is "*" or a list of entity tags, weak ones compare equal
+static bool etagMatches(char const * ifNoneMatch, std::string const & etag)
+{
+    char const * p = ifNoneMatch;
+    while( *p )
+    {
+        while( *p == ' ' || *p == '\t' || *p == ',' ) ++p;
+        char const * begin = p;
+        while( *p && *p != ',' && *p != ' ' && *p != '\t' ) ++p;
+        if( p - begin == 1 && *begin == '*' ) return true;
+        if( p - begin > 2 && begin[0] == 'W' && begin[1] == '/' ) begin += 2;
+        if( size_t(p - begin) == etag.size() && std::memcmp(begin,etag.data(),etag.size()) == 0 ) return true;
+    }
+    return false;
+}
+
+static std::string cacheKey(Request const & request, bool gzip, CachePolicy const & policy)
+{
+    std::string key(request.getURI_c());
+    for( auto it = policy.params.begin() ; it != policy.params.end() ; ++it )
+    {
+        key += '\0';
+        if( request.hasGet(it->c_str()) )
+        {
+            auto value = request.get_ref(*it);
+            key += '=';
+            key.append(value.data(),value.size());
+        }
+    }
+    for( auto it = policy.headers.begin() ; it != policy.headers.end() ; ++it )
+    {
+        auto value = request.getHeader_ref(*it);
+        key += '\0';
+        key.append(value.data(),value.size());
+    }
+    key += '\0';
+    if( gzip )
+    {
+        key += "gzip";
+    }
+    return key;
+}
+
+size_t ResponseCache::Entry::size() const
+{
+    return key.size() + head.size() + body.size() + notModified.size() + 128;
+}
+
+ResponseCache::Flight::Flight():
+    done(false)
+{}
+
+ResponseCache::Shard::Shard():
+    used(0),
+    budget(0)
+{}
+
+ResponseCache::ResponseCache(size_t budget)
+{
+    setBudget(budget);
+}
+
+void ResponseCache::setBudget(size_t budget)
+{
+    for( size_t i = 0 ; i < SHARDS ; ++i )
+    {
+        Lock lock(shards[i].mutex);
+        shards[i].budget = budget / SHARDS;
+        evict(shards[i]);
+    }
+}
+
+void ResponseCache::evict(Shard & shard)
+{
+    while( shard.used > shard.budget && ! shard.lru.empty() )
+    {
+        shard.used -= shard.lru.back()->size();
+        shard.index.erase(shard.lru.back()->key);
+        shard.lru.pop_back();
+    }
+}
+
+bool ResponseCache::serve(Request request, Response response, CachePolicy const & policy, Callback const & handler)
+{
+    auto method = request.getMethod();
+    if( policy.ttl == 0 || (method != GET && method != HEAD) ) return handler(request,response);
+
+    auto key = cacheKey(request,response.state->acceptsGzip,policy);
+    Shard & shard = shards[std::hash<std::string>()(key) % SHARDS];
+    long long now = (long long)std::time(0);
+    EntryPtr entry;
+    bool leader = false;
+    {
+        Lock lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if( it != shard.index.end() )
+        {
+            if( (*it->second)->expires > now )
+            {
+                shard.lru.splice(shard.lru.begin(),shard.lru,it->second);
+                entry = *it->second;
+            }
+            else
+            {
+                shard.used -= (*it->second)->size();
+                shard.lru.erase(it->second);
+                shard.index.erase(it);
+            }
+        }
+        if( ! entry )
+        {
+            auto f = shard.flights.find(key);
+            if( f != shard.flights.end() )
+            {
+                // another request is running the handler, its response will do
+                std::shared_ptr<Flight> flight = f->second;
+                while( ! flight->done )
+                {
+                    shard.landed.wait(shard.mutex);
+                }
+                entry = flight->entry;
+            }
+            else
+            {
+                shard.flights[key] = std::make_shared<Flight>();
+                leader = true;
+            }
+        }
+    }
+
+    if( entry )
+    {
+        send(response,*entry);
+        return true;
+    }
+    // the response we waited for could not be shared
+    if( ! leader ) return handler(request,response);
+
+    return run(shard,key,request,response,policy,handler);
+}
+
+// Run the handler with its output captured, share the result with the
+// requests waiting for it and send it.
+bool ResponseCache::run(Shard & shard, std::string const & key, Request request, Response response, CachePolicy const & policy, Callback const & handler)
+{
+    CapturedResponse captured;
+    ResponseState * rs = response.state;
+    bool deferrable = rs->deferrable;
+    bool handled;
+
+    // a deferred response can't be captured
+    rs->capture = &captured;
+    rs->deferrable = false;
+    try
+    {
+        handled = handler(request,response);
+        if( handled )
+        {
+            response.finish();
+        }
+    }
+    catch(...)
+    {
+        rs->capture = 0;
+        rs->deferrable = deferrable;
+        land(shard,key,EntryPtr());
+        throw;
+    }
+    rs->capture = 0;
+    rs->deferrable = deferrable;
+
+    if( ! handled || captured.status != 200 || ! shareable(captured.head) )
+    {
+        land(shard,key,EntryPtr());
+        if( handled )
+        {
+            send(response,captured);
+        }
+        return handled;
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->key = key;
+    entry->expires = (long long)std::time(0) + policy.ttl;
+    entry->head.swap(captured.head);
+    entry->body.swap(captured.body);
+
+    std::string etag;
+    if( ! findHeader(entry->head,"ETag",etag) )
+    {
+        char buf[24];
+        std::sprintf(buf,"\"%016llx\"",hash64(hash64(14695981039346656037ull,entry->head),entry->body));
+        etag = buf;
+        entry->head += "ETag: " + etag + "\r\n";
+    }
+    std::string vary;
+    for( auto it = policy.headers.begin() ; it != policy.headers.end() ; ++it )
+    {
+        vary += (vary.empty() ? "Vary: " : ", ") + *it;
+    }
+    if( ! vary.empty() )
+    {
+        vary += "\r\n";
+        entry->head += vary;
+    }
+    entry->etag = etag;
+    entry->notModified = "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n" + vary + "\r\n";
+
+    land(shard,key,entry);
+    send(response,*entry);
+    return true;
+}
+
+void ResponseCache::land(Shard & shard, std::string const & key, EntryPtr const & entry)
+{
+    Lock lock(shard.mutex);
+    auto f = shard.flights.find(key);
+    f->second->entry = entry;
+    f->second->done = true;
+    shard.flights.erase(f);
+    shard.landed.notifyAll();
+
+    if( ! entry || entry->size() > shard.budget ) return;
+
+    auto it = shard.index.find(key);
+    if( it != shard.index.end() )
+    {
+        shard.used -= (*it->second)->size();
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front(entry);
+    shard.index[key] = shard.lru.begin();
+    shard.used += entry->size();
+    evict(shard);
+}
+
+// Headers and a small body go out in a single write, like Response does it
+static void sendWhole(struct mg_connection * conn, std::string & head, std::string const & body, bool headOnly)
+{
+    char length[48];
+    std::sprintf(length,"Content-Length: %lu\r\n\r\n",(unsigned long)body.size());
+    head += length;
+    if( headOnly )
+    {
+        mg_write(conn,head.data(),head.size());
+    }
+    else if( body.size() <= ResponseState::BUFSIZE )
+    {
+        head += body;
+        mg_write(conn,head.data(),head.size());
+    }
+    else
+    {
+        mg_write(conn,head.data(),head.size());
+        mg_write(conn,body.data(),body.size());
+    }
+}
+
+void ResponseCache::send(Response response, CapturedResponse const & captured)
+{
+    std::string head(captured.head);
+    sendWhole(response.state->conn,head,captured.body,response.state->headOnly);
+}
+
+void ResponseCache::send(Response response, Entry const & entry)
+{
+    ResponseState * rs = response.state;
+    auto ifNoneMatch = mg_get_header(rs->conn,"If-None-Match");
+    if( ifNoneMatch && etagMatches(ifNoneMatch,entry.etag) )
+    {
+        mg_write(rs->conn,entry.notModified.data(),entry.notModified.size());
+    }
+    else
+    {
+        std::string head(entry.head);
+        sendWhole(rs->conn,head,entry.body,rs->headOnly);
+    }
+    rs->finished = true;
+}
+
+}
@@ -0,0 +1,89 @@
+﻿#ifndef MONGOOSE_CACHE_H_GUARD_h5t0cw83zq6m
+#define MONGOOSE_CACHE_H_GUARD_h5t0cw83zq6m
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "MongoServer.h"
+#include "MongoMutex.h"
+
+namespace Mongo
+{
+
+// What makes two requests to a cached route get the same response.
+// The key is always the path, plus the listed query parameters and request
+// headers; other parameters and headers are ignored. Whether the client
+// accepts gzip is part of the key too, for handlers that call compress().
+struct CachePolicy
+{
+    unsigned ttl;   // seconds
+    std::vector<std::string> params;
+    std::vector<std::string> headers;
+    explicit CachePolicy(unsigned ttl = 10);
+    CachePolicy & param(std::string const & name);
+    // Listed headers are also named in a Vary header of the response.
+    CachePolicy & vary(std::string const & name);
+};
+
+// Responses of dynamic GET and HEAD handlers, kept in memory for the TTL of
+// their route. Cached responses get an ETag, and requests with a matching
+// If-None-Match get a 304. Only 200 responses are kept, and not those with
+// Set-Cookie or with Cache-Control no-store, private or no-cache.
+// The cache is split into shards, each with its own lock and LRU list, and
+// bounded by the total size of the responses. When several requests miss
+// on the same key at once, one runs the handler and the others wait for its
+// response rather than running the handler too.
+class ResponseCache
+{
+public:
+    explicit ResponseCache(size_t budget);
+    void setBudget(size_t budget);
+    // Answer from the cache, or run handler and keep what it sends.
+    bool serve(Request request, Response response, CachePolicy const & policy, Callback const & handler);
+private:
+    struct Entry
+    {
+        std::string key;
+        std::string head;           // with ETag and Vary, without framing
+        std::string body;
+        std::string etag;
+        std::string notModified;    // the whole 304 response
+        long long expires;
+        size_t size() const;
+    };
+    typedef std::shared_ptr<Entry const> EntryPtr;
+    // a handler run that other requests for the same key wait for
+    struct Flight
+    {
+        Flight();
+        bool done;
+        EntryPtr entry;
+    };
+    typedef std::list<EntryPtr> List;
+    struct Shard
+    {
+        Shard();
+        Mutex mutex;
+        Condition landed;
+        List lru;   // most recently used first
+        std::unordered_map<std::string,List::iterator> index;
+        std::unordered_map<std::string,std::shared_ptr<Flight> > flights;
+        size_t used;
+        size_t budget;
+    };
+    enum { SHARDS = 16 };
+    Shard shards[SHARDS];
+    ResponseCache(ResponseCache const &);
+    ResponseCache & operator=(ResponseCache const &);
+    bool run(Shard & shard, std::string const & key, Request request, Response response, CachePolicy const & policy, Callback const & handler);
+    void land(Shard & shard, std::string const & key, EntryPtr const & entry);
+    void evict(Shard & shard);
+    static void send(Response response, CapturedResponse const & captured);
+    static void send(Response response, Entry const & entry);
+};
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+﻿#include "MongoDeferred.h"
+#include "mongoose.h"
+
+namespace Mongo
+{
+
+class DeferredState
+{
+public:
+    explicit DeferredState(Deferred::CancelCallback const & onCancel);
+    ~DeferredState();
+    struct mg_async * async;
+    Deferred::CancelCallback onCancel;
+private:
+    DeferredState(DeferredState const &);
+    DeferredState & operator=(DeferredState const &);
+};
+
+DeferredState::DeferredState(Deferred::CancelCallback const & onCancel):
+    async(0),
+    onCancel(onCancel)
+{}
+
+DeferredState::~DeferredState()
+{
+    if( ! async ) return;
+
+    // every handle is gone and nobody answered
+    if( struct mg_connection * conn = mg_resume_begin(async) )
+    {
+        ResponseState rs(conn,mg_get_request_info(conn));
+        Response resp(&rs);
+        resp.status(500);
+        resp.printf("Request dropped by its handler");
+        resp.finish();
+        mg_resume_end(async);
+    }
+    mg_async_release(async);
+}
+
+// mongoose calls this exactly once, when it lets go of the request. arg is
+// the server's own (weak) reference to the state.
+static void asyncCallback(struct mg_async *, enum mg_async_status status, void * arg)
+{
+    auto ref = static_cast<std::weak_ptr<DeferredState> *>(arg);
+    if( status != MG_ASYNC_COMPLETED )
+    {
+        auto state = ref->lock();
+        if( state && state->onCancel )
+        {
+            state->onCancel(status == MG_ASYNC_TIMEOUT ? Deferred::TIMEOUT :
+                            status == MG_ASYNC_DISCONNECT ? Deferred::DISCONNECT :
+                            Deferred::SHUTDOWN);
+        }
+    }
+    delete ref;
+}
+
+Deferred::Deferred()
+{}
+
+Deferred::Deferred(Response resp, unsigned timeoutMs, CancelCallback onCancel)
+{
+    ResponseState * rs = resp.state;
+    if( ! rs->deferrable || rs->committed || rs->finished ) return;
+
+    std::shared_ptr<DeferredState> s = std::make_shared<DeferredState>(onCancel);
+    auto ref = new std::weak_ptr<DeferredState>(s);
+    s->async = mg_suspend(rs->conn,(int)timeoutMs,&asyncCallback,ref);
+    if( ! s->async )
+    {
+        delete ref;
+        return;
+    }
+
+    // whatever the callback buffered is dropped, complete() starts afresh
+    rs->finished = true;
+    state = s;
+}
+
+bool Deferred::valid() const
+{
+    return state.get() != 0;
+}
+
+bool Deferred::complete(Writer const & writer) const
+{
+    if( ! state ) return false;
+
+    struct mg_connection * conn = mg_resume_begin(state->async);
+    if( ! conn ) return false;
+
+    ResponseState rs(conn,mg_get_request_info(conn));
+    try
+    {
+        writer(Response(&rs));
+    }
+    catch(...)
+    {
+        Response(&rs).finish();
+        mg_resume_end(state->async);
+        throw;
+    }
+    Response(&rs).finish();
+    mg_resume_end(state->async);
+    return true;
+}
+
+}
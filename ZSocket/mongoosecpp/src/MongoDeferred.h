@@ -0,0 +1,45 @@
+﻿#ifndef MONGOOSE_DEFERRED_H_GUARD_q8v3ne52lk0w
+#define MONGOOSE_DEFERRED_H_GUARD_q8v3ne52lk0w
+
+#include <memory>
+#include <functional>
+#include "MongoResponse.h"
+
+namespace Mongo
+{
+
+class DeferredState;
+
+// Response of a request that is answered after its callback has returned.
+// A start callback creates it from its Response and returns true without
+// writing anything; the worker thread goes on serving other connections,
+// and complete() sends the response later, from any thread.
+// Copies share the request. When the last one goes away before the request
+// was completed or cancelled, the client gets a 500.
+// The Request handed to the callback must not be used after the callback
+// returns, and no Deferred may outlive the Server.
+class Deferred
+{
+public:
+    enum Reason { TIMEOUT, DISCONNECT, SHUTDOWN };
+    typedef std::function<void(Reason)> CancelCallback;
+    typedef std::function<void(Response)> Writer;
+
+    Deferred();
+    // A timeoutMs of 0 waits forever. onCancel is called from a server
+    // thread when the request times out (the client gets a 504), the client
+    // disconnects or the server stops (503); it must not block.
+    // Outside of a start callback, or once the response has been sent in
+    // part, the result is not valid() and resp is left as it was.
+    Deferred(Response resp, unsigned timeoutMs, CancelCallback onCancel = CancelCallback());
+    bool valid() const;
+    // Runs writer on the response and sends it. Returns false, without
+    // calling writer, if the request was already completed or cancelled.
+    bool complete(Writer const & writer) const;
+private:
+    std::shared_ptr<DeferredState> state;
+};
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <cctype>
 #include <functional>
 #include <iostream>
+#include <cstring>
 
 namespace Mongo
 {
@@ -13,7 +14,11 @@ using std::placeholders::_1;
 using std::placeholders::_2;
 
 Dispatcher::Dispatcher(Server & server)
-    :page404([](Request request, Response response) -> bool
+    :server(server),
+     webSockets(false),
+     gzipCache(8 << 20),
+     responseCache(16 << 20),
+     page404([](Request request, Response response) -> bool
 {
     response.status(404);
     if( request.getQueryString_c() )
@@ -43,11 +48,36 @@ void Dispatcher::staticFile(std::string const & urlpath, std::string const & fil
     serve(urlpath,bind(&Dispatcher::dispatchFile,this,_1,_2,filename));
 }
 
+void Dispatcher::setGzipCacheSize(size_t bytes)
+{
+    gzipCache.setBudget(bytes);
+}
+
+void Dispatcher::setResponseCacheSize(size_t bytes)
+{
+    responseCache.setBudget(bytes);
+}
+
 void Dispatcher::serve(std::string const & urlpath, Callback handler)
 {
     dispatchMap[urlpath] = handler;
 }
 
+void Dispatcher::serveCached(std::string const & urlpath, CachePolicy const & policy, Callback handler)
+{
+    dispatchMap[urlpath] = bind(&ResponseCache::serve,&responseCache,_1,_2,policy,handler);
+}
+
+void Dispatcher::serveWebSocket(std::string const & urlpath, WebSocketEndpoint const & endpoint)
+{
+    if( ! webSockets )
+    {
+        server.setOption("enable_websocket","yes");
+        webSockets = true;
+    }
+    dispatchMap[urlpath] = bind(&WebSocket::upgrade,_1,_2,std::make_shared<WebSocketEndpoint const>(endpoint));
+}
+
 void Dispatcher::servePrefix(std::string const & urlpath, Callback handler)
 {
     dispatchMapPrefix[urlpath] = handler;
@@ -61,7 +91,7 @@ bool Dispatcher::dispatch(Request request, Response response)
     if( it != dispatchMap.end() ) return it->second(request,response);
 
     // no need to search on prefix map if we don't have a resource
-    if( request.getResource().empty() ) return page404(request,response);
+    if( request.getResource_ref().empty() ) return page404(request,response);
 
     // now search on prefix maps
     auto path = request.getPath();
@@ -74,28 +104,131 @@ bool Dispatcher::dispatchStatic(Request request, Response response, std::string
     return dispatchFile(request,response,localPath + '/' + request.getResource());
 }
 
+static std::streamoff streamSize(std::istream & is)
+{
+    is.seekg(0,std::ios::end);
+    std::streamoff size = is.tellg();
+    is.seekg(0,std::ios::beg);
+    return size;
+}
+
+// Compressible files go out gzipped to clients that accept it: a
+// precompressed "file.gz" next to the file is preferred, otherwise the
+// compressed copy comes from (or goes to) the gzip cache.
 bool Dispatcher::dispatchFile(Request request, Response response, std::string const & filename)
 {
     std::ifstream file(filename.c_str(),std::ios::binary);
     if( ! file ) return page404(request,response);
 
-    response.contentType(getContentType(filename));
+    auto type = getContentType(filename);
+    response.contentType(type);
+    if( isCompressible(type.c_str()) )
+    {
+        response.header("Vary","Accept-Encoding");
+        if( acceptsGzip(request.getHeader_c("Accept-Encoding")) )
+        {
+            std::ifstream gz((filename + ".gz").c_str(),std::ios::binary);
+            if( gz )
+            {
+                response.header("Content-Encoding","gzip");
+                response.contentLength(streamSize(gz));
+                response.write(gz);
+                return true;
+            }
+            auto data = gzipCache.get(filename);
+            if( data )
+            {
+                response.header("Content-Encoding","gzip");
+                response.contentLength(data->size());
+                response.write(data->data(),data->size());
+                return true;
+            }
+        }
+    }
+
+    response.contentLength(streamSize(file));
     response.write(file);
     return true;
 }
 
+namespace
+{
+
+struct MimeType
+{
+    char const * ext;
+    char const * type;
+};
+
+// sorted by extension
+MimeType const mimeTypes[] =
+{
+    { "7z", "application/x-7z-compressed" },
+    { "avi", "video/x-msvideo" },
+    { "bmp", "image/bmp" },
+    { "css", "text/css" },
+    { "csv", "text/csv" },
+    { "doc", "application/msword" },
+    { "eot", "application/vnd.ms-fontobject" },
+    { "gif", "image/gif" },
+    { "gz", "application/gzip" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "ico", "image/x-icon" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "m4a", "audio/mp4" },
+    { "map", "application/json" },
+    { "md", "text/markdown" },
+    { "mjs", "application/javascript" },
+    { "mp3", "audio/mpeg" },
+    { "mp4", "video/mp4" },
+    { "oga", "audio/ogg" },
+    { "ogg", "audio/ogg" },
+    { "ogv", "video/ogg" },
+    { "otf", "font/otf" },
+    { "pdf", "application/pdf" },
+    { "png", "image/png" },
+    { "rss", "application/rss+xml" },
+    { "rtf", "application/rtf" },
+    { "svg", "image/svg+xml" },
+    { "tar", "application/x-tar" },
+    { "tif", "image/tiff" },
+    { "tiff", "image/tiff" },
+    { "ttf", "font/ttf" },
+    { "txt", "text/plain" },
+    { "wasm", "application/wasm" },
+    { "wav", "audio/wav" },
+    { "webm", "video/webm" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "xhtml", "application/xhtml+xml" },
+    { "xml", "text/xml" },
+    { "zip", "application/zip" },
+};
+
+}
+
 std::string Dispatcher::getContentType(std::string const & filename) const
 {
     auto p = filename.rfind('.');
     if( p >= filename.length() ) return "text/plain";
 
     auto ext = filename.substr(p+1);
-    std::transform(ext.begin(),ext.end(),ext.begin(),&std::tolower);
-    // TODO use a map
-    if( ext == "htm" ) ext = "html";
-    if( ext == "jpg" ) ext = "jpeg";
-    if( ext == "xml" || ext == "html" || ext == "css" ) return "text/" + ext;
-    if( ext == "jpeg" || ext == "gif" || ext == "png" ) return "image/" + ext;
+    for( auto it = ext.begin() ; it != ext.end() ; ++it )
+    {
+        *it = (char)std::tolower((unsigned char)*it);
+    }
+
+    auto end = mimeTypes + sizeof(mimeTypes) / sizeof(mimeTypes[0]);
+    auto found = std::lower_bound(mimeTypes,end,ext.c_str(),[](MimeType const & m, char const * e)
+    {
+        return std::strcmp(m.ext,e) < 0;
+    });
+    if( found != end && ext == found->ext ) return found->type;
 
     return "text/plain";
 }
@@ -3,6 +3,9 @@
 
 #include <string>
 #include "MongoServer.h"
+#include "MongoGzip.h"
+#include "MongoCache.h"
+#include "MongoWebSocket.h"
 #include <unordered_map>
 
 namespace Mongo
@@ -10,8 +13,12 @@ namespace Mongo
 
 class Dispatcher
 {
+    Server & server;
+    bool webSockets;
     std::unordered_map<std::string,Callback> dispatchMap;
     std::unordered_map<std::string,Callback> dispatchMapPrefix;
+    GzipCache gzipCache;
+    ResponseCache responseCache;
     bool dispatch(Request request, Response response);
     bool dispatchStatic(Request request, Response response, std::string const & localPath);
     bool dispatchFile(Request request, Response response, std::string const & filename);
@@ -22,6 +29,15 @@ public:
     void staticPages(std::string urlpath, std::string const & path);
     void serve(std::string const & urlpath, Callback handler);
     void servePrefix(std::string const & urlpath, Callback handler);
+    // Like serve(), but GET and HEAD responses are cached as policy says
+    void serveCached(std::string const & urlpath, CachePolicy const & policy, Callback handler);
+    // WebSocket connections to urlpath, served as endpoint says.
+    // Call before Server::start(), which then runs the WebSocket thread.
+    void serveWebSocket(std::string const & urlpath, WebSocketEndpoint const & endpoint);
+    // memory for compressed copies of static files, 8MB by default
+    void setGzipCacheSize(size_t bytes);
+    // memory for cached responses, 16MB by default
+    void setResponseCacheSize(size_t bytes);
     Callback page404;
 };
 
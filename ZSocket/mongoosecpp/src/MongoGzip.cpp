@@ -0,0 +1,266 @@
+﻿#include "MongoGzip.h"
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace Mongo
+{
+
+static bool matchToken(char const * begin, char const * end, char const * token)
+{
+    size_t len = std::strlen(token);
+    if( size_t(end - begin) != len ) return false;
+    for( size_t i = 0 ; i < len ; ++i )
+    {
+        if( std::tolower((unsigned char)begin[i]) != token[i] ) return false;
+    }
+    return true;
+}
+
+// Accept-Encoding is a list of "coding;q=value". gzip is acceptable if it is
+// listed, or covered by "*", with a non zero quality.
+bool acceptsGzip(char const * acceptEncoding)
+{
+    if( ! acceptEncoding ) return false;
+
+    int gzip = -1;  // -1 not mentioned, 0 refused, 1 accepted
+    int star = -1;
+    char const * p = acceptEncoding;
+    while( *p )
+    {
+        while( *p == ' ' || *p == '\t' || *p == ',' ) ++p;
+        char const * begin = p;
+        while( *p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t' ) ++p;
+        char const * end = p;
+
+        bool accepted = true;
+        while( *p && *p != ',' )
+        {
+            if( *p == 'q' && p[1] == '=' )
+            {
+                accepted = std::atof(p + 2) > 0;
+            }
+            ++p;
+        }
+
+        if( matchToken(begin,end,"gzip") || matchToken(begin,end,"x-gzip") )
+        {
+            gzip = accepted;
+        }
+        else if( matchToken(begin,end,"*") )
+        {
+            star = accepted;
+        }
+    }
+    return gzip == 1 || (gzip == -1 && star == 1);
+}
+
+bool isCompressible(char const * contentType)
+{
+    static char const * const types[] =
+    {
+        "application/javascript", "application/json", "application/xml",
+        "application/xhtml+xml", "application/rss+xml", "application/wasm",
+        "application/vnd.ms-fontobject", "image/svg+xml", "image/x-icon",
+        "image/bmp", "font/ttf", "font/otf", 0
+    };
+
+    if( std::strncmp(contentType,"text/",5) == 0 ) return true;
+    for( char const * const * t = types ; *t ; ++t )
+    {
+        if( std::strcmp(contentType,*t) == 0 ) return true;
+    }
+    return false;
+}
+
+static Mutex poolMutex;
+static std::vector<Deflater *> pool;
+
+Deflater::Deflater(void * stream):
+    stream(stream),
+    level(Z_DEFAULT_COMPRESSION)
+{}
+
+Deflater::~Deflater()
+{
+    deflateEnd(static_cast<z_stream *>(stream));
+    delete static_cast<z_stream *>(stream);
+}
+
+Deflater * Deflater::acquire(int level)
+{
+    Deflater * result = 0;
+    {
+        Lock lock(poolMutex);
+        if( ! pool.empty() )
+        {
+            result = pool.back();
+            pool.pop_back();
+        }
+    }
+
+    if( ! result )
+    {
+        z_stream * zs = new z_stream;
+        std::memset(zs,0,sizeof(*zs));
+        // 15 bits window, +16 for a gzip header and trailer
+        if( deflateInit2(zs,level,Z_DEFLATED,15 + 16,8,Z_DEFAULT_STRATEGY) != Z_OK )
+        {
+            delete zs;
+            return 0;
+        }
+        result = new Deflater(zs);
+        result->level = level;
+    }
+    else if( result->level != level )
+    {
+        deflateParams(static_cast<z_stream *>(result->stream),level,Z_DEFAULT_STRATEGY);
+        result->level = level;
+    }
+    return result;
+}
+
+void Deflater::release(Deflater * deflater)
+{
+    if( ! deflater ) return;
+
+    deflateReset(static_cast<z_stream *>(deflater->stream));
+    Lock lock(poolMutex);
+    pool.push_back(deflater);
+}
+
+bool Deflater::deflate(char const * data, size_t size, bool finish, Sink const & sink)
+{
+    z_stream * zs = static_cast<z_stream *>(stream);
+    char out[16384];
+    int ret;
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = (uInt)size;
+    do
+    {
+        zs->next_out = (Bytef *)out;
+        zs->avail_out = sizeof(out);
+        ret = ::deflate(zs,finish ? Z_FINISH : Z_NO_FLUSH);
+        if( ret == Z_STREAM_ERROR ) return false;
+
+        size_t n = sizeof(out) - zs->avail_out;
+        if( n )
+        {
+            sink(out,n);
+        }
+    }
+    while( finish ? ret != Z_STREAM_END : zs->avail_out == 0 );
+    return true;
+}
+
+GzipCache::GzipCache(size_t budget):
+    budget(budget),
+    used(0)
+{}
+
+void GzipCache::setBudget(size_t budget)
+{
+    Lock lock(mutex);
+    this->budget = budget;
+    evict();
+}
+
+size_t GzipCache::Entry::cost() const
+{
+    // an entry without data still takes some memory
+    return data ? data->size() : sizeof(Entry) + filename.size();
+}
+
+void GzipCache::evict()
+{
+    while( used > budget && ! lru.empty() )
+    {
+        used -= lru.back().cost();
+        index.erase(lru.back().filename);
+        lru.pop_back();
+    }
+}
+
+GzipCache::Data GzipCache::compress(std::string const & filename)
+{
+    std::ifstream file(filename.c_str(),std::ios::binary);
+    if( ! file ) return Data();
+    std::string raw((std::istreambuf_iterator<char>(file)),std::istreambuf_iterator<char>());
+
+    Deflater * deflater = Deflater::acquire(Deflater::BEST_LEVEL);
+    if( ! deflater ) return Data();
+    std::shared_ptr<std::string> out(new std::string);
+    out->reserve(raw.size() / 3 + 64);
+    bool ok = deflater->deflate(raw.data(),raw.size(),true,[&out](char const * data, size_t size)
+    {
+        out->append(data,size);
+    });
+    Deflater::release(deflater);
+    if( ! ok ) return Data();
+
+    return out;
+}
+
+GzipCache::Data GzipCache::get(std::string const & filename)
+{
+    struct stat st;
+    if( stat(filename.c_str(),&st) != 0 || (st.st_mode & S_IFMT) != S_IFREG ) return Data();
+
+    {
+        Lock lock(mutex);
+        for( ;; )
+        {
+            auto it = index.find(filename);
+            if( it != index.end() )
+            {
+                auto entry = it->second;
+                if( entry->mtime == (long long)st.st_mtime && entry->size == (long long)st.st_size )
+                {
+                    lru.splice(lru.begin(),lru,entry);
+                    return entry->data;
+                }
+                // stale
+                used -= entry->cost();
+                lru.erase(entry);
+                index.erase(it);
+            }
+            if( ! compressing.count(filename) ) break;
+
+            // another request is compressing the file, use its result
+            while( compressing.count(filename) )
+            {
+                compressed.wait(mutex);
+            }
+        }
+        compressing.insert(filename);
+    }
+
+    // compress outside the lock, other files keep being served meanwhile
+    Data data = compress(filename);
+
+    Lock lock(mutex);
+    compressing.erase(filename);
+    compressed.notifyAll();
+    if( data && index.find(filename) == index.end() )
+    {
+        Entry entry;
+        entry.filename = filename;
+        entry.mtime = (long long)st.st_mtime;
+        entry.size = (long long)st.st_size;
+        if( data->size() <= budget ) entry.data = data;
+        lru.push_front(entry);
+        index[filename] = lru.begin();
+        used += entry.cost();
+        evict();
+    }
+    return data;
+}
+
+}
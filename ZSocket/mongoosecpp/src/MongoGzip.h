@@ -0,0 +1,81 @@
+﻿#ifndef MONGOOSE_GZIP_H_GUARD_r4n8vb20xk3s
+#define MONGOOSE_GZIP_H_GUARD_r4n8vb20xk3s
+
+#include <string>
+#include <list>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include "MongoMutex.h"
+
+namespace Mongo
+{
+
+// True if an Accept-Encoding header value lets us send a gzip body.
+bool acceptsGzip(char const * acceptEncoding);
+
+// True for content types worth compressing: text, scripts, JSON, XML, SVG,
+// uncompressed fonts.
+bool isCompressible(char const * contentType);
+
+// gzip deflate stream. zlib allocates a few hundred KB per stream, so rather
+// than setting one up per response, streams are pooled and reset between
+// uses; there are as many as there are threads compressing at the same time.
+class Deflater
+{
+    void * stream;
+    int level;
+    explicit Deflater(void * stream);
+    Deflater(Deflater const &);
+    Deflater & operator=(Deflater const &);
+public:
+    enum { DEFAULT_LEVEL = 6, BEST_LEVEL = 9 };
+    typedef std::function<void(char const *,size_t)> Sink;
+    // A ready stream from the pool, or 0 on OOM.
+    static Deflater * acquire(int level);
+    static void release(Deflater * deflater);
+    // Compress data, passing the output to sink. finish ends the gzip stream.
+    bool deflate(char const * data, size_t size, bool finish, Sink const & sink);
+    ~Deflater();
+};
+
+// LRU of gzip-compressed static files, bounded by the size of the compressed
+// data. Entries are checked against the file's size and mtime on every hit.
+// A file whose compressed copy is larger than the whole budget is kept as an
+// entry without data, so it is not compressed again on every request. When
+// several requests miss on the same file at once, one compresses it and the
+// others wait for the result.
+class GzipCache
+{
+public:
+    typedef std::shared_ptr<std::string const> Data;
+    explicit GzipCache(size_t budget);
+    void setBudget(size_t budget);
+    // Compressed contents of the file, compressed now on a miss. Null if the
+    // file can't be read or is too large to cache, then it is sent as is.
+    Data get(std::string const & filename);
+private:
+    struct Entry
+    {
+        std::string filename;
+        long long mtime;
+        long long size;
+        Data data;      // null for a file too large to cache
+        size_t cost() const;
+    };
+    typedef std::list<Entry> List;
+    Mutex mutex;
+    Condition compressed;
+    List lru;   // most recently used first
+    std::unordered_map<std::string,List::iterator> index;
+    std::unordered_set<std::string> compressing;
+    size_t budget;
+    size_t used;
+    void evict();
+    static Data compress(std::string const & filename);
+};
+
+}
+
+#endif
@@ -0,0 +1,105 @@
+﻿#include "MongoMutex.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace Mongo
+{
+
+#ifdef _WIN32
+
+Mutex::Mutex():
+    impl(new CRITICAL_SECTION)
+{
+    InitializeCriticalSection(static_cast<CRITICAL_SECTION *>(impl));
+}
+
+Mutex::~Mutex()
+{
+    DeleteCriticalSection(static_cast<CRITICAL_SECTION *>(impl));
+    delete static_cast<CRITICAL_SECTION *>(impl);
+}
+
+void Mutex::lock()
+{
+    EnterCriticalSection(static_cast<CRITICAL_SECTION *>(impl));
+}
+
+void Mutex::unlock()
+{
+    LeaveCriticalSection(static_cast<CRITICAL_SECTION *>(impl));
+}
+
+Condition::Condition():
+    impl(new CONDITION_VARIABLE)
+{
+    InitializeConditionVariable(static_cast<CONDITION_VARIABLE *>(impl));
+}
+
+Condition::~Condition()
+{
+    delete static_cast<CONDITION_VARIABLE *>(impl);
+}
+
+void Condition::wait(Mutex & mutex)
+{
+    SleepConditionVariableCS(static_cast<CONDITION_VARIABLE *>(impl),static_cast<CRITICAL_SECTION *>(mutex.impl),INFINITE);
+}
+
+void Condition::notifyAll()
+{
+    WakeAllConditionVariable(static_cast<CONDITION_VARIABLE *>(impl));
+}
+
+#else
+
+Mutex::Mutex():
+    impl(new pthread_mutex_t)
+{
+    pthread_mutex_init(static_cast<pthread_mutex_t *>(impl),0);
+}
+
+Mutex::~Mutex()
+{
+    pthread_mutex_destroy(static_cast<pthread_mutex_t *>(impl));
+    delete static_cast<pthread_mutex_t *>(impl);
+}
+
+void Mutex::lock()
+{
+    pthread_mutex_lock(static_cast<pthread_mutex_t *>(impl));
+}
+
+void Mutex::unlock()
+{
+    pthread_mutex_unlock(static_cast<pthread_mutex_t *>(impl));
+}
+
+Condition::Condition():
+    impl(new pthread_cond_t)
+{
+    pthread_cond_init(static_cast<pthread_cond_t *>(impl),0);
+}
+
+Condition::~Condition()
+{
+    pthread_cond_destroy(static_cast<pthread_cond_t *>(impl));
+    delete static_cast<pthread_cond_t *>(impl);
+}
+
+void Condition::wait(Mutex & mutex)
+{
+    pthread_cond_wait(static_cast<pthread_cond_t *>(impl),static_cast<pthread_mutex_t *>(mutex.impl));
+}
+
+void Condition::notifyAll()
+{
+    pthread_cond_broadcast(static_cast<pthread_cond_t *>(impl));
+}
+
+#endif
+
+}
@@ -0,0 +1,57 @@
+﻿#ifndef MONGOOSE_MUTEX_H_GUARD_x7c2mq94ld0e
+#define MONGOOSE_MUTEX_H_GUARD_x7c2mq94ld0e
+
+namespace Mongo
+{
+
+// Plain non recursive mutex over the platform primitive, for state shared
+// between the server's worker threads. The platform headers stay out of here.
+class Mutex
+{
+    friend class Condition;
+    void * impl;
+    Mutex(Mutex const &);
+    Mutex & operator=(Mutex const &);
+public:
+    Mutex();
+    ~Mutex();
+    void lock();
+    void unlock();
+};
+
+// Condition variable to go with a Mutex.
+class Condition
+{
+    void * impl;
+    Condition(Condition const &);
+    Condition & operator=(Condition const &);
+public:
+    Condition();
+    ~Condition();
+    // mutex must be locked; it is released while waiting and locked again
+    // before returning. Wakeups may be spurious.
+    void wait(Mutex & mutex);
+    void notifyAll();
+};
+
+class Lock
+{
+    Mutex & mutex;
+    Lock(Lock const &);
+    Lock & operator=(Lock const &);
+public:
+    explicit Lock(Mutex & mutex):
+        mutex(mutex)
+    {
+        mutex.lock();
+    }
+
+    ~Lock()
+    {
+        mutex.unlock();
+    }
+};
+
+}
+
+#endif
@@ -1,67 +1,57 @@
 ﻿#include "MongoRequest.h"
+#include "MongoRequestIndex.h"
 #include "mongoose.h"
 #include <cstring>
-
-#ifndef MAXGETSIZE
-#define MAXGETSIZE 200
-#endif
+#include <cstdlib>
 
 namespace Mongo
 {
 
 using std::strcmp;
 
-Request::Request(struct mg_request_info const * request_info, struct mg_connection * conn):
+Request::Request(struct mg_request_info const * request_info, struct mg_connection * conn, RequestIndex * index):
     request_info(request_info),
     conn(conn),
+    index(index),
     pathPos(0)
 {}
 
-bool Request::hasVar(char const * name, char const * buf, size_t size) const
-{
-    char outbuf[MAXGETSIZE];
-    return mg_get_var(buf,size,name,outbuf,sizeof(outbuf)) > 0;
-}
-
-std::string Request::getVar(char const * name, char const * buf, size_t size) const
+bool Request::hasGet(char const * name) const
 {
-    std::string outbuf;
-    outbuf.resize(MAXGETSIZE);
-    auto sz = mg_get_var(buf,size,name,&outbuf[0],outbuf.size());
-    if( sz == -1 ) return std::string();
-
-    outbuf.resize(sz);
-    return outbuf;
+    return index->getQuery().find(name) != 0;
 }
 
-bool Request::hasGet(char const * name) const
+std::string Request::get(char const * name) const
 {
-    if( ! request_info->query_string ) return false;
-    return hasVar(name,request_info->query_string,std::strlen(request_info->query_string));
+    return get_ref(name).str();
 }
 
-std::string Request::get(char const * name) const
+StringRef Request::get_ref(StringRef name) const
 {
-    if( ! request_info->query_string ) return std::string();
-    return getVar(name,request_info->query_string,std::strlen(request_info->query_string));
+    auto field = index->getQuery().find(name);
+    return field ? field->value : StringRef();
 }
 
 bool Request::hasPost(char const * name) const
 {
-    computePostBuffer();
-    return hasVar(name,&postBuffer[0],postBuffer.size());
+    return index->getForm().find(name) != 0;
 }
 
 
 std::string Request::post(std::string const & name) const
 {
-    return post(name.c_str());
+    return post_ref(name).str();
 }
 
 std::string Request::post(char const * name) const
 {
-    computePostBuffer();
-    return getVar(name,&postBuffer[0],postBuffer.size());
+    return post_ref(name).str();
+}
+
+StringRef Request::post_ref(StringRef name) const
+{
+    auto field = index->getForm().find(name);
+    return field ? field->value : StringRef();
 }
 
 
@@ -75,6 +65,11 @@ std::string Request::getURI() const
     return request_info->uri;
 }
 
+StringRef Request::getURI_ref() const
+{
+    return StringRef(request_info->uri);
+}
+
 char const * Request::getQueryString_c() const
 {
     return request_info->query_string;
@@ -82,7 +77,12 @@ char const * Request::getQueryString_c() const
 
 std::string Request::getQueryString() const
 {
-    return request_info->query_string;
+    return getQueryString_ref().str();
+}
+
+StringRef Request::getQueryString_ref() const
+{
+    return StringRef(request_info->query_string);
 }
 
 void Request::computePathPos() const
@@ -104,26 +104,27 @@ void Request::computePathPos() const
     pathPos = slash == 0 ? pathEnd : slash + 1;
 }
 
-void Request::computePostBuffer() const
-{
-    if( ! postBuffer.empty() ) return;
-    if( strcmp(getContentType_c(),"application/x-www-form-urlencoded") != 0 ) return;
 
-    postBuffer.resize(getContentLength());
-    mg_read(conn,&postBuffer[0],postBuffer.size());
+std::string Request::getPath() const
+{
+    return getPath_ref().str();
 }
 
-
-std::string Request::getPath() const
+StringRef Request::getPath_ref() const
 {
     computePathPos();
-    return std::string(request_info->uri,pathPos);
+    return StringRef(request_info->uri,pathPos - request_info->uri);
 }
 
 std::string Request::getResource() const
+{
+    return getResource_ref().str();
+}
+
+StringRef Request::getResource_ref() const
 {
     computePathPos();
-    return std::string(pathPos,pathEnd);
+    return StringRef(pathPos,pathEnd - pathPos);
 }
 
 Method Request::getMethod() const
@@ -146,7 +147,14 @@ char const * Request::getMethod_c() const
 
 char const * Request::getHeader_c(char const * name) const
 {
-    return get_header(request_info,name);
+    auto field = index->getHeaders().find(name);
+    return field ? field->value.data() : 0;
+}
+
+StringRef Request::getHeader_ref(StringRef name) const
+{
+    auto field = index->getHeaders().find(name);
+    return field ? field->value : StringRef();
 }
 
 char const * Request::getContentType_c() const
@@ -162,7 +170,21 @@ unsigned long Request::getContentLength() const
     auto value = getHeader_c("Content-Length");
     if( ! value ) return 0;
 
-    return atol(value);
+    return std::strtoul(value,0,10);
+}
+
+BodyReader & Request::getBodyReader() const
+{
+    return index->getBodyReader();
+}
+
+bool Request::readMultipart(MultipartHandler & handler) const
+{
+    auto boundary = MultipartParser::boundaryOf(getHeader_ref("Content-Type"));
+    if( boundary.empty() ) return false;
+
+    MultipartParser parser(boundary,handler);
+    return parser.parse(index->getBodyReader());
 }
 
 }
@@ -2,7 +2,8 @@
 #define MONGOOSE_REQ_H_GUARD_kjdff49w8ur43bvf67
 
 #include <string>
-#include <vector>
+#include "StringRef.h"
+#include "MongoBody.h"
 
 struct mg_connection;
 struct mg_request_info;
@@ -12,38 +13,52 @@ namespace Mongo
 
 enum Method { UNKNOWN_METHOD, GET, HEAD, POST, PUT, DELETE, TRACE, CONNECT, };
 
+class RequestIndex;
+
+// The *_ref accessors do not allocate; the returned references point into
+// the request buffer or the request arena and are valid until the callback
+// returns.
 class Request
 {
     struct mg_request_info const * request_info;
     struct mg_connection * conn;
+    RequestIndex * index;
     mutable char const * pathPos;
     mutable char const * pathEnd;
-    mutable std::vector<char> postBuffer;
     void computePathPos() const;
-    void computePostBuffer() const;
-    bool hasVar(char const * name, char const * buf, size_t size) const;
-    std::string getVar(char const * name, char const * buf, size_t size) const;
 public:
-    Request(struct mg_request_info const * request_info, struct mg_connection * conn);
+    Request(struct mg_request_info const * request_info, struct mg_connection * conn, RequestIndex * index);
     bool hasGet(char const * name) const;
     std::string get(char const * name) const;
+    StringRef get_ref(StringRef name) const;
     bool hasPost(char const * name) const;
     std::string post(char const * name) const;
     std::string post(std::string const & name) const;
+    StringRef post_ref(StringRef name) const;
     char const * getURI_c() const;
     std::string getURI() const;
+    StringRef getURI_ref() const;
     char const * getQueryString_c() const;
     std::string getQueryString() const;
+    StringRef getQueryString_ref() const;
     std::string getPath() const;
+    StringRef getPath_ref() const;
     std::string getResource() const;
+    StringRef getResource_ref() const;
     Method getMethod() const;
     char const * getMethod_c() const;
     char const * getHeader_c(char const * name) const;
+    StringRef getHeader_ref(StringRef name) const;
     char const * getContentType_c() const;
     unsigned long getContentLength() const;
+    // Streaming access to the body, for uploads too large for post(). The
+    // body is read once: either through the reader or by post().
+    BodyReader & getBodyReader() const;
+    // Parse a multipart/form-data body as it arrives. False if the request
+    // is not multipart, the body is malformed, or the handler stopped.
+    bool readMultipart(MultipartHandler & handler) const;
 };
 
 }
 
 #endif
-
@@ -0,0 +1,206 @@
+﻿#include "MongoRequestIndex.h"
+#include "mongoose.h"
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+
+namespace Mongo
+{
+
+static bool equalsNoCase(StringRef a, StringRef b)
+{
+    if( a.size() != b.size() ) return false;
+
+    for( size_t i = 0 ; i < a.size() ; ++i )
+    {
+        if( std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i]) ) return false;
+    }
+    return true;
+}
+
+// media type match that ignores parameters such as "; charset=UTF-8"
+static bool isFormUrlEncoded(StringRef contentType)
+{
+    StringRef const form("application/x-www-form-urlencoded");
+    if( contentType.size() < form.size() ) return false;
+    if( contentType.size() > form.size() && contentType[form.size()] != ';' ) return false;
+    return equalsNoCase(StringRef(contentType.data(),form.size()),form);
+}
+
+FieldList::FieldList():
+    fields(0),
+    count(0)
+{}
+
+// FNV-1a over the lowercased name
+unsigned FieldList::hash(StringRef name)
+{
+    unsigned h = 2166136261u;
+    for( auto it = name.begin() ; it != name.end() ; ++it )
+    {
+        h ^= (unsigned)std::tolower((unsigned char)*it);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+FieldList::Field const * FieldList::find(StringRef name) const
+{
+    auto h = hash(name);
+    for( size_t i = 0 ; i < count ; ++i )
+    {
+        if( fields[i].hash == h && equalsNoCase(fields[i].name,name) ) return &fields[i];
+    }
+    return 0;
+}
+
+size_t FieldList::size() const
+{
+    return count;
+}
+
+FieldList::Field const & FieldList::operator[](size_t i) const
+{
+    return fields[i];
+}
+
+void FieldList::parseUrlEncoded(Arena & arena, char const * buf, size_t size)
+{
+    fields = 0;
+    count = 0;
+    if( ! buf || size == 0 ) return;
+
+    // one pass to size the table, one to fill it
+    size_t pairs = 1;
+    for( size_t i = 0 ; i < size ; ++i )
+    {
+        if( buf[i] == '&' ) ++pairs;
+    }
+    fields = static_cast<Field *>(arena.allocate(pairs * sizeof(Field)));
+
+    // decoded data never grows, so one copy of the input holds all of it
+    auto scratch = static_cast<char *>(arena.allocate(size + pairs * 2));
+    auto e = buf + size;
+    for( auto p = buf ; p < e ; )
+    {
+        auto amp = static_cast<char const *>(std::memchr(p,'&',e - p));
+        if( ! amp ) amp = e;
+        auto eq = static_cast<char const *>(std::memchr(p,'=',amp - p));
+        if( eq && eq > p )
+        {
+            auto nameLen = mg_url_decode(p,eq - p,scratch,(eq - p) + 1,1);
+            Field & f = fields[count++];
+            f.name = StringRef(scratch,nameLen);
+            f.hash = hash(f.name);
+            scratch += nameLen + 1;
+
+            auto valueLen = mg_url_decode(eq + 1,amp - eq - 1,scratch,(amp - eq - 1) + 1,1);
+            f.value = StringRef(scratch,valueLen);
+            scratch += valueLen + 1;
+        }
+        p = amp + 1;
+    }
+}
+
+void FieldList::assignHeaders(Arena & arena, struct mg_request_info const * request_info)
+{
+    count = (size_t)request_info->num_headers;
+    fields = count ? static_cast<Field *>(arena.allocate(count * sizeof(Field))) : 0;
+    for( size_t i = 0 ; i < count ; ++i )
+    {
+        Field & f = fields[i];
+        f.name = StringRef(request_info->http_headers[i].name);
+        f.value = StringRef(request_info->http_headers[i].value);
+        f.hash = hash(f.name);
+    }
+}
+
+RequestIndex::RequestIndex(struct mg_request_info const * request_info, struct mg_connection * conn):
+    request_info(request_info),
+    conn(conn),
+    arena(conn),
+    reader(conn),
+    queryBuilt(false),
+    formBuilt(false),
+    headersBuilt(false),
+    bodyRead(false)
+{}
+
+FieldList const & RequestIndex::getQuery()
+{
+    if( ! queryBuilt )
+    {
+        auto qs = request_info->query_string;
+        query.parseUrlEncoded(arena,qs,qs ? std::strlen(qs) : 0);
+        queryBuilt = true;
+    }
+    return query;
+}
+
+FieldList const & RequestIndex::getForm()
+{
+    if( ! formBuilt )
+    {
+        formBuilt = true;
+        auto contentType = getHeaders().find("Content-Type");
+        if( contentType && isFormUrlEncoded(contentType->value) )
+        {
+            auto buf = getBody();
+            form.parseUrlEncoded(arena,buf.data(),buf.size());
+        }
+    }
+    return form;
+}
+
+FieldList const & RequestIndex::getHeaders()
+{
+    if( ! headersBuilt )
+    {
+        headers.assignHeaders(arena,request_info);
+        headersBuilt = true;
+    }
+    return headers;
+}
+
+StringRef RequestIndex::getBody()
+{
+    if( ! bodyRead )
+    {
+        bodyRead = true;
+        // a chunked body has no length up front, its buffer grows as it
+        // comes in
+        auto cl = getHeaders().find("Content-Length");
+        size_t capacity = cl ? std::strtoul(cl->value.data(),0,10) : 4096;
+        size_t used = 0;
+        if( capacity && conn )
+        {
+            auto buf = static_cast<char *>(arena.allocate(capacity));
+            size_t n;
+            while( (n = reader.read(buf + used,capacity - used)) > 0 )
+            {
+                used += n;
+                if( used == capacity && ! cl )
+                {
+                    auto bigger = static_cast<char *>(arena.allocate(capacity * 2));
+                    std::memcpy(bigger,buf,used);
+                    buf = bigger;
+                    capacity *= 2;
+                }
+            }
+            body = StringRef(buf,used);
+        }
+    }
+    return body;
+}
+
+BodyReader & RequestIndex::getBodyReader()
+{
+    return reader;
+}
+
+Arena & RequestIndex::getArena()
+{
+    return arena;
+}
+
+}
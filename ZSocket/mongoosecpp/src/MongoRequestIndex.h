@@ -0,0 +1,70 @@
+﻿#ifndef MONGOOSE_REQINDEX_H_GUARD_p2k38dmz71qa
+#define MONGOOSE_REQINDEX_H_GUARD_p2k38dmz71qa
+
+#include "StringRef.h"
+#include "MongoArena.h"
+#include "MongoBody.h"
+
+struct mg_connection;
+struct mg_request_info;
+
+namespace Mongo
+{
+
+// Decoded name/value pairs of one source (query string, form body or
+// headers). Names are matched case insensitively, first occurrence wins,
+// like mg_get_var() and get_header() do.
+class FieldList
+{
+public:
+    struct Field
+    {
+        StringRef name;
+        StringRef value;
+        unsigned hash;
+    };
+    FieldList();
+    Field const * find(StringRef name) const;
+    size_t size() const;
+    Field const & operator[](size_t i) const;
+    void parseUrlEncoded(Arena & arena, char const * buf, size_t size);
+    void assignHeaders(Arena & arena, struct mg_request_info const * request_info);
+    static unsigned hash(StringRef name);
+private:
+    Field * fields;
+    size_t count;
+};
+
+// Per-request lookup tables shared by all copies of a Request. Each table is
+// built on first use, so handlers that never touch the form body never read
+// it, and handlers that read twenty parameters decode the query string once.
+// Tables live in the request arena of the connection.
+class RequestIndex
+{
+    struct mg_request_info const * request_info;
+    struct mg_connection * conn;
+    Arena arena;
+    FieldList query;
+    FieldList form;
+    FieldList headers;
+    BodyReader reader;
+    StringRef body;
+    bool queryBuilt;
+    bool formBuilt;
+    bool headersBuilt;
+    bool bodyRead;
+    RequestIndex(RequestIndex const &);
+    RequestIndex & operator=(RequestIndex const &);
+public:
+    RequestIndex(struct mg_request_info const * request_info, struct mg_connection * conn);
+    FieldList const & getQuery();
+    FieldList const & getForm();
+    FieldList const & getHeaders();
+    StringRef getBody();
+    BodyReader & getBodyReader();
+    Arena & getArena();
+};
+
+}
+
+#endif
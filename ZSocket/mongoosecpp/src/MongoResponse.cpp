@@ -1,38 +1,71 @@
 ﻿#include "MongoResponse.h"
+#include "MongoGzip.h"
 #include "mongoose.h"
+#include <cstdio>
+#include <cstring>
 
 namespace Mongo
 {
 
 int const BUFSIZE = 8192;
 
-Response::Response(struct mg_connection * conn):
+ResponseState::ResponseState(struct mg_connection * conn, struct mg_request_info const * request_info):
     conn(conn),
+    deferrable(false),
+    http11(request_info->http_version && std::strcmp(request_info->http_version,"1.1") == 0),
+    headOnly(request_info->request_method && std::strcmp(request_info->request_method,"HEAD") == 0),
+    acceptsGzip(Mongo::acceptsGzip(get_header(request_info,"Accept-Encoding"))),
     statusSet(false),
     contentTypeSet(false),
-    headersSent(false)
+    lengthSet(false),
+    bodyStarted(false),
+    committed(false),
+    chunked(false),
+    finished(false),
+    headLen(0),
+    bodyStart(0),
+    used(0),
+    deflater(0),
+    capture(0)
+{}
+
+CapturedResponse::CapturedResponse():
+    status(200)
+{}
+
+ResponseState::~ResponseState()
+{
+    Deflater::release(deflater);
+}
+
+Response::Response(ResponseState * state):
+    state(state)
 {}
 
 Response & Response::status(int code)
 {
-    if( statusSet ) return *this;
+    if( state->statusSet ) return *this;
 
+    if( state->capture )
+    {
+        state->capture->status = code;
+    }
     do_printf("HTTP/1.1 %d OK\r\n",code);
-    statusSet = true;
+    state->statusSet = true;
     return *this;
 }
 
 Response & Response::contentType(char const * type)
 {
-    if( contentTypeSet ) return *this;
+    if( state->contentTypeSet ) return *this;
 
-    if( ! statusSet )
+    if( ! state->statusSet )
     {
         status(200);
     }
 
     do_printf("Content-Type: %s\r\n",type);
-    contentTypeSet = true;
+    state->contentTypeSet = true;
     return *this;
 }
 
@@ -41,30 +74,51 @@ Response & Response::contentType(std::string const & type)
     return contentType(type.c_str());
 }
 
-int Response::printf(const char *fmt, ...)
+Response & Response::header(char const * name, char const * value)
 {
-    checkHeadersSent();
-    va_list ap;
-    va_start(ap, fmt);
-    int result = vprintf(fmt,ap);
-    va_end(ap);
-    return result;
+    if( ! state->statusSet )
+    {
+        status(200);
+    }
+
+    do_printf("%s: %s\r\n",name,value);
+    return *this;
 }
 
-void Response::checkHeadersSent()
+Response & Response::contentLength(unsigned long long length)
 {
-    if( ! headersSent )
+    // a compressed body is measured after compression, a captured one when
+    // it is sent
+    if( state->lengthSet || state->deflater || state->capture ) return *this;
+
+    if( ! state->statusSet )
     {
-        if( ! contentTypeSet )
-        {
-            contentType("text/plain");
-        }
-        mg_write(conn, "\r\n", 2);
-        headersSent = true;
+        status(200);
     }
+
+    do_printf("Content-Length: %llu\r\n",length);
+    state->lengthSet = true;
+    return *this;
 }
 
-int Response::do_printf(const char *fmt, ...)
+// Gzip the body if the client accepts it. Has to come before the body and
+// before contentLength().
+Response & Response::compress()
+{
+    if( state->bodyStarted || state->finished || state->lengthSet || state->deflater ) return *this;
+
+    header("Vary","Accept-Encoding");
+    if( ! state->acceptsGzip ) return *this;
+
+    state->deflater = Deflater::acquire(Deflater::DEFAULT_LEVEL);
+    if( state->deflater )
+    {
+        header("Content-Encoding","gzip");
+    }
+    return *this;
+}
+
+int Response::printf(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
@@ -73,17 +127,189 @@ int Response::do_printf(const char *fmt, ...)
     return result;
 }
 
+int Response::do_printf(const char *fmt, ...)
+{
+    char buf[BUFSIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = mg_vsnprintf(state->conn, buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    appendHead(buf,(size_t)len);
+    return len;
+}
+
 int Response::vprintf(const char *fmt, va_list ap)
 {
     char buf[BUFSIZE];
-    int len = mg_vsnprintf(conn, buf, sizeof(buf), fmt, ap);
-    return mg_write(conn, buf, (size_t)len);
+    int len = mg_vsnprintf(state->conn, buf, sizeof(buf), fmt, ap);
+    write(buf,(size_t)len);
+    return len;
+}
+
+// Header lines after the body has started are dropped, like the status and
+// content type were before.
+void Response::appendHead(char const * data, size_t size)
+{
+    if( state->bodyStarted || state->finished ) return;
+
+    if( state->capture )
+    {
+        state->capture->head.append(data,size);
+        return;
+    }
+    if( state->headLen + size > ResponseState::BUFSIZE - ResponseState::GAP )
+    {
+        // unusually large headers, let the first part go
+        mg_write(state->conn,state->buf,state->headLen);
+        state->headLen = 0;
+    }
+    std::memcpy(state->buf + state->headLen,data,size);
+    state->headLen += size;
+}
+
+void Response::beginBody()
+{
+    if( state->bodyStarted ) return;
+
+    if( ! state->contentTypeSet )
+    {
+        contentType("text/plain");
+    }
+    state->bodyStarted = true;
+    state->bodyStart = state->headLen + ResponseState::GAP;
+    state->used = state->bodyStart;
+}
+
+// Send the headers, followed by whatever body is buffered. The last header
+// lines (framing and the blank line) and the first chunk size are written
+// into the gap before the body, and the headers are moved up to meet them,
+// so everything leaves in one write.
+void Response::commit(bool final)
+{
+    char extra[ResponseState::GAP];
+    size_t bodyLen = state->used - state->bodyStart;
+    int n = 0;
+
+    if( ! state->lengthSet && final )
+    {
+        n = std::sprintf(extra,"Content-Length: %lu\r\n\r\n",(unsigned long)bodyLen);
+    }
+    else if( ! state->lengthSet && state->http11 )
+    {
+        state->chunked = true;
+        n = std::sprintf(extra,"Transfer-Encoding: chunked\r\n\r\n");
+        if( bodyLen && ! state->headOnly )
+        {
+            n += std::sprintf(extra + n,"%lx\r\n",(unsigned long)bodyLen);
+            state->buf[state->used++] = '\r';
+            state->buf[state->used++] = '\n';
+        }
+    }
+    else if( ! state->lengthSet )
+    {
+        // HTTP/1.0 without a length: the body ends when the connection
+        // is closed, so it cannot be kept alive
+        n = std::sprintf(extra,"Connection: close\r\n\r\n");
+        mg_set_must_close(state->conn);
+    }
+    else
+    {
+        n = std::sprintf(extra,"\r\n");
+    }
+
+    char * start = state->buf + ResponseState::GAP - n;
+    std::memmove(start,state->buf,state->headLen);
+    std::memcpy(start + state->headLen,extra,n);
+    size_t total = state->headLen + n + (state->headOnly ? 0 : state->used - state->bodyStart);
+    mg_write(state->conn,start,total);
+
+    state->committed = true;
+    state->headLen = 0;
+    state->bodyStart = ResponseState::GAP;
+    state->used = state->bodyStart;
+}
+
+void Response::flushBody(bool final)
+{
+    size_t bodyLen = state->used - state->bodyStart;
+    char * start = state->buf + state->bodyStart;
+
+    if( state->headOnly )
+    {
+        state->used = state->bodyStart;
+        return;
+    }
+    if( state->chunked )
+    {
+        char head[24];
+        int n = bodyLen ? std::sprintf(head,"%lx\r\n",(unsigned long)bodyLen) : 0;
+        start -= n;
+        std::memcpy(start,head,n);
+        if( bodyLen )
+        {
+            state->buf[state->used++] = '\r';
+            state->buf[state->used++] = '\n';
+        }
+        if( final )
+        {
+            std::memcpy(state->buf + state->used,"0\r\n\r\n",5);
+            state->used += 5;
+        }
+    }
+    if( state->buf + state->used > start )
+    {
+        mg_write(state->conn,start,state->buf + state->used - start);
+    }
+    state->used = state->bodyStart;
 }
 
 void Response::write(char const * buf, size_t size)
 {
-    checkHeadersSent();
-    mg_write(conn, buf, size);
+    if( state->finished ) return;
+
+    beginBody();
+    if( state->deflater )
+    {
+        state->deflater->deflate(buf,size,false,[this](char const * out, size_t n)
+        {
+            append(out,n);
+        });
+        return;
+    }
+    append(buf,size);
+}
+
+void Response::append(char const * buf, size_t size)
+{
+    if( state->capture )
+    {
+        state->capture->body.append(buf,size);
+        return;
+    }
+
+    // keep room for the chunk trailer and the terminating chunk
+    size_t const limit = ResponseState::BUFSIZE - 8;
+    while( size )
+    {
+        size_t room = limit - state->used;
+        if( room == 0 )
+        {
+            if( state->committed )
+            {
+                flushBody(false);
+            }
+            else
+            {
+                commit(false);
+            }
+            continue;
+        }
+        size_t n = size < room ? size : room;
+        std::memcpy(state->buf + state->used,buf,n);
+        state->used += n;
+        buf += n;
+        size -= n;
+    }
 }
 
 void Response::write(std::istream & is)
@@ -96,5 +322,32 @@ void Response::write(std::istream & is)
     }
 }
 
+// Complete the response: send what is still buffered and terminate the
+// chunked body. Called by the server when a callback reports the request
+// as handled.
+void Response::finish()
+{
+    if( state->finished ) return;
+
+    beginBody();
+    if( state->deflater )
+    {
+        state->deflater->deflate(0,0,true,[this](char const * out, size_t n)
+        {
+            append(out,n);
+        });
+        Deflater::release(state->deflater);
+        state->deflater = 0;
+    }
+    if( state->committed )
+    {
+        flushBody(true);
+    }
+    else if( ! state->capture )
+    {
+        commit(true);
+    }
+    state->finished = true;
+}
 
 }
@@ -6,30 +6,86 @@
 #include <istream>
 
 struct mg_connection;
+struct mg_request_info;
 
 namespace Mongo
 {
 
-class Response
+class Deflater;
+
+// A response collected in memory instead of being sent, for the response
+// cache. Framing (Content-Length, chunking) is left out of head.
+struct CapturedResponse
+{
+    CapturedResponse();
+    int status;
+    std::string head;   // status line and header lines
+    std::string body;
+};
+
+// Output side of one request, shared by all copies of a Response and owned
+// by the server for the duration of the callback.
+// Headers and body are collected in buf. If the whole response fits, it goes
+// out in a single write with a Content-Length header. Otherwise the headers
+// are sent as soon as the buffer fills up and the body follows in chunks
+// (HTTP/1.1) or unframed (HTTP/1.0). A compressed body goes through a
+// pooled deflater on its way into buf.
+class ResponseState
 {
+public:
+    enum { BUFSIZE = 16384, GAP = 64 };
+    ResponseState(struct mg_connection * conn, struct mg_request_info const * request_info);
+    ~ResponseState();
     struct mg_connection * conn;
+    bool deferrable;    // a start callback may hand the request to a Deferred
+    bool http11;
+    bool headOnly;
+    bool acceptsGzip;
     bool statusSet;
     bool contentTypeSet;
-    bool headersSent;
+    bool lengthSet;
+    bool bodyStarted;
+    bool committed;
+    bool chunked;
+    bool finished;
+    size_t headLen;     // header lines at buf[0,headLen)
+    size_t bodyStart;   // body starts GAP bytes after the headers
+    size_t used;        // end of buffered data
+    Deflater * deflater;    // set while the body is being compressed
+    CapturedResponse * capture; // set while the response is being captured
+    char buf[BUFSIZE];
+private:
+    ResponseState(ResponseState const &);
+    ResponseState & operator=(ResponseState const &);
+};
+
+class Response
+{
+    friend class Deferred;
+    friend class ResponseCache;
+    friend class WebSocket;
+    ResponseState * state;
     int do_printf(const char *fmt, ...);
-    void checkHeadersSent();
+    void appendHead(char const * data, size_t size);
+    void beginBody();
+    void commit(bool final);
+    void flushBody(bool final);
+    void append(char const * buf, size_t size);
 public:
-    Response(struct mg_connection * conn);
+    explicit Response(ResponseState * state);
     Response & status(int code);
     Response & contentType(char const * type);
     Response & contentType(std::string const & type);
+    Response & header(char const * name, char const * value);
+    Response & contentLength(unsigned long long length);
+    Response & compress();
     int printf(const char *fmt, ...);	// :-(
     int vprintf(const char *fmt, va_list ap);  // :-[
     void write(char const * buf, size_t size);
     void write(std::istream & is);
+    void finish();
 };
 
 }
 
 #endif
-
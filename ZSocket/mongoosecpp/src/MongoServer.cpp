@@ -1,4 +1,5 @@
 ﻿#include "MongoServer.h"
+#include "MongoRequestIndex.h"
 #include "mongoose.h"
 #include <algorithm>
 #include <iterator>
@@ -6,23 +7,51 @@
 namespace Mongo
 {
 
+// Run a callback that may answer the request; a handled request gets its
+// buffered response flushed and terminated before control returns to mongoose.
+static void * respond(Callback const & cb, Request req, Response resp)
+{
+    if( ! cb(req,resp) ) return 0;
+
+    resp.finish();
+    return const_cast<char *>("");
+}
+
 static void * CallbackWrapper(enum ::mg_event event, struct ::mg_connection * conn, const struct ::mg_request_info * request_info)
 {
     auto server = reinterpret_cast<Server const *>(request_info->user_data);
-    Request req(request_info,conn);
-    Response resp(conn);
+    // with MG_INIT_SSL conn is really the SSL_CTX, keep the index away from it
+    RequestIndex index(request_info,event == MG_INIT_SSL ? 0 : conn);
+    Request req(request_info,conn,&index);
     switch(event)
     {
     case MG_NEW_REQUEST:
-        return server->cbStart(req,resp) ? "" : 0;
+    {
+        ResponseState state(conn,request_info);
+        state.deferrable = true;
+        return respond(server->cbStart,req,Response(&state));
+    }
     case MG_HTTP_ERROR:
-        return server->cbError(req,resp) ? "" : 0;
+    {
+        ResponseState state(conn,request_info);
+        return respond(server->cbError,req,Response(&state));
+    }
+    default:
+        break;
+    }
+
+    // no response may be sent for the remaining events
+    ResponseState state(conn,request_info);
+    state.finished = true;
+    Response resp(&state);
+    switch(event)
+    {
     case MG_EVENT_LOG:
-        return server->cbLog(req,resp) ? "" : 0;
+        return server->cbLog(req,resp) ? const_cast<char *>("") : 0;
     case MG_INIT_SSL:
-        return server->cbInitSSL(req,resp) ? "" : 0;
+        return server->cbInitSSL(req,resp) ? const_cast<char *>("") : 0;
     case MG_REQUEST_COMPLETE:
-        return server->cbEnd(req,resp) ? "" : 0;
+        return server->cbEnd(req,resp) ? const_cast<char *>("") : 0;
     default:
         return 0;
     }
@@ -39,7 +68,11 @@ Server::Server():
     return true;
 }),
 cbEnd(cbStart),
-cbError(cbStart),
+// unhandled errors get mongoose's own error page
+cbError([](Request,Response)
+{
+    return false;
+}),
 cbLog(cbStart),
 cbInitSSL(cbStart)
 {}
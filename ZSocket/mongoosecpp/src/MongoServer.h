@@ -9,6 +9,7 @@ struct mg_context;
 #include <functional>
 #include "MongoRequest.h"
 #include "MongoResponse.h"
+#include "MongoDeferred.h"
 
 namespace Mongo
 {
@@ -0,0 +1,186 @@
+﻿#include "MongoWebSocket.h"
+#include "mongoose.h"
+#include <algorithm>
+
+namespace Mongo
+{
+
+class WebSocketState
+{
+public:
+    explicit WebSocketState(std::shared_ptr<WebSocketEndpoint const> const & endpoint);
+    ~WebSocketState();
+    static void callback(struct mg_websocket *, enum mg_websocket_event event, int opcode,
+                         char const * data, size_t len, void * arg);
+    struct mg_websocket * ws;
+    std::shared_ptr<WebSocketEndpoint const> endpoint;
+private:
+    WebSocketState(WebSocketState const &);
+    WebSocketState & operator=(WebSocketState const &);
+};
+
+WebSocketState::WebSocketState(std::shared_ptr<WebSocketEndpoint const> const & endpoint):
+    ws(0),
+    endpoint(endpoint)
+{}
+
+WebSocketState::~WebSocketState()
+{
+    if( ws )
+    {
+        mg_websocket_release(ws);
+    }
+}
+
+// Called from the WebSocket thread. arg is the server's reference to the
+// state, dropped with the last event.
+void WebSocketState::callback(struct mg_websocket *, enum mg_websocket_event event, int opcode,
+                              char const * data, size_t len, void * arg)
+{
+    auto ref = static_cast<std::shared_ptr<WebSocketState> *>(arg);
+    WebSocket ws(*ref);
+    WebSocketEndpoint const & endpoint = *(*ref)->endpoint;
+    try
+    {
+        if( event == MG_WEBSOCKET_MESSAGE )
+        {
+            if( endpoint.onMessage )
+            {
+                endpoint.onMessage(ws,StringRef(data,len),opcode == MG_WEBSOCKET_BINARY);
+            }
+        }
+        else if( endpoint.onClose )
+        {
+            endpoint.onClose(ws);
+        }
+    }
+    catch(...)
+    {
+        // the thread serves everybody else too, only this connection goes
+        ws.close(1011);
+    }
+    if( event == MG_WEBSOCKET_CLOSE )
+    {
+        delete ref;
+    }
+}
+
+WebSocket::WebSocket()
+{}
+
+WebSocket::WebSocket(std::shared_ptr<WebSocketState> const & state):
+    state(state)
+{}
+
+bool WebSocket::valid() const
+{
+    return state.get() != 0;
+}
+
+bool WebSocket::sendText(StringRef text) const
+{
+    return state && mg_websocket_send(state->ws,MG_WEBSOCKET_TEXT,text.data(),text.size());
+}
+
+bool WebSocket::sendBinary(char const * data, size_t size) const
+{
+    return state && mg_websocket_send(state->ws,MG_WEBSOCKET_BINARY,data,size);
+}
+
+void WebSocket::close(int status) const
+{
+    if( state )
+    {
+        mg_websocket_close(state->ws,status);
+    }
+}
+
+bool WebSocket::operator==(WebSocket const & other) const
+{
+    return state == other.state;
+}
+
+bool WebSocket::operator!=(WebSocket const & other) const
+{
+    return state != other.state;
+}
+
+bool WebSocket::upgrade(Request request, Response response, std::shared_ptr<WebSocketEndpoint const> const & endpoint)
+{
+    ResponseState * rs = response.state;
+    if( rs->deferrable && ! rs->statusSet && ! rs->finished )
+    {
+        std::shared_ptr<WebSocketState> s = std::make_shared<WebSocketState>(endpoint);
+        auto ref = new std::shared_ptr<WebSocketState>(s);
+        s->ws = mg_websocket_upgrade(rs->conn,&WebSocketState::callback,ref);
+        if( s->ws )
+        {
+            // the 101 has been sent, the connection is no longer HTTP
+            rs->finished = true;
+            if( endpoint->onOpen )
+            {
+                endpoint->onOpen(WebSocket(s),request);
+            }
+            return true;
+        }
+        delete ref;
+    }
+
+    response.status(426);
+    response.header("Upgrade","websocket");
+    response.header("Sec-WebSocket-Version","13");
+    response.printf("WebSocket handshake expected");
+    return true;
+}
+
+WebSocketGroup::WebSocketGroup()
+{}
+
+void WebSocketGroup::add(WebSocket ws)
+{
+    Lock lock(mutex);
+    members.push_back(ws);
+}
+
+void WebSocketGroup::remove(WebSocket ws)
+{
+    Lock lock(mutex);
+    members.erase(std::remove(members.begin(),members.end(),ws),members.end());
+}
+
+size_t WebSocketGroup::broadcastText(StringRef text)
+{
+    return broadcast(MG_WEBSOCKET_TEXT,text.data(),text.size());
+}
+
+size_t WebSocketGroup::broadcastBinary(char const * data, size_t size)
+{
+    return broadcast(MG_WEBSOCKET_BINARY,data,size);
+}
+
+// Only queues, the WebSocket thread does the writing
+size_t WebSocketGroup::broadcast(int opcode, char const * data, size_t size)
+{
+    Lock lock(mutex);
+    size_t sent = 0;
+    for( size_t i = 0; i < members.size(); )
+    {
+        if( members[i].state && mg_websocket_send(members[i].state->ws,opcode,data,size) )
+        {
+            sent++;
+            i++;
+            continue;
+        }
+        members[i] = members.back();
+        members.pop_back();
+    }
+    return sent;
+}
+
+size_t WebSocketGroup::size()
+{
+    Lock lock(mutex);
+    return members.size();
+}
+
+}
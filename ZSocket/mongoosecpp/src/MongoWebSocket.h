@@ -0,0 +1,80 @@
+﻿#ifndef MONGOOSE_WEBSOCKET_H_GUARD_r4m81xq0vbz6
+#define MONGOOSE_WEBSOCKET_H_GUARD_r4m81xq0vbz6
+
+#include <memory>
+#include <functional>
+#include <vector>
+#include "MongoRequest.h"
+#include "MongoResponse.h"
+#include "MongoMutex.h"
+#include "StringRef.h"
+
+namespace Mongo
+{
+
+class WebSocketState;
+struct WebSocketEndpoint;
+
+// One WebSocket connection. Copies share it; it stays open until either
+// side closes it, and handles can be kept and used from any thread, also
+// after the Server is gone (sending then fails).
+class WebSocket
+{
+public:
+    WebSocket();
+    // false for a default constructed handle
+    bool valid() const;
+    // Queue a message. False if the connection is closing, or if the client
+    // does not keep up and is being dropped.
+    bool sendText(StringRef text) const;
+    bool sendBinary(char const * data, size_t size) const;
+    // 1000 is a normal closure; onClose follows once the client answers
+    void close(int status = 1000) const;
+    bool operator==(WebSocket const & other) const;
+    bool operator!=(WebSocket const & other) const;
+    // Start callback accepting the handshake for endpoint, see
+    // Dispatcher::serveWebSocket(). Anything else gets a 426.
+    static bool upgrade(Request request, Response response, std::shared_ptr<WebSocketEndpoint const> const & endpoint);
+private:
+    friend class WebSocketState;
+    friend class WebSocketGroup;
+    explicit WebSocket(std::shared_ptr<WebSocketState> const & state);
+    std::shared_ptr<WebSocketState> state;
+};
+
+// What to do with the connections of one URL. onOpen runs in the worker
+// that accepted the handshake, before any message can arrive. onMessage and
+// onClose run in the server's WebSocket thread, which serves all the
+// connections, so they must not block. Fragmented messages arrive whole.
+struct WebSocketEndpoint
+{
+    typedef std::function<void(WebSocket, Request)> OpenCallback;
+    typedef std::function<void(WebSocket, StringRef, bool binary)> MessageCallback;
+    typedef std::function<void(WebSocket)> CloseCallback;
+    OpenCallback onOpen;
+    MessageCallback onMessage;
+    CloseCallback onClose;
+};
+
+// Connections that get the same messages, e.g. the subscribers of a feed.
+// Closed connections are dropped by the next broadcast.
+class WebSocketGroup
+{
+    Mutex mutex;
+    std::vector<WebSocket> members;
+    size_t broadcast(int opcode, char const * data, size_t size);
+    WebSocketGroup(WebSocketGroup const &);
+    WebSocketGroup & operator=(WebSocketGroup const &);
+public:
+    WebSocketGroup();
+    void add(WebSocket ws);
+    void remove(WebSocket ws);
+    // Return the number of connections the message was queued for
+    size_t broadcastText(StringRef text);
+    size_t broadcastBinary(char const * data, size_t size);
+    size_t size();
+};
+
+}
+
+#endif
@@ -0,0 +1,86 @@
+﻿#ifndef STRINGREF_H_GUARD_a83kd92mvx7e
+#define STRINGREF_H_GUARD_a83kd92mvx7e
+
+#include <cstring>
+#include <string>
+
+namespace Mongo
+{
+
+// Non owning reference to a chunk of characters. Stays valid as long as the
+// buffer it points into, which for request data means until the callback
+// returns.
+class StringRef
+{
+    char const * ptr;
+    size_t len;
+public:
+    StringRef():
+        ptr(""),
+        len(0)
+    {}
+
+    StringRef(char const * str):
+        ptr(str ? str : ""),
+        len(str ? std::strlen(str) : 0)
+    {}
+
+    StringRef(char const * str, size_t size):
+        ptr(str),
+        len(size)
+    {}
+
+    StringRef(std::string const & str):
+        ptr(str.data()),
+        len(str.size())
+    {}
+
+    char const * data() const
+    {
+        return ptr;
+    }
+
+    size_t size() const
+    {
+        return len;
+    }
+
+    bool empty() const
+    {
+        return len == 0;
+    }
+
+    char const * begin() const
+    {
+        return ptr;
+    }
+
+    char const * end() const
+    {
+        return ptr + len;
+    }
+
+    char operator[](size_t i) const
+    {
+        return ptr[i];
+    }
+
+    std::string str() const
+    {
+        return std::string(ptr,len);
+    }
+
+    bool operator==(StringRef const & other) const
+    {
+        return len == other.len && std::memcmp(ptr,other.ptr,len) == 0;
+    }
+
+    bool operator!=(StringRef const & other) const
+    {
+        return ! (*this == other);
+    }
+};
+
+}
+
+#endif
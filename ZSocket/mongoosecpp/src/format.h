@@ -80,7 +80,8 @@ template<typename T, typename U, typename... V>
 std::basic_string<T> strformat(T const * str, U const & v1, V... rest)
 {
     std::basic_stringstream<T> ss;
-    return format(ss,str,v1,rest...).str();
+    format(ss,str,v1,rest...);
+    return ss.str();
 }
 
 #else
@@ -107,6 +107,7 @@ typedef long off_t;
 #define EWOULDBLOCK  WSAEWOULDBLOCK
 #endif // !EWOULDBLOCK
 #define _POSIX_
+#define NO_FASTCGI // No Unix domain sockets
 #define INT64_FMT  "I64d"
 
 #define WINCDECL __cdecl
@@ -114,6 +115,8 @@ typedef long off_t;
 #define snprintf _snprintf
 #define vsnprintf _vsnprintf
 #define sleep(x) Sleep((x) * 1000)
+#define mg_sleep(x) Sleep(x)
+#define mg_memory_barrier() MemoryBarrier()
 
 #define pipe(x) _pipe(x, BUFSIZ, _O_BINARY)
 #define popen(x, y) _popen(x, y)
@@ -187,6 +190,8 @@ typedef struct DIR
 #include <pwd.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/un.h>
 #if !defined(NO_SSL_DL) && !defined(NO_SSL)
 #include <dlfcn.h>
 #endif
@@ -215,11 +220,17 @@ typedef struct DIR
 #define ERRNO errno
 #define INVALID_SOCKET (-1)
 #define INT64_FMT PRId64
+#define mg_sleep(x) usleep((x) * 1000)
+#define mg_memory_barrier() __sync_synchronize()
 typedef int SOCKET;
 #define WINCDECL
 
 #endif // End of Windows and UNIX specific includes
 
+#if defined(NO_CGI) && !defined(NO_FASTCGI)
+#define NO_FASTCGI // FastCGI passes on the CGI environment
+#endif // NO_CGI
+
 #include "mongoose.h"
 
 #define MONGOOSE_VERSION "3.1"
@@ -270,11 +281,34 @@ static const char *http_500_error = "Internal Server Error";
 typedef struct ssl_st SSL;
 typedef struct ssl_method_st SSL_METHOD;
 typedef struct ssl_ctx_st SSL_CTX;
+typedef struct evp_cipher_st EVP_CIPHER;
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+typedef struct evp_md_st EVP_MD;
+typedef struct hmac_ctx_st HMAC_CTX;
+typedef struct engine_st ENGINE;
 
 #define SSL_ERROR_WANT_READ 2
 #define SSL_ERROR_WANT_WRITE 3
 #define SSL_FILETYPE_PEM 1
 #define CRYPTO_LOCK  1
+#define SSL_CTRL_SESS_NUMBER 20
+#define SSL_CTRL_SESS_ACCEPT 24
+#define SSL_CTRL_SESS_ACCEPT_GOOD 25
+#define SSL_CTRL_SESS_HIT 27
+#define SSL_CTRL_SESS_MISSES 29
+#define SSL_CTRL_SESS_TIMEOUTS 30
+#define SSL_CTRL_SESS_CACHE_FULL 31
+#define SSL_CTRL_OPTIONS 32
+#define SSL_CTRL_MODE 33
+#define SSL_CTRL_SET_SESS_CACHE_SIZE 42
+#define SSL_CTRL_SET_SESS_CACHE_MODE 44
+#define SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB 72
+#define SSL_SESS_CACHE_OFF 0
+#define SSL_SESS_CACHE_SERVER 2
+#define SSL_OP_NO_TICKET 0x00004000L
+#define SSL_MODE_ENABLE_PARTIAL_WRITE 0x1
+#define SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER 0x2
+#define SSL_MODE_RELEASE_BUFFERS 0x10
 
 #if defined(NO_SSL_DL)
 extern void SSL_free(SSL *);
@@ -294,11 +328,28 @@ extern int SSL_CTX_use_certificate_file(SSL_CTX *, const char *, int);
 extern int SSL_CTX_use_certificate_chain_file(SSL_CTX *, const char *);
 extern void SSL_CTX_set_default_passwd_cb(SSL_CTX *, mg_callback_t);
 extern void SSL_CTX_free(SSL_CTX *);
+extern long SSL_CTX_ctrl(SSL_CTX *, int, long, void *);
+extern long SSL_CTX_callback_ctrl(SSL_CTX *, int, void (*)(void));
+extern long SSL_CTX_set_timeout(SSL_CTX *, long);
+extern int SSL_CTX_set_session_id_context(SSL_CTX *, const unsigned char *,
+        unsigned int);
+extern int SSL_set_ex_data(SSL *, int, void *);
+extern void *SSL_get_ex_data(const SSL *, int);
+extern int SSL_shutdown(SSL *);
 extern unsigned long ERR_get_error(void);
 extern char *ERR_error_string(unsigned long, char *);
 extern int CRYPTO_num_locks(void);
 extern void CRYPTO_set_locking_callback(void (*)(int, int, const char *, int));
 extern void CRYPTO_set_id_callback(unsigned long (*)(void));
+extern int RAND_bytes(unsigned char *, int);
+extern const EVP_CIPHER *EVP_aes_128_cbc(void);
+extern int EVP_EncryptInit_ex(EVP_CIPHER_CTX *, const EVP_CIPHER *, ENGINE *,
+                              const unsigned char *, const unsigned char *);
+extern int EVP_DecryptInit_ex(EVP_CIPHER_CTX *, const EVP_CIPHER *, ENGINE *,
+                              const unsigned char *, const unsigned char *);
+extern const EVP_MD *EVP_sha256(void);
+extern int HMAC_Init_ex(HMAC_CTX *, const void *, int, const EVP_MD *,
+                        ENGINE *);
 #else
 // Dynamically loaded SSL functionality
 struct ssl_func
@@ -328,6 +379,15 @@ struct ssl_func
 #define SSL_load_error_strings (* (void (*)(void)) ssl_sw[15].ptr)
 #define SSL_CTX_use_certificate_chain_file \
   (* (int (*)(SSL_CTX *, const char *)) ssl_sw[16].ptr)
+#define SSL_CTX_ctrl (* (long (*)(SSL_CTX *, int, long, void *)) ssl_sw[17].ptr)
+#define SSL_CTX_callback_ctrl \
+  (* (long (*)(SSL_CTX *, int, void (*)(void))) ssl_sw[18].ptr)
+#define SSL_CTX_set_timeout (* (long (*)(SSL_CTX *, long)) ssl_sw[19].ptr)
+#define SSL_CTX_set_session_id_context \
+  (* (int (*)(SSL_CTX *, const unsigned char *, unsigned int)) ssl_sw[20].ptr)
+#define SSL_set_ex_data (* (int (*)(SSL *, int, void *)) ssl_sw[21].ptr)
+#define SSL_get_ex_data (* (void * (*)(const SSL *, int)) ssl_sw[22].ptr)
+#define SSL_shutdown (* (int (*)(SSL *)) ssl_sw[23].ptr)
 
 #define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
 #define CRYPTO_set_locking_callback \
@@ -336,6 +396,15 @@ struct ssl_func
   (* (void (*)(unsigned long (*)(void))) crypto_sw[2].ptr)
 #define ERR_get_error (* (unsigned long (*)(void)) crypto_sw[3].ptr)
 #define ERR_error_string (* (char * (*)(unsigned long,char *)) crypto_sw[4].ptr)
+#define RAND_bytes (* (int (*)(unsigned char *, int)) crypto_sw[5].ptr)
+#define EVP_aes_128_cbc (* (const EVP_CIPHER * (*)(void)) crypto_sw[6].ptr)
+#define EVP_EncryptInit_ex (* (int (*)(EVP_CIPHER_CTX *, const EVP_CIPHER *, \
+        ENGINE *, const unsigned char *, const unsigned char *)) crypto_sw[7].ptr)
+#define EVP_DecryptInit_ex (* (int (*)(EVP_CIPHER_CTX *, const EVP_CIPHER *, \
+        ENGINE *, const unsigned char *, const unsigned char *)) crypto_sw[8].ptr)
+#define EVP_sha256 (* (const EVP_MD * (*)(void)) crypto_sw[9].ptr)
+#define HMAC_Init_ex (* (int (*)(HMAC_CTX *, const void *, int, \
+        const EVP_MD *, ENGINE *)) crypto_sw[10].ptr)
 
 // set_ssl_option() function updates this array.
 // It loads SSL library dynamically and changes NULLs to the actual addresses
@@ -360,6 +429,13 @@ static struct ssl_func ssl_sw[] =
     {"SSL_CTX_free",  NULL},
     {"SSL_load_error_strings", NULL},
     {"SSL_CTX_use_certificate_chain_file", NULL},
+    {"SSL_CTX_ctrl", NULL},
+    {"SSL_CTX_callback_ctrl", NULL},
+    {"SSL_CTX_set_timeout", NULL},
+    {"SSL_CTX_set_session_id_context", NULL},
+    {"SSL_set_ex_data", NULL},
+    {"SSL_get_ex_data", NULL},
+    {"SSL_shutdown", NULL},
     {NULL,    NULL}
 };
 
@@ -371,6 +447,12 @@ static struct ssl_func crypto_sw[] =
     {"CRYPTO_set_id_callback", NULL},
     {"ERR_get_error",  NULL},
     {"ERR_error_string", NULL},
+    {"RAND_bytes", NULL},
+    {"EVP_aes_128_cbc", NULL},
+    {"EVP_EncryptInit_ex", NULL},
+    {"EVP_DecryptInit_ex", NULL},
+    {"EVP_sha256", NULL},
+    {"HMAC_Init_ex", NULL},
     {NULL,    NULL}
 };
 #endif // NO_SSL_DL
@@ -399,6 +481,24 @@ struct vec
     size_t len;
 };
 
+// Request-scoped bump allocator. The first block is carved out of the
+// connection allocation; requests that outgrow it chain malloc()-ed blocks,
+// which are released when the arena is reset before the next request.
+struct mg_arena_block
+{
+    struct mg_arena_block *next;
+};
+
+struct mg_arena
+{
+    char *first;                  // Block owned by the connection
+    size_t first_size;            // Size of the first block
+    char *cur;                    // Block allocations are taken from
+    size_t size;                  // Size of the current block
+    size_t used;                  // Bytes taken from the current block
+    struct mg_arena_block *extra; // Overflow blocks
+};
+
 // Structure used by mg_stat() function. Uses 64 bit file length.
 struct mgstat
 {
@@ -418,6 +518,40 @@ struct socket
     int is_ssl;           // Is socket SSL-ed
 };
 
+// State of a suspended (asynchronous) request. A request starts PENDING;
+// whoever moves it out of PENDING first - the thread that completes it, or
+// the async thread on timeout, disconnect or shutdown - owns the connection
+// until the request is over.
+enum
+{
+    ASYNC_PENDING, ASYNC_COMPLETING, ASYNC_DONE, ASYNC_CANCELLED
+};
+
+struct mg_async
+{
+    struct mg_context *ctx;
+    struct mg_connection *conn;  // Suspended connection, NULL once detached
+    mg_async_callback_t callback;
+    void *callback_arg;
+    int64_t deadline;            // Millisecond time of the timeout, 0 if none
+    int state;                   // ASYNC_*
+    enum mg_async_status reason; // Why the request was cancelled
+    int refs;                    // Held by the user and by the connection
+    int parked;                  // Worker has let go of the connection
+    int peeked;                  // Client sent more data, can't watch for EOF
+    struct mg_async *prev;       // Linkage in the suspended list
+    struct mg_async *next;       // Linkage in the suspended list or queues
+};
+
+// How the request body is framed, and how far it has been read
+enum
+{
+    BODY_LENGTH,   // Content-Length, or no body at all
+    BODY_CHUNKED,  // Chunked, more chunks to come
+    BODY_DONE,     // Chunked, last chunk and trailers read
+    BODY_BROKEN    // Malformed, or the client went away mid-body
+};
+
 enum
 {
     CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
@@ -427,7 +561,9 @@ enum
     ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
     EXTRA_MIME_TYPES, LISTENING_PORTS,
     DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, RUN_AS_USER, REWRITE,
-    NUM_OPTIONS
+    REQUEST_ARENA_SIZE, LOG_BUFFER_SIZE, FASTCGI_PATTERN, FASTCGI_PROCESSES,
+    SSL_SESSION_CACHE_SIZE, SSL_SESSION_TIMEOUT, WEBSOCKET_BUFFER_SIZE,
+    ENABLE_WEBSOCKET, NUM_OPTIONS
 };
 
 static const char *config_options[] =
@@ -455,10 +591,29 @@ static const char *config_options[] =
     "t", "num_threads", "10",
     "u", "run_as_user", NULL,
     "w", "url_rewrite_patterns", NULL,
+    "A", "request_arena_size", "8192",
+    "B", "log_buffer_size", "262144",
+    "f", "fastcgi_pattern", NULL,
+    "F", "fastcgi_processes", "4",
+    "z", "ssl_session_cache_size", "20480",
+    "T", "ssl_session_timeout", "300",
+    "W", "websocket_buffer_size", "4194304",
+    "o", "enable_websocket", "no",
     NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
 
+#define AUTH_FILE_BUCKETS 64  // Hash size of the passwords file cache
+
+// TLS session ticket encryption key
+struct ssl_ticket_key
+{
+    unsigned char name[16];
+    unsigned char aes_key[16];
+    unsigned char hmac_key[16];
+    time_t created;               // 0 if the key is not set
+};
+
 struct mg_context
 {
     volatile int stop_flag;       // Should we stop event loop
@@ -468,6 +623,17 @@ struct mg_context
     void *user_data;              // User-defined data
 
     struct socket *listening_sockets;
+    struct acl *acl;              // Compiled access_control_list
+
+    pthread_mutex_t ticket_mutex;         // Protects ticket_keys
+    struct ssl_ticket_key ticket_keys[2]; // Current and previous key
+
+    pthread_mutex_t fcgi_mutex;   // Protects the FastCGI pools
+    struct fcgi_pool *fcgi_pools;
+
+    pthread_mutex_t auth_mutex;   // Protects the passwords file cache
+    struct auth_file *auth_files[AUTH_FILE_BUCKETS];
+    int num_auth_files;
 
     volatile int num_threads;  // Number of threads
     pthread_mutex_t mutex;     // Protects (max|num)_threads
@@ -476,8 +642,34 @@ struct mg_context
     struct socket queue[20];   // Accepted sockets
     volatile int sq_head;      // Head of the socket queue
     volatile int sq_tail;      // Tail of the socket queue
-    pthread_cond_t sq_full;    // Singaled when socket is produced
+    pthread_cond_t sq_full;    // Singaled when socket (or resumed request) is produced
     pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+    struct mg_connection *idle_conns; // Recycled connection structures
+    int num_idle_conns;               // Length of the idle_conns list
+    struct mg_async *suspended;       // Parked asynchronous requests
+    struct mg_async *resumed;         // Completed asynchronous requests,
+    struct mg_async *resumed_tail;    // waiting for a worker to continue
+    int num_async;                    // Requests suspended and not over yet
+
+    pthread_mutex_t ws_mutex;         // Guards the fields below
+    struct mg_websocket *ws_new;      // Upgraded, not yet taken by the thread
+    SOCKET ws_wakeup[2];              // Wakes up the WebSocket thread
+    int ws_woken;                     // A wakeup byte is on its way
+    int ws_running;                   // WebSocket thread takes connections
+
+    pthread_mutex_t log_mutex;        // Guards log_rings and log_shared
+    struct log_ring *log_rings;       // Rings drained by the log writer
+    struct log_ring *log_shared;      // Ring of threads that have none
+    volatile int log_running;         // Log writer thread is up
+    volatile int log_stop;            // Log writer should drain and exit
+    volatile int log_reopen;          // Log files should be reopened
+#if !defined(_WIN32)
+    int log_sigusr1_set;              // Our SIGUSR1 handler is installed
+    void (*log_old_sigusr1)(int);     // Handler to restore in mg_stop()
+#endif // !_WIN32
+    volatile int64_t log_records;     // Records written by the log writer
+    volatile int64_t log_bytes;       // Bytes written by the log writer
 };
 
 struct mg_connection
@@ -490,12 +682,21 @@ struct mg_connection
     int64_t num_bytes_sent;     // Total bytes sent to client
     int64_t content_len;        // Content-Length header value
     int64_t consumed_content;   // How many bytes of content is already read
+    int64_t chunk_left;         // Bytes left in the current body chunk
     char *buf;                  // Buffer for received data
+    struct mg_arena arena;      // Per-request allocations
     char *path_info;            // PATH_INFO part of the URL
     int must_close;             // 1 if connection must be closed
     int buf_size;               // Buffer size
     int request_len;            // Size of the request + headers in a buffer
     int data_len;               // Total size of data in a buffer
+    int body_state;             // BODY_*
+    int body_offset;            // Chunked body bytes taken from the buffer
+    int continue_sent;          // "100 Continue" has been sent
+    struct mg_async *async;     // Suspended request, if any
+    struct mg_websocket *ws;    // Upgraded to a WebSocket, if any
+    struct mg_connection *next; // Linkage in the idle list
+    struct log_ring *log_ring;  // Log ring of the thread serving it
 };
 
 const char **mg_get_valid_option_names(void)
@@ -558,50 +759,213 @@ static void sockaddr_to_string(char *buf, size_t len,
 #endif
 }
 
-// Print error message to the opened error log stream.
+// Log records are formatted by the thread that logs them and queued in a
+// ring buffer owned by that thread. The log writer thread drains the rings
+// and writes the log files in large batches, so request handling never waits
+// for the disk. A ring has one producer and one consumer: head is only
+// advanced by the owner, tail only by the writer, and no lock is needed.
+// Threads without a ring of their own share ctx->log_shared, taking turns
+// under ctx->log_mutex.
+#define LOG_RECORD_ERROR 0x80000000U  // Record header bit: goes to error log
+#define LOG_MAX_WAIT_MSEC 10          // How long a full ring holds up a thread
+#define LOG_FLUSH_MSEC 50             // Log writer pass interval
+#define LOG_OUTPUT_SIZE 65536         // Log writer batch size, per log file
+
+struct log_ring
+{
+    struct log_ring *next;      // Linkage in ctx->log_rings
+    unsigned long owner;        // Producing thread
+    char *buf;
+    size_t size;                // Power of two
+    volatile size_t head;       // Advanced by the owner
+    volatile size_t tail;       // Advanced by the log writer
+    volatile int64_t dropped;   // Records that did not fit in time
+    volatile int64_t waits;     // Times the owner waited for room
+    time_t date_time;           // Access log time stamp cache
+    char date[64];
+};
+
+#if !defined(_WIN32)
+// Bumped by the SIGUSR1 handler, log writers reopen the files when it changes
+static volatile sig_atomic_t log_reopen_signals;
+
+static void log_reopen_signal_handler(int sig_num)
+{
+    (void) sig_num;
+    log_reopen_signals++;
+}
+#endif // !_WIN32
+
+static struct log_ring *log_ring_new(struct mg_context *ctx)
+{
+    struct log_ring *ring;
+    size_t size = 4096, wanted = (size_t) atoi(ctx->config[LOG_BUFFER_SIZE]);
+
+    while (size < wanted)
+    {
+        size <<= 1;
+    }
+    if ((ring = (struct log_ring *) calloc(1, sizeof(*ring) + size)) != NULL)
+    {
+        ring->buf = (char *) (ring + 1);
+        ring->size = size;
+        ring->owner = (unsigned long) pthread_self();
+
+        (void) pthread_mutex_lock(&ctx->log_mutex);
+        ring->next = ctx->log_rings;
+        ctx->log_rings = ring;
+        (void) pthread_mutex_unlock(&ctx->log_mutex);
+    }
+    return ring;
+}
+
+static void log_ring_copy_in(struct log_ring *ring, size_t pos,
+                             const void *data, size_t len)
+{
+    size_t off = pos & (ring->size - 1), n = ring->size - off;
+
+    n = n < len ? n : len;
+    memcpy(ring->buf + off, data, n);
+    memcpy(ring->buf, (const char *) data + n, len - n);
+}
+
+static void log_ring_copy_out(const struct log_ring *ring, size_t pos,
+                              void *data, size_t len)
+{
+    size_t off = pos & (ring->size - 1), n = ring->size - off;
+
+    n = n < len ? n : len;
+    memcpy(data, ring->buf + off, n);
+    memcpy((char *) data + n, ring->buf, len - n);
+}
+
+// Queue a record. A full ring holds the thread up for a few milliseconds
+// to let the writer catch up, then the record is dropped and counted.
+// mutex, if not NULL, is held by the caller and released while waiting.
+static void log_ring_push(struct log_ring *ring, pthread_mutex_t *mutex,
+                          int is_error, const char *data, size_t len)
+{
+    uint32_t header = (uint32_t) len | (is_error ? LOG_RECORD_ERROR : 0);
+    size_t total = sizeof(header) + len;
+    int waited = 0;
+
+    while (total > ring->size - (ring->head - ring->tail))
+    {
+        if (waited == 0)
+        {
+            ring->waits++;
+        }
+        if (total > ring->size || waited++ == LOG_MAX_WAIT_MSEC)
+        {
+            ring->dropped++;
+            return;
+        }
+        if (mutex != NULL)
+        {
+            (void) pthread_mutex_unlock(mutex);
+        }
+        mg_sleep(1);
+        if (mutex != NULL)
+        {
+            (void) pthread_mutex_lock(mutex);
+        }
+    }
+
+    log_ring_copy_in(ring, ring->head, &header, sizeof(header));
+    log_ring_copy_in(ring, ring->head + sizeof(header), data, len);
+    mg_memory_barrier();  // Record must be in place before head moves past it
+    ring->head += total;
+}
+
+// Ring the calling thread owns, or NULL
+static struct log_ring *own_log_ring(const struct mg_connection *conn)
+{
+    return conn->log_ring != NULL &&
+           conn->log_ring->owner == (unsigned long) pthread_self() ?
+           conn->log_ring : NULL;
+}
+
+// Hand a formatted record to the log writer. If there is none (mg_start()
+// has not started it yet, or it has finished), append to the file directly.
+static void log_record(const struct mg_connection *conn, int is_error,
+                       const char *data, size_t len)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct log_ring *ring;
+    FILE *fp;
+
+    if (ctx->log_running)
+    {
+        if ((ring = own_log_ring(conn)) != NULL)
+        {
+            log_ring_push(ring, NULL, is_error, data, len);
+        }
+        else
+        {
+            (void) pthread_mutex_lock(&ctx->log_mutex);
+            log_ring_push(ctx->log_shared, &ctx->log_mutex, is_error,
+                          data, len);
+            (void) pthread_mutex_unlock(&ctx->log_mutex);
+        }
+    }
+    else if ((fp = mg_fopen(ctx->config[is_error ? ERROR_LOG_FILE :
+                                        ACCESS_LOG_FILE], "a+")) != NULL)
+    {
+        flockfile(fp);
+        (void) fwrite(data, 1, len, fp);
+        funlockfile(fp);
+        fclose(fp);
+    }
+}
+
+// Append formatted text to a log record of the given size, truncating it
+// if it does not fit. Unlike mg_snprintf(), does not log truncation.
+static int log_printf(char *buf, int size, int len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+
+    // Windows' vsnprintf() returns -1 on truncation
+    return n < 0 || n >= size - len ? size - 1 : len + n;
+}
+
+// Print error message to the error log.
 static void cry(struct mg_connection *conn, const char *fmt, ...)
 {
-    char buf[BUFSIZ], src_addr[20];
+    char buf[BUFSIZ], record[BUFSIZ + 256], src_addr[20];
     va_list ap;
-    FILE *fp;
-    time_t timestamp;
+    int len;
 
     va_start(ap, fmt);
     (void) vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
+    buf[sizeof(buf) - 1] = '\0';
 
     // Do not lock when getting the callback value, here and below.
     // I suppose this is fine, since function cannot disappear in the
     // same way string option can.
     conn->request_info.log_message = buf;
-    if (call_user(conn, MG_EVENT_LOG) == NULL)
+    if (call_user(conn, MG_EVENT_LOG) == NULL &&
+            conn->ctx->config[ERROR_LOG_FILE] != NULL)
     {
-        fp = conn->ctx->config[ERROR_LOG_FILE] == NULL ? NULL :
-             mg_fopen(conn->ctx->config[ERROR_LOG_FILE], "a+");
-
-        if (fp != NULL)
+        sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
+        // One byte is kept for the newline
+        len = log_printf(record, sizeof(record) - 1, 0,
+                         "[%010lu] [error] [client %s] ",
+                         (unsigned long) time(NULL), src_addr);
+        if (conn->request_info.request_method != NULL)
         {
-            flockfile(fp);
-            timestamp = time(NULL);
-
-            sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
-            fprintf(fp, "[%010lu] [error] [client %s] ", (unsigned long) timestamp,
-                    src_addr);
-
-            if (conn->request_info.request_method != NULL)
-            {
-                fprintf(fp, "%s %s: ", conn->request_info.request_method,
-                        conn->request_info.uri);
-            }
-
-            (void) fprintf(fp, "%s", buf);
-            fputc('\n', fp);
-            funlockfile(fp);
-            if (fp != stderr)
-            {
-                fclose(fp);
-            }
+            len = log_printf(record, sizeof(record) - 1, len, "%s %s: ",
+                             conn->request_info.request_method,
+                             conn->request_info.uri);
         }
+        len = log_printf(record, sizeof(record) - 1, len, "%s", buf);
+        record[len++] = '\n';
+        log_record(conn, 1, record, len);
     }
     conn->request_info.log_message = NULL;
 }
@@ -686,6 +1050,85 @@ static char * mg_strdup(const char *str)
     return mg_strndup(str, strlen(str));
 }
 
+#define ARENA_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static void arena_init(struct mg_arena *arena, char *buf, size_t size)
+{
+    arena->first = arena->cur = buf;
+    arena->first_size = arena->size = size;
+    arena->used = 0;
+    arena->extra = NULL;
+}
+
+// Release overflow blocks and rewind to the start of the first block.
+static void arena_reset(struct mg_arena *arena)
+{
+    struct mg_arena_block *block;
+
+    while ((block = arena->extra) != NULL)
+    {
+        arena->extra = block->next;
+        free(block);
+    }
+    arena->cur = arena->first;
+    arena->size = arena->first_size;
+    arena->used = 0;
+}
+
+static void *arena_alloc(struct mg_arena *arena, size_t len)
+{
+    struct mg_arena_block *block;
+    size_t header = ARENA_ALIGN(sizeof(*block)), block_size;
+    void *p;
+
+    len = ARENA_ALIGN(len);
+    if (arena->cur != NULL && arena->size - arena->used >= len)
+    {
+        p = arena->cur + arena->used;
+        arena->used += len;
+        return p;
+    }
+
+    // Large allocations get a block of their own, and do not replace
+    // the current block, which may still have room for small ones
+    block_size = header + (len > arena->first_size ? len : arena->first_size);
+    if ((block = (struct mg_arena_block *) malloc(block_size)) == NULL)
+    {
+        return NULL;
+    }
+    block->next = arena->extra;
+    arena->extra = block;
+    p = (char *) block + header;
+
+    if (len <= arena->first_size)
+    {
+        arena->cur = (char *) p;
+        arena->size = block_size - header;
+        arena->used = len;
+    }
+
+    return p;
+}
+
+static char *arena_strndup(struct mg_arena *arena, const char *ptr,
+                           size_t len)
+{
+    char *p;
+
+    if ((p = (char *) arena_alloc(arena, len + 1)) != NULL)
+    {
+        mg_strlcpy(p, ptr, len + 1);
+    }
+
+    return p;
+}
+
+void *mg_arena_alloc(struct mg_connection *conn, size_t len)
+{
+    // Fake connections used for logging have no arena to allocate from
+    return conn->arena.first == NULL ? NULL : arena_alloc(&conn->arena, len);
+}
+
 // Like snprintf(), but never returns negative value, or the value
 // that is larger than a supplied buffer.
 // Thanks to Adam Zeldis to pointing snprintf()-caused vulnerability
@@ -921,11 +1364,12 @@ static int should_keep_alive(const struct mg_connection *conn)
 {
     const char *http_version = conn->request_info.http_version;
     const char *header = mg_get_header(conn, "Connection");
-    return (!conn->must_close &&
-            !conn->request_info.status_code != 401 &&
-            !mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
-            (header == NULL && http_version && !strcmp(http_version, "1.1"))) ||
-           (header != NULL && !mg_strcasecmp(header, "keep-alive"));
+    // must_close wins over a "Connection: keep-alive" request header
+    return !conn->must_close &&
+           ((!conn->request_info.status_code != 401 &&
+             !mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
+             (header == NULL && http_version && !strcmp(http_version, "1.1"))) ||
+            (header != NULL && !mg_strcasecmp(header, "keep-alive")));
 }
 
 static const char *suggest_connection_header(const struct mg_connection *conn)
@@ -1592,21 +2036,181 @@ static int pull(FILE *fp, SOCKET sock, SSL *ssl, char *buf, int len)
     return nread;
 }
 
+// Tell a client that waits with "Expect: 100-continue" to go ahead and
+// send the body. Done once, when the body is first read.
+static void send_continue(struct mg_connection *conn)
+{
+    const char *expect = mg_get_header(conn, "Expect");
+
+    if (!conn->continue_sent && expect != NULL &&
+            !mg_strcasecmp(expect, "100-continue") &&
+            !strcmp(conn->request_info.http_version, "1.1"))
+    {
+        conn->continue_sent = 1;
+        (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+}
+
+// Next byte of a chunked body, or -1. Bytes come from the request buffer;
+// once that is used up, the space after the request headers is refilled
+// from the socket.
+static int body_getc(struct mg_connection *conn)
+{
+    unsigned char ch;
+    int n, room;
+
+    if (conn->request_len + conn->body_offset >= conn->data_len)
+    {
+        room = conn->buf_size - conn->request_len;
+        if (room <= 0)
+        {
+            n = pull(NULL, conn->client.sock, conn->ssl, (char *) &ch, 1);
+            return n == 1 ? ch : -1;
+        }
+        n = pull(NULL, conn->client.sock, conn->ssl,
+                 conn->buf + conn->request_len, room);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        conn->data_len = conn->request_len + n;
+        conn->body_offset = 0;
+    }
+
+    return (unsigned char) conn->buf[conn->request_len + conn->body_offset++];
+}
+
+// Read chunk data: what is buffered, or else straight from the socket into
+// the caller's buffer.
+static int read_chunk_data(struct mg_connection *conn, char *buf, int len)
+{
+    int buffered_len = conn->data_len - conn->request_len - conn->body_offset;
+
+    if (buffered_len <= 0)
+    {
+        return pull(NULL, conn->client.sock, conn->ssl, buf, len);
+    }
+    if (len > buffered_len)
+    {
+        len = buffered_len;
+    }
+    memcpy(buf, conn->buf + conn->request_len + conn->body_offset, len);
+    conn->body_offset += len;
+    return len;
+}
+
+// Read the rest of a line of a chunked body. Return its length without the
+// line ending, or -1 on error or if it is unreasonably long.
+static int read_chunk_line(struct mg_connection *conn)
+{
+    int ch, len = 0;
+
+    while ((ch = body_getc(conn)) != -1 && ch != '\n')
+    {
+        if (ch != '\r' && ++len > BUFSIZ)
+        {
+            return -1;
+        }
+    }
+
+    return ch == '\n' ? len : -1;
+}
+
+// Read a chunk header, "1f40[;extension]\r\n". Return the chunk size or -1.
+static int64_t read_chunk_size(struct mg_connection *conn)
+{
+    int64_t size = 0;
+    int ch, digits = 0;
+
+    while ((ch = body_getc(conn)) != -1 && isxdigit(ch))
+    {
+        if (++digits > 15)
+        {
+            return -1;
+        }
+        size = size * 16 + (isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10);
+    }
+
+    if (ch == '\n')
+    {
+        return digits > 0 ? size : -1;
+    }
+    return ch != -1 && digits > 0 && read_chunk_line(conn) >= 0 ? size : -1;
+}
+
+static int read_chunked_body(struct mg_connection *conn, char *buf, size_t len)
+{
+    int n, nread = 0;
+    int64_t size;
+
+    while (len > 0 && conn->body_state == BODY_CHUNKED)
+    {
+        if (conn->chunk_left == 0)
+        {
+            if ((size = read_chunk_size(conn)) < 0)
+            {
+                conn->body_state = BODY_BROKEN;
+                break;
+            }
+            if (size == 0)
+            {
+                // Last chunk. Trailers, if any, are skipped up to the empty line
+                while ((n = read_chunk_line(conn)) > 0)
+                {
+                }
+                conn->body_state = n == 0 ? BODY_DONE : BODY_BROKEN;
+                break;
+            }
+            conn->chunk_left = size;
+        }
+
+        n = (int) (len < (size_t) INT_MAX ? len : (size_t) INT_MAX);
+        if ((int64_t) n > conn->chunk_left)
+        {
+            n = (int) conn->chunk_left;
+        }
+        if ((n = read_chunk_data(conn, buf, n)) <= 0)
+        {
+            conn->body_state = BODY_BROKEN;
+            break;
+        }
+        buf += n;
+        len -= n;
+        nread += n;
+        conn->chunk_left -= n;
+        conn->consumed_content += n;
+
+        if (conn->chunk_left == 0 && read_chunk_line(conn) != 0)
+        {
+            conn->body_state = BODY_BROKEN;
+        }
+    }
+
+    return nread;
+}
+
 int mg_read(struct mg_connection *conn, void *buf, size_t len)
 {
     int n, buffered_len, nread;
     const char *buffered;
 
     assert((conn->content_len == -1 && conn->consumed_content == 0) ||
+           conn->body_state != BODY_LENGTH ||
            conn->consumed_content <= conn->content_len);
     DEBUG_TRACE(("%p %zu %lld %lld", buf, len,
                  conn->content_len, conn->consumed_content));
     nread = 0;
-    if (conn->consumed_content < conn->content_len)
+    if (len > 0 && conn->body_state == BODY_CHUNKED)
+    {
+        send_continue(conn);
+        nread = read_chunked_body(conn, (char *) buf, len);
+    }
+    else if (conn->consumed_content < conn->content_len)
     {
-
         // Adjust number of bytes to read.
         int64_t to_read = conn->content_len - conn->consumed_content;
+
+        send_continue(conn);
         if (to_read < (int64_t) len)
         {
             len = (int) to_read;
@@ -1638,6 +2242,7 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len)
             n = pull(NULL, conn->client.sock, conn->ssl, (char *) buf, (int) len);
             if (n <= 0)
             {
+                conn->body_state = BODY_BROKEN;
                 break;
             }
             buf = (char *) buf + n;
@@ -1649,6 +2254,20 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len)
     return nread;
 }
 
+int mg_body_status(const struct mg_connection *conn)
+{
+    if (conn->body_state == BODY_BROKEN)
+    {
+        return -1;
+    }
+    else if (conn->body_state == BODY_CHUNKED)
+    {
+        return 0;
+    }
+    return conn->body_state == BODY_DONE ||
+           conn->consumed_content >= conn->content_len;
+}
+
 int mg_write(struct mg_connection *conn, const void *buf, size_t len)
 {
     return (int) push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
@@ -1706,6 +2325,12 @@ static size_t url_decode(const char *src, size_t src_len, char *dst,
     return j;
 }
 
+size_t mg_url_decode(const char *src, size_t src_len, char *dst,
+                     size_t dst_len, int is_form_url_encoded)
+{
+    return url_decode(src, src_len, dst, dst_len, is_form_url_encoded);
+}
+
 // Scan given buffer and fetch the value of the given variable.
 // It can be specified in query string, or in the POST data.
 // Return NULL if the variable not found, or allocated 0-terminated value.
@@ -1848,7 +2473,9 @@ static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
 
 static int sslize(struct mg_connection *conn, int (*func)(SSL *))
 {
+    // The connection is the app data, the ticket key callback needs it
     return (conn->ssl = SSL_new(conn->ctx->ssl_ctx)) != NULL &&
+           SSL_set_ex_data(conn->ssl, 0, conn) == 1 &&
            SSL_set_fd(conn->ssl, conn->client.sock) == 1 &&
            func(conn->ssl) == 1;
 }
@@ -2315,29 +2942,256 @@ static int check_password(const char *method, const char *ha1, const char *uri,
     return mg_strcasecmp(response, expected_response) == 0;
 }
 
-// Use the global passwords file, if specified by auth_gpass option,
-// or search for .htpasswd in the requested directory.
-static FILE *open_auth_file(struct mg_connection *conn, const char *path)
+// Passwords files are parsed once into a hash table of user records, and
+// parsed again when their modification time or size changes. A cached file
+// is stat()-ed at most once a second. Missing files are cached too: most
+// directories have no .htpasswd, and every request into them looks for one.
+#define AUTH_MAX_FILES 1024      // Past that, the cache starts over
+#define AUTH_CHECK_INTERVAL 1    // Seconds between stat()s of a cached file
+
+struct auth_record
 {
-    struct mg_context *ctx = conn->ctx;
-    char name[PATH_MAX];
-    const char *p, *e;
-    struct mgstat st;
-    FILE *fp;
+    struct auth_record *next;  // Linkage in the bucket
+    uint32_t hash;             // Of user and domain
+    char *user;                // Point past the structure
+    char *domain;
+    char ha1[33];
+};
 
-    if (ctx->config[GLOBAL_PASSWORDS_FILE] != NULL)
-    {
-        // Use global passwords file
-        fp =  mg_fopen(ctx->config[GLOBAL_PASSWORDS_FILE], "r");
-        if (fp == NULL)
-            cry(fc(ctx), "fopen(%s): %s",
-                ctx->config[GLOBAL_PASSWORDS_FILE], strerror(ERRNO));
-    }
-    else if (!mg_stat(path, &st) && st.is_directory)
+struct auth_file
+{
+    struct auth_file *next;        // Linkage in the bucket
+    uint32_t hash;                 // Of path
+    char *path;                    // Points past the structure
+    int exists;
+    time_t checked;                // When the file was last stat()-ed
+    time_t loaded;                 // When the file was last parsed
+    time_t mtime;
+    int64_t size;
+    struct auth_record **records;  // Hash table of records, NULL if empty
+    uint32_t num_buckets;          // Power of two
+};
+
+// FNV-1a, continued from a previous hash. Includes the terminating nul.
+static uint32_t auth_hash(uint32_t hash, const char *s)
+{
+    do
     {
-        (void) mg_snprintf(conn, name, sizeof(name), "%s%c%s",
-                           path, DIRSEP, PASSWORDS_FILE_NAME);
-        fp = mg_fopen(name, "r");
+        hash = (hash ^ (unsigned char) *s) * 16777619U;
+    }
+    while (*s++ != '\0');
+    return hash;
+}
+
+static void free_auth_records(struct auth_file *file)
+{
+    struct auth_record *record;
+    uint32_t i;
+
+    for (i = 0; file->records != NULL && i < file->num_buckets; i++)
+    {
+        while ((record = file->records[i]) != NULL)
+        {
+            file->records[i] = record->next;
+            free(record);
+        }
+    }
+    free(file->records);
+    file->records = NULL;
+    file->num_buckets = 0;
+}
+
+static void free_auth_files(struct mg_context *ctx)
+{
+    struct auth_file *file;
+    int i;
+
+    for (i = 0; i < AUTH_FILE_BUCKETS; i++)
+    {
+        while ((file = ctx->auth_files[i]) != NULL)
+        {
+            ctx->auth_files[i] = file->next;
+            free_auth_records(file);
+            free(file);
+        }
+    }
+    ctx->num_auth_files = 0;
+}
+
+// Parse the passwords file, in the "user:domain:ha1" format
+static void load_auth_file(struct auth_file *file)
+{
+    char line[256], f_user[256], f_domain[256], ha1[256];
+    struct auth_record *list = NULL, *record;
+    uint32_t count = 0, i;
+    size_t user_len, domain_len;
+    FILE *fp;
+
+    free_auth_records(file);
+    if ((fp = mg_fopen(file->path, "r")) == NULL)
+    {
+        file->exists = 0;
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) != 3)
+        {
+            continue;
+        }
+        user_len = strlen(f_user);
+        domain_len = strlen(f_domain);
+        record = (struct auth_record *) malloc(sizeof(*record) + user_len +
+                                               domain_len + 2);
+        if (record == NULL)
+        {
+            break;
+        }
+        record->user = (char *) (record + 1);
+        record->domain = record->user + user_len + 1;
+        memcpy(record->user, f_user, user_len + 1);
+        memcpy(record->domain, f_domain, domain_len + 1);
+        mg_strlcpy(record->ha1, ha1, sizeof(record->ha1));
+        record->hash = auth_hash(auth_hash(2166136261U, f_user), f_domain);
+        record->next = list;
+        list = record;
+        count++;
+    }
+    (void) fclose(fp);
+
+    for (file->num_buckets = 16; file->num_buckets < count; )
+    {
+        file->num_buckets *= 2;
+    }
+    file->records = (struct auth_record **)
+                    calloc(file->num_buckets, sizeof(file->records[0]));
+
+    // Records were collected in reverse; put them back in file order, so the
+    // first record of a user wins, like it did with a linear scan
+    while ((record = list) != NULL)
+    {
+        list = record->next;
+        if (file->records == NULL)
+        {
+            free(record);
+            continue;
+        }
+        i = record->hash & (file->num_buckets - 1);
+        record->next = file->records[i];
+        file->records[i] = record;
+    }
+}
+
+// Look up the user in the passwords file, (re)loading it if needed.
+// Return -1 if there is no such file, 1 with ha1 filled in if the user has
+// a record, 0 otherwise. user may be NULL to check whether the file exists.
+static int find_auth_record(struct mg_context *ctx, const char *path,
+                            const char *user, char *ha1)
+{
+    const char *domain = ctx->config[AUTHENTICATION_DOMAIN];
+    struct auth_file *file;
+    struct auth_record *record;
+    struct mgstat st;
+    uint32_t hash = auth_hash(2166136261U, path);
+    time_t now = time(NULL);
+    int found = -1, exists;
+    size_t len;
+
+    (void) pthread_mutex_lock(&ctx->auth_mutex);
+    for (file = ctx->auth_files[hash % AUTH_FILE_BUCKETS]; file != NULL;
+            file = file->next)
+    {
+        if (file->hash == hash && !strcmp(file->path, path))
+        {
+            break;
+        }
+    }
+
+    if (file == NULL)
+    {
+        if (ctx->num_auth_files >= AUTH_MAX_FILES)
+        {
+            free_auth_files(ctx);
+        }
+        len = strlen(path);
+        if ((file = (struct auth_file *) calloc(1, sizeof(*file) + len + 1)) != NULL)
+        {
+            file->path = (char *) (file + 1);
+            memcpy(file->path, path, len + 1);
+            file->hash = hash;
+            file->checked = now - AUTH_CHECK_INTERVAL;
+            file->next = ctx->auth_files[hash % AUTH_FILE_BUCKETS];
+            ctx->auth_files[hash % AUTH_FILE_BUCKETS] = file;
+            ctx->num_auth_files++;
+        }
+    }
+
+    if (file != NULL && now - file->checked >= AUTH_CHECK_INTERVAL)
+    {
+        file->checked = now;
+        exists = mg_stat(path, &st) == 0 && !st.is_directory;
+        // A file modified in the second it was loaded may have changed again
+        // since without its time stamp showing it
+        if (exists != file->exists || (exists && (st.mtime != file->mtime ||
+                                       st.size != file->size ||
+                                       file->mtime >= file->loaded)))
+        {
+            file->exists = exists;
+            if (exists)
+            {
+                file->mtime = st.mtime;
+                file->size = st.size;
+                file->loaded = now;
+                load_auth_file(file);
+            }
+            else
+            {
+                free_auth_records(file);
+            }
+        }
+    }
+
+    if (file != NULL && file->exists)
+    {
+        found = 0;
+        hash = user == NULL ? 0 : auth_hash(auth_hash(2166136261U, user), domain);
+        for (record = user == NULL || file->records == NULL ? NULL :
+                      file->records[hash & (file->num_buckets - 1)];
+                record != NULL; record = record->next)
+        {
+            if (record->hash == hash && !strcmp(record->user, user) &&
+                    !strcmp(record->domain, domain))
+            {
+                memcpy(ha1, record->ha1, sizeof(record->ha1));
+                found = 1;
+                break;
+            }
+        }
+    }
+    (void) pthread_mutex_unlock(&ctx->auth_mutex);
+
+    return found;
+}
+
+// Use the global passwords file, if specified by auth_gpass option,
+// or search for .htpasswd in the requested directory.
+static void get_auth_file_name(struct mg_connection *conn, const char *path,
+                               char *name, size_t name_len)
+{
+    struct mg_context *ctx = conn->ctx;
+    const char *p, *e;
+    struct mgstat st;
+
+    if (ctx->config[GLOBAL_PASSWORDS_FILE] != NULL)
+    {
+        // Use global passwords file
+        mg_strlcpy(name, ctx->config[GLOBAL_PASSWORDS_FILE], name_len);
+    }
+    else if (!mg_stat(path, &st) && st.is_directory)
+    {
+        (void) mg_snprintf(conn, name, name_len, "%s%c%s",
+                           path, DIRSEP, PASSWORDS_FILE_NAME);
     }
     else
     {
@@ -2345,12 +3199,9 @@ static FILE *open_auth_file(struct mg_connection *conn, const char *path)
         for (p = path, e = p + strlen(p) - 1; e > p; e--)
             if (IS_DIRSEP_CHAR(*e))
                 break;
-        (void) mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
+        (void) mg_snprintf(conn, name, name_len, "%.*s%c%s",
                            (int) (e - p), p, DIRSEP, PASSWORDS_FILE_NAME);
-        fp = mg_fopen(name, "r");
     }
-
-    return fp;
 }
 
 // Parsed Authorization header
@@ -2438,7 +3289,8 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
     // CGI needs it as REMOTE_USER
     if (ah->user != NULL)
     {
-        conn->request_info.remote_user = mg_strdup(ah->user);
+        conn->request_info.remote_user =
+            arena_strndup(&conn->arena, ah->user, strlen(ah->user));
     }
     else
     {
@@ -2448,47 +3300,39 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
     return 1;
 }
 
-// Authorize against the opened passwords file. Return 1 if authorized.
-static int authorize(struct mg_connection *conn, FILE *fp)
+// Authorize against the passwords file. Return 1 if authorized, 0 if not,
+// -1 if there is no such file.
+static int authorize(struct mg_connection *conn, const char *fname)
 {
     struct ah ah;
-    char line[256], f_user[256], ha1[256], f_domain[256], buf[BUFSIZ];
+    char ha1[33], buf[BUFSIZ];
+    int parsed, found;
 
-    if (!parse_auth_header(conn, buf, sizeof(buf), &ah))
+    parsed = parse_auth_header(conn, buf, sizeof(buf), &ah);
+    found = find_auth_record(conn->ctx, fname, parsed ? ah.user : NULL, ha1);
+
+    if (found == -1)
     {
-        return 0;
+        // Unprotected, the user name means nothing
+        conn->request_info.remote_user = NULL;
     }
-
-    // Loop over passwords file
-    while (fgets(line, sizeof(line), fp) != NULL)
+    else if (found == 1)
     {
-        if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) != 3)
-        {
-            continue;
-        }
-
-        if (!strcmp(ah.user, f_user) &&
-                !strcmp(conn->ctx->config[AUTHENTICATION_DOMAIN], f_domain))
-            return check_password(
-                       conn->request_info.request_method,
-                       ha1, ah.uri, ah.nonce, ah.nc, ah.cnonce, ah.qop,
-                       ah.response);
+        return check_password(conn->request_info.request_method,
+                              ha1, ah.uri, ah.nonce, ah.nc, ah.cnonce, ah.qop,
+                              ah.response);
     }
 
-    return 0;
+    return found;
 }
 
 // Return 1 if request is authorised, 0 otherwise.
 static int check_authorization(struct mg_connection *conn, const char *path)
 {
-    FILE *fp;
     char fname[PATH_MAX];
     struct vec uri_vec, filename_vec;
     const char *list;
-    int authorized;
-
-    fp = NULL;
-    authorized = 1;
+    int authorized = -1;
 
     list = conn->ctx->config[PROTECT_URI];
     while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL)
@@ -2497,26 +3341,26 @@ static int check_authorization(struct mg_connection *conn, const char *path)
         {
             (void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
                                filename_vec.len, filename_vec.ptr);
-            if ((fp = mg_fopen(fname, "r")) == NULL)
+            if ((authorized = authorize(conn, fname)) == -1)
             {
-                cry(conn, "%s: cannot open %s: %s", __func__, fname, strerror(errno));
+                cry(conn, "%s: cannot open %s", __func__, fname);
             }
             break;
         }
     }
 
-    if (fp == NULL)
-    {
-        fp = open_auth_file(conn, path);
-    }
-
-    if (fp != NULL)
+    if (authorized == -1)
     {
-        authorized = authorize(conn, fp);
-        (void) fclose(fp);
+        get_auth_file_name(conn, path, fname, sizeof(fname));
+        if ((authorized = authorize(conn, fname)) == -1 &&
+                conn->ctx->config[GLOBAL_PASSWORDS_FILE] != NULL)
+        {
+            cry(fc(conn->ctx), "cannot open %s", fname);
+        }
     }
 
-    return authorized;
+    // No passwords file, no protection
+    return authorized != 0;
 }
 
 static void send_authorization_request(struct mg_connection *conn)
@@ -2533,19 +3377,8 @@ static void send_authorization_request(struct mg_connection *conn)
 
 static int is_authorized_for_put(struct mg_connection *conn)
 {
-    FILE *fp;
-    int ret = 0;
-
-    fp = conn->ctx->config[PUT_DELETE_PASSWORDS_FILE] == NULL ? NULL :
-         mg_fopen(conn->ctx->config[PUT_DELETE_PASSWORDS_FILE], "r");
-
-    if (fp != NULL)
-    {
-        ret = authorize(conn, fp);
-        (void) fclose(fp);
-    }
-
-    return ret;
+    return conn->ctx->config[PUT_DELETE_PASSWORDS_FILE] != NULL &&
+           authorize(conn, conn->ctx->config[PUT_DELETE_PASSWORDS_FILE]) == 1;
 }
 
 int mg_modify_passwords_file(const char *fname, const char *domain,
@@ -2807,7 +3640,8 @@ static void dir_scan_callback(struct de *de, void *data)
     }
     else
     {
-        dsd->entries[dsd->num_entries].file_name = mg_strdup(de->file_name);
+        dsd->entries[dsd->num_entries].file_name =
+            arena_strndup(&de->conn->arena, de->file_name, strlen(de->file_name));
         dsd->entries[dsd->num_entries].st = de->st;
         dsd->entries[dsd->num_entries].conn = de->conn;
         dsd->num_entries++;
@@ -2859,7 +3693,6 @@ static void handle_directory_request(struct mg_connection *conn,
     for (i = 0; i < data.num_entries; i++)
     {
         print_dir_entry(&data.entries[i]);
-        free(data.entries[i].file_name);
     }
     free(data.entries);
 
@@ -2984,6 +3817,16 @@ void mg_send_file(struct mg_connection *conn, const char *path)
     }
 }
 
+struct mg_request_info *mg_get_request_info(struct mg_connection *conn)
+{
+    return &conn->request_info;
+}
+
+void mg_set_must_close(struct mg_connection *conn)
+{
+    conn->must_close = 1;
+}
+
 
 // Parse HTTP headers from the given buffer, advance buffer to the point
 // where parsing stopped.
@@ -3123,17 +3966,20 @@ static int is_not_modified(const struct mg_connection *conn,
     return ims != NULL && stp->mtime <= parse_date_string(ims);
 }
 
-static int forward_body_data(struct mg_connection *conn, FILE *fp,
-                             SOCKET sock, SSL *ssl)
+// Receives the request body piece by piece. Returns 0 on failure.
+typedef int (*body_sink_t)(void *arg, const char *buf, int len);
+
+// Read the request body from the client and pass it on to the sink.
+static int forward_body(struct mg_connection *conn, body_sink_t sink,
+                        void *arg)
 {
     const char *expect, *buffered;
     char buf[BUFSIZ];
-    int to_read, nread, buffered_len, success = 0;
+    int to_read, nread, buffered_len, ok = 1, success = 0;
 
     expect = mg_get_header(conn, "Expect");
-    assert(fp != NULL);
 
-    if (conn->content_len == -1)
+    if (conn->content_len == -1 && conn->body_state != BODY_CHUNKED)
     {
         send_http_error(conn, 411, "Length Required", "");
     }
@@ -3141,12 +3987,23 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
     {
         send_http_error(conn, 417, "Expectation Failed", "");
     }
-    else
+    else if (conn->body_state == BODY_CHUNKED)
     {
-        if (expect != NULL)
+        // mg_read() decodes the chunks
+        while ((nread = mg_read(conn, buf, sizeof(buf))) > 0 &&
+                sink(arg, buf, nread))
+        {
+        }
+
+        success = conn->body_state == BODY_DONE;
+        if (!success)
         {
-            (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+            send_http_error(conn, 577, http_500_error, "");
         }
+    }
+    else
+    {
+        send_continue(conn);
 
         buffered = conn->buf + conn->request_len;
         buffered_len = conn->data_len - conn->request_len;
@@ -3159,11 +4016,11 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
             {
                 buffered_len = (int) conn->content_len;
             }
-            push(fp, sock, ssl, buffered, (int64_t) buffered_len);
+            ok = sink(arg, buffered, buffered_len);
             conn->consumed_content += buffered_len;
         }
 
-        while (conn->consumed_content < conn->content_len)
+        while (ok && conn->consumed_content < conn->content_len)
         {
             to_read = sizeof(buf);
             if ((int64_t) to_read > conn->content_len - conn->consumed_content)
@@ -3171,14 +4028,14 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
                 to_read = (int) (conn->content_len - conn->consumed_content);
             }
             nread = pull(NULL, conn->client.sock, conn->ssl, buf, to_read);
-            if (nread <= 0 || push(fp, sock, ssl, buf, nread) != nread)
+            if (nread <= 0 || !sink(arg, buf, nread))
             {
                 break;
             }
             conn->consumed_content += nread;
         }
 
-        if (conn->consumed_content == conn->content_len)
+        if (ok && conn->consumed_content == conn->content_len)
         {
             success = 1;
         }
@@ -3193,6 +4050,32 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
     return success;
 }
 
+// Destination of forward_body_data()
+struct push_sink
+{
+    FILE *fp;
+    SOCKET sock;
+    SSL *ssl;
+};
+
+static int push_body_data(void *arg, const char *buf, int len)
+{
+    struct push_sink *sink = (struct push_sink *) arg;
+    return push(sink->fp, sink->sock, sink->ssl, buf, (int64_t) len) == len;
+}
+
+static int forward_body_data(struct mg_connection *conn, FILE *fp,
+                             SOCKET sock, SSL *ssl)
+{
+    struct push_sink sink;
+
+    assert(fp != NULL);
+    sink.fp = fp;
+    sink.sock = sock;
+    sink.ssl = ssl;
+    return forward_body(conn, push_body_data, &sink);
+}
+
 #if !defined(NO_CGI)
 // This structure helps to create an environment for the spawned CGI program.
 // Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
@@ -3361,12 +4244,65 @@ static void prepare_cgi_environment(struct mg_connection *conn,
     assert(blk->len < (int) sizeof(blk->buf));
 }
 
-static void handle_cgi_request(struct mg_connection *conn, const char *prog)
+// Send the status line and headers made up from the headers the CGI program
+// sent, which take headers_len bytes of buf.
+static void send_cgi_headers(struct mg_connection *conn, char *buf,
+                             int headers_len)
 {
-    int headers_len, data_len, i, fd_stdin[2], fd_stdout[2];
     const char *status, *status_text;
-    char buf[BUFSIZ], *pbuf, dir[PATH_MAX], *p;
     struct mg_request_info ri;
+    char *pbuf;
+    int i;
+
+    pbuf = buf;
+    buf[headers_len - 1] = '\0';
+    parse_http_headers(&pbuf, &ri);
+
+    // Make up and send the status line
+    status_text = "OK";
+    if ((status = get_header(&ri, "Status")) != NULL)
+    {
+        conn->request_info.status_code = atoi(status);
+        status_text = status;
+        while (isdigit(* (unsigned char *) status_text) || *status_text == ' ')
+        {
+            status_text++;
+        }
+    }
+    else if (get_header(&ri, "Location") != NULL)
+    {
+        conn->request_info.status_code = 302;
+    }
+    else
+    {
+        conn->request_info.status_code = 200;
+    }
+    if (get_header(&ri, "Connection") != NULL &&
+            !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive"))
+    {
+        conn->must_close = 1;
+    }
+    // Without a length, the body ends where the connection does
+    if (get_header(&ri, "Content-Length") == NULL)
+    {
+        conn->must_close = 1;
+    }
+    (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->request_info.status_code,
+                     status_text);
+
+    // Send headers
+    for (i = 0; i < ri.num_headers; i++)
+    {
+        mg_printf(conn, "%s: %s\r\n",
+                  ri.http_headers[i].name, ri.http_headers[i].value);
+    }
+    (void) mg_write(conn, "\r\n", 2);
+}
+
+static void handle_cgi_request(struct mg_connection *conn, const char *prog)
+{
+    int headers_len, data_len, fd_stdin[2], fd_stdout[2];
+    char buf[BUFSIZ], dir[PATH_MAX], *p;
     struct cgi_env_block blk;
     FILE *in, *out;
     pid_t pid;
@@ -3440,44 +4376,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
                         data_len, buf);
         goto done;
     }
-    pbuf = buf;
-    buf[headers_len - 1] = '\0';
-    parse_http_headers(&pbuf, &ri);
-
-    // Make up and send the status line
-    status_text = "OK";
-    if ((status = get_header(&ri, "Status")) != NULL)
-    {
-        conn->request_info.status_code = atoi(status);
-        status_text = status;
-        while (isdigit(* (unsigned char *) status_text) || *status_text == ' ')
-        {
-            status_text++;
-        }
-    }
-    else if (get_header(&ri, "Location") != NULL)
-    {
-        conn->request_info.status_code = 302;
-    }
-    else
-    {
-        conn->request_info.status_code = 200;
-    }
-    if (get_header(&ri, "Connection") != NULL &&
-            !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive"))
-    {
-        conn->must_close = 1;
-    }
-    (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->request_info.status_code,
-                     status_text);
-
-    // Send headers
-    for (i = 0; i < ri.num_headers; i++)
-    {
-        mg_printf(conn, "%s: %s\r\n",
-                  ri.http_headers[i].name, ri.http_headers[i].value);
-    }
-    (void) mg_write(conn, "\r\n", 2);
+    send_cgi_headers(conn, buf, headers_len);
 
     // Send chunk of data that may be read after the headers
     conn->num_bytes_sent += mg_write(conn, buf + headers_len,
@@ -3520,12 +4419,549 @@ done:
 }
 #endif // !NO_CGI
 
-// For a given PUT path, create all intermediate subdirectories
-// for given path. Return 0 if the path itself is a directory,
-// or -1 on error, 1 if OK.
-static int put_dir(const char *path)
+#if !defined(NO_FASTCGI)
+// FastCGI applications are kept running between requests. Each script
+// matching fastcgi_pattern gets a pool of up to fastcgi_processes copies,
+// started on demand. A process gets a Unix socket to listen on as its stdin,
+// as the FastCGI specification has it, and serves one request at a time over
+// a connection that is kept open. Requests queue for a free process of the
+// pool; a process found dead is started again.
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_REQUEST_ID 1        // One request per connection at a time
+#define FCGI_QUEUE_TIMEOUT 10    // Seconds to wait for a free process
+
+struct fcgi_process
+{
+    pid_t pid;                   // 0 if not running
+    SOCKET sock;                 // Kept open connection, or INVALID_SOCKET
+    int busy;                    // Taken by a request
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+};
+
+struct fcgi_pool
 {
-    char buf[PATH_MAX];
+    struct fcgi_pool *next;      // Linkage in ctx->fcgi_pools
+    char *prog;                  // Script path, points past the structure
+    pthread_cond_t cond;         // Signaled when a process is freed
+    int num_processes;
+    struct fcgi_process *processes;
+};
+
+// Take a process off the pool of the program, creating the pool if needed.
+// Waits for one to be free, returns NULL on timeout or shutdown.
+static struct fcgi_process *fcgi_acquire(struct mg_context *ctx,
+                                         const char *prog,
+                                         struct fcgi_pool **pool_out)
+{
+    struct fcgi_pool *pool;
+    struct fcgi_process *process = NULL;
+    struct timespec deadline;
+    size_t len;
+    int i, n;
+
+    deadline.tv_sec = time(NULL) + FCGI_QUEUE_TIMEOUT;
+    deadline.tv_nsec = 0;
+
+    (void) pthread_mutex_lock(&ctx->fcgi_mutex);
+    for (pool = ctx->fcgi_pools; pool != NULL; pool = pool->next)
+    {
+        if (!strcmp(pool->prog, prog))
+        {
+            break;
+        }
+    }
+    if (pool == NULL)
+    {
+        n = atoi(ctx->config[FASTCGI_PROCESSES]);
+        n = n < 1 ? 1 : n;
+        len = strlen(prog) + 1;
+        if ((pool = (struct fcgi_pool *) calloc(1, sizeof(*pool) + len +
+                                                n * sizeof(*process))) != NULL)
+        {
+            pool->processes = (struct fcgi_process *) (pool + 1);
+            pool->prog = (char *) (pool->processes + n);
+            memcpy(pool->prog, prog, len);
+            pool->num_processes = n;
+            for (i = 0; i < n; i++)
+            {
+                pool->processes[i].sock = INVALID_SOCKET;
+            }
+            (void) pthread_cond_init(&pool->cond, NULL);
+            pool->next = ctx->fcgi_pools;
+            ctx->fcgi_pools = pool;
+        }
+    }
+
+    while (pool != NULL && process == NULL && ctx->stop_flag == 0)
+    {
+        // Prefer a running process, start another one only if all are busy
+        for (i = 0; i < pool->num_processes; i++)
+        {
+            if (!pool->processes[i].busy &&
+                    (process == NULL || process->pid == 0))
+            {
+                process = &pool->processes[i];
+            }
+        }
+        if (process == NULL &&
+                pthread_cond_timedwait(&pool->cond, &ctx->fcgi_mutex,
+                                       &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    if (process != NULL)
+    {
+        process->busy = 1;
+    }
+    (void) pthread_mutex_unlock(&ctx->fcgi_mutex);
+
+    *pool_out = pool;
+    return process;
+}
+
+static void fcgi_release(struct mg_context *ctx, struct fcgi_pool *pool,
+                         struct fcgi_process *process)
+{
+    (void) pthread_mutex_lock(&ctx->fcgi_mutex);
+    process->busy = 0;
+    (void) pthread_cond_signal(&pool->cond);
+    (void) pthread_mutex_unlock(&ctx->fcgi_mutex);
+}
+
+static void fcgi_disconnect(struct fcgi_process *process)
+{
+    if (process->sock != INVALID_SOCKET)
+    {
+        (void) closesocket(process->sock);
+        process->sock = INVALID_SOCKET;
+    }
+}
+
+static void fcgi_kill(struct fcgi_process *process)
+{
+    fcgi_disconnect(process);
+    if (process->pid != 0)
+    {
+        (void) kill(process->pid, SIGKILL);
+        process->pid = 0;
+    }
+    if (process->path[0] != '\0')
+    {
+        (void) unlink(process->path);
+        process->path[0] = '\0';
+    }
+}
+
+// Start the FastCGI program with a listening socket as its stdin
+static int fcgi_spawn(struct mg_connection *conn, const char *prog,
+                      struct fcgi_process *process)
+{
+    struct sockaddr_un sun;
+    const char *tmp, *interp;
+    char dir[PATH_MAX], *p;
+    SOCKET sock;
+    pid_t pid;
+
+    if ((tmp = getenv("TMPDIR")) == NULL)
+    {
+        tmp = "/tmp";
+    }
+    (void) mg_snprintf(conn, process->path, sizeof(process->path),
+                       "%s/mongoose-fcgi.%d.%p", tmp, (int) getpid(),
+                       (void *) process);
+    (void) unlink(process->path);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    mg_strlcpy(sun.sun_path, process->path, sizeof(sun.sun_path));
+
+    // The program runs in its own directory, like a CGI program does
+    (void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
+    if ((p = strrchr(dir, DIRSEP)) != NULL)
+    {
+        *p++ = '\0';
+    }
+    else
+    {
+        dir[0] = '.', dir[1] = '\0';
+        p = (char *) prog;
+    }
+    interp = conn->ctx->config[CGI_INTERPRETER];
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+        cry(conn, "%s: socket: %s", __func__, strerror(ERRNO));
+        return 0;
+    }
+    if (bind(sock, (struct sockaddr *) &sun, sizeof(sun)) != 0 ||
+            listen(sock, SOMAXCONN) != 0)
+    {
+        cry(conn, "%s: %s: %s", __func__, process->path, strerror(ERRNO));
+        (void) closesocket(sock);
+        return 0;
+    }
+
+    if ((pid = fork()) == -1)
+    {
+        cry(conn, "%s: fork(): %s", __func__, strerror(ERRNO));
+    }
+    else if (pid == 0)
+    {
+        // Child. Only async-signal-safe calls from here on
+        if (chdir(dir) == 0 && dup2(sock, 0) == 0)
+        {
+            if (interp == NULL)
+            {
+                (void) execl(p, p, (char *) NULL);
+            }
+            else
+            {
+                (void) execl(interp, interp, p, (char *) NULL);
+            }
+        }
+        _exit(EXIT_FAILURE);
+    }
+    (void) closesocket(sock);
+
+    if (pid == -1)
+    {
+        (void) unlink(process->path);
+        process->path[0] = '\0';
+        return 0;
+    }
+    process->pid = pid;
+    return 1;
+}
+
+// Make sure the process runs and there is a connection to it
+static int fcgi_connect(struct mg_connection *conn, const char *prog,
+                        struct fcgi_process *process)
+{
+    struct sockaddr_un sun;
+    int attempt;
+    char c;
+
+    // A kept open connection has nothing to read, unless the application
+    // closed it or went away
+    if (process->sock != INVALID_SOCKET &&
+            recv(process->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) != -1)
+    {
+        fcgi_disconnect(process);
+    }
+
+    for (attempt = 0; process->sock == INVALID_SOCKET && attempt < 2; attempt++)
+    {
+        if (process->pid == 0 || kill(process->pid, 0) != 0 || attempt > 0)
+        {
+            fcgi_kill(process);
+            if (!fcgi_spawn(conn, prog, process))
+            {
+                return 0;
+            }
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        mg_strlcpy(sun.sun_path, process->path, sizeof(sun.sun_path));
+        if ((process->sock = socket(AF_UNIX, SOCK_STREAM, 0)) != INVALID_SOCKET)
+        {
+            set_close_on_exec(process->sock);
+            if (connect(process->sock, (struct sockaddr *) &sun,
+                        sizeof(sun)) != 0)
+            {
+                fcgi_disconnect(process);
+            }
+        }
+    }
+
+    return process->sock != INVALID_SOCKET;
+}
+
+static void fcgi_header(unsigned char *h, int type, int len, int padding)
+{
+    h[0] = FCGI_VERSION_1;
+    h[1] = (unsigned char) type;
+    h[2] = (unsigned char) (FCGI_REQUEST_ID >> 8);
+    h[3] = (unsigned char) FCGI_REQUEST_ID;
+    h[4] = (unsigned char) (len >> 8);
+    h[5] = (unsigned char) len;
+    h[6] = (unsigned char) padding;
+    h[7] = 0;
+}
+
+// Send a record of up to 65535 bytes
+static int fcgi_send(SOCKET sock, int type, const char *buf, int len)
+{
+    unsigned char h[FCGI_HEADER_LEN];
+
+    fcgi_header(h, type, len, 0);
+    return push(NULL, sock, NULL, (const char *) h, sizeof(h)) == sizeof(h) &&
+           push(NULL, sock, NULL, buf, len) == len;
+}
+
+// The body may come in larger pieces than a record holds. An empty
+// record would end the stream, so len == 0 sends nothing.
+static int fcgi_send_stdin(void *arg, const char *buf, int len)
+{
+    int n;
+
+    for (; len > 0; buf += n, len -= n)
+    {
+        n = len > 65535 ? 65535 : len;
+        if (!fcgi_send(* (SOCKET *) arg, FCGI_STDIN, buf, n))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int fcgi_put_length(unsigned char *p, size_t len)
+{
+    if (len < 128)
+    {
+        p[0] = (unsigned char) len;
+        return 1;
+    }
+    p[0] = (unsigned char) ((len >> 24) | 0x80);
+    p[1] = (unsigned char) (len >> 16);
+    p[2] = (unsigned char) (len >> 8);
+    p[3] = (unsigned char) len;
+    return 4;
+}
+
+// Encode the CGI environment as FastCGI name-value pairs
+static int fcgi_encode_params(const struct cgi_env_block *blk,
+                              unsigned char *buf)
+{
+    const char *var, *eq;
+    size_t name_len, value_len;
+    int i, n = 0;
+
+    for (i = 0; (var = blk->vars[i]) != NULL; i++)
+    {
+        if ((eq = strchr(var, '=')) == NULL)
+        {
+            continue;
+        }
+        name_len = eq - var;
+        value_len = strlen(eq + 1);
+        n += fcgi_put_length(buf + n, name_len);
+        n += fcgi_put_length(buf + n, value_len);
+        memcpy(buf + n, var, name_len);
+        memcpy(buf + n + name_len, eq + 1, value_len);
+        n += (int) (name_len + value_len);
+    }
+
+    return n;
+}
+
+static int fcgi_read(SOCKET sock, char *buf, int len)
+{
+    int n, total = 0;
+
+    while (total < len &&
+            (n = pull(NULL, sock, NULL, buf + total, len - total)) > 0)
+    {
+        total += n;
+    }
+    return total == len;
+}
+
+// Relay the application's output to the client. Returns 1 when the request
+// ended properly; otherwise the connection can't be used any more.
+static int fcgi_relay_response(struct mg_connection *conn, SOCKET sock)
+{
+    unsigned char h[FCGI_HEADER_LEN];
+    char buf[BUFSIZ], data[BUFSIZ];
+    int type, len, n, padding, buf_len = 0, headers_len = 0;
+
+    for (;;)
+    {
+        if (!fcgi_read(sock, (char *) h, sizeof(h)) || h[0] != FCGI_VERSION_1)
+        {
+            break;
+        }
+        type = h[1];
+        len = (h[4] << 8) | h[5];
+        padding = h[6];
+
+        while (len > 0)
+        {
+            n = len < (int) sizeof(data) ? len : (int) sizeof(data);
+            if (!fcgi_read(sock, data, n))
+            {
+                return 0;
+            }
+            len -= n;
+
+            if (type == FCGI_STDERR)
+            {
+                cry(conn, "%.*s", n, data);
+            }
+            else if (type != FCGI_STDOUT)
+            {
+                // END_REQUEST body, application status is of no interest
+            }
+            else if (headers_len > 0)
+            {
+                conn->num_bytes_sent += mg_write(conn, data, (size_t) n);
+            }
+            else if (buf_len + n > (int) sizeof(buf))
+            {
+                send_http_error(conn, 500, http_500_error,
+                                "FastCGI program sent too large headers");
+                return 0;
+            }
+            else
+            {
+                // Buffer the output until all HTTP headers are in
+                memcpy(buf + buf_len, data, n);
+                buf_len += n;
+                if ((headers_len = get_request_len(buf, buf_len)) < 0)
+                {
+                    send_http_error(conn, 500, http_500_error,
+                                    "FastCGI program sent malformed HTTP "
+                                    "headers: [%.*s]", buf_len, buf);
+                    return 0;
+                }
+                else if (headers_len > 0)
+                {
+                    send_cgi_headers(conn, buf, headers_len);
+                    conn->num_bytes_sent +=
+                        mg_write(conn, buf + headers_len,
+                                 (size_t) (buf_len - headers_len));
+                }
+            }
+        }
+        if (padding > 0 && !fcgi_read(sock, data, padding))
+        {
+            break;
+        }
+        if (type == FCGI_END_REQUEST)
+        {
+            if (headers_len == 0)
+            {
+                send_http_error(conn, 500, http_500_error,
+                                "FastCGI program sent no HTTP headers");
+            }
+            return 1;
+        }
+    }
+
+    if (headers_len == 0)
+    {
+        send_http_error(conn, 502, "Bad Gateway",
+                        "FastCGI program closed the connection");
+    }
+    return 0;
+}
+
+static void handle_fastcgi_request(struct mg_connection *conn,
+                                   const char *prog)
+{
+    const char *method = conn->request_info.request_method;
+    unsigned char begin[8];
+    unsigned char params[CGI_ENVIRONMENT_SIZE + 8 * MAX_CGI_ENVIR_VARS];
+    struct cgi_env_block blk;
+    struct fcgi_pool *pool;
+    struct fcgi_process *process;
+    int params_len, ok;
+
+    prepare_cgi_environment(conn, prog, &blk);
+    params_len = fcgi_encode_params(&blk, params);
+
+    if ((process = fcgi_acquire(conn->ctx, prog, &pool)) == NULL)
+    {
+        send_http_error(conn, 503, "Service Unavailable",
+                        "No FastCGI process available");
+        return;
+    }
+    if (!fcgi_connect(conn, prog, process))
+    {
+        send_http_error(conn, 500, http_500_error,
+                        "Cannot start FastCGI program %s", prog);
+        fcgi_release(conn->ctx, pool, process);
+        return;
+    }
+
+    memset(begin, 0, sizeof(begin));
+    begin[1] = FCGI_RESPONDER;
+    begin[2] = FCGI_KEEP_CONN;
+
+    ok = fcgi_send(process->sock, FCGI_BEGIN_REQUEST, (char *) begin,
+                   sizeof(begin)) &&
+         fcgi_send(process->sock, FCGI_PARAMS, (char *) params, params_len) &&
+         fcgi_send(process->sock, FCGI_PARAMS, "", 0);
+    if (!ok)
+    {
+        send_http_error(conn, 502, "Bad Gateway",
+                        "Cannot send the request to the FastCGI program");
+    }
+    else if ((conn->content_len > 0 || !strcmp(method, "POST")) &&
+             !forward_body(conn, fcgi_send_stdin, &process->sock))
+    {
+        ok = 0;
+    }
+    else if (!fcgi_send(process->sock, FCGI_STDIN, "", 0))
+    {
+        send_http_error(conn, 502, "Bad Gateway",
+                        "Cannot send the request to the FastCGI program");
+        ok = 0;
+    }
+    else
+    {
+        ok = fcgi_relay_response(conn, process->sock);
+    }
+
+    // A connection in an unknown state can't be reused, and if the program
+    // died, the next request starts it again
+    if (!ok)
+    {
+        fcgi_disconnect(process);
+        if (kill(process->pid, 0) != 0)
+        {
+            fcgi_kill(process);
+        }
+    }
+    fcgi_release(conn->ctx, pool, process);
+}
+
+// Stop the FastCGI programs, called when the server stops
+static void free_fastcgi_pools(struct mg_context *ctx)
+{
+    struct fcgi_pool *pool;
+    int i;
+
+    while ((pool = ctx->fcgi_pools) != NULL)
+    {
+        ctx->fcgi_pools = pool->next;
+        for (i = 0; i < pool->num_processes; i++)
+        {
+            fcgi_kill(&pool->processes[i]);
+        }
+        (void) pthread_cond_destroy(&pool->cond);
+        free(pool);
+    }
+}
+#endif // !NO_FASTCGI
+
+// For a given PUT path, create all intermediate subdirectories
+// for given path. Return 0 if the path itself is a directory,
+// or -1 on error, 1 if OK.
+static int put_dir(const char *path)
+{
+    char buf[PATH_MAX];
     const char *s, *p;
     struct mgstat st;
     int len, res = 1;
@@ -3957,6 +5393,15 @@ static void handle_request(struct mg_connection *conn)
             send_http_error(conn, 403, "Directory Listing Denied",
                             "Directory listing denied");
         }
+#if !defined(NO_FASTCGI)
+    }
+    else if (conn->ctx->config[FASTCGI_PATTERN] != NULL &&
+             match_prefix(conn->ctx->config[FASTCGI_PATTERN],
+                          strlen(conn->ctx->config[FASTCGI_PATTERN]),
+                          path) > 0)
+    {
+        handle_fastcgi_request(conn, path);
+#endif // !NO_FASTCGI
 #if !defined(NO_CGI)
     }
     else if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
@@ -3969,6 +5414,11 @@ static void handle_request(struct mg_connection *conn)
             send_http_error(conn, 501, "Not Implemented",
                             "Method %s is not implemented", ri->request_method);
         }
+        else if (conn->body_state == BODY_CHUNKED)
+        {
+            // CGI programs need CONTENT_LENGTH to know where the body ends
+            send_http_error(conn, 411, "Length Required", "");
+        }
         else
         {
             handle_cgi_request(conn, path);
@@ -4110,118 +5560,487 @@ static int set_ports_option(struct mg_context *ctx)
     return success;
 }
 
-static void log_header(const struct mg_connection *conn, const char *header,
-                       FILE *fp)
+static int log_header(const struct mg_connection *conn, const char *header,
+                      char *buf, int size, int len)
 {
     const char *header_value;
 
     if ((header_value = mg_get_header(conn, header)) == NULL)
     {
-        (void) fprintf(fp, "%s", " -");
+        return log_printf(buf, size, len, "%s", " -");
     }
     else
     {
-        (void) fprintf(fp, " \"%s\"", header_value);
+        return log_printf(buf, size, len, " \"%s\"", header_value);
     }
 }
 
 static void log_access(const struct mg_connection *conn)
 {
     const struct mg_request_info *ri;
-    FILE *fp;
-    char date[64], src_addr[20];
-
-    fp = conn->ctx->config[ACCESS_LOG_FILE] == NULL ?  NULL :
-         mg_fopen(conn->ctx->config[ACCESS_LOG_FILE], "a+");
+    struct log_ring *ring;
+    char buf[2 * BUFSIZ], date_buf[64], src_addr[20];
+    const char *date;
+    int len;
 
-    if (fp == NULL)
+    if (conn->ctx->config[ACCESS_LOG_FILE] == NULL)
         return;
 
-    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
-             localtime(&conn->birth_time));
-
-    ri = &conn->request_info;
-    flockfile(fp);
+    // Requests of a busy thread mostly start within the same second
+    if ((ring = own_log_ring(conn)) != NULL)
+    {
+        if (ring->date[0] == '\0' || ring->date_time != conn->birth_time)
+        {
+            strftime(ring->date, sizeof(ring->date), "%d/%b/%Y:%H:%M:%S %z",
+                     localtime(&conn->birth_time));
+            ring->date_time = conn->birth_time;
+        }
+        date = ring->date;
+    }
+    else
+    {
+        strftime(date_buf, sizeof(date_buf), "%d/%b/%Y:%H:%M:%S %z",
+                 localtime(&conn->birth_time));
+        date = date_buf;
+    }
 
+    ri = &conn->request_info;
     sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
-    fprintf(fp, "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
-            src_addr, ri->remote_user == NULL ? "-" : ri->remote_user, date,
-            ri->request_method ? ri->request_method : "-",
-            ri->uri ? ri->uri : "-", ri->http_version,
-            conn->request_info.status_code, conn->num_bytes_sent);
-    log_header(conn, "Referer", fp);
-    log_header(conn, "User-Agent", fp);
-    fputc('\n', fp);
-    fflush(fp);
+    // One byte is kept for the newline
+    len = log_printf(buf, sizeof(buf) - 1, 0,
+                     "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
+                     src_addr, ri->remote_user == NULL ? "-" : ri->remote_user,
+                     date, ri->request_method ? ri->request_method : "-",
+                     ri->uri ? ri->uri : "-",
+                     ri->http_version ? ri->http_version : "-",
+                     conn->request_info.status_code, conn->num_bytes_sent);
+    len = log_header(conn, "Referer", buf, sizeof(buf) - 1, len);
+    len = log_header(conn, "User-Agent", buf, sizeof(buf) - 1, len);
+    buf[len++] = '\n';
+    log_record(conn, 0, buf, len);
+}
+
+// Batch of records for one log file
+struct log_output
+{
+    const char *path;
+    FILE *fp;
+    char *buf;
+    size_t len;
+};
+
+static void open_log_output(struct log_output *out)
+{
+    if (out->fp != NULL)
+    {
+        fclose(out->fp);
+    }
+    out->fp = out->path == NULL ? NULL : mg_fopen(out->path, "a+");
+    if (out->fp != NULL)
+    {
+        // Batches are written as they are, in one write each
+        (void) setvbuf(out->fp, NULL, _IONBF, 0);
+    }
+    else if (out->path != NULL)
+    {
+        // cry() would only queue the complaint for ourselves
+        fprintf(stderr, "Cannot open log file %s: %s\n", out->path,
+                strerror(ERRNO));
+    }
+}
 
-    funlockfile(fp);
-    fclose(fp);
+static void flush_log_output(struct mg_context *ctx, struct log_output *out)
+{
+    if (out->len > 0 && out->fp != NULL)
+    {
+        (void) fwrite(out->buf, 1, out->len, out->fp);
+        ctx->log_bytes += out->len;
+    }
+    out->len = 0;
 }
 
-static int isbyte(int n)
+static void append_log_output(struct mg_context *ctx, struct log_output *out,
+                              const char *data, size_t len)
 {
-    return n >= 0 && n <= 255;
+    if (out->len + len > LOG_OUTPUT_SIZE)
+    {
+        flush_log_output(ctx, out);
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
 }
 
-// Verify given socket address against the ACL.
-// Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, const union usa *usa)
+// Move all complete records out of the ring. Records never exceed the
+// formatting buffers of cry() and log_access(), which fit in a batch.
+static void drain_log_ring(struct mg_context *ctx, struct log_ring *ring,
+                           struct log_output *outs)
 {
-    int a, b, c, d, n, mask, allowed;
-    char flag;
-    uint32_t acl_subnet, acl_mask, remote_ip;
-    struct vec vec;
-    const char *list = ctx->config[ACCESS_CONTROL_LIST];
+    size_t head = ring->head, tail = ring->tail, len;
+    struct log_output *out;
+    uint32_t header;
 
-    if (list == NULL)
+    mg_memory_barrier();  // Read records only after reading head
+    while (tail != head)
     {
-        return 1;
+        log_ring_copy_out(ring, tail, &header, sizeof(header));
+        len = header & ~LOG_RECORD_ERROR;
+        out = &outs[header & LOG_RECORD_ERROR ? 1 : 0];
+        if (out->len + len > LOG_OUTPUT_SIZE)
+        {
+            flush_log_output(ctx, out);
+        }
+        log_ring_copy_out(ring, tail + sizeof(header), out->buf + out->len, len);
+        out->len += len;
+        tail += sizeof(header) + len;
+        ctx->log_records++;
     }
+    mg_memory_barrier();  // Done reading before handing the room back
+    ring->tail = tail;
+}
 
-    (void) memcpy(&remote_ip, &usa->sin.sin_addr, sizeof(remote_ip));
+// Writes queued log records to the access and error log files. Runs until
+// all other threads are gone, so nothing logged by them is lost.
+static void log_writer_thread(struct mg_context *ctx)
+{
+    struct log_output outs[2];  // Access log, error log
+    struct log_ring *ring, *rings;
+    int64_t dropped, dropped_reported = 0;
+    char msg[100];
+    int i, stopping;
+#if !defined(_WIN32)
+    sig_atomic_t reopen_signals = log_reopen_signals;
+#endif // !_WIN32
 
-    // If any ACL is set, deny by default
-    allowed = '-';
+    memset(outs, 0, sizeof(outs));
+    outs[0].path = ctx->config[ACCESS_LOG_FILE];
+    outs[1].path = ctx->config[ERROR_LOG_FILE];
+    for (i = 0; i < 2; i++)
+    {
+        outs[i].buf = (char *) malloc(LOG_OUTPUT_SIZE);
+        open_log_output(&outs[i]);
+    }
 
-    while ((list = next_option(list, &vec, NULL)) != NULL)
+    for (;;)
     {
-        mask = 32;
+        stopping = ctx->log_stop;
 
-        if (sscanf(vec.ptr, "%c%d.%d.%d.%d%n", &flag, &a, &b, &c, &d, &n) != 5)
+        // Rotation: whoever renamed the files wants us to start new ones
+#if !defined(_WIN32)
+        if (reopen_signals != log_reopen_signals)
         {
-            cry(fc(ctx), "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
-            return -1;
+            reopen_signals = log_reopen_signals;
+            ctx->log_reopen = 1;
         }
-        else if (flag != '+' && flag != '-')
+#endif // !_WIN32
+        if (ctx->log_reopen)
         {
-            cry(fc(ctx), "%s: flag must be + or -: [%s]", __func__, vec.ptr);
-            return -1;
+            ctx->log_reopen = 0;
+            open_log_output(&outs[0]);
+            open_log_output(&outs[1]);
         }
-        else if (!isbyte(a)||!isbyte(b)||!isbyte(c)||!isbyte(d))
+
+        // Rings are only ever added at the head of the list
+        (void) pthread_mutex_lock(&ctx->log_mutex);
+        rings = ctx->log_rings;
+        (void) pthread_mutex_unlock(&ctx->log_mutex);
+
+        dropped = 0;
+        for (ring = rings; ring != NULL; ring = ring->next)
         {
-            cry(fc(ctx), "%s: bad ip address: [%s]", __func__, vec.ptr);
-            return -1;
+            if (outs[0].buf != NULL && outs[1].buf != NULL)
+            {
+                drain_log_ring(ctx, ring, outs);
+            }
+            dropped += ring->dropped;
         }
-        else if (sscanf(vec.ptr + n, "/%d", &mask) == 0)
+        if (dropped != dropped_reported && outs[1].buf != NULL)
         {
-            // Do nothing, no mask specified
+            i = log_printf(msg, sizeof(msg), 0,
+                           "[%010lu] [warning] %" INT64_FMT
+                           " log records dropped\n", (unsigned long) time(NULL),
+                           dropped - dropped_reported);
+            append_log_output(ctx, &outs[1], msg, i);
+            dropped_reported = dropped;
         }
-        else if (mask < 0 || mask > 32)
+        flush_log_output(ctx, &outs[0]);
+        flush_log_output(ctx, &outs[1]);
+
+        if (stopping)
         {
-            cry(fc(ctx), "%s: bad subnet mask: %d [%s]", __func__, n, vec.ptr);
-            return -1;
+            break;
+        }
+        mg_sleep(LOG_FLUSH_MSEC);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        if (outs[i].fp != NULL)
+        {
+            fclose(outs[i].fp);
+        }
+        free(outs[i].buf);
+    }
+    (void) pthread_mutex_lock(&ctx->log_mutex);
+    rings = ctx->log_rings;
+    ctx->log_rings = ctx->log_shared = NULL;
+    (void) pthread_mutex_unlock(&ctx->log_mutex);
+    while ((ring = rings) != NULL)
+    {
+        rings = ring->next;
+        free(ring);
+    }
+
+    // Signal master that we're done
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->log_running = 0;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+void mg_reopen_logs(struct mg_context *ctx)
+{
+    ctx->log_reopen = 1;
+}
+
+void mg_get_log_stats(struct mg_context *ctx, struct mg_log_stats *stats)
+{
+    struct log_ring *ring;
+
+    memset(stats, 0, sizeof(*stats));
+    (void) pthread_mutex_lock(&ctx->log_mutex);
+    for (ring = ctx->log_rings; ring != NULL; ring = ring->next)
+    {
+        stats->dropped += ring->dropped;
+        stats->waits += ring->waits;
+    }
+    (void) pthread_mutex_unlock(&ctx->log_mutex);
+    stats->records = ctx->log_records;
+    stats->bytes = ctx->log_bytes;
+}
+
+static int isbyte(int n)
+{
+    return n >= 0 && n <= 255;
+}
+
+// The access control list is compiled by mg_start() into a binary trie over
+// the bits of the address. IPv4 addresses and rules are handled as IPv4-mapped
+// IPv6 ones (::ffff:x.x.x.x). All rules matching an address lie on its path
+// from the root, and the lookup keeps the one listed last, which is the one
+// that wins.
+struct acl_node
+{
+    int child[2];  // Index in acl->nodes, 0 if none - the root is no child
+    int rule;      // 1 + position in the list of the rule ending here, or 0
+    char flag;     // '+' or '-'
+};
+
+struct acl
+{
+    struct acl_node *nodes;
+    int num_nodes;
+    int max_nodes;
+};
+
+static int acl_bit(const unsigned char *addr, int i)
+{
+    return (addr[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static int acl_new_node(struct acl *acl)
+{
+    struct acl_node *nodes;
+
+    if (acl->num_nodes == acl->max_nodes)
+    {
+        acl->max_nodes = acl->max_nodes == 0 ? 64 : acl->max_nodes * 2;
+        nodes = (struct acl_node *) realloc(acl->nodes,
+                                            acl->max_nodes * sizeof(*nodes));
+        if (nodes == NULL)
+        {
+            return 0;
+        }
+        acl->nodes = nodes;
+    }
+    memset(&acl->nodes[acl->num_nodes], 0, sizeof(acl->nodes[0]));
+    return acl->num_nodes++;
+}
+
+static int acl_add(struct acl *acl, const unsigned char *addr, int bits,
+                   int rule, char flag)
+{
+    int i, node = 0, next;
+
+    for (i = 0; i < bits; i++)
+    {
+        if ((next = acl->nodes[node].child[acl_bit(addr, i)]) == 0)
+        {
+            if ((next = acl_new_node(acl)) == 0)
+            {
+                return 0;
+            }
+            acl->nodes[node].child[acl_bit(addr, i)] = next;
+        }
+        node = next;
+    }
+    acl->nodes[node].rule = rule;
+    acl->nodes[node].flag = flag;
+    return 1;
+}
+
+static void acl_free(struct acl *acl)
+{
+    if (acl != NULL)
+    {
+        free(acl->nodes);
+        free(acl);
+    }
+}
+
+// Parse one "[+|-]address[/bits]" rule into a 16 byte address
+static int acl_parse_rule(struct mg_context *ctx, const struct vec *vec,
+                          char *flag, unsigned char *addr, int *bits)
+{
+    char rule[100], *slash;
+    int a, b, c, d, n, mask, max_mask;
+
+    if (vec->len >= sizeof(rule))
+    {
+        cry(fc(ctx), "%s: rule too long: [%.*s]", __func__, (int) vec->len,
+            vec->ptr);
+        return 0;
+    }
+    memcpy(rule, vec->ptr, vec->len);
+    rule[vec->len] = '\0';
+
+    *flag = rule[0];
+    if (*flag != '+' && *flag != '-')
+    {
+        cry(fc(ctx), "%s: flag must be + or -: [%s]", __func__, rule);
+        return 0;
+    }
+
+    if ((slash = strchr(rule, '/')) != NULL)
+    {
+        *slash = '\0';
+    }
+
+    memset(addr, 0, 16);
+    if (strchr(rule, ':') == NULL)
+    {
+        if (sscanf(rule + 1, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) != 4 ||
+                rule[1 + n] != '\0')
+        {
+            cry(fc(ctx), "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
+            return 0;
+        }
+        else if (!isbyte(a)||!isbyte(b)||!isbyte(c)||!isbyte(d))
+        {
+            cry(fc(ctx), "%s: bad ip address: [%s]", __func__, rule);
+            return 0;
+        }
+        addr[10] = addr[11] = 0xff;
+        addr[12] = (unsigned char) a;
+        addr[13] = (unsigned char) b;
+        addr[14] = (unsigned char) c;
+        addr[15] = (unsigned char) d;
+        max_mask = 32;
+    }
+#if defined(USE_IPV6)
+    else if (inet_pton(AF_INET6, rule + 1, addr) == 1)
+    {
+        max_mask = 128;
+    }
+#endif // USE_IPV6
+    else
+    {
+        cry(fc(ctx), "%s: bad ip address: [%s]", __func__, rule);
+        return 0;
+    }
+
+    mask = max_mask;
+    if (slash != NULL && (sscanf(slash + 1, "%d%n", &mask, &n) != 1 ||
+                          slash[1 + n] != '\0' || mask < 0 || mask > max_mask))
+    {
+        cry(fc(ctx), "%s: bad subnet mask: [%s]", __func__, slash + 1);
+        return 0;
+    }
+    *bits = mask + 128 - max_mask;
+
+    return 1;
+}
+
+static struct acl *compile_acl(struct mg_context *ctx, const char *list)
+{
+    struct acl *acl;
+    struct vec vec;
+    unsigned char addr[16];
+    int bits, rule = 0;
+    char flag;
+
+    if ((acl = (struct acl *) calloc(1, sizeof(*acl))) == NULL ||
+            acl_new_node(acl) != 0)
+    {
+        acl_free(acl);
+        return NULL;
+    }
+
+    while ((list = next_option(list, &vec, NULL)) != NULL)
+    {
+        if (!acl_parse_rule(ctx, &vec, &flag, addr, &bits) ||
+                !acl_add(acl, addr, bits, ++rule, flag))
+        {
+            acl_free(acl);
+            return NULL;
         }
+    }
+
+    return acl;
+}
+
+// Verify given socket address against the ACL.
+// Return 0 if address is disallowed, 1 if allowed.
+static int check_acl(struct mg_context *ctx, const union usa *usa)
+{
+    const struct acl *acl = ctx->acl;
+    const struct acl_node *node;
+    unsigned char addr[16];
+    int i, next, rule = 0;
+    char flag = '-';  // If any ACL is set, deny by default
+
+    if (acl == NULL)
+    {
+        return 1;
+    }
 
-        acl_subnet = (a << 24) | (b << 16) | (c << 8) | d;
-        acl_mask = mask ? 0xffffffffU << (32 - mask) : 0;
+    memset(addr, 0, sizeof(addr));
+#if defined(USE_IPV6)
+    if (usa->sa.sa_family == AF_INET6)
+    {
+        memcpy(addr, &usa->sin6.sin6_addr, sizeof(addr));
+    }
+    else
+#endif // USE_IPV6
+    {
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &usa->sin.sin_addr, 4);
+    }
 
-        if (acl_subnet == (ntohl(remote_ip) & acl_mask))
+    for (i = 0, node = acl->nodes; ; i++)
+    {
+        if (node->rule > rule)
         {
-            allowed = flag;
+            rule = node->rule;
+            flag = node->flag;
         }
+        if (i == 128 || (next = node->child[acl_bit(addr, i)]) == 0)
+        {
+            break;
+        }
+        node = &acl->nodes[next];
     }
 
-    return allowed == '+';
+    return flag == '+';
 }
 
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd)
@@ -4292,6 +6111,78 @@ static unsigned long ssl_id_callback(void)
     return (unsigned long) pthread_self();
 }
 
+// Session tickets are encrypted with a key that is replaced every
+// ssl_session_timeout seconds; the previous key still decrypts, and tickets
+// made with it are renewed. Returns 1 if a key is set up, 2 if the ticket
+// should be renewed, 0 if it is not ours, -1 on error.
+static int ssl_ticket_key_callback(SSL *ssl, unsigned char *name,
+                                   unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                                   HMAC_CTX *hmac, int enc)
+{
+    struct mg_connection *conn = (struct mg_connection *) SSL_get_ex_data(ssl, 0);
+    struct mg_context *ctx = conn->ctx;
+    struct ssl_ticket_key key, *keys = ctx->ticket_keys;
+    time_t now = time(NULL);
+    int result = 0;
+
+    (void) pthread_mutex_lock(&ctx->ticket_mutex);
+    if (keys[0].created == 0 ||
+            now - keys[0].created >= atol(ctx->config[SSL_SESSION_TIMEOUT]))
+    {
+        key = keys[0];
+        if (RAND_bytes(keys[0].name, sizeof(keys[0].name)) == 1 &&
+                RAND_bytes(keys[0].aes_key, sizeof(keys[0].aes_key)) == 1 &&
+                RAND_bytes(keys[0].hmac_key, sizeof(keys[0].hmac_key)) == 1)
+        {
+            keys[0].created = now;
+            keys[1] = key;
+        }
+        else
+        {
+            keys[0] = key;
+        }
+    }
+    if (enc)
+    {
+        key = keys[0];
+        result = key.created != 0 ? 1 : -1;
+    }
+    else if (keys[0].created != 0 && !memcmp(name, keys[0].name, 16))
+    {
+        key = keys[0];
+        result = 1;
+    }
+    else if (keys[1].created != 0 && !memcmp(name, keys[1].name, 16))
+    {
+        key = keys[1];
+        result = 2;
+    }
+    (void) pthread_mutex_unlock(&ctx->ticket_mutex);
+
+    if (result <= 0)
+    {
+        return result;
+    }
+    else if (enc)
+    {
+        memcpy(name, key.name, 16);
+        if (RAND_bytes(iv, 16) != 1 ||
+                EVP_EncryptInit_ex(cipher, EVP_aes_128_cbc(), NULL,
+                                   key.aes_key, iv) != 1)
+        {
+            return -1;
+        }
+    }
+    else if (EVP_DecryptInit_ex(cipher, EVP_aes_128_cbc(), NULL,
+                                key.aes_key, iv) != 1)
+    {
+        return -1;
+    }
+
+    return HMAC_Init_ex(hmac, key.hmac_key, sizeof(key.hmac_key),
+                        EVP_sha256(), NULL) == 1 ? result : -1;
+}
+
 #if !defined(NO_SSL_DL)
 static int load_dll(struct mg_context *ctx, const char *dll_name,
                     struct ssl_func *sw)
@@ -4341,6 +6232,7 @@ static int set_ssl_option(struct mg_context *ctx)
     struct mg_request_info request_info;
     SSL_CTX *CTX;
     int i, size;
+    long cache_size;
     const char *pem = ctx->config[SSL_CERTIFICATE];
     const char *chain = ctx->config[SSL_CHAIN_FILE];
 
@@ -4393,6 +6285,37 @@ static int set_ssl_option(struct mg_context *ctx)
         return 0;
     }
 
+    // Returning clients resume their session instead of doing a full
+    // handshake, either from the session cache or with a session ticket.
+    // A zero size disables resumption: no cache (zero means unlimited to
+    // OpenSSL, so the cache is switched off instead) and no tickets.
+    if (CTX != NULL)
+    {
+        cache_size = atol(ctx->config[SSL_SESSION_CACHE_SIZE]);
+        (void) SSL_CTX_ctrl(CTX, SSL_CTRL_SET_SESS_CACHE_MODE, cache_size > 0 ?
+                            SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF, NULL);
+        (void) SSL_CTX_ctrl(CTX, SSL_CTRL_SET_SESS_CACHE_SIZE, cache_size, NULL);
+        (void) SSL_CTX_set_timeout(CTX, atol(ctx->config[SSL_SESSION_TIMEOUT]));
+        (void) SSL_CTX_set_session_id_context(CTX,
+                                              (const unsigned char *) "mongoose", 8);
+        if (cache_size > 0)
+        {
+            (void) SSL_CTX_callback_ctrl(CTX, SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB,
+                                         (void (*)(void)) ssl_ticket_key_callback);
+        }
+        else
+        {
+            (void) SSL_CTX_ctrl(CTX, SSL_CTRL_OPTIONS, SSL_OP_NO_TICKET, NULL);
+        }
+
+        // Idle keep-alive connections don't need to hold on to their buffers.
+        // WebSocket connections are written to without blocking: a write
+        // may complete in part, and be retried from a moved buffer.
+        (void) SSL_CTX_ctrl(CTX, SSL_CTRL_MODE, SSL_MODE_RELEASE_BUFFERS |
+                            SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, NULL);
+    }
+
     // Initialize locking callbacks, needed for thread safety.
     // http://www.openssl.org/support/faq.html#PROG1
     size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
@@ -4416,6 +6339,23 @@ static int set_ssl_option(struct mg_context *ctx)
     return 1;
 }
 
+void mg_get_ssl_stats(struct mg_context *ctx, struct mg_ssl_stats *stats)
+{
+    SSL_CTX *CTX = ctx->ssl_ctx;
+
+    memset(stats, 0, sizeof(*stats));
+    if (CTX != NULL)
+    {
+        stats->handshakes = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_ACCEPT, 0, NULL);
+        stats->completed = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_ACCEPT_GOOD, 0, NULL);
+        stats->resumed = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_HIT, 0, NULL);
+        stats->cache_misses = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_MISSES, 0, NULL);
+        stats->cache_timeouts = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_TIMEOUTS, 0, NULL);
+        stats->cache_full = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_CACHE_FULL, 0, NULL);
+        stats->cache_entries = SSL_CTX_ctrl(CTX, SSL_CTRL_SESS_NUMBER, 0, NULL);
+    }
+}
+
 static void uninitialize_ssl(struct mg_context *ctx)
 {
     int i;
@@ -4432,6 +6372,14 @@ static void uninitialize_ssl(struct mg_context *ctx)
 }
 #endif // !NO_SSL
 
+#if defined(NO_SSL)
+void mg_get_ssl_stats(struct mg_context *ctx, struct mg_ssl_stats *stats)
+{
+    (void) ctx;
+    memset(stats, 0, sizeof(*stats));
+}
+#endif // NO_SSL
+
 static int set_gpass_option(struct mg_context *ctx)
 {
     struct mgstat mgstat;
@@ -4439,191 +6387,1781 @@ static int set_gpass_option(struct mg_context *ctx)
     return path == NULL || mg_stat(path, &mgstat) == 0;
 }
 
-static int set_acl_option(struct mg_context *ctx)
-{
-    union usa fake;
-    return check_acl(ctx, &fake) != -1;
+static int set_acl_option(struct mg_context *ctx)
+{
+    if (ctx->config[ACCESS_CONTROL_LIST] == NULL)
+    {
+        return 1;
+    }
+    return (ctx->acl = compile_acl(ctx, ctx->config[ACCESS_CONTROL_LIST])) != NULL;
+}
+
+static void reset_per_request_attributes(struct mg_connection *conn)
+{
+    struct mg_request_info *ri = &conn->request_info;
+
+    // Reset request info attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port
+    ri->remote_user = ri->request_method = ri->uri = ri->http_version =
+            conn->path_info = NULL;
+    ri->num_headers = 0;
+    ri->status_code = -1;
+
+    conn->num_bytes_sent = conn->consumed_content = conn->chunk_left = 0;
+    conn->content_len = -1;
+    conn->request_len = conn->data_len = 0;
+    conn->body_state = BODY_LENGTH;
+    conn->body_offset = conn->continue_sent = 0;
+    conn->must_close = 0;
+
+    arena_reset(&conn->arena);
+}
+
+static void close_socket_gracefully(SOCKET sock)
+{
+    char buf[BUFSIZ];
+    struct linger linger;
+    int n;
+
+    // Set linger option to avoid socket hanging out after close. This prevent
+    // ephemeral port exhaust problem under high QPS.
+    linger.l_onoff = 1;
+    linger.l_linger = 1;
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *) &linger, sizeof(linger));
+
+    // Send FIN to the client
+    (void) shutdown(sock, SHUT_WR);
+    set_non_blocking_mode(sock);
+
+    // Read and discard pending data. If we do not do that and close the
+    // socket, the data in the send buffer may be discarded. This
+    // behaviour is seen on Windows, when client keeps sending data
+    // when server decide to close the connection; then when client
+    // does recv() it gets no data back.
+    do
+    {
+        n = pull(NULL, sock, NULL, buf, sizeof(buf));
+    }
+    while (n > 0);
+
+    // Now we know that our FIN is ACK-ed, safe to close
+    (void) closesocket(sock);
+}
+
+static void close_connection(struct mg_connection *conn)
+{
+    if (conn->ssl)
+    {
+        // OpenSSL drops the session from the cache unless close_notify
+        // has been sent, so the client could not resume it
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+
+    if (conn->client.sock != INVALID_SOCKET)
+    {
+        close_socket_gracefully(conn->client.sock);
+    }
+}
+
+static void discard_current_request_from_buffer(struct mg_connection *conn)
+{
+    char *buffered;
+    int buffered_len, body_len;
+
+    buffered = conn->buf + conn->request_len;
+    buffered_len = conn->data_len - conn->request_len;
+    assert(buffered_len >= 0);
+
+    if (conn->body_state != BODY_LENGTH)
+    {
+        body_len = conn->body_offset;
+    }
+    else if (conn->content_len == -1)
+    {
+        body_len = 0;
+    }
+    else if (conn->content_len < (int64_t) buffered_len)
+    {
+        body_len = (int) conn->content_len;
+    }
+    else
+    {
+        body_len = buffered_len;
+    }
+
+    // If the handler did not read all of the body, the rest is still on its
+    // way and the next request can't be told apart from it
+    if (conn->body_state == BODY_CHUNKED || conn->body_state == BODY_BROKEN ||
+            (conn->content_len > (int64_t) buffered_len &&
+             conn->consumed_content < conn->content_len))
+    {
+        conn->must_close = 1;
+    }
+
+    conn->data_len -= conn->request_len + body_len;
+    memmove(conn->buf, conn->buf + conn->request_len + body_len,
+            (size_t) conn->data_len);
+}
+
+static int is_valid_uri(const char *uri)
+{
+    // Conform to http://www.w3.org/Protocols/rfc2616/rfc2616-sec5.html#sec5.1.2
+    // URI can be an asterisk (*) or should start with slash.
+    return uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0');
+}
+
+// Wrap up a request whose response has been sent
+static void complete_request(struct mg_connection *conn)
+{
+    call_user(conn, MG_REQUEST_COMPLETE);
+    log_access(conn);
+    discard_current_request_from_buffer(conn);
+}
+
+static void notify_async(struct mg_async *async, enum mg_async_status status)
+{
+    if (async->callback != NULL)
+    {
+        async->callback(async, status, async->callback_arg);
+    }
+}
+
+// Drop the connection's reference to its suspended request
+static void detach_async(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct mg_async *async = conn->async;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    conn->async = NULL;
+    async->conn = NULL;
+    ctx->num_async--;
+    if (--async->refs == 0)
+    {
+        free(async);
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void process_new_connection(struct mg_connection *conn)
+{
+    struct mg_request_info *ri = &conn->request_info;
+    int keep_alive_enabled;
+    const char *cl, *te;
+
+    keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+
+    // A completed asynchronous request picks up where handle_request() left it
+    if (conn->async != NULL)
+    {
+        notify_async(conn->async, MG_ASYNC_COMPLETED);
+        detach_async(conn);
+        complete_request(conn);
+        if (conn->ctx->stop_flag != 0 ||
+                !keep_alive_enabled ||
+                !should_keep_alive(conn))
+        {
+            return;
+        }
+    }
+
+    do
+    {
+        reset_per_request_attributes(conn);
+
+        // If next request is not pipelined, read it in
+        if ((conn->request_len = get_request_len(conn->buf, conn->data_len)) == 0)
+        {
+            conn->request_len = read_request(NULL, conn->client.sock, conn->ssl,
+                                             conn->buf, conn->buf_size, &conn->data_len);
+        }
+        assert(conn->data_len >= conn->request_len);
+        if (conn->request_len == 0 && conn->data_len == conn->buf_size)
+        {
+            send_http_error(conn, 413, "Request Too Large", "");
+            return;
+        }
+        if (conn->request_len <= 0)
+        {
+            return;  // Remote end closed the connection
+        }
+
+        // Nul-terminate the request cause parse_http_request() uses sscanf
+        conn->buf[conn->request_len - 1] = '\0';
+        if (!parse_http_request(conn->buf, ri) || !is_valid_uri(ri->uri))
+        {
+            // Do not put garbage in the access log, just send it back to the client
+            send_http_error(conn, 400, "Bad Request",
+                            "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
+        }
+        else if (strcmp(ri->http_version, "1.0") &&
+                 strcmp(ri->http_version, "1.1"))
+        {
+            // Request seems valid, but HTTP version is strange
+            send_http_error(conn, 505, "HTTP version not supported", "");
+            log_access(conn);
+        }
+        else if ((te = get_header(ri, "Transfer-Encoding")) != NULL &&
+                 mg_strcasecmp(te, "chunked") && mg_strcasecmp(te, "identity"))
+        {
+            // There is no telling where such a body ends
+            conn->must_close = 1;
+            send_http_error(conn, 501, "Not Implemented",
+                            "Transfer-Encoding %s is not supported", te);
+            log_access(conn);
+        }
+        else
+        {
+            // Request is valid, handle it. A chunked body has no length, and
+            // Content-Length must be ignored if both are present
+            cl = get_header(ri, "Content-Length");
+            conn->content_len = cl == NULL ? -1 : strtoll(cl, NULL, 10);
+            if (te != NULL && !mg_strcasecmp(te, "chunked"))
+            {
+                conn->content_len = -1;
+                conn->body_state = BODY_CHUNKED;
+            }
+            conn->birth_time = time(NULL);
+            handle_request(conn);
+            if (conn->async != NULL)
+            {
+                return;  // Suspended, the response is sent later
+            }
+            if (conn->ws != NULL)
+            {
+                // Upgraded, the connection is no longer HTTP
+                call_user(conn, MG_REQUEST_COMPLETE);
+                log_access(conn);
+                return;
+            }
+            complete_request(conn);
+        }
+    }
+    while (conn->ctx->stop_flag == 0 &&
+            keep_alive_enabled &&
+            should_keep_alive(conn));
+}
+
+// Connection structures are pooled. A connection, its request buffer and the
+// first arena block share a single allocation, which is reused for every
+// socket and every keep-alive request it serves.
+// Must be called with ctx->mutex held.
+static struct mg_connection *get_connection(struct mg_context *ctx)
+{
+    struct mg_connection *conn;
+    int buf_size;
+    size_t arena_size;
+
+    if ((conn = ctx->idle_conns) != NULL)
+    {
+        ctx->idle_conns = conn->next;
+        ctx->num_idle_conns--;
+        return conn;
+    }
+
+    buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
+    arena_size = ARENA_ALIGN((size_t) atoi(ctx->config[REQUEST_ARENA_SIZE]));
+    conn = (struct mg_connection *) calloc(1, ARENA_ALIGN(sizeof(*conn)) +
+                                           arena_size + buf_size);
+    if (conn != NULL)
+    {
+        arena_init(&conn->arena, (char *) conn + ARENA_ALIGN(sizeof(*conn)),
+                   arena_size);
+        conn->buf_size = buf_size;
+        conn->buf = conn->arena.first + arena_size;
+        conn->ctx = ctx;
+    }
+    return conn;
+}
+
+// Return a closed connection to the pool. As many structures are kept as
+// there are threads, extra ones (left over from a burst of suspended
+// requests) are freed.
+static void put_connection(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+
+    arena_reset(&conn->arena);
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (ctx->num_idle_conns < ctx->num_threads)
+    {
+        conn->next = ctx->idle_conns;
+        ctx->idle_conns = conn;
+        ctx->num_idle_conns++;
+        conn = NULL;
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free(conn);
+}
+
+// Milliseconds since the epoch
+static int64_t get_msec(void)
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return (int64_t) ((((uint64_t) ft.dwHighDateTime << 32) |
+                       ft.dwLowDateTime) / 10000);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif // _WIN32
+}
+
+// Take a parked request off the suspended list. Must be called with
+// ctx->mutex held.
+static void unlink_async(struct mg_async *async)
+{
+    struct mg_context *ctx = async->ctx;
+
+    if (async->prev != NULL)
+    {
+        async->prev->next = async->next;
+    }
+    else
+    {
+        ctx->suspended = async->next;
+    }
+    if (async->next != NULL)
+    {
+        async->next->prev = async->prev;
+    }
+    async->prev = async->next = NULL;
+    async->parked = 0;
+}
+
+// Answer (or just drop) a request that went to ASYNC_CANCELLED, and close
+// its connection. The caller owns the connection at this point.
+static void cancel_async(struct mg_async *async)
+{
+    struct mg_connection *conn = async->conn;
+
+    notify_async(async, async->reason);
+    conn->must_close = 1;
+    if (async->reason == MG_ASYNC_TIMEOUT)
+    {
+        send_http_error(conn, 504, "Gateway Timeout", "%s",
+                        "Request timed out");
+    }
+    else if (async->reason == MG_ASYNC_SHUTDOWN)
+    {
+        send_http_error(conn, 503, "Service Unavailable", "%s",
+                        "Server is shutting down");
+    }
+    detach_async(conn);
+    call_user(conn, MG_REQUEST_COMPLETE);
+    log_access(conn);
+    close_connection(conn);
+    put_connection(conn);
+}
+
+// Called by the worker after the handler has suspended the request.
+// Returns 1 if the connection has been parked and no longer belongs to the
+// worker, 0 if the request has been completed meanwhile and the worker goes
+// on serving the connection.
+static int park_connection(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct mg_async *async = conn->async;
+    int parked = 1;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (async->state == ASYNC_DONE)
+    {
+        parked = 0;
+    }
+    else
+    {
+        async->parked = 1;
+        async->prev = NULL;
+        async->next = ctx->suspended;
+        if (ctx->suspended != NULL)
+        {
+            ctx->suspended->prev = async;
+        }
+        ctx->suspended = async;
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    return parked;
+}
+
+static void attach_websocket(struct mg_connection *);
+
+// Serve requests on the connection until it is closed, until a request is
+// suspended and the connection gets parked, or until it is upgraded to a
+// WebSocket.
+static void serve_connection(struct mg_connection *conn)
+{
+    for (;;)
+    {
+        process_new_connection(conn);
+        if (conn->ws != NULL)
+        {
+            attach_websocket(conn);
+            return;
+        }
+        if (conn->async == NULL)
+        {
+            close_connection(conn);
+            put_connection(conn);
+            return;
+        }
+        if (park_connection(conn))
+        {
+            return;
+        }
+    }
+}
+
+struct mg_async *mg_suspend(struct mg_connection *conn, int timeout_ms,
+                            mg_async_callback_t callback, void *arg)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct mg_async *async;
+
+    if (conn->async != NULL ||
+            (async = (struct mg_async *) calloc(1, sizeof(*async))) == NULL)
+    {
+        return NULL;
+    }
+
+    async->ctx = ctx;
+    async->conn = conn;
+    async->callback = callback;
+    async->callback_arg = arg;
+    async->deadline = timeout_ms > 0 ? get_msec() + timeout_ms : 0;
+    async->state = ASYNC_PENDING;
+    async->refs = 2;
+    conn->async = async;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_async++;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    return async;
+}
+
+struct mg_connection *mg_resume_begin(struct mg_async *async)
+{
+    struct mg_connection *conn = NULL;
+
+    (void) pthread_mutex_lock(&async->ctx->mutex);
+    if (async->state == ASYNC_PENDING)
+    {
+        async->state = ASYNC_COMPLETING;
+        conn = async->conn;
+    }
+    (void) pthread_mutex_unlock(&async->ctx->mutex);
+
+    return conn;
+}
+
+void mg_resume_end(struct mg_async *async)
+{
+    struct mg_context *ctx = async->ctx;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (async->state == ASYNC_COMPLETING)
+    {
+        async->state = ASYNC_DONE;
+
+        // If the worker still holds the connection, park_connection() sees
+        // ASYNC_DONE and carries on. Otherwise queue it for a worker (or for
+        // the async thread, once the server is stopping).
+        if (async->parked)
+        {
+            unlink_async(async);
+            if (ctx->resumed_tail != NULL)
+            {
+                ctx->resumed_tail->next = async;
+            }
+            else
+            {
+                ctx->resumed = async;
+            }
+            ctx->resumed_tail = async;
+            (void) pthread_cond_signal(&ctx->sq_full);
+        }
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+void mg_async_release(struct mg_async *async)
+{
+    struct mg_context *ctx = async->ctx;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (--async->refs == 0)
+    {
+        free(async);
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// WebSocket connections (RFC 6455). Once the handshake is answered, the
+// connection leaves its worker for the WebSocket thread, which watches all
+// of them with one poll(): it reads and unmasks frames, hands complete
+// messages to the callback, and sends what mg_websocket_send() queued.
+// Frames queued between two passes of the thread leave in a single write.
+#define WS_CLOSE_MSEC 3000  // How long to wait for the client's close frame
+
+enum { WS_OPEN, WS_CLOSING, WS_CLOSED };
+
+enum
+{
+    WS_CONTINUATION = 0, WS_TEXT = 1, WS_BINARY = 2,
+    WS_CLOSE = 8, WS_PING = 9, WS_PONG = 10
+};
+
+struct mg_websocket
+{
+    struct mg_context *ctx;
+    mg_websocket_callback_t callback;
+    void *callback_arg;
+    size_t limit;               // websocket_buffer_size
+
+    pthread_mutex_t mutex;      // Guards the fields up to out_size
+    struct mg_connection *conn; // NULL once closed
+    int refs;                   // Held by the user and by the WebSocket thread
+    int state;                  // WS_*
+    int overflow;               // Send queue is full, drop the client
+    int close_received;         // No more frames to read
+    int64_t close_deadline;     // When to stop waiting for the close frame
+    char *out;                  // Frames waiting to be sent, from out_sent
+    size_t out_sent, out_len, out_size;
+
+    // Used by the WebSocket thread only
+    char *in;                   // Received data, follows the structure
+    int in_len, in_size;
+    int in_frame;               // Frame header read, payload follows
+    int fin, opcode;            // Of the current frame
+    unsigned char mask[4];
+    uint64_t frame_left;        // Payload bytes still to come
+    size_t mask_pos;            // Payload bytes unmasked so far
+    char *msg;                  // Fragmented message being assembled
+    size_t msg_len, msg_size;
+    int msg_opcode;             // WS_TEXT or WS_BINARY while assembling
+    char ctrl[125];             // Control frame payload
+    size_t ctrl_len;
+    int more_input;             // Input may be waiting without the socket
+                                // being readable
+    int dead;                   // Drop on the next pass
+    struct mg_websocket *next;
+};
+
+// SHA-1 (RFC 3174), for Sec-WebSocket-Accept only
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                     0xC3D2E1F0};
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    uint64_t bits = (uint64_t) len * 8;
+    unsigned char block[64];
+    size_t i, j, pos, blocks = (len + 8) / 64 + 1;
+
+    for (i = 0; i < blocks; i++)
+    {
+        // Block i of the message, padded with 0x80, zeros and the bit length
+        for (j = 0; j < 64; j++)
+        {
+            pos = i * 64 + j;
+            block[j] = pos < len ? data[pos] : pos == len ? 0x80 : 0;
+        }
+        if (i == blocks - 1)
+        {
+            for (j = 0; j < 8; j++)
+            {
+                block[56 + j] = (unsigned char) (bits >> (56 - 8 * j));
+            }
+        }
+
+        for (j = 0; j < 16; j++)
+        {
+            w[j] = (uint32_t) block[j * 4] << 24 | (uint32_t) block[j * 4 + 1] << 16 |
+                   (uint32_t) block[j * 4 + 2] << 8 | block[j * 4 + 3];
+        }
+        for (j = 16; j < 80; j++)
+        {
+            t = w[j - 3] ^ w[j - 8] ^ w[j - 14] ^ w[j - 16];
+            w[j] = t << 1 | t >> 31;
+        }
+
+        a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (j = 0; j < 80; j++)
+        {
+            if (j < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (j < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (j < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            t = (a << 5 | a >> 27) + f + e + k + w[j];
+            e = d, d = c, c = b << 30 | b >> 2, b = a, a = t;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    }
+
+    for (i = 0; i < 20; i++)
+    {
+        digest[i] = (unsigned char) (h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+static void base64_encode(const unsigned char *src, int src_len, char *dst)
+{
+    static const char *b64 =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, j = 0, a, b, c;
+
+    for (i = 0; i < src_len; i += 3)
+    {
+        a = src[i];
+        b = i + 1 < src_len ? src[i + 1] : 0;
+        c = i + 2 < src_len ? src[i + 2] : 0;
+        dst[j++] = b64[a >> 2];
+        dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
+        dst[j++] = i + 1 < src_len ? b64[((b & 15) << 2) | (c >> 6)] : '=';
+        dst[j++] = i + 2 < src_len ? b64[c & 63] : '=';
+    }
+    dst[j] = '\0';
+}
+
+// Text messages must be UTF-8: no overlong forms, no surrogates, nothing
+// above U+10FFFF
+static int is_valid_utf8(const unsigned char *s, size_t len)
+{
+    size_t i = 0, j, n;
+    uint32_t cp, min;
+
+    while (i < len)
+    {
+        if (s[i] < 0x80)
+        {
+            i++;
+            continue;
+        }
+        if ((s[i] & 0xE0) == 0xC0)
+            n = 1, cp = s[i] & 0x1F, min = 0x80;
+        else if ((s[i] & 0xF0) == 0xE0)
+            n = 2, cp = s[i] & 0x0F, min = 0x800;
+        else if ((s[i] & 0xF8) == 0xF0)
+            n = 3, cp = s[i] & 0x07, min = 0x10000;
+        else
+            return 0;
+
+        if (len - i <= n)
+        {
+            return 0;
+        }
+        for (j = 1; j <= n; j++)
+        {
+            if ((s[i + j] & 0xC0) != 0x80)
+            {
+                return 0;
+            }
+            cp = cp << 6 | (s[i + j] & 0x3F);
+        }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        {
+            return 0;
+        }
+        i += n + 1;
+    }
+    return 1;
+}
+
+// XOR len bytes of payload with the frame mask; pos is the offset of src
+// in the payload. The middle part goes eight bytes at a time with the mask
+// rotated to match, a loop compilers turn into vector instructions.
+// dst may be src.
+static void ws_unmask(char *dst, const char *src, size_t len,
+                      const unsigned char mask[4], size_t pos)
+{
+    unsigned char m[8];
+    uint64_t word, v;
+    size_t i = 0, j;
+
+    while (i < len && ((size_t) (dst + i) & 7) != 0)
+    {
+        dst[i] = src[i] ^ mask[(pos + i) & 3];
+        i++;
+    }
+    if (len - i >= 8)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            m[j] = mask[(pos + i + j) & 3];
+        }
+        memcpy(&word, m, 8);
+        for (; len - i >= 8; i += 8)
+        {
+            memcpy(&v, src + i, 8);
+            v ^= word;
+            memcpy(dst + i, &v, 8);
+        }
+    }
+    for (; i < len; i++)
+    {
+        dst[i] = src[i] ^ mask[(pos + i) & 3];
+    }
+}
+
+// Append a frame to the send queue. Data frames that would take the queue
+// over the limit are refused, and the client is dropped: it does not keep
+// up. Must be called with ws->mutex held.
+static int ws_queue_frame(struct mg_websocket *ws, int opcode,
+                          const char *data, size_t len)
+{
+    unsigned char header[10];
+    size_t header_len = 2, need, i;
+    char *p;
+
+    header[0] = (unsigned char) (0x80 | opcode);
+    if (len < 126)
+    {
+        header[1] = (unsigned char) len;
+    }
+    else if (len < 65536)
+    {
+        header[1] = 126;
+        header[2] = (unsigned char) (len >> 8);
+        header[3] = (unsigned char) len;
+        header_len = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (i = 0; i < 8; i++)
+        {
+            header[2 + i] = (unsigned char) ((uint64_t) len >> (56 - 8 * i));
+        }
+        header_len = 10;
+    }
+
+    if (ws->out_sent > 0)
+    {
+        memmove(ws->out, ws->out + ws->out_sent, ws->out_len - ws->out_sent);
+        ws->out_len -= ws->out_sent;
+        ws->out_sent = 0;
+    }
+    need = ws->out_len + header_len + len;
+    if (opcode < WS_CLOSE && need > ws->limit)
+    {
+        ws->overflow = 1;
+        return 0;
+    }
+    if (need > ws->out_size)
+    {
+        i = ws->out_size * 2 > need ? ws->out_size * 2 : need;
+        if ((p = (char *) realloc(ws->out, i)) == NULL)
+        {
+            ws->overflow = 1;
+            return 0;
+        }
+        ws->out = p;
+        ws->out_size = i;
+    }
+    memcpy(ws->out + ws->out_len, header, header_len);
+    memcpy(ws->out + ws->out_len + header_len, data, len);
+    ws->out_len = need;
+    return 1;
+}
+
+// Queue a close frame and stop taking data frames.
+// Must be called with ws->mutex held.
+static void ws_queue_close(struct mg_websocket *ws, int status)
+{
+    char payload[2];
+
+    payload[0] = (char) (status >> 8);
+    payload[1] = (char) status;
+    (void) ws_queue_frame(ws, WS_CLOSE, payload, status ? 2 : 0);
+    ws->state = WS_CLOSING;
+    ws->close_deadline = get_msec() + WS_CLOSE_MSEC;
+}
+
+static void ws_wakeup(struct mg_context *ctx)
+{
+    (void) pthread_mutex_lock(&ctx->ws_mutex);
+    if (!ctx->ws_woken)
+    {
+        ctx->ws_woken = 1;
+        (void) send(ctx->ws_wakeup[1], "", 1, MSG_NOSIGNAL);
+    }
+    (void) pthread_mutex_unlock(&ctx->ws_mutex);
+}
+
+struct mg_websocket *mg_websocket_upgrade(struct mg_connection *conn,
+        mg_websocket_callback_t callback, void *arg)
+{
+    static const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    const char *upgrade, *connection, *version, *key, *s;
+    struct mg_websocket *ws;
+    unsigned char digest[20];
+    char buf[128], accept[32];
+    int buffered, running;
+
+    upgrade = mg_get_header(conn, "Upgrade");
+    connection = mg_get_header(conn, "Connection");
+    version = mg_get_header(conn, "Sec-WebSocket-Version");
+    key = mg_get_header(conn, "Sec-WebSocket-Key");
+
+    // Connection is a token list, e.g. "keep-alive, Upgrade"
+    for (s = connection; s != NULL && *s != '\0'; s++)
+    {
+        if (!mg_strncasecmp(s, "upgrade", 7))
+        {
+            break;
+        }
+    }
+
+    (void) pthread_mutex_lock(&conn->ctx->ws_mutex);
+    running = conn->ctx->ws_running;
+    (void) pthread_mutex_unlock(&conn->ctx->ws_mutex);
+
+    buffered = conn->data_len - conn->request_len;
+    if (!running || conn->ws != NULL || conn->async != NULL ||
+            strcmp(conn->request_info.request_method, "GET") ||
+            upgrade == NULL || mg_strcasecmp(upgrade, "websocket") ||
+            s == NULL || *s == '\0' ||
+            version == NULL || strcmp(version, "13") ||
+            key == NULL || strlen(key) > 64 ||
+            (ws = (struct mg_websocket *) calloc(1, sizeof(*ws) +
+                    conn->buf_size)) == NULL)
+    {
+        return NULL;
+    }
+
+    ws->ctx = conn->ctx;
+    ws->callback = callback;
+    ws->callback_arg = arg;
+    ws->limit = (size_t) atol(conn->ctx->config[WEBSOCKET_BUFFER_SIZE]);
+    (void) pthread_mutex_init(&ws->mutex, NULL);
+    ws->conn = conn;
+    ws->refs = 2;
+    ws->state = WS_OPEN;
+    ws->in = (char *) (ws + 1);
+    ws->in_size = conn->buf_size;
+
+    // Frames the client did not wait for the handshake to send
+    if (buffered > 0)
+    {
+        memcpy(ws->in, conn->buf + conn->request_len, buffered);
+        ws->in_len = buffered;
+        conn->data_len = conn->request_len;
+    }
+
+    mg_snprintf(conn, buf, sizeof(buf), "%s%s", key, guid);
+    sha1((unsigned char *) buf, strlen(buf), digest);
+    base64_encode(digest, sizeof(digest), accept);
+
+    conn->request_info.status_code = 101;
+    (void) mg_printf(conn, "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    conn->ws = ws;
+    return ws;
+}
+
+int mg_websocket_send(struct mg_websocket *ws, int opcode,
+                      const void *data, size_t len)
+{
+    int ok, was_empty;
+
+    if (opcode != MG_WEBSOCKET_TEXT && opcode != MG_WEBSOCKET_BINARY)
+    {
+        return 0;
+    }
+
+    (void) pthread_mutex_lock(&ws->mutex);
+    was_empty = ws->out_sent == ws->out_len;
+    ok = ws->state == WS_OPEN && !ws->overflow &&
+         ws_queue_frame(ws, opcode, (const char *) data, len);
+
+    // A non-empty queue is already being watched by the thread. The
+    // context stays alive until the thread has closed the connection,
+    // which happens under ws->mutex.
+    if (ws->state != WS_CLOSED && ((ok && was_empty) || ws->overflow))
+    {
+        ws_wakeup(ws->ctx);
+    }
+    (void) pthread_mutex_unlock(&ws->mutex);
+    return ok;
+}
+
+void mg_websocket_close(struct mg_websocket *ws, int status)
+{
+    (void) pthread_mutex_lock(&ws->mutex);
+    if (ws->state == WS_OPEN)
+    {
+        ws_queue_close(ws, status);
+        ws_wakeup(ws->ctx);
+    }
+    (void) pthread_mutex_unlock(&ws->mutex);
+}
+
+void mg_websocket_release(struct mg_websocket *ws)
+{
+    int last;
+
+    (void) pthread_mutex_lock(&ws->mutex);
+    last = --ws->refs == 0;
+    (void) pthread_mutex_unlock(&ws->mutex);
+
+    if (last)
+    {
+        (void) pthread_mutex_destroy(&ws->mutex);
+        free(ws->out);
+        free(ws->msg);
+        free(ws);
+    }
+}
+
+// Find out which of the sockets are readable (or closed), and which of those
+// flagged in want_write (which may be NULL) are writable, waiting up to the
+// given number of milliseconds. ready[i] gets bit 1 set for readable, bit 2
+// for writable.
+static void poll_sockets(const SOCKET *socks, const char *want_write,
+                         char *ready, int n, int milliseconds)
+{
+#if defined(_WIN32)
+    fd_set read_set, write_set;
+    struct timeval tv;
+    int i, j, batch;
+
+    memset(ready, 0, n);
+    if (n == 0)
+    {
+        Sleep(milliseconds);
+        return;
+    }
+
+    // Windows select() does not care about socket values, only about the
+    // set size. Check FD_SETSIZE sockets at a time, waiting on the first set.
+    for (i = 0; i < n; i += batch)
+    {
+        batch = n - i < FD_SETSIZE ? n - i : FD_SETSIZE;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        for (j = 0; j < batch; j++)
+        {
+            FD_SET(socks[i + j], &read_set);
+            if (want_write != NULL && want_write[i + j])
+            {
+                FD_SET(socks[i + j], &write_set);
+            }
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = i == 0 ? milliseconds * 1000 : 0;
+        if (select(0, &read_set, &write_set, NULL, &tv) > 0)
+        {
+            for (j = 0; j < batch; j++)
+            {
+                ready[i + j] = (FD_ISSET(socks[i + j], &read_set) ? 1 : 0) |
+                               (FD_ISSET(socks[i + j], &write_set) ? 2 : 0);
+            }
+        }
+    }
+#else
+    struct pollfd *fds;
+    int i;
+
+    memset(ready, 0, n);
+    fds = n == 0 ? NULL : (struct pollfd *) malloc(n * sizeof(*fds));
+    if (fds == NULL)
+    {
+        (void) poll(NULL, 0, milliseconds);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+        if (want_write != NULL && want_write[i])
+        {
+            fds[i].events |= POLLOUT;
+        }
+        fds[i].revents = 0;
+    }
+    if (poll(fds, n, milliseconds) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            ready[i] = ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0) |
+                       ((fds[i].revents & POLLOUT) ? 2 : 0);
+        }
+    }
+    free(fds);
+#endif // _WIN32
+}
+
+#define ASYNC_POLL_MSEC 100
+
+// Make room for more watched requests. Returns 0 on OOM.
+static int grow_watch_lists(struct mg_async ***watched, SOCKET **socks,
+                            char **readable, int *size)
+{
+    int new_size = *size * 2 + 64;
+    struct mg_async **w;
+    SOCKET *s;
+    char *r;
+
+    if ((w = (struct mg_async **) realloc(*watched,
+                                          new_size * sizeof(*w))) != NULL)
+    {
+        *watched = w;
+    }
+    if ((s = (SOCKET *) realloc(*socks, new_size * sizeof(*s))) != NULL)
+    {
+        *socks = s;
+    }
+    if ((r = (char *) realloc(*readable, new_size)) != NULL)
+    {
+        *readable = r;
+    }
+    if (w == NULL || s == NULL || r == NULL)
+    {
+        return 0;
+    }
+    *size = new_size;
+    return 1;
+}
+
+// Watches parked requests: cancels them on timeout, when the client goes
+// away and when the server stops.
+static void async_thread(struct mg_context *ctx)
+{
+    struct mg_async *async, *next, *cancelled, *resumed, **watched = NULL;
+    struct mg_connection *conn;
+    struct log_ring *ring = ctx->log_running ? log_ring_new(ctx) : NULL;
+    SOCKET *socks = NULL;
+    char *readable = NULL, c;
+    int i, n, size = 0, stopping, r;
+    int64_t now;
+
+    for (;;)
+    {
+        cancelled = resumed = NULL;
+        n = 0;
+        now = get_msec();
+
+        (void) pthread_mutex_lock(&ctx->mutex);
+        stopping = ctx->stop_flag != 0;
+        if (stopping && ctx->num_async == 0)
+        {
+            (void) pthread_mutex_unlock(&ctx->mutex);
+            break;
+        }
+
+        for (async = ctx->suspended; async != NULL; async = next)
+        {
+            next = async->next;
+            if (async->state != ASYNC_PENDING)
+            {
+                continue;
+            }
+            if (stopping || (async->deadline != 0 && now >= async->deadline))
+            {
+                unlink_async(async);
+                async->state = ASYNC_CANCELLED;
+                async->reason = stopping ? MG_ASYNC_SHUTDOWN : MG_ASYNC_TIMEOUT;
+                async->next = cancelled;
+                cancelled = async;
+            }
+            else if (!async->peeked)
+            {
+                if (n == size &&
+                        !grow_watch_lists(&watched, &socks, &readable, &size))
+                {
+                    continue;  // OOM, the timeout still applies
+                }
+                // Keep the handle alive while we look at its socket
+                async->refs++;
+                watched[n] = async;
+                socks[n] = async->conn->client.sock;
+                n++;
+            }
+        }
+
+        // Workers don't take completed requests once stopping, finish them here
+        if (stopping)
+        {
+            resumed = ctx->resumed;
+            ctx->resumed = ctx->resumed_tail = NULL;
+        }
+        (void) pthread_mutex_unlock(&ctx->mutex);
+
+        for (async = resumed; async != NULL; async = next)
+        {
+            next = async->next;
+            conn = async->conn;
+            async->next = NULL;
+            conn->log_ring = ring;
+            serve_connection(conn);
+        }
+        for (async = cancelled; async != NULL; async = next)
+        {
+            next = async->next;
+            async->conn->log_ring = ring;
+            cancel_async(async);
+        }
+
+        poll_sockets(socks, NULL, readable, n, ASYNC_POLL_MSEC);
+
+        // A readable socket of a parked request means the client either
+        // closed the connection or pipelined the next request. Peek to find
+        // out; in the latter case, EOF can't be seen until the request is over.
+        cancelled = NULL;
+        (void) pthread_mutex_lock(&ctx->mutex);
+        for (i = 0; i < n; i++)
+        {
+            async = watched[i];
+            if (readable[i] && async->state == ASYNC_PENDING)
+            {
+                r = recv(socks[i], &c, 1, MSG_PEEK);
+                if (r > 0)
+                {
+                    async->peeked = 1;
+                }
+                else if (r == 0 || ERRNO != EWOULDBLOCK)
+                {
+                    unlink_async(async);
+                    async->state = ASYNC_CANCELLED;
+                    async->reason = MG_ASYNC_DISCONNECT;
+                    async->next = cancelled;
+                    cancelled = async;
+                }
+            }
+            if (--async->refs == 0)
+            {
+                free(async);
+            }
+        }
+        (void) pthread_mutex_unlock(&ctx->mutex);
+
+        for (async = cancelled; async != NULL; async = next)
+        {
+            next = async->next;
+            async->conn->log_ring = ring;
+            cancel_async(async);
+        }
+    }
+    free(watched);
+    free(socks);
+    free(readable);
+
+    // Signal master that we're done
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
+}
+
+// A connected pair of sockets, for waking up a thread that waits in poll()
+static int make_wakeup_pair(SOCKET sv[2])
+{
+#if defined(_WIN32)
+    struct sockaddr_in sa;
+    SOCKET listener;
+    int len = sizeof(sa), ok = 0;
+
+    // No socketpair() on Windows, connect over the loopback interface
+    sv[0] = sv[1] = INVALID_SOCKET;
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+    {
+        return 0;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *) &sa, sizeof(sa)) == 0 &&
+            listen(listener, 1) == 0 &&
+            getsockname(listener, (struct sockaddr *) &sa, &len) == 0 &&
+            (sv[1] = socket(AF_INET, SOCK_STREAM, 0)) != INVALID_SOCKET &&
+            connect(sv[1], (struct sockaddr *) &sa, sizeof(sa)) == 0 &&
+            (sv[0] = accept(listener, NULL, NULL)) != INVALID_SOCKET)
+    {
+        ok = 1;
+    }
+    (void) closesocket(listener);
+    if (!ok)
+    {
+        if (sv[1] != INVALID_SOCKET)
+        {
+            (void) closesocket(sv[1]);
+        }
+        sv[0] = sv[1] = INVALID_SOCKET;
+        return 0;
+    }
+#else
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        return 0;
+    }
+#endif // _WIN32
+    (void) set_non_blocking_mode(sv[0]);
+    (void) set_non_blocking_mode(sv[1]);
+    return 1;
+}
+
+// Close the connection and let go of it
+static void ws_drop(struct mg_websocket *ws)
+{
+    struct mg_connection *conn = ws->conn;
+
+    (void) pthread_mutex_lock(&ws->mutex);
+    ws->state = WS_CLOSED;
+    ws->conn = NULL;
+    (void) pthread_mutex_unlock(&ws->mutex);
+
+    if (ws->callback != NULL)
+    {
+        ws->callback(ws, MG_WEBSOCKET_CLOSE, 0, NULL, 0, ws->callback_arg);
+    }
+
+    conn->ws = NULL;
+    close_connection(conn);
+    put_connection(conn);
+    mg_websocket_release(ws);
+}
+
+// Hand an upgraded connection over to the WebSocket thread. Once the thread
+// has stopped taking them, the connection is closed instead.
+static void attach_websocket(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct mg_websocket *ws = conn->ws;
+    int running;
+
+    (void) set_non_blocking_mode(conn->client.sock);
+
+    (void) pthread_mutex_lock(&ctx->ws_mutex);
+    running = ctx->ws_running;
+    if (running)
+    {
+        ws->next = ctx->ws_new;
+        ctx->ws_new = ws;
+    }
+    (void) pthread_mutex_unlock(&ctx->ws_mutex);
+
+    if (running)
+    {
+        ws_wakeup(ctx);
+    }
+    else
+    {
+        ws_drop(ws);
+    }
+}
+
+// Non-blocking I/O on a WebSocket connection. Returns the number of bytes
+// transferred, 0 if the socket would block, -1 on error and on EOF.
+static int ws_io(struct mg_connection *conn, char *buf, int len, int writing)
+{
+    int n, err;
+
+    if (conn->ssl != NULL)
+    {
+        n = writing ? SSL_write(conn->ssl, buf, len) :
+            SSL_read(conn->ssl, buf, len);
+        if (n > 0)
+        {
+            return n;
+        }
+        err = SSL_get_error(conn->ssl, n);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+
+    n = writing ? send(conn->client.sock, buf, len, MSG_NOSIGNAL) :
+        recv(conn->client.sock, buf, len, 0);
+    if (n > 0)
+    {
+        return n;
+    }
+    if (n == 0)
+    {
+        return writing ? 0 : -1;
+    }
+    return ERRNO == EWOULDBLOCK || ERRNO == EINTR ? 0 : -1;
+}
+
+// Protocol error: tell the client why, and read nothing more
+static void ws_fail(struct mg_websocket *ws, int status)
+{
+    (void) pthread_mutex_lock(&ws->mutex);
+    if (ws->state == WS_OPEN)
+    {
+        ws_queue_close(ws, status);
+    }
+    ws->close_received = 1;
+    (void) pthread_mutex_unlock(&ws->mutex);
+}
+
+static void ws_deliver(struct mg_websocket *ws, int opcode, char *data,
+                       size_t len)
+{
+    if (opcode == WS_TEXT && !is_valid_utf8((unsigned char *) data, len))
+    {
+        ws_fail(ws, 1007);
+    }
+    else if (ws->callback != NULL)
+    {
+        ws->callback(ws, MG_WEBSOCKET_MESSAGE, opcode, data, len,
+                     ws->callback_arg);
+    }
+}
+
+// The current frame has been read whole
+static void ws_frame_done(struct mg_websocket *ws)
+{
+    int status;
+
+    ws->in_frame = 0;
+    if (ws->opcode < WS_CLOSE)
+    {
+        if (ws->fin)
+        {
+            ws_deliver(ws, ws->msg_opcode, ws->msg, ws->msg_len);
+            ws->msg_len = 0;
+            ws->msg_opcode = 0;
+        }
+        return;
+    }
+
+    (void) pthread_mutex_lock(&ws->mutex);
+    if (ws->opcode == WS_PING && ws->state == WS_OPEN)
+    {
+        (void) ws_queue_frame(ws, WS_PONG, ws->ctrl, ws->ctrl_len);
+    }
+    else if (ws->opcode == WS_CLOSE)
+    {
+        // Answer with the client's status code
+        if (ws->state == WS_OPEN)
+        {
+            status = ws->ctrl_len < 2 ? 0 :
+                     (unsigned char) ws->ctrl[0] << 8 | (unsigned char) ws->ctrl[1];
+            ws_queue_close(ws, status);
+        }
+        ws->close_received = 1;
+    }
+    (void) pthread_mutex_unlock(&ws->mutex);
+}
+
+// Parse a frame header. Returns its length, 0 if it is incomplete, or -1
+// after a protocol error.
+static int ws_header(struct mg_websocket *ws, const unsigned char *p,
+                     size_t avail)
+{
+    uint64_t len;
+    int header_len, opcode, i;
+
+    if (avail < 2)
+    {
+        return 0;
+    }
+
+    // The first two bytes are enough to tell a broken frame
+    opcode = p[0] & 15;
+    len = p[1] & 127;
+    if ((p[0] & 0x70) != 0 || (p[1] & 0x80) == 0 ||
+            (opcode >= WS_CLOSE && (opcode > WS_PONG || !(p[0] & 0x80) || len > 125)) ||
+            (opcode < WS_CLOSE && (opcode > WS_BINARY ||
+                                   (opcode == WS_CONTINUATION) != (ws->msg_opcode != 0))))
+    {
+        // Extension bits without extensions, an unmasked frame, a bad
+        // control frame, an unknown opcode or a fragment out of place
+        ws_fail(ws, 1002);
+        return -1;
+    }
+
+    header_len = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + 4;
+    if (avail < (size_t) header_len)
+    {
+        return 0;
+    }
+    if (len == 126)
+    {
+        len = (uint64_t) p[2] << 8 | p[3];
+    }
+    else if (len == 127)
+    {
+        for (len = 0, i = 2; i < 10; i++)
+        {
+            len = len << 8 | p[i];
+        }
+    }
+
+    ws->fin = p[0] >> 7;
+    if (opcode >= WS_CLOSE)
+    {
+        ws->ctrl_len = 0;
+    }
+    else if (len > ws->limit - ws->msg_len)
+    {
+        ws_fail(ws, 1009);
+        return -1;
+    }
+    else if (opcode != WS_CONTINUATION)
+    {
+        ws->msg_opcode = opcode;
+    }
+
+    ws->opcode = opcode;
+    memcpy(ws->mask, p + header_len - 4, 4);
+    ws->frame_left = len;
+    ws->mask_pos = 0;
+    ws->in_frame = 1;
+    return header_len;
 }
 
-static void reset_per_request_attributes(struct mg_connection *conn)
+// Act on the frames in the input buffer. An incomplete frame header is
+// left at the start of the buffer, payload is taken as it comes.
+static void ws_parse(struct mg_websocket *ws)
 {
-    struct mg_request_info *ri = &conn->request_info;
+    unsigned char *p;
+    size_t pos = 0, avail, n;
+    int header_len, opcode;
+    char *dst;
 
-    // Reset request info attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port
-    ri->remote_user = ri->request_method = ri->uri = ri->http_version =
-            conn->path_info = NULL;
-    ri->num_headers = 0;
-    ri->status_code = -1;
+    while (!ws->close_received)
+    {
+        p = (unsigned char *) ws->in + pos;
+        avail = ws->in_len - pos;
+        if (!ws->in_frame)
+        {
+            if ((header_len = ws_header(ws, p, avail)) <= 0)
+            {
+                break;
+            }
+            pos += header_len;
+            p += header_len;
+            avail -= header_len;
+
+            // Usually the whole message is in the buffer: unmask it there
+            // and deliver it without copying
+            if (ws->opcode != WS_CONTINUATION && ws->opcode < WS_CLOSE &&
+                    ws->fin && ws->frame_left <= avail)
+            {
+                n = (size_t) ws->frame_left;
+                opcode = ws->msg_opcode;
+                ws->msg_opcode = 0;
+                ws->in_frame = 0;
+                ws_unmask((char *) p, (char *) p, n, ws->mask, 0);
+                ws_deliver(ws, opcode, (char *) p, n);
+                pos += n;
+                continue;
+            }
+        }
 
-    conn->num_bytes_sent = conn->consumed_content = 0;
-    conn->content_len = -1;
-    conn->request_len = conn->data_len = 0;
-    conn->must_close = 0;
+        n = avail < ws->frame_left ? avail : (size_t) ws->frame_left;
+        if (n == 0 && ws->frame_left > 0)
+        {
+            break;
+        }
+        if (ws->opcode >= WS_CLOSE)
+        {
+            dst = ws->ctrl + ws->ctrl_len;
+            ws->ctrl_len += n;
+        }
+        else
+        {
+            // Room for the whole frame, the header said how large it is
+            if (ws->msg_len + ws->frame_left > ws->msg_size)
+            {
+                n = ws->msg_len + (size_t) ws->frame_left;
+                if ((dst = (char *) realloc(ws->msg, n)) == NULL)
+                {
+                    ws_fail(ws, 1009);
+                    break;
+                }
+                ws->msg = dst;
+                ws->msg_size = n;
+                n = avail < ws->frame_left ? avail : (size_t) ws->frame_left;
+            }
+            dst = ws->msg + ws->msg_len;
+            ws->msg_len += n;
+        }
+        ws_unmask(dst, (char *) p, n, ws->mask, ws->mask_pos);
+        ws->mask_pos += n;
+        ws->frame_left -= n;
+        pos += n;
+        if (ws->frame_left == 0)
+        {
+            ws_frame_done(ws);
+        }
+    }
+
+    memmove(ws->in, ws->in + pos, ws->in_len - pos);
+    ws->in_len -= (int) pos;
 }
 
-static void close_socket_gracefully(SOCKET sock)
+// Read what the client sent. A busy client gets a bounded amount per pass,
+// so it can't hold up the others; more_input says it has more waiting.
+// Returns 0 if the connection is gone.
+static int ws_read(struct mg_websocket *ws)
 {
-    char buf[BUFSIZ];
-    struct linger linger;
-    int n;
-
-    // Set linger option to avoid socket hanging out after close. This prevent
-    // ephemeral port exhaust problem under high QPS.
-    linger.l_onoff = 1;
-    linger.l_linger = 1;
-    setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *) &linger, sizeof(linger));
-
-    // Send FIN to the client
-    (void) shutdown(sock, SHUT_WR);
-    set_non_blocking_mode(sock);
+    int i, n;
 
-    // Read and discard pending data. If we do not do that and close the
-    // socket, the data in the send buffer may be discarded. This
-    // behaviour is seen on Windows, when client keeps sending data
-    // when server decide to close the connection; then when client
-    // does recv() it gets no data back.
-    do
+    ws->more_input = 0;
+    ws_parse(ws);
+    for (i = 0; i < 8; i++)
     {
-        n = pull(NULL, sock, NULL, buf, sizeof(buf));
+        if (ws->close_received)
+        {
+            ws->in_len = 0;  // Anything after the close frame is ignored
+        }
+        n = ws_io(ws->conn, ws->in + ws->in_len, ws->in_size - ws->in_len, 0);
+        if (n <= 0)
+        {
+            return n == 0;
+        }
+        ws->in_len += n;
+        ws_parse(ws);
     }
-    while (n > 0);
-
-    // Now we know that our FIN is ACK-ed, safe to close
-    (void) closesocket(sock);
+    ws->more_input = 1;
+    return 1;
 }
 
-static void close_connection(struct mg_connection *conn)
+// Send what is queued, as far as the socket takes it. Returns 0 when the
+// connection is to be dropped: it failed, fell too far behind, or has
+// finished closing.
+static int ws_flush(struct mg_websocket *ws, int64_t now)
 {
-    if (conn->ssl)
+    size_t left;
+    int n, ok = !ws->dead;
+
+    (void) pthread_mutex_lock(&ws->mutex);
+    ok = ok && !ws->overflow;
+    while (ok && ws->out_sent < ws->out_len)
     {
-        SSL_free(conn->ssl);
-        conn->ssl = NULL;
+        left = ws->out_len - ws->out_sent;
+        n = ws_io(ws->conn, ws->out + ws->out_sent,
+                  left > INT_MAX ? INT_MAX : (int) left, 1);
+        if (n <= 0)
+        {
+            ok = n == 0;
+            break;
+        }
+        ws->out_sent += n;
     }
-
-    if (conn->client.sock != INVALID_SOCKET)
+    if (ws->out_sent == ws->out_len)
     {
-        close_socket_gracefully(conn->client.sock);
+        ws->out_sent = ws->out_len = 0;
+        if (ws->out_size > 65536)
+        {
+            // Don't keep the memory of a burst
+            free(ws->out);
+            ws->out = NULL;
+            ws->out_size = 0;
+        }
+    }
+    if (ws->state == WS_CLOSING && ws->out_len == 0 &&
+            (ws->close_received || now >= ws->close_deadline))
+    {
+        ok = 0;
+    }
+    if (ws->state == WS_CLOSING && now >= ws->close_deadline + WS_CLOSE_MSEC)
+    {
+        ok = 0;  // The close frame can't even be sent
     }
+    (void) pthread_mutex_unlock(&ws->mutex);
+    return ok;
 }
 
-static void discard_current_request_from_buffer(struct mg_connection *conn)
+// Make room for more WebSocket connections. Returns 0 on OOM.
+static int grow_ws_lists(struct mg_websocket ***polled, SOCKET **socks,
+                         char **want_write, char **ready, int *size)
 {
-    char *buffered;
-    int buffered_len, body_len;
+    int new_size = *size * 2 + 64;
+    struct mg_websocket **p;
+    SOCKET *s;
+    char *w, *r;
 
-    buffered = conn->buf + conn->request_len;
-    buffered_len = conn->data_len - conn->request_len;
-    assert(buffered_len >= 0);
-
-    if (conn->content_len == -1)
+    if ((p = (struct mg_websocket **) realloc(*polled,
+             new_size * sizeof(*p))) != NULL)
     {
-        body_len = 0;
+        *polled = p;
     }
-    else if (conn->content_len < (int64_t) buffered_len)
+    if ((s = (SOCKET *) realloc(*socks, new_size * sizeof(*s))) != NULL)
     {
-        body_len = (int) conn->content_len;
+        *socks = s;
     }
-    else
+    if ((w = (char *) realloc(*want_write, new_size)) != NULL)
     {
-        body_len = buffered_len;
+        *want_write = w;
     }
-
-    conn->data_len -= conn->request_len + body_len;
-    memmove(conn->buf, conn->buf + conn->request_len + body_len,
-            (size_t) conn->data_len);
-}
-
-static int is_valid_uri(const char *uri)
-{
-    // Conform to http://www.w3.org/Protocols/rfc2616/rfc2616-sec5.html#sec5.1.2
-    // URI can be an asterisk (*) or should start with slash.
-    return uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0');
+    if ((r = (char *) realloc(*ready, new_size)) != NULL)
+    {
+        *ready = r;
+    }
+    if (p == NULL || s == NULL || w == NULL || r == NULL)
+    {
+        return 0;
+    }
+    *size = new_size;
+    return 1;
 }
 
-static void process_new_connection(struct mg_connection *conn)
+// Serves all WebSocket connections. Each pass flushes the send queues,
+// waits for input, output space or a wakeup, and reads what came in.
+// When the server stops, clients get a "going away" close frame.
+static void websocket_thread(struct mg_context *ctx)
 {
-    struct mg_request_info *ri = &conn->request_info;
-    int keep_alive_enabled;
-    const char *cl;
-
-    keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+    struct mg_websocket *list = NULL, *ws, **pp, **polled = NULL;
+    struct log_ring *ring = ctx->log_running ? log_ring_new(ctx) : NULL;
+    SOCKET *socks = NULL;
+    char *want_write = NULL, *ready = NULL, drain[64];
+    int i, n, size = 0, stopping, busy;
+    int64_t now;
 
-    do
+    for (;;)
     {
-        reset_per_request_attributes(conn);
-
-        // If next request is not pipelined, read it in
-        if ((conn->request_len = get_request_len(conn->buf, conn->data_len)) == 0)
+        (void) pthread_mutex_lock(&ctx->ws_mutex);
+        stopping = ctx->stop_flag != 0;
+        ctx->ws_running = !stopping;
+        while ((ws = ctx->ws_new) != NULL)
         {
-            conn->request_len = read_request(NULL, conn->client.sock, conn->ssl,
-                                             conn->buf, conn->buf_size, &conn->data_len);
+            ctx->ws_new = ws->next;
+            ws->next = list;
+            list = ws;
+            ws->conn->log_ring = ring;
+            ws->more_input = 1;  // May have come with the handshake
         }
-        assert(conn->data_len >= conn->request_len);
-        if (conn->request_len == 0 && conn->data_len == conn->buf_size)
+        ctx->ws_woken = 0;
+        (void) pthread_mutex_unlock(&ctx->ws_mutex);
+
+        while (recv(ctx->ws_wakeup[0], drain, sizeof(drain), 0) > 0)
         {
-            send_http_error(conn, 413, "Request Too Large", "");
-            return;
         }
-        if (conn->request_len <= 0)
+        if (stopping)
         {
-            return;  // Remote end closed the connection
+            break;
         }
 
-        // Nul-terminate the request cause parse_http_request() uses sscanf
-        conn->buf[conn->request_len - 1] = '\0';
-        if (!parse_http_request(conn->buf, ri) || !is_valid_uri(ri->uri))
+        // The wakeup socket comes first
+        if (size == 0 && !grow_ws_lists(&polled, &socks, &want_write, &ready,
+                                        &size))
         {
-            // Do not put garbage in the access log, just send it back to the client
-            send_http_error(conn, 400, "Bad Request",
-                            "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
+            poll_sockets(NULL, NULL, NULL, 0, ASYNC_POLL_MSEC);
+            continue;
         }
-        else if (strcmp(ri->http_version, "1.0") &&
-                 strcmp(ri->http_version, "1.1"))
+        polled[0] = NULL;
+        socks[0] = ctx->ws_wakeup[0];
+        want_write[0] = 0;
+        n = 1;
+        busy = 0;
+        now = get_msec();
+
+        for (pp = &list; (ws = *pp) != NULL;)
         {
-            // Request seems valid, but HTTP version is strange
-            send_http_error(conn, 505, "HTTP version not supported", "");
-            log_access(conn);
+            if (!ws_flush(ws, now))
+            {
+                *pp = ws->next;
+                ws_drop(ws);
+                continue;
+            }
+            pp = &ws->next;
+            if (n == size &&
+                    !grow_ws_lists(&polled, &socks, &want_write, &ready, &size))
+            {
+                continue;  // OOM, look at it next time
+            }
+            polled[n] = ws;
+            socks[n] = ws->conn->client.sock;
+            (void) pthread_mutex_lock(&ws->mutex);
+            want_write[n] = ws->out_len > 0;
+            (void) pthread_mutex_unlock(&ws->mutex);
+            busy |= ws->more_input;
+            n++;
         }
-        else
+
+        poll_sockets(socks, want_write, ready, n, busy ? 0 : ASYNC_POLL_MSEC);
+
+        for (i = 1; i < n; i++)
         {
-            // Request is valid, handle it
-            cl = get_header(ri, "Content-Length");
-            conn->content_len = cl == NULL ? -1 : strtoll(cl, NULL, 10);
-            conn->birth_time = time(NULL);
-            handle_request(conn);
-            call_user(conn, MG_REQUEST_COMPLETE);
-            log_access(conn);
-            discard_current_request_from_buffer(conn);
+            ws = polled[i];
+            if (((ready[i] & 1) || ws->more_input) && !ws_read(ws))
+            {
+                ws->dead = 1;
+            }
         }
-        if (ri->remote_user != NULL)
+    }
+
+    // Say goodbye, as far as the sockets take it without waiting
+    while ((ws = list) != NULL)
+    {
+        list = ws->next;
+        (void) pthread_mutex_lock(&ws->mutex);
+        if (ws->state == WS_OPEN)
         {
-            free((void *) ri->remote_user);
+            ws_queue_close(ws, 1001);
         }
+        (void) pthread_mutex_unlock(&ws->mutex);
+        (void) ws_flush(ws, get_msec());
+        ws_drop(ws);
     }
-    while (conn->ctx->stop_flag == 0 &&
-            keep_alive_enabled &&
-            should_keep_alive(conn));
+    free(polled);
+    free(socks);
+    free(want_write);
+    free(ready);
+
+    // Signal master that we're done
+    (void) pthread_mutex_lock(&ctx->mutex);
+    ctx->num_threads--;
+    (void) pthread_cond_signal(&ctx->cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    DEBUG_TRACE(("exiting"));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp)
+// Worker threads take completed asynchronous requests first, then accepted
+// sockets from the queue. Returns NULL when the server is stopping.
+static struct mg_connection *consume_connection(struct mg_context *ctx)
 {
+    struct mg_connection *conn = NULL;
+    struct mg_async *async;
+    struct socket accepted;
+    int have_socket = 0, stopping;
+
     (void) pthread_mutex_lock(&ctx->mutex);
     DEBUG_TRACE(("going idle"));
 
-    // If the queue is empty, wait. We're idle at this point.
-    while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0)
+    // If the queues are empty, wait. We're idle at this point.
+    while (ctx->sq_head == ctx->sq_tail && ctx->resumed == NULL &&
+            ctx->stop_flag == 0)
     {
         pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
     }
+    stopping = ctx->stop_flag != 0;
 
+    if (!stopping && (async = ctx->resumed) != NULL)
+    {
+        ctx->resumed = async->next;
+        if (ctx->resumed == NULL)
+        {
+            ctx->resumed_tail = NULL;
+        }
+        async->next = NULL;
+        conn = async->conn;
+        DEBUG_TRACE(("resuming socket %d, going busy", conn->client.sock));
+    }
     // If we're stopping, sq_head may be equal to sq_tail.
-    if (ctx->sq_head > ctx->sq_tail)
+    else if (ctx->sq_head > ctx->sq_tail)
     {
         // Copy socket from the queue and increment tail
-        *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
+        accepted = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
         ctx->sq_tail++;
-        DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+        have_socket = 1;
+        DEBUG_TRACE(("grabbed socket %d, going busy", accepted.sock));
 
         // Wrap pointers if needed
         while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue))
@@ -4631,54 +8169,64 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp)
             ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
             ctx->sq_head -= ARRAY_SIZE(ctx->queue);
         }
+
+        if (!stopping && (conn = get_connection(ctx)) != NULL)
+        {
+            conn->client = accepted;
+        }
     }
 
     (void) pthread_cond_signal(&ctx->sq_empty);
     (void) pthread_mutex_unlock(&ctx->mutex);
 
-    return !ctx->stop_flag;
+    if (have_socket && conn == NULL)
+    {
+        if (!stopping)
+        {
+            cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
+        }
+        (void) closesocket(accepted.sock);
+    }
+
+    return stopping ? NULL : conn;
 }
 
 static void worker_thread(struct mg_context *ctx)
 {
     struct mg_connection *conn;
-    int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
-
-    conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
-    if (conn == NULL)
-    {
-        cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
-        return;
-    }
-    conn->buf_size = buf_size;
-    conn->buf = (char *) (conn + 1);
+    struct log_ring *ring = ctx->log_running ? log_ring_new(ctx) : NULL;
 
-    // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
-    // sq_empty condvar to wake up the master waiting in produce_socket()
-    while (consume_socket(ctx, &conn->client))
+    // Call consume_connection() even when ctx->stop_flag > 0, to let it
+    // signal sq_empty condvar to wake up the master waiting in produce_socket()
+    while ((conn = consume_connection(ctx)) != NULL)
     {
-        conn->birth_time = time(NULL);
-        conn->ctx = ctx;
-
-        // Fill in IP, port info early so even if SSL setup below fails,
-        // error handler would have the corresponding info.
-        // Thanks to Johannes Winkelmann for the patch.
-        // TODO(lsm): Fix IPv6 case
-        conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
-        memcpy(&conn->request_info.remote_ip,
-               &conn->client.rsa.sin.sin_addr.s_addr, 4);
-        conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
-        conn->request_info.is_ssl = conn->client.is_ssl;
+        conn->log_ring = ring;
 
-        if (!conn->client.is_ssl ||
-                (conn->client.is_ssl && sslize(conn, SSL_accept)))
+        // Resumed connections carry on with their suspended request
+        if (conn->async == NULL)
         {
-            process_new_connection(conn);
+            conn->birth_time = time(NULL);
+
+            // Fill in IP, port info early so even if SSL setup below fails,
+            // error handler would have the corresponding info.
+            // Thanks to Johannes Winkelmann for the patch.
+            // TODO(lsm): Fix IPv6 case
+            conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
+            memcpy(&conn->request_info.remote_ip,
+                   &conn->client.rsa.sin.sin_addr.s_addr, 4);
+            conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
+            conn->request_info.is_ssl = conn->client.is_ssl;
+
+            if (conn->client.is_ssl && !sslize(conn, SSL_accept))
+            {
+                close_connection(conn);
+                put_connection(conn);
+                continue;
+            }
         }
 
-        close_connection(conn);
+        serve_connection(conn);
     }
-    free(conn);
 
     // Signal master that we're done with connection and exiting
     (void) pthread_mutex_lock(&ctx->mutex);
@@ -4810,10 +8358,24 @@ static void master_thread(struct mg_context *ctx)
     {
         (void) pthread_cond_wait(&ctx->cond, &ctx->mutex);
     }
+
+    // Let the log writer write out what the threads have logged
+    ctx->log_stop = 1;
+    while (ctx->log_running)
+    {
+        (void) pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    }
     (void) pthread_mutex_unlock(&ctx->mutex);
 
     // All threads exited, no sync is needed. Destroy mutex and condvars
     (void) pthread_mutex_destroy(&ctx->mutex);
+    (void) pthread_mutex_destroy(&ctx->log_mutex);
+    (void) pthread_mutex_destroy(&ctx->auth_mutex);
+#if !defined(NO_FASTCGI)
+    free_fastcgi_pools(ctx);
+#endif // !NO_FASTCGI
+    (void) pthread_mutex_destroy(&ctx->fcgi_mutex);
+    (void) pthread_mutex_destroy(&ctx->ticket_mutex);
     (void) pthread_cond_destroy(&ctx->cond);
     (void) pthread_cond_destroy(&ctx->sq_empty);
     (void) pthread_cond_destroy(&ctx->sq_full);
@@ -4830,8 +8392,35 @@ static void master_thread(struct mg_context *ctx)
 
 static void free_context(struct mg_context *ctx)
 {
+    struct mg_connection *conn;
+    struct log_ring *ring;
     int i;
 
+    // Deallocate pooled connections
+    while ((conn = ctx->idle_conns) != NULL)
+    {
+        ctx->idle_conns = conn->next;
+        free(conn);
+    }
+
+    acl_free(ctx->acl);
+    free_auth_files(ctx);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (ctx->ws_wakeup[i] != INVALID_SOCKET)
+        {
+            (void) closesocket(ctx->ws_wakeup[i]);
+        }
+    }
+
+    // Deallocate log rings, if the log writer did not get to do it
+    while ((ring = ctx->log_rings) != NULL)
+    {
+        ctx->log_rings = ring->next;
+        free(ring);
+    }
+
     // Deallocate config parameters
     for (i = 0; i < NUM_OPTIONS; i++)
     {
@@ -4864,6 +8453,12 @@ void mg_stop(struct mg_context *ctx)
     {
         (void) sleep(0);
     }
+#if !defined(_WIN32) && !defined(__SYMBIAN32__)
+    if (ctx->log_sigusr1_set)
+    {
+        (void) signal(SIGUSR1, ctx->log_old_sigusr1);
+    }
+#endif // !_WIN32
     free_context(ctx);
 
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
@@ -4889,6 +8484,7 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
     ctx = (struct mg_context *) calloc(1, sizeof(*ctx));
     ctx->user_callback = user_callback;
     ctx->user_data = user_data;
+    ctx->ws_wakeup[0] = ctx->ws_wakeup[1] = INVALID_SOCKET;
 
     while (options && (name = *options++) != NULL)
     {
@@ -4950,13 +8546,74 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 #endif // !_WIN32
 
     (void) pthread_mutex_init(&ctx->mutex, NULL);
+    (void) pthread_mutex_init(&ctx->log_mutex, NULL);
+    (void) pthread_mutex_init(&ctx->auth_mutex, NULL);
+    (void) pthread_mutex_init(&ctx->fcgi_mutex, NULL);
+    (void) pthread_mutex_init(&ctx->ticket_mutex, NULL);
+    (void) pthread_mutex_init(&ctx->ws_mutex, NULL);
     (void) pthread_cond_init(&ctx->cond, NULL);
     (void) pthread_cond_init(&ctx->sq_empty, NULL);
     (void) pthread_cond_init(&ctx->sq_full, NULL);
 
+    // Start the log writer before the threads that log. It is not counted
+    // in num_threads, the master waits for it after all the others.
+    if (ctx->config[ACCESS_LOG_FILE] != NULL ||
+            ctx->config[ERROR_LOG_FILE] != NULL)
+    {
+        ctx->log_shared = log_ring_new(ctx);
+        ctx->log_running = ctx->log_shared != NULL;
+        if (ctx->log_running &&
+                start_thread(ctx, (mg_thread_func_t) log_writer_thread, ctx) != 0)
+        {
+            ctx->log_running = 0;
+            cry(fc(ctx), "Cannot start log writer thread: %d", ERRNO);
+        }
+#if !defined(_WIN32) && !defined(__SYMBIAN32__)
+        // Reopen log files on SIGUSR1, after they were rotated. The
+        // embedding application's handler is put back by mg_stop().
+        if (ctx->log_running)
+        {
+            ctx->log_old_sigusr1 = signal(SIGUSR1, log_reopen_signal_handler);
+            ctx->log_sigusr1_set = ctx->log_old_sigusr1 != SIG_ERR;
+        }
+#endif // !_WIN32
+    }
+
     // Start master (listening) thread
     start_thread(ctx, (mg_thread_func_t) master_thread, ctx);
 
+    // Start the thread watching suspended requests. It is waited for on
+    // shutdown like the workers are.
+    if (start_thread(ctx, (mg_thread_func_t) async_thread, ctx) != 0)
+    {
+        cry(fc(ctx), "Cannot start async thread: %d", ERRNO);
+    }
+    else
+    {
+        ctx->num_threads++;
+    }
+
+    // Start the thread serving WebSocket connections, also waited for
+    if (mg_strcasecmp(ctx->config[ENABLE_WEBSOCKET], "yes"))
+    {
+        // mg_websocket_upgrade() refuses the handshake
+    }
+    else if (!make_wakeup_pair(ctx->ws_wakeup))
+    {
+        cry(fc(ctx), "Cannot create WebSocket wakeup sockets: %d", ERRNO);
+    }
+    else if (start_thread(ctx, (mg_thread_func_t) websocket_thread, ctx) != 0)
+    {
+        cry(fc(ctx), "Cannot start WebSocket thread: %d", ERRNO);
+    }
+    else
+    {
+        (void) pthread_mutex_lock(&ctx->ws_mutex);
+        ctx->ws_running = 1;
+        (void) pthread_mutex_unlock(&ctx->ws_mutex);
+        ctx->num_threads++;
+    }
+
     // Start worker threads
     for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++)
     {
@@ -92,9 +92,9 @@ typedef void * (*mg_callback_t)(enum mg_event event,
 //   options: NULL terminated list of option_name, option_value pairs that
 //            specify Mongoose configuration parameters.
 //
-// Side-effects: on UNIX, ignores SIGCHLD and SIGPIPE signals. If custom
-//    processing is required for these, signal handlers must be set up
-//    after calling mg_start().
+// Side-effects: on UNIX, ignores SIGCHLD and SIGPIPE signals, and reopens
+//    the log files on SIGUSR1. If custom processing is required for these,
+//    signal handlers must be set up after calling mg_start().
 //
 //
 // Example:
@@ -137,6 +137,49 @@ const char *mg_get_option(const struct mg_context *ctx, const char *name);
 const char **mg_get_valid_option_names(void);
 
 
+// Reopen the access and error log files, e.g. after they have been rotated.
+//
+// Log records are written by a background thread, in batches; the files are
+// reopened before its next batch. Only sets a flag, so it is safe to call
+// from a signal handler.
+void mg_reopen_logs(struct mg_context *);
+
+
+// Log writing statistics.
+struct mg_log_stats
+{
+    long long records;  // Records written to the log files
+    long long bytes;    // Bytes written to the log files
+    long long dropped;  // Records lost because a log buffer stayed full
+    long long waits;    // Times a thread had to wait for log buffer space
+};
+
+// Fill in the log writing statistics of a running server.
+// Each thread buffers its records in "log_buffer_size" bytes; a thread that
+// logs faster than the files are written waits for space briefly, then
+// drops the record. Drops are also reported in the error log.
+void mg_get_log_stats(struct mg_context *, struct mg_log_stats *stats);
+
+
+// TLS handshake statistics, all zero if SSL is not in use.
+// Resumed handshakes reuse a session from the session cache
+// ("ssl_session_cache_size" sessions, kept "ssl_session_timeout" seconds)
+// or from a session ticket, and skip the expensive key exchange. A cache
+// size of 0 disables both. The resumption rate is resumed / completed.
+struct mg_ssl_stats
+{
+    long handshakes;      // Handshakes started
+    long completed;       // Handshakes completed
+    long resumed;         // Completed handshakes that resumed a session
+    long cache_misses;    // Session IDs not found in the cache
+    long cache_timeouts;  // Sessions found in the cache, but expired
+    long cache_full;      // Sessions dropped because the cache was full
+    long cache_entries;   // Sessions in the cache
+};
+
+void mg_get_ssl_stats(struct mg_context *, struct mg_ssl_stats *stats);
+
+
 // Add, edit or delete the entry in the passwords file.
 //
 // This function allows an application to manipulate .htpasswd files on the
@@ -175,14 +218,165 @@ int mg_vsnprintf(struct mg_connection *conn, char *buf, size_t buflen,
                  const char *fmt, va_list ap);
 
 
+// Allocate memory from the request arena of the connection.
+//
+// The memory is valid until the current request completes; it is released
+// in bulk before the next request on the connection is read, there is no
+// way (and no need) to free it individually. The size of the first arena
+// block is set by the "request_arena_size" option, requests that need more
+// than that transparently get additional blocks.
+//
+// Return:
+//   Pointer aligned for any pointer-sized type, or NULL on OOM or if the
+//   connection has no arena (e.g. during MG_INIT_SSL).
+void *mg_arena_alloc(struct mg_connection *, size_t len);
+
+
 // Send contents of the entire file together with HTTP headers.
 void mg_send_file(struct mg_connection *conn, const char *path);
 
 
+// Return information associated with the request.
+struct mg_request_info *mg_get_request_info(struct mg_connection *);
+
+
+// Close the connection once the current request is handled, instead of
+// keeping it alive. Needed when the end of the response body is marked
+// by closing the connection.
+void mg_set_must_close(struct mg_connection *);
+
+
+// Asynchronous (suspended) requests.
+struct mg_async;  // Handle for a suspended request
+
+enum mg_async_status
+{
+    MG_ASYNC_COMPLETED,   // The response has been sent
+    MG_ASYNC_TIMEOUT,     // Not completed in time, the client gets a 504
+    MG_ASYNC_DISCONNECT,  // The client closed the connection
+    MG_ASYNC_SHUTDOWN     // The server is stopping, the client gets a 503
+};
+
+// Called exactly once per suspended request, when the server lets go of it:
+// with MG_ASYNC_COMPLETED after a completed response went out, otherwise
+// with the cancellation reason, before the server answers the client.
+// Called from a server thread, or from the thread that calls
+// mg_resume_end() while the server is stopping.
+typedef void (*mg_async_callback_t)(struct mg_async *async,
+                                    enum mg_async_status status, void *arg);
+
+// Suspend the current request.
+//
+// Called from the MG_NEW_REQUEST handler, which then returns non-NULL without
+// sending anything. The worker thread goes on to other connections, while
+// the connection and the request (request_info, headers, request arena)
+// stay untouched until the request is over.
+//
+// The response is sent later, from any thread: mg_resume_begin() returns
+// the connection to write it to, mg_resume_end() hands the connection back
+// to the server, which goes on with the next keep-alive request.
+// If the response is not begun within timeout_ms milliseconds (0 means no
+// limit), the client closes the connection or the server stops, the request
+// is cancelled instead: callback is called, then the server answers or
+// closes the connection itself.
+//
+// Return:
+//   Handle that must be released with mg_async_release() exactly once, or
+//   NULL on OOM or if the request is already suspended.
+struct mg_async *mg_suspend(struct mg_connection *, int timeout_ms,
+                            mg_async_callback_t callback, void *arg);
+
+// Begin the response of a suspended request.
+//
+// Return:
+//   Connection to send the response to, or NULL if the request has already
+//   been completed or cancelled. In that case nothing must be sent, and
+//   mg_resume_end() must not be called.
+struct mg_connection *mg_resume_begin(struct mg_async *);
+
+// Finish the response begun with mg_resume_begin().
+// The connection must not be used after this call.
+void mg_resume_end(struct mg_async *);
+
+// Release the handle returned by mg_suspend(). Can be called at any time,
+// the request itself is not affected. Handles must be released before
+// mg_stop() returns.
+void mg_async_release(struct mg_async *);
+
+
+// WebSocket connections (RFC 6455).
+struct mg_websocket;  // Handle for an upgraded connection
+
+enum mg_websocket_event
+{
+    MG_WEBSOCKET_MESSAGE,  // A complete message arrived
+    MG_WEBSOCKET_CLOSE     // The connection is closed, nothing follows
+};
+
+// Message opcodes
+enum
+{
+    MG_WEBSOCKET_TEXT = 1,   // UTF-8 text, validated on the way in
+    MG_WEBSOCKET_BINARY = 2
+};
+
+// Called from the WebSocket thread, which serves all WebSocket connections
+// of the server, so it must not block. Fragmented messages are put back
+// together, data is only valid during the call. Pings are answered and
+// the closing handshake is done by the server.
+typedef void (*mg_websocket_callback_t)(struct mg_websocket *ws,
+                                        enum mg_websocket_event event,
+                                        int opcode, const char *data,
+                                        size_t len, void *arg);
+
+// Accept a WebSocket handshake (version 13).
+//
+// Called from the MG_NEW_REQUEST handler, which then returns non-NULL without
+// sending anything. The 101 response is sent here; once the handler returns,
+// the connection is handed over to the WebSocket thread and no worker is
+// tied up with it.
+// Incoming messages, and messages queued for sending, are limited to
+// websocket_buffer_size bytes; a client that sends larger messages, or reads
+// too slowly for its queue, is dropped.
+// The WebSocket thread only runs with enable_websocket set to "yes".
+//
+// Return:
+//   Handle that must be released with mg_websocket_release() exactly once,
+//   or NULL if the request is not a valid handshake, or WebSocket
+//   connections are not available. In that case nothing has been sent.
+struct mg_websocket *mg_websocket_upgrade(struct mg_connection *,
+        mg_websocket_callback_t callback, void *arg);
+
+// Queue a message, from any thread. Messages queued by the time the
+// WebSocket thread gets to the connection go out in a single write.
+// Return:
+//   1 if queued, 0 if the connection is closing or the queue is full.
+int mg_websocket_send(struct mg_websocket *, int opcode,
+                      const void *data, size_t len);
+
+// Start the closing handshake, with the given status code (1000 is a
+// normal closure). MG_WEBSOCKET_CLOSE follows once it is done.
+void mg_websocket_close(struct mg_websocket *, int status);
+
+// Release the handle returned by mg_websocket_upgrade(). Can be called at
+// any time, also after mg_stop(); sending on a closed connection fails.
+void mg_websocket_release(struct mg_websocket *);
+
+
 // Read data from the remote end, return number of bytes read.
+// Chunked request bodies are decoded. If the client sent
+// "Expect: 100-continue", the go-ahead is sent on the first read. Data is
+// only taken off the socket when asked for, so a slow reader holds back a
+// fast client instead of buffering for it.
 int mg_read(struct mg_connection *, void *buf, size_t len);
 
 
+// Return 1 if the whole request body has been read (or there is none),
+// 0 if there is more to read, and -1 if the body is malformed or the client
+// went away before sending all of it.
+int mg_body_status(const struct mg_connection *);
+
+
 // Get the value of particular HTTP header.
 //
 // This is a helper function. It traverses request_info->http_headers array,
@@ -214,6 +408,17 @@ const char *get_header(const struct mg_request_info *ri, const char *name);
 int mg_get_var(const char *data, size_t data_len,
                const char *var_name, char *buf, size_t buf_len);
 
+// URL-decode input buffer into destination buffer.
+//
+// If is_form_url_encoded is non-zero, '+' is decoded as space, as used by
+// query strings and application/x-www-form-urlencoded bodies. src and dst may
+// point to the same buffer, decoded data is never longer than the source.
+//
+// Return:
+//   Length of the decoded data. Destination buffer is '\0' - terminated.
+size_t mg_url_decode(const char *src, size_t src_len, char *dst,
+                     size_t dst_len, int is_form_url_encoded);
+
 // Fetch value of certain cookie variable into the destination buffer.
 //
 // Destination buffer is guaranteed to be '\0' - terminated. In case of
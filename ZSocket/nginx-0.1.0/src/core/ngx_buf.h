@@ -93,6 +93,15 @@ typedef struct
 
     ngx_output_chain_filter_pt   output_filter;
     void                        *filter_ctx;
+
+#if (NGX_THREAD_POOL)
+    /* the file reads are run by the pool, the handler resumes the output */
+    ngx_thread_pool_t           *thread_pool;
+    ngx_thread_task_t           *thread_task;
+    void                       (*thread_handler)(void *data);
+    void                        *thread_data;
+    unsigned                     aio:1;
+#endif
 } ngx_output_chain_ctx_t;
 
 
@@ -753,6 +753,9 @@ ngx_open_file_t *ngx_conf_open_file(ngx_cycle_t *cycle, ngx_str_t *name)
         file->name.data = NULL;
     }
 
+    file->flush = NULL;
+    file->data = NULL;
+
     return file;
 }
 
@@ -90,12 +90,16 @@ struct ngx_open_file_s
     ngx_fd_t   fd;
     //z 文件名称
     ngx_str_t  name;
+
+    /* writes out the data buffered by a module, e.g. by the access log */
+    void     (*flush)(ngx_open_file_t *file, ngx_log_t *log);
+    void      *data;
+
 #if 0
     /* e.g. append mode, error_log */
     int        flags;
     /* e.g. reopen db file */
     int      (*handler)(void *data, ngx_open_file_t *file);
-    void      *data;
 #endif
 };
 
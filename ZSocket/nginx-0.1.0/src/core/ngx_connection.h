@@ -41,6 +41,8 @@ typedef struct
     time_t            post_accept_timeout;     /* should be here because
                                                   of the deferred accept */
 
+    ngx_uint_t        worker;     /* the worker of the reuseport socket */
+
     unsigned          new:1;
     unsigned          remain:1;
     unsigned          ignore:1;
@@ -56,6 +58,7 @@ typedef struct
 #if (HAVE_DEFERRED_ACCEPT)
     unsigned          deferred_accept:1;
 #endif
+    unsigned          reuseport:1;   /* a separate socket for each worker */
 
     unsigned          addr_ntop:1;
 } ngx_listening_t;
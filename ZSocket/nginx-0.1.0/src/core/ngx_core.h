@@ -19,6 +19,12 @@ typedef struct ngx_command_s     ngx_command_t;
 typedef struct ngx_file_s        ngx_file_t;
 typedef struct ngx_event_s       ngx_event_t;
 typedef struct ngx_connection_s  ngx_connection_t;
+typedef struct ngx_open_file_cache_s  ngx_open_file_cache_t;
+
+#if (NGX_THREAD_POOL)
+typedef struct ngx_thread_task_s  ngx_thread_task_t;
+typedef struct ngx_thread_pool_s  ngx_thread_pool_t;
+#endif
 
 typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
 
@@ -58,6 +64,8 @@ typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
 #include <ngx_regex.h>
 #endif
 #include <ngx_rbtree.h>
+#include <ngx_slab.h>
+#include <ngx_radix_tree.h>
 #include <ngx_times.h>
 #include <ngx_inet.h>
 #include <ngx_cycle.h>
@@ -68,6 +76,10 @@ typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
 #include <ngx_event_openssl.h>
 #endif
 #include <ngx_connection.h>
+#include <ngx_open_file_cache.h>
+#if (NGX_THREAD_POOL)
+#include <ngx_thread_pool.h>
+#endif
 
 
 #define LF     (u_char) 10
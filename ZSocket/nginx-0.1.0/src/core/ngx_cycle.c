@@ -10,6 +10,13 @@
 
 
 static void ngx_clean_old_cycles(ngx_event_t *ev);
+#if !(WIN32)
+static ngx_int_t ngx_init_zones(ngx_cycle_t *cycle, ngx_cycle_t *old_cycle);
+static void ngx_free_zones(ngx_cycle_t *cycle, ngx_cycle_t *keep);
+#endif
+#if (HAVE_REUSEPORT)
+static ngx_int_t ngx_clone_listening(ngx_cycle_t *cycle);
+#endif
 
 
 volatile ngx_cycle_t  *ngx_cycle;
@@ -105,6 +112,28 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
     }
 
 
+    if (old_cycle->shared_memory.part.nelts)
+    {
+        n = old_cycle->shared_memory.part.nelts;
+        for (part = old_cycle->shared_memory.part.next; part; part = part->next)
+        {
+            n += part->nelts;
+        }
+
+    }
+    else
+    {
+        n = 1;
+    }
+
+    if (ngx_list_init(&cycle->shared_memory, pool, n, sizeof(ngx_shm_zone_t))
+            == NGX_ERROR)
+    {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+
     if (!(cycle->new_log = ngx_log_create_errlog(cycle, NULL)))
     {
         ngx_destroy_pool(pool);
@@ -209,6 +238,17 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
     }
 
 
+#if (HAVE_REUSEPORT)
+
+    if (ngx_clone_listening(cycle) == NGX_ERROR)
+    {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+#endif
+
+
     failed = 0;
 
 
@@ -287,6 +327,18 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
         }
     }
 
+#if !(WIN32)
+
+    if (!failed)
+    {
+        if (ngx_init_zones(cycle, old_cycle) == NGX_ERROR)
+        {
+            failed = 1;
+        }
+    }
+
+#endif
+
     cycle->log = cycle->new_log;
     pool->log = cycle->new_log;
 
@@ -315,6 +367,18 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
                         continue;
                     }
 
+                    /*
+                     * each worker has its own reuseport socket so the socket
+                     * is inherited only by the same worker number
+                     */
+
+                    if (ls[i].remain
+                        || ls[i].reuseport != nls[n].reuseport
+                        || ls[i].worker != nls[n].worker)
+                    {
+                        continue;
+                    }
+
                     if (ngx_memcmp(nls[n].sockaddr,
                                    ls[i].sockaddr, ls[i].socklen) == 0)
                     {
@@ -407,6 +471,10 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
             }
         }
 
+#if !(WIN32)
+        ngx_free_zones(cycle, old_cycle);
+#endif
+
         if (ngx_test_config)
         {
             ngx_destroy_pool(pool);
@@ -473,6 +541,14 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
 
     /* close and delete stuff that lefts from an old cycle */
 
+#if !(WIN32)
+
+    /* free the shared memory zones that are not reused */
+
+    ngx_free_zones(old_cycle, cycle);
+
+#endif
+
     /* close the unneeded listening sockets */
 
     ls = old_cycle->listening.elts;
@@ -516,6 +592,11 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle)
             continue;
         }
 
+        if (file[i].flush)
+        {
+            file[i].flush(&file[i], log);
+        }
+
         if (ngx_close_file(file[i].fd) == NGX_FILE_ERROR)
         {
             ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
@@ -720,6 +801,11 @@ void ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
             continue;
         }
 
+        if (file[i].flush)
+        {
+            file[i].flush(&file[i], cycle->log);
+        }
+
         fd = ngx_open_file(file[i].name.data, NGX_FILE_RDWR,
                            NGX_FILE_CREATE_OR_OPEN|NGX_FILE_APPEND);
 
@@ -809,6 +895,338 @@ void ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user)
 }
 
 
+void ngx_flush_files(ngx_cycle_t *cycle)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_open_file_t  *file;
+
+    part = &cycle->open_files.part;
+    file = part->elts;
+
+    for (i = 0; /* void */ ; i++)
+    {
+
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+            part = part->next;
+            file = part->elts;
+            i = 0;
+        }
+
+        if (file[i].flush)
+        {
+            file[i].flush(&file[i], cycle->log);
+        }
+    }
+}
+
+
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
+                                      size_t size, void *tag)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_shm_zone_t   *zone;
+
+    part = &cf->cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++)
+    {
+
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (name->len != zone[i].name.len
+                || ngx_strncmp(name->data, zone[i].name.data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (tag != zone[i].tag)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the shared memory zone \"%s\" is "
+                               "already declared for a different use",
+                               zone[i].name.data);
+            return NULL;
+        }
+
+        if (size && zone[i].size && size != zone[i].size)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the size " SIZE_T_FMT " of the shared memory "
+                               "zone \"%s\" conflicts with the already "
+                               "declared size " SIZE_T_FMT,
+                               size, zone[i].name.data, zone[i].size);
+            return NULL;
+        }
+
+        if (size)
+        {
+            zone[i].size = size;
+        }
+
+        return &zone[i];
+    }
+
+    if (!(zone = ngx_list_push(&cf->cycle->shared_memory)))
+    {
+        return NULL;
+    }
+
+    zone->name = *name;
+    zone->size = size;
+    zone->shpool = NULL;
+    zone->data = NULL;
+    zone->tag = tag;
+    zone->init = NULL;
+
+    return zone;
+}
+
+
+#if !(WIN32)
+
+/*
+ * a zone of the same name, size and owner is inherited from the old cycle
+ * with its content, the owner's init() gets the old zone data to pick it up
+ */
+
+static ngx_int_t ngx_init_zones(ngx_cycle_t *cycle, ngx_cycle_t *old_cycle)
+{
+    ngx_uint_t        i, n;
+    ngx_list_part_t  *part, *opart;
+    ngx_shm_zone_t   *zone, *ozone, *old;
+
+    part = &cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++)
+    {
+
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].size == 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "the size of the shared memory zone \"%s\" "
+                          "is not defined", zone[i].name.data);
+            return NGX_ERROR;
+        }
+
+        if (zone[i].init == NULL)
+        {
+            /* the zone is declared but is not used */
+            continue;
+        }
+
+        old = NULL;
+
+        opart = &old_cycle->shared_memory.part;
+        ozone = opart->elts;
+
+        for (n = 0; /* void */ ; n++)
+        {
+
+            if (n >= opart->nelts)
+            {
+                if (opart->next == NULL)
+                {
+                    break;
+                }
+                opart = opart->next;
+                ozone = opart->elts;
+                n = 0;
+            }
+
+            if (ozone[n].shpool
+                    && ozone[n].tag == zone[i].tag
+                    && ozone[n].size == zone[i].size
+                    && ozone[n].name.len == zone[i].name.len
+                    && ngx_strncmp(ozone[n].name.data, zone[i].name.data,
+                                   zone[i].name.len) == 0)
+            {
+                old = &ozone[n];
+                break;
+            }
+        }
+
+        if (old)
+        {
+            zone[i].shpool = old->shpool;
+
+            if (zone[i].init(&zone[i], old->data) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        zone[i].shpool = ngx_create_shared_memory(zone[i].size, cycle->log);
+        if (zone[i].shpool == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_slab_init(zone[i].shpool, zone[i].size, cycle->log)
+                != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (zone[i].init(&zone[i], NULL) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void ngx_free_zones(ngx_cycle_t *cycle, ngx_cycle_t *keep)
+{
+    ngx_uint_t        i, n;
+    ngx_list_part_t  *part, *kpart;
+    ngx_shm_zone_t   *zone, *kzone;
+
+    part = &cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++)
+    {
+
+        if (i >= part->nelts)
+        {
+            if (part->next == NULL)
+            {
+                break;
+            }
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].shpool == NULL)
+        {
+            continue;
+        }
+
+        kpart = &keep->shared_memory.part;
+        kzone = kpart->elts;
+
+        for (n = 0; /* void */ ; n++)
+        {
+
+            if (n >= kpart->nelts)
+            {
+                if (kpart->next == NULL)
+                {
+                    break;
+                }
+                kpart = kpart->next;
+                kzone = kpart->elts;
+                n = 0;
+            }
+
+            if (kzone[n].shpool == zone[i].shpool)
+            {
+                break;
+            }
+        }
+
+        if (n < kpart->nelts)
+        {
+            /* the zone is inherited */
+            continue;
+        }
+
+        ngx_free_shared_memory(zone[i].shpool, zone[i].size, cycle->log);
+        zone[i].shpool = NULL;
+    }
+}
+
+#endif
+
+
+#if (HAVE_REUSEPORT)
+
+/*
+ * the "reuseport" listening socket is duplicated for each worker process,
+ * the kernel balances the new connections between the sockets bound
+ * to the same address and the workers do not need the accept mutex
+ */
+
+static ngx_int_t ngx_clone_listening(ngx_cycle_t *cycle)
+{
+    ngx_uint_t        i, n, nelts;
+    ngx_listening_t  *ls, *nls;
+    ngx_core_conf_t  *ccf;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (!ccf->master || ccf->worker_processes <= 1)
+    {
+        return NGX_OK;
+    }
+
+    nelts = cycle->listening.nelts;
+
+    for (i = 0; i < nelts; i++)
+    {
+        ls = cycle->listening.elts;
+
+        if (!ls[i].reuseport)
+        {
+            continue;
+        }
+
+        for (n = 1; n < (ngx_uint_t) ccf->worker_processes; n++)
+        {
+            if (!(nls = ngx_push_array(&cycle->listening)))
+            {
+                return NGX_ERROR;
+            }
+
+            /* the array may be reallocated */
+
+            ls = cycle->listening.elts;
+
+            *nls = ls[i];
+            nls->worker = n;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void ngx_clean_old_cycles(ngx_event_t *ev)
 {
     ngx_uint_t     i, n, found, live;
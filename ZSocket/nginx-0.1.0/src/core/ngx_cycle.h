@@ -12,6 +12,24 @@
 #include <ngx_core.h>
 
 
+typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
+
+typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+
+struct ngx_shm_zone_s
+{
+    ngx_str_t              name;
+    size_t                 size;
+    ngx_slab_pool_t       *shpool;
+
+    void                  *data;     /* the owner's data */
+    void                  *tag;      /* the owner module */
+
+    /* data is the owner's data of the zone in the old cycle or NULL */
+    ngx_shm_zone_init_pt   init;
+};
+
+
 struct ngx_cycle_s
 {
     void           ****conf_ctx;
@@ -23,6 +41,7 @@ struct ngx_cycle_s
     ngx_array_t        listening;
     ngx_array_t        pathes;
     ngx_list_t         open_files;
+    ngx_list_t         shared_memory;
 
     ngx_uint_t         connection_n;
     ngx_connection_t  *connections;
@@ -67,6 +86,9 @@ ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle);
 ngx_int_t ngx_create_pidfile(ngx_cycle_t *cycle, ngx_cycle_t *old_cycle);
 void ngx_delete_pidfile(ngx_cycle_t *cycle);
 void ngx_reopen_files(ngx_cycle_t *cycle, ngx_uid_t user);
+void ngx_flush_files(ngx_cycle_t *cycle);
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
+                                      size_t size, void *tag);
 ngx_pid_t ngx_exec_new_binary(ngx_cycle_t *cycle, char *const *argv);
 
 
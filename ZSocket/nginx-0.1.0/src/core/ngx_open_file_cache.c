@@ -0,0 +1,898 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_channel.h>
+
+#if (HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
+
+/*
+ * The open file cache keeps the descriptors of the regular files,
+ * the stat() results of the directories and, if it is allowed, the open()
+ * and stat() errors.  The entries are looked up by the rbtree and are
+ * evicted by the LRU list when the cache is full or they are inactive.
+ *
+ * An entry is used without any syscall during the "valid" time, after that
+ * the file is stat()ed and its descriptor is kept if the file is the same.
+ * On Linux the watched files are removed from the cache by the inotify
+ * events as soon as they are changed, however the parent directories
+ * are not watched, so the "valid" time still applies.
+ */
+
+
+#if (HAVE_INOTIFY)
+
+#define NGX_OPEN_FILE_WATCH_MASK                                              \
+                             (IN_ATTRIB|IN_MODIFY|IN_MOVE_SELF|IN_DELETE_SELF)
+
+/* the several names of the same file share one inotify watch */
+
+struct ngx_open_file_watch_s
+{
+    ngx_rbtree_t              node;      /* node.key is the watch descriptor */
+    ngx_cached_open_file_t   *files;
+    unsigned                  ignored:1; /* the watch is removed by kernel */
+};
+
+#endif
+
+
+static ngx_int_t ngx_open_file_cache_init_process(ngx_cycle_t *cycle);
+static ngx_cached_open_file_t *ngx_open_file_cache_find(
+        ngx_open_file_cache_t *cache, ngx_int_t key);
+static ngx_int_t ngx_open_and_stat_file(u_char *name,
+                                        ngx_open_file_info_t *of,
+                                        ngx_log_t *log);
+static ngx_uint_t ngx_open_file_cache_usable(ngx_cached_open_file_t *file,
+        ngx_open_file_info_t *of);
+static ngx_int_t ngx_open_file_cache_use(ngx_cached_open_file_t *file,
+        ngx_open_file_info_t *of, time_t now);
+static void ngx_open_file_cache_insert(ngx_open_file_cache_t *cache,
+                                       ngx_cached_open_file_t *file);
+static void ngx_open_file_cache_expire(ngx_open_file_cache_t *cache,
+                                       time_t now, ngx_uint_t n,
+                                       ngx_log_t *log);
+static void ngx_open_file_cache_remove(ngx_cached_open_file_t *file,
+                                       ngx_log_t *log);
+static void ngx_open_file_cache_free(ngx_cached_open_file_t *file,
+                                     ngx_log_t *log);
+#if (HAVE_INOTIFY)
+static void ngx_open_file_add_watch(ngx_cached_open_file_t *file,
+                                    ngx_log_t *log);
+static void ngx_open_file_del_watch(ngx_cached_open_file_t *file,
+                                    ngx_log_t *log);
+static void ngx_open_file_watch_invalidate(ngx_open_file_watch_t *watch,
+        ngx_log_t *log);
+static void ngx_open_file_watch_handler(ngx_event_t *ev);
+#endif
+
+
+static ngx_core_module_t  ngx_open_file_cache_module_ctx =
+{
+    ngx_string("open_file_cache"),
+    NULL,
+    NULL
+};
+
+
+ngx_module_t  ngx_open_file_cache_module =
+{
+    NGX_MODULE,
+    &ngx_open_file_cache_module_ctx,       /* module context */
+    NULL,                                  /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init module */
+    ngx_open_file_cache_init_process       /* init process */
+};
+
+
+/* set in the master process and inherited by the workers */
+
+static ngx_uint_t             ngx_open_file_cache_used;
+
+#if (HAVE_INOTIFY)
+
+static ngx_fd_t               ngx_open_file_inotify = -1;
+static ngx_rbtree_t          *ngx_open_file_watch_root;
+static ngx_rbtree_t           ngx_open_file_watch_sentinel;
+
+#endif
+
+
+ngx_open_file_cache_t *ngx_open_file_cache_init(ngx_pool_t *pool,
+                                                ngx_uint_t max,
+                                                time_t inactive)
+{
+    ngx_open_file_cache_t  *cache;
+
+    if (!(cache = ngx_pcalloc(pool, sizeof(ngx_open_file_cache_t))))
+    {
+        return NULL;
+    }
+
+    /* the calloc()ed sentinel is black */
+
+    cache->root = &cache->sentinel;
+    cache->lru.next = &cache->lru;
+    cache->lru.prev = &cache->lru;
+
+    cache->current = 0;
+    cache->max = max;
+    cache->inactive = inactive;
+
+    ngx_open_file_cache_used = 1;
+
+    return cache;
+}
+
+
+/*
+ * returns NGX_OK or NGX_ERROR, of->err is zero if the error is not
+ * the file error; if of->file is set then the of->fd must be released
+ * by ngx_close_cached_file(of->file)
+ */
+
+ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
+                               ngx_open_file_info_t *of, ngx_log_t *log)
+{
+    time_t                   now;
+    ngx_int_t                key, rc;
+    ngx_file_info_t          fi;
+    ngx_cached_open_file_t  *file;
+
+    of->fd = NGX_INVALID_FILE;
+    of->err = 0;
+    of->failed = NULL;
+    of->file = NULL;
+
+    now = ngx_time();
+
+    ngx_open_file_cache_expire(cache, now, 1, log);
+
+    key = (ngx_int_t) ngx_crc((char *) name->data, name->len);
+
+    for (file = ngx_open_file_cache_find(cache, key); file; file = file->same)
+    {
+        if (file->len == name->len
+                && ngx_strncmp(file->name, name->data, name->len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (file)
+    {
+        if (now - file->created < of->valid
+                && ngx_open_file_cache_usable(file, of))
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                           "open file cache hit: \"%s\", fd: %d",
+                           file->name, file->fd);
+
+#if (NGX_STAT_STUB)
+            ngx_atomic_inc(ngx_stat_open_file_hits);
+#endif
+
+            return ngx_open_file_cache_use(file, of, now);
+        }
+
+        /* the kept descriptor is used if the file is the same */
+
+        if (file->fd != NGX_INVALID_FILE
+                && ngx_file_info(file->name, &fi) != NGX_FILE_ERROR
+                && ngx_is_file(&fi)
+                && ngx_file_uniq(&fi) == file->uniq)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                           "open file cache revalidated: \"%s\", fd: %d",
+                           file->name, file->fd);
+
+#if (NGX_STAT_STUB)
+            ngx_atomic_inc(ngx_stat_open_file_misses);
+#endif
+
+            file->mtime = ngx_file_mtime(&fi);
+            file->size = ngx_file_size(&fi);
+            file->created = now;
+
+            return ngx_open_file_cache_use(file, of, now);
+        }
+
+        ngx_open_file_cache_remove(file, log);
+    }
+
+#if (NGX_STAT_STUB)
+    ngx_atomic_inc(ngx_stat_open_file_misses);
+#endif
+
+    if (!(file = ngx_alloc(sizeof(ngx_cached_open_file_t) + name->len, log)))
+    {
+        return NGX_ERROR;
+    }
+
+    file->len = name->len;
+    ngx_memcpy(file->name, name->data, name->len);
+    file->name[name->len] = '\0';
+
+    file->cache = cache;
+    file->count = 0;
+    file->close = 0;
+
+#if (HAVE_INOTIFY)
+
+    /* the watch is added before the open() to see the following changes */
+
+    file->watch = NULL;
+    ngx_open_file_add_watch(file, log);
+
+#endif
+
+    rc = ngx_open_and_stat_file(file->name, of, log);
+
+    if (rc == NGX_DECLINED || (rc == NGX_ERROR && !of->errors))
+    {
+        /* the error is not cached */
+
+#if (HAVE_INOTIFY)
+        ngx_open_file_del_watch(file, log);
+#endif
+        ngx_free(file);
+
+        return NGX_ERROR;
+    }
+
+    file->fd = of->fd;
+    file->uniq = of->uniq;
+    file->mtime = of->mtime;
+    file->size = of->size;
+    file->err = of->err;
+    file->failed = of->failed;
+    file->is_dir = of->is_dir;
+    file->is_file = of->is_file;
+    file->test_dir = of->test_dir;
+
+    file->created = now;
+    file->accessed = now;
+
+    if (cache->current >= cache->max)
+    {
+        ngx_open_file_cache_expire(cache, now, 0, log);
+    }
+
+    file->node.key = key;
+    ngx_open_file_cache_insert(cache, file);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "open file cache add: \"%s\", fd: %d",
+                   file->name, file->fd);
+
+    if (rc == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    if (file->fd != NGX_INVALID_FILE)
+    {
+        file->count = 1;
+        of->file = file;
+    }
+
+    return NGX_OK;
+}
+
+
+void ngx_close_cached_file(void *data)
+{
+    ngx_cached_open_file_t *file = data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "close cached file: \"%s\", count: %d, close: %d",
+                   file->name, file->count, file->close);
+
+    file->count--;
+
+    if (file->count == 0 && file->close)
+    {
+        ngx_open_file_cache_free(file, ngx_cycle->log);
+    }
+}
+
+
+static ngx_int_t ngx_open_file_cache_init_process(ngx_cycle_t *cycle)
+{
+#if (HAVE_INOTIFY)
+
+    ngx_fd_t  fd;
+
+    ngx_open_file_watch_root = &ngx_open_file_watch_sentinel;
+
+    if (!ngx_open_file_cache_used)
+    {
+        return NGX_OK;
+    }
+
+    /* the cache works without inotify, the entries just live longer */
+
+    fd = inotify_init();
+
+    if (fd == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "inotify_init() failed");
+        return NGX_OK;
+    }
+
+    if (ngx_nonblocking(fd) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_nonblocking_n " inotify failed");
+        (void) close(fd);
+        return NGX_OK;
+    }
+
+    if (ngx_add_channel_event(cycle, fd, NGX_READ_EVENT,
+                              ngx_open_file_watch_handler) == NGX_ERROR)
+    {
+        (void) close(fd);
+        return NGX_OK;
+    }
+
+    ngx_open_file_inotify = fd;
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_cached_open_file_t *ngx_open_file_cache_find(
+        ngx_open_file_cache_t *cache, ngx_int_t key)
+{
+    ngx_rbtree_t  *node, *sentinel;
+
+    sentinel = &cache->sentinel;
+
+    for (node = cache->root; node != sentinel; /* void */)
+    {
+        if (key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_cached_open_file_t *) node;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * the directories and the special files are not kept open,
+ * NGX_DECLINED means that the fstat() of the opened file has failed
+ */
+
+static ngx_int_t ngx_open_and_stat_file(u_char *name,
+                                        ngx_open_file_info_t *of,
+                                        ngx_log_t *log)
+{
+    ngx_fd_t         fd;
+    ngx_file_info_t  fi;
+
+    if (of->test_dir)
+    {
+        if (ngx_file_info(name, &fi) == NGX_FILE_ERROR)
+        {
+            of->err = ngx_errno;
+            of->failed = ngx_file_info_n;
+            return NGX_ERROR;
+        }
+
+        fd = NGX_INVALID_FILE;
+
+    }
+    else
+    {
+        fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN);
+
+        if (fd == NGX_INVALID_FILE)
+        {
+            of->err = ngx_errno;
+            of->failed = ngx_open_file_n;
+            return NGX_ERROR;
+        }
+
+        if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+        {
+            of->err = ngx_errno;
+            of->failed = ngx_fd_info_n;
+
+            if (ngx_close_file(fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", name);
+            }
+
+            return NGX_DECLINED;
+        }
+
+        if (!ngx_is_file(&fi))
+        {
+            if (ngx_close_file(fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", name);
+            }
+
+            fd = NGX_INVALID_FILE;
+        }
+    }
+
+    of->fd = fd;
+    of->uniq = ngx_file_uniq(&fi);
+    of->mtime = ngx_file_mtime(&fi);
+    of->size = ngx_file_size(&fi);
+    of->is_dir = ngx_is_dir(&fi) ? 1 : 0;
+    of->is_file = ngx_is_file(&fi) ? 1 : 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the stat() result of a regular file can not be used to open it,
+ * and the open() errors other than ENOENT and ENOTDIR can not be used
+ * for stat() and vice versa
+ */
+
+static ngx_uint_t ngx_open_file_cache_usable(ngx_cached_open_file_t *file,
+        ngx_open_file_info_t *of)
+{
+    if (file->err)
+    {
+        if (!of->errors)
+        {
+            return 0;
+        }
+
+        return file->test_dir == of->test_dir
+               || file->err == NGX_ENOENT
+               || file->err == NGX_ENOTDIR;
+    }
+
+    if (of->test_dir)
+    {
+        return 1;
+    }
+
+    return !(file->is_file && file->fd == NGX_INVALID_FILE);
+}
+
+
+static ngx_int_t ngx_open_file_cache_use(ngx_cached_open_file_t *file,
+        ngx_open_file_info_t *of, time_t now)
+{
+    ngx_open_file_cache_t  *cache;
+
+    cache = file->cache;
+
+    file->accessed = now;
+
+    /* move to the head of the LRU list */
+
+    file->prev->next = file->next;
+    file->next->prev = file->prev;
+
+    file->next = cache->lru.next;
+    file->prev = &cache->lru;
+    cache->lru.next->prev = file;
+    cache->lru.next = file;
+
+    if (file->err)
+    {
+        of->err = file->err;
+        of->failed = file->failed;
+        return NGX_ERROR;
+    }
+
+    of->uniq = file->uniq;
+    of->mtime = file->mtime;
+    of->size = file->size;
+    of->is_dir = file->is_dir;
+    of->is_file = file->is_file;
+
+    if (file->fd != NGX_INVALID_FILE && !of->test_dir)
+    {
+        of->fd = file->fd;
+        of->file = file;
+        file->count++;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the names of the same crc are linked to the rbtree node,
+ * so the rbtree has the unique keys only
+ */
+
+static void ngx_open_file_cache_insert(ngx_open_file_cache_t *cache,
+                                       ngx_cached_open_file_t *file)
+{
+    ngx_cached_open_file_t  *node;
+
+    node = ngx_open_file_cache_find(cache, file->node.key);
+
+    if (node)
+    {
+        file->in_tree = 0;
+        file->same = node->same;
+        node->same = file;
+
+    }
+    else
+    {
+        file->in_tree = 1;
+        file->same = NULL;
+        ngx_rbtree_insert(&cache->root, &cache->sentinel, &file->node);
+    }
+
+    file->next = cache->lru.next;
+    file->prev = &cache->lru;
+    cache->lru.next->prev = file;
+    cache->lru.next = file;
+
+    cache->current++;
+}
+
+
+/*
+ * n == 1 deletes up to two inactive entries from the tail of the LRU list,
+ * n == 0 deletes the least recently used entry unconditionally as well
+ */
+
+static void ngx_open_file_cache_expire(ngx_open_file_cache_t *cache,
+                                       time_t now, ngx_uint_t n,
+                                       ngx_log_t *log)
+{
+    ngx_cached_open_file_t  *file;
+
+    while (n < 3)
+    {
+        file = cache->lru.prev;
+
+        if (file == &cache->lru)
+        {
+            return;
+        }
+
+        if (n++ != 0 && now - file->accessed <= cache->inactive)
+        {
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                       "open file cache expire: \"%s\"", file->name);
+
+        ngx_open_file_cache_remove(file, log);
+    }
+}
+
+
+/* the entry that is still used by a request is freed by the last user */
+
+static void ngx_open_file_cache_remove(ngx_cached_open_file_t *file,
+                                       ngx_log_t *log)
+{
+    ngx_open_file_cache_t   *cache;
+    ngx_cached_open_file_t  *node;
+
+    cache = file->cache;
+
+    file->prev->next = file->next;
+    file->next->prev = file->prev;
+
+    if (file->in_tree)
+    {
+        ngx_rbtree_delete(&cache->root, &cache->sentinel, &file->node);
+
+        if (file->same)
+        {
+            file->same->in_tree = 1;
+            ngx_rbtree_insert(&cache->root, &cache->sentinel,
+                              &file->same->node);
+        }
+
+    }
+    else
+    {
+        node = ngx_open_file_cache_find(cache, file->node.key);
+
+        while (node->same != file)
+        {
+            node = node->same;
+        }
+
+        node->same = file->same;
+    }
+
+    cache->current--;
+
+#if (HAVE_INOTIFY)
+    ngx_open_file_del_watch(file, log);
+#endif
+
+    file->close = 1;
+
+    if (file->count == 0)
+    {
+        ngx_open_file_cache_free(file, log);
+    }
+}
+
+
+static void ngx_open_file_cache_free(ngx_cached_open_file_t *file,
+                                     ngx_log_t *log)
+{
+    if (file->fd != NGX_INVALID_FILE)
+    {
+        if (ngx_close_file(file->fd) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", file->name);
+        }
+    }
+
+    ngx_free(file);
+}
+
+
+#if (HAVE_INOTIFY)
+
+/*
+ * a watch failure is not an error, e.g. the watches number is limited
+ * by the max_user_watches, and the entry is still revalidated by the time
+ */
+
+static void ngx_open_file_add_watch(ngx_cached_open_file_t *file,
+                                    ngx_log_t *log)
+{
+    ngx_int_t               wd;
+    ngx_rbtree_t           *node, *sentinel;
+    ngx_open_file_watch_t  *watch;
+
+    if (ngx_open_file_inotify == -1)
+    {
+        return;
+    }
+
+    wd = inotify_add_watch(ngx_open_file_inotify, (char *) file->name,
+                           NGX_OPEN_FILE_WATCH_MASK);
+
+    if (wd == -1)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, ngx_errno,
+                       "inotify_add_watch(\"%s\") failed", file->name);
+        return;
+    }
+
+    sentinel = &ngx_open_file_watch_sentinel;
+
+    for (node = ngx_open_file_watch_root; node != sentinel; /* void */)
+    {
+        if (wd < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (wd > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        break;
+    }
+
+    if (node != sentinel)
+    {
+        watch = (ngx_open_file_watch_t *) node;
+
+    }
+    else
+    {
+        if (!(watch = ngx_alloc(sizeof(ngx_open_file_watch_t), log)))
+        {
+            (void) inotify_rm_watch(ngx_open_file_inotify, wd);
+            return;
+        }
+
+        watch->node.key = wd;
+        watch->files = NULL;
+        watch->ignored = 0;
+
+        ngx_rbtree_insert(&ngx_open_file_watch_root, sentinel, &watch->node);
+    }
+
+    file->watch = watch;
+    file->watch_next = watch->files;
+    watch->files = file;
+}
+
+
+static void ngx_open_file_del_watch(ngx_cached_open_file_t *file,
+                                    ngx_log_t *log)
+{
+    ngx_open_file_watch_t    *watch;
+    ngx_cached_open_file_t  **fp;
+
+    watch = file->watch;
+
+    if (watch == NULL)
+    {
+        return;
+    }
+
+    for (fp = &watch->files; *fp != file; fp = &(*fp)->watch_next)
+    {
+        /* void */
+    }
+
+    *fp = file->watch_next;
+    file->watch = NULL;
+
+    if (watch->files)
+    {
+        return;
+    }
+
+    if (!watch->ignored
+            && inotify_rm_watch(ngx_open_file_inotify, watch->node.key) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "inotify_rm_watch() failed");
+    }
+
+    ngx_rbtree_delete(&ngx_open_file_watch_root, &ngx_open_file_watch_sentinel,
+                      &watch->node);
+
+    ngx_free(watch);
+}
+
+
+/* the watch is freed with its last file */
+
+static void ngx_open_file_watch_invalidate(ngx_open_file_watch_t *watch,
+        ngx_log_t *log)
+{
+    ngx_uint_t               last;
+    ngx_cached_open_file_t  *file;
+
+    do
+    {
+        file = watch->files;
+        last = (file->watch_next == NULL);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                       "open file cache invalidate: \"%s\"", file->name);
+
+        ngx_open_file_cache_remove(file, log);
+    }
+    while (!last);
+}
+
+
+static void ngx_open_file_watch_handler(ngx_event_t *ev)
+{
+    u_char                   *p, *last;
+    ssize_t                   n;
+    ngx_err_t                 err;
+    ngx_rbtree_t             *node, *sentinel;
+    struct inotify_event      buf[256], *ie;
+    ngx_open_file_watch_t    *watch;
+
+    sentinel = &ngx_open_file_watch_sentinel;
+
+    for ( ;; )
+    {
+        n = read(ngx_open_file_inotify, buf, sizeof(buf));
+
+        if (n == -1)
+        {
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN)
+            {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "read() from inotify failed");
+            }
+
+            return;
+        }
+
+        if (n == 0)
+        {
+            return;
+        }
+
+        last = (u_char *) buf + n;
+
+        for (p = (u_char *) buf; p < last; p += sizeof(struct inotify_event)
+                                                 + ie->len)
+        {
+            ie = (struct inotify_event *) p;
+
+            if (ie->mask & IN_Q_OVERFLOW)
+            {
+                ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                              "inotify queue overflow, "
+                              "the open file cache is invalidated");
+
+                while (ngx_open_file_watch_root != sentinel)
+                {
+                    ngx_open_file_watch_invalidate(
+                        (ngx_open_file_watch_t *) ngx_open_file_watch_root,
+                        ev->log);
+                }
+
+                continue;
+            }
+
+            /* the events of the files in a watched directory are skipped */
+
+            if (ie->len)
+            {
+                continue;
+            }
+
+            for (node = ngx_open_file_watch_root; node != sentinel; /* void */)
+            {
+                if (ie->wd < node->key)
+                {
+                    node = node->left;
+                    continue;
+                }
+
+                if (ie->wd > node->key)
+                {
+                    node = node->right;
+                    continue;
+                }
+
+                break;
+            }
+
+            if (node == sentinel)
+            {
+                continue;
+            }
+
+            watch = (ngx_open_file_watch_t *) node;
+
+            if (ie->mask & IN_IGNORED)
+            {
+                watch->ignored = 1;
+            }
+
+            ngx_open_file_watch_invalidate(watch, ev->log);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,112 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#ifndef _NGX_OPEN_FILE_CACHE_H_INCLUDED_
+#define _NGX_OPEN_FILE_CACHE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct ngx_cached_open_file_s  ngx_cached_open_file_t;
+typedef struct ngx_open_file_watch_s   ngx_open_file_watch_t;
+
+
+typedef struct
+{
+    /* the lookup parameters */
+
+    time_t                    valid;
+    unsigned                  errors:1;    /* cache the errors */
+    unsigned                  test_dir:1;  /* stat() only, do not open */
+
+    /* the result */
+
+    ngx_fd_t                  fd;
+    ngx_file_uniq_t           uniq;
+    time_t                    mtime;
+    off_t                     size;
+
+    ngx_err_t                 err;
+    char                     *failed;
+
+    unsigned                  is_dir:1;
+    unsigned                  is_file:1;
+
+    /* the fd is used until ngx_close_cached_file(file) */
+    ngx_cached_open_file_t   *file;
+} ngx_open_file_info_t;
+
+
+/*
+ * the cache is private to a worker process, the entries are allocated
+ * by malloc() and own their descriptors
+ */
+
+struct ngx_cached_open_file_s
+{
+    ngx_rbtree_t              node;      /* node.key is the name crc */
+    ngx_cached_open_file_t   *same;      /* the other names of the same crc */
+
+    ngx_cached_open_file_t   *prev;      /* the LRU list */
+    ngx_cached_open_file_t   *next;
+
+    ngx_open_file_cache_t    *cache;
+
+#if (HAVE_INOTIFY)
+    ngx_open_file_watch_t    *watch;
+    ngx_cached_open_file_t   *watch_next;
+#endif
+
+    ngx_fd_t                  fd;
+    ngx_file_uniq_t           uniq;
+    time_t                    mtime;
+    off_t                     size;
+    ngx_err_t                 err;
+    char                     *failed;
+
+    time_t                    created;
+    time_t                    accessed;
+
+    ngx_uint_t                count;     /* the requests that use the fd */
+
+    unsigned                  is_dir:1;
+    unsigned                  is_file:1;
+    unsigned                  test_dir:1;  /* only stat()ed */
+    unsigned                  in_tree:1;
+    unsigned                  close:1;   /* removed from the cache */
+
+    size_t                    len;
+    u_char                    name[1];
+};
+
+
+struct ngx_open_file_cache_s
+{
+    ngx_rbtree_t             *root;
+    ngx_rbtree_t              sentinel;
+
+    ngx_cached_open_file_t    lru;       /* the most recently used first */
+
+    ngx_uint_t                current;
+    ngx_uint_t                max;
+    time_t                    inactive;
+};
+
+
+ngx_open_file_cache_t *ngx_open_file_cache_init(ngx_pool_t *pool,
+                                                ngx_uint_t max,
+                                                time_t inactive);
+ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
+                               ngx_open_file_info_t *of, ngx_log_t *log);
+void ngx_close_cached_file(void *data);
+
+
+extern ngx_module_t  ngx_open_file_cache_module;
+
+
+#endif /* _NGX_OPEN_FILE_CACHE_H_INCLUDED_ */
@@ -14,8 +14,28 @@
 
 ngx_inline static ngx_int_t
 ngx_output_chain_need_to_copy(ngx_output_chain_ctx_t *ctx, ngx_buf_t *buf);
-static ngx_int_t ngx_output_chain_copy_buf(ngx_buf_t *dst, ngx_buf_t *src,
-        ngx_uint_t sendfile);
+static ngx_int_t ngx_output_chain_copy_buf(ngx_output_chain_ctx_t *ctx,
+        ngx_buf_t *dst, ngx_buf_t *src);
+
+#if (NGX_THREAD_POOL)
+
+typedef struct
+{
+    ngx_fd_t   fd;
+    off_t      offset;
+    size_t     size;
+    ssize_t    n;
+    ngx_err_t  err;
+    u_char     buf[1];
+} ngx_output_chain_read_t;
+
+
+static ssize_t ngx_output_chain_thread_read(ngx_output_chain_ctx_t *ctx,
+        ngx_file_t *file, u_char *buf, size_t size, off_t offset);
+static void ngx_output_chain_thread_read_handler(void *data);
+static void ngx_output_chain_thread_read_done(ngx_thread_task_t *task);
+
+#endif
 
 
 ngx_int_t ngx_output_chain(ngx_output_chain_ctx_t *ctx, ngx_chain_t *in)
@@ -62,6 +82,17 @@ ngx_int_t ngx_output_chain(ngx_output_chain_ctx_t *ctx, ngx_chain_t *in)
     for ( ;; )
     {
 
+#if (NGX_THREAD_POOL)
+
+        /* a file read is run by the thread pool, ctx->in is kept intact */
+
+        if (ctx->aio)
+        {
+            return NGX_AGAIN;
+        }
+
+#endif
+
         while (ctx->in)
         {
 
@@ -159,8 +190,7 @@ ngx_int_t ngx_output_chain(ngx_output_chain_ctx_t *ctx, ngx_chain_t *in)
                 }
             }
 
-            rc = ngx_output_chain_copy_buf(ctx->buf, ctx->in->buf,
-                                           ctx->sendfile);
+            rc = ngx_output_chain_copy_buf(ctx, ctx->buf, ctx->in->buf);
 
             if (rc == NGX_ERROR)
             {
@@ -240,8 +270,8 @@ ngx_output_chain_need_to_copy(ngx_output_chain_ctx_t *ctx, ngx_buf_t *buf)
 }
 
 
-static ngx_int_t ngx_output_chain_copy_buf(ngx_buf_t *dst, ngx_buf_t *src,
-        ngx_uint_t sendfile)
+static ngx_int_t ngx_output_chain_copy_buf(ngx_output_chain_ctx_t *ctx,
+        ngx_buf_t *dst, ngx_buf_t *src)
 {
     size_t   size;
     ssize_t  n;
@@ -272,8 +302,30 @@ static ngx_int_t ngx_output_chain_copy_buf(ngx_buf_t *dst, ngx_buf_t *src,
     }
     else
     {
+#if (NGX_THREAD_POOL)
+
+        if (ctx->thread_pool)
+        {
+            n = ngx_output_chain_thread_read(ctx, src->file, dst->pos, size,
+                                             src->file_pos);
+
+            if (n == NGX_AGAIN)
+            {
+                return n;
+            }
+
+        }
+        else
+        {
+            n = ngx_read_file(src->file, dst->pos, size, src->file_pos);
+        }
+
+#else
+
         n = ngx_read_file(src->file, dst->pos, size, src->file_pos);
 
+#endif
+
         if (n == NGX_ERROR)
         {
             return n;
@@ -300,7 +352,7 @@ static ngx_int_t ngx_output_chain_copy_buf(ngx_buf_t *dst, ngx_buf_t *src,
         src->file_pos += n;
         dst->last += n;
 
-        if (!sendfile)
+        if (!ctx->sendfile)
         {
             dst->in_file = 0;
         }
@@ -315,6 +367,115 @@ static ngx_int_t ngx_output_chain_copy_buf(ngx_buf_t *dst, ngx_buf_t *src,
 }
 
 
+#if (NGX_THREAD_POOL)
+
+/*
+ * the first call posts the read of the private buffer to the pool and
+ * returns NGX_AGAIN, the call after the completion with the same arguments
+ * copies the data read, so the thread never writes to the request memory
+ * that may be freed while the read is run
+ */
+
+static ssize_t ngx_output_chain_thread_read(ngx_output_chain_ctx_t *ctx,
+        ngx_file_t *file, u_char *buf, size_t size, off_t offset)
+{
+    ssize_t                   n;
+    ngx_thread_task_t        *task;
+    ngx_output_chain_read_t  *rd;
+
+    task = ctx->thread_task;
+
+    if (task)
+    {
+        ctx->thread_task = NULL;
+
+        rd = task->ctx;
+
+        if (rd->fd == file->fd && rd->offset == offset && rd->size == size)
+        {
+            n = rd->n;
+
+            if (n == -1)
+            {
+                ngx_log_error(NGX_LOG_CRIT, file->log, rd->err,
+                              "pread() failed, file \"%s\"",
+                              file->name.data);
+                ngx_thread_task_free(task);
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(buf, rd->buf, n);
+            ngx_thread_task_free(task);
+
+            file->offset += n;
+
+            return n;
+        }
+
+        ngx_thread_task_free(task);
+    }
+
+    task = ngx_thread_task_alloc(sizeof(ngx_output_chain_read_t) + size,
+                                 file->log);
+    if (task == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    rd = task->ctx;
+    rd->fd = file->fd;
+    rd->offset = offset;
+    rd->size = size;
+
+    task->handler = ngx_output_chain_thread_read_handler;
+    task->event_handler = ngx_output_chain_thread_read_done;
+    task->data = ctx;
+
+    if (ngx_thread_task_post(ctx->thread_pool, task) != NGX_OK)
+    {
+        ngx_thread_task_free(task);
+
+        /* the queue is full, read the file in the worker */
+
+        return ngx_read_file(file, buf, size, offset);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "thread read: %d, %d, " OFF_T_FMT,
+                   file->fd, size, offset);
+
+    ctx->thread_task = task;
+    ctx->aio = 1;
+
+    return NGX_AGAIN;
+}
+
+
+static void ngx_output_chain_thread_read_handler(void *data)
+{
+    ngx_output_chain_read_t *rd = data;
+
+    rd->n = pread(rd->fd, rd->buf, rd->size, rd->offset);
+
+    if (rd->n == -1)
+    {
+        rd->err = ngx_errno;
+    }
+}
+
+
+static void ngx_output_chain_thread_read_done(ngx_thread_task_t *task)
+{
+    ngx_output_chain_ctx_t *ctx = task->data;
+
+    ctx->aio = 0;
+
+    ctx->thread_handler(ctx->thread_data);
+}
+
+#endif
+
+
 ngx_int_t ngx_chain_writer(void *data, ngx_chain_t *in)
 {
     ngx_chain_writer_ctx_t *ctx = data;
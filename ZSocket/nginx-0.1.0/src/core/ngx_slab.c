@@ -0,0 +1,398 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * The pool divides a shared memory zone into the pages.  The allocations
+ * larger than a half of a page get the runs of the whole pages, the smaller
+ * ones are rounded up to a power of two and are carved from the pages that
+ * are dedicated to the chunks of one size.  The partially free pages of each
+ * size are kept in the slot lists, the free page runs are kept in the free
+ * list and are merged with their free neighbours when they are freed.
+ */
+
+
+#define ngx_slab_page_addr(pool, page)                                        \
+    ((pool)->start + (((page) - (pool)->pages) << (pool)->page_shift))
+
+
+static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
+        ngx_uint_t npages);
+static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
+                                ngx_uint_t npages);
+static void ngx_slab_link(ngx_slab_page_t *list, ngx_slab_page_t *page);
+static void ngx_slab_unlink(ngx_slab_page_t *page);
+
+
+ngx_int_t ngx_slab_init(ngx_slab_pool_t *pool, size_t size, ngx_log_t *log)
+{
+    u_char      *p;
+    ngx_uint_t   i, n;
+
+    pool->page_shift = 0;
+    for (n = ngx_pagesize; n >>= 1; pool->page_shift++)
+    {
+        /* void */
+    }
+
+    pool->nslots = pool->page_shift - NGX_SLAB_MIN_SHIFT;
+    pool->slots = (ngx_slab_page_t *) ((u_char *) pool
+                                       + sizeof(ngx_slab_pool_t));
+
+    for (i = 0; i < pool->nslots; i++)
+    {
+        pool->slots[i].next = &pool->slots[i];
+        pool->slots[i].prev = &pool->slots[i];
+    }
+
+    p = (u_char *) &pool->slots[pool->nslots];
+    pool->end = (u_char *) pool + size;
+
+    n = 0;
+
+    if (p < pool->end)
+    {
+        n = (pool->end - p) / (ngx_pagesize + sizeof(ngx_slab_page_t));
+    }
+
+    pool->pages = (ngx_slab_page_t *) p;
+    pool->start = (u_char *) (((uintptr_t) &pool->pages[n] + ngx_pagesize - 1)
+                              & ~((uintptr_t) ngx_pagesize - 1));
+
+    if (n && pool->start + (n << pool->page_shift) > pool->end)
+    {
+        n--;
+    }
+
+    if (n == 0)
+    {
+        ngx_log_error(NGX_LOG_EMERG, log, 0,
+                      "the shared memory zone of " SIZE_T_FMT
+                      " bytes is too small", size);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(pool->pages, n * sizeof(ngx_slab_page_t));
+
+    pool->npages = n;
+    pool->nfree = 0;
+
+    pool->free.next = &pool->free;
+    pool->free.prev = &pool->free;
+
+    ngx_slab_free_pages(pool, pool->pages, n);
+
+    pool->lock = 0;
+    pool->data = NULL;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                   "slab pool " PTR_FMT ": %d pages of %d",
+                   pool, n, ngx_pagesize);
+
+    return NGX_OK;
+}
+
+
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    ngx_slab_lock(pool);
+
+    p = ngx_slab_alloc_locked(pool, size);
+
+    ngx_slab_unlock(pool);
+
+    return p;
+}
+
+
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size)
+{
+    void  *p;
+
+    if ((p = ngx_slab_alloc(pool, size)))
+    {
+        ngx_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
+{
+    u_char           *p;
+    size_t            chunk;
+    ngx_uint_t        shift, n;
+    ngx_slab_page_t  *page, *slot;
+
+    if (size > (size_t) (ngx_pagesize >> 1))
+    {
+        page = ngx_slab_alloc_pages(pool,
+                                    (size + ngx_pagesize - 1) >> pool->page_shift);
+        if (page == NULL)
+        {
+            return NULL;
+        }
+
+        return ngx_slab_page_addr(pool, page);
+    }
+
+    for (shift = NGX_SLAB_MIN_SHIFT; ((size_t) 1 << shift) < size; shift++)
+    {
+        /* void */
+    }
+
+    slot = &pool->slots[shift - NGX_SLAB_MIN_SHIFT];
+    page = slot->next;
+
+    if (page == slot)
+    {
+        if (!(page = ngx_slab_alloc_pages(pool, 1)))
+        {
+            return NULL;
+        }
+
+        page->type = NGX_SLAB_PAGE_SMALL;
+        page->shift = shift;
+        page->used = 0;
+        page->free = NULL;
+
+        /* thread the free chunks through the page itself */
+
+        chunk = (size_t) 1 << shift;
+        p = ngx_slab_page_addr(pool, page) + ngx_pagesize;
+
+        for (n = ngx_pagesize >> shift; n; n--)
+        {
+            p -= chunk;
+            *(void **) p = page->free;
+            page->free = p;
+        }
+
+        ngx_slab_link(slot, page);
+    }
+
+    p = page->free;
+    page->free = *(void **) p;
+    page->used++;
+
+    if (page->free == NULL)
+    {
+        /* the page is full */
+        ngx_slab_unlink(page);
+    }
+
+    return p;
+}
+
+
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_slab_lock(pool);
+
+    ngx_slab_free_locked(pool, p);
+
+    ngx_slab_unlock(pool);
+}
+
+
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
+{
+    ngx_uint_t        n, full;
+    ngx_slab_page_t  *page;
+
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ngx_slab_free(): pointer " PTR_FMT
+                      " is outside of pool", p);
+        return;
+    }
+
+    n = ((u_char *) p - pool->start) >> pool->page_shift;
+
+    if (n >= pool->npages)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ngx_slab_free(): pointer " PTR_FMT
+                      " is outside of pool", p);
+        return;
+    }
+
+    page = &pool->pages[n];
+
+    switch (page->type)
+    {
+
+    case NGX_SLAB_PAGE_SMALL:
+
+        if (((uintptr_t) p & (((uintptr_t) 1 << page->shift) - 1)) != 0)
+        {
+            break;
+        }
+
+        full = (page->free == NULL);
+
+        *(void **) p = page->free;
+        page->free = p;
+
+        if (--page->used == 0)
+        {
+            if (!full)
+            {
+                ngx_slab_unlink(page);
+            }
+
+            ngx_slab_free_pages(pool, page, 1);
+            return;
+        }
+
+        if (full)
+        {
+            ngx_slab_link(&pool->slots[page->shift - NGX_SLAB_MIN_SHIFT],
+                          page);
+        }
+
+        return;
+
+    case NGX_SLAB_PAGE_START:
+
+        if ((u_char *) p != ngx_slab_page_addr(pool, page))
+        {
+            break;
+        }
+
+        ngx_slab_free_pages(pool, page, page->npages);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                  "ngx_slab_free(): pointer " PTR_FMT " to wrong chunk", p);
+}
+
+
+static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
+        ngx_uint_t npages)
+{
+    ngx_uint_t        i;
+    ngx_slab_page_t  *page, *rest;
+
+    for (page = pool->free.next; page != &pool->free; page = page->next)
+    {
+
+        if (page->npages < npages)
+        {
+            continue;
+        }
+
+        if (page->npages > npages)
+        {
+            /* the rest of the run stays in the free list in place */
+
+            rest = page + npages;
+            rest->npages = page->npages - npages;
+            rest->head = rest;
+            rest[rest->npages - 1].head = rest;
+
+            rest->next = page->next;
+            rest->prev = page->prev;
+            rest->next->prev = rest;
+            rest->prev->next = rest;
+
+        }
+        else
+        {
+            ngx_slab_unlink(page);
+        }
+
+        page->type = NGX_SLAB_PAGE_START;
+        page->npages = npages;
+        page->head = page;
+        page->next = NULL;
+        page->prev = NULL;
+
+        for (i = 1; i < npages; i++)
+        {
+            page[i].type = NGX_SLAB_PAGE_BUSY;
+            page[i].head = page;
+        }
+
+        pool->nfree -= npages;
+
+        return page;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "slab pool " PTR_FMT " has no memory", pool);
+
+    return NULL;
+}
+
+
+static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
+                                ngx_uint_t npages)
+{
+    ngx_uint_t        i;
+    ngx_slab_page_t  *neighbour;
+
+    for (i = 0; i < npages; i++)
+    {
+        page[i].type = NGX_SLAB_PAGE_FREE;
+    }
+
+    pool->nfree += npages;
+
+    /* merge with the following free run */
+
+    neighbour = page + npages;
+
+    if (neighbour < pool->pages + pool->npages
+            && neighbour->type == NGX_SLAB_PAGE_FREE)
+    {
+        ngx_slab_unlink(neighbour);
+        npages += neighbour->npages;
+    }
+
+    /* merge with the preceding free run, its last page knows its head */
+
+    if (page > pool->pages && page[-1].type == NGX_SLAB_PAGE_FREE)
+    {
+        neighbour = page[-1].head;
+
+        ngx_slab_unlink(neighbour);
+        npages += neighbour->npages;
+        page = neighbour;
+    }
+
+    page->npages = npages;
+    page->head = page;
+    page[npages - 1].head = page;
+
+    ngx_slab_link(&pool->free, page);
+}
+
+
+static void ngx_slab_link(ngx_slab_page_t *list, ngx_slab_page_t *page)
+{
+    page->next = list->next;
+    page->prev = list;
+    list->next->prev = page;
+    list->next = page;
+}
+
+
+static void ngx_slab_unlink(ngx_slab_page_t *page)
+{
+    page->prev->next = page->next;
+    page->next->prev = page->prev;
+    page->next = NULL;
+    page->prev = NULL;
+}
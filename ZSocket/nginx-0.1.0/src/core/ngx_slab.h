@@ -0,0 +1,76 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#ifndef _NGX_SLAB_H_INCLUDED_
+#define _NGX_SLAB_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_SLAB_PAGE_FREE   0
+#define NGX_SLAB_PAGE_START  1     /* the first page of an allocated run */
+#define NGX_SLAB_PAGE_BUSY   2     /* the rest pages of an allocated run */
+#define NGX_SLAB_PAGE_SMALL  3     /* a page divided into the small chunks */
+
+#define NGX_SLAB_MIN_SHIFT   3
+
+
+typedef struct ngx_slab_page_s  ngx_slab_page_t;
+
+struct ngx_slab_page_s
+{
+    ngx_uint_t           type;
+    ngx_uint_t           npages;    /* the length of a run at its first page */
+    ngx_slab_page_t     *head;      /* the first page of a free run */
+
+    ngx_uint_t           shift;     /* the chunk size of a small page */
+    ngx_uint_t           used;      /* the busy chunks of a small page */
+    void                *free;      /* the free chunks of a small page */
+
+    ngx_slab_page_t     *next;
+    ngx_slab_page_t     *prev;
+};
+
+
+/*
+ * the pool lives at the start of a shared memory zone, the zone is mapped
+ * at the same address in all processes so the pool may keep the pointers
+ */
+
+typedef struct
+{
+    ngx_atomic_t         lock;
+
+    ngx_uint_t           page_shift;
+    ngx_uint_t           nslots;
+    ngx_slab_page_t     *slots;     /* the partially free small pages */
+
+    ngx_slab_page_t     *pages;
+    ngx_slab_page_t      free;      /* the list of the free page runs */
+    ngx_uint_t           npages;
+    ngx_uint_t           nfree;
+
+    u_char              *start;
+    u_char              *end;
+
+    void                *data;      /* the zone owner's root structure */
+} ngx_slab_pool_t;
+
+
+ngx_int_t ngx_slab_init(ngx_slab_pool_t *pool, size_t size, ngx_log_t *log);
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+
+#define ngx_slab_lock(pool)    ngx_spinlock(&(pool)->lock, 1024)
+#define ngx_slab_unlock(pool)  ngx_unlock(&(pool)->lock)
+
+
+#endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -0,0 +1,616 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_channel.h>
+
+#include <sys/eventfd.h>
+
+
+#define NGX_THREAD_POOL_DEFAULT_THREADS    32
+#define NGX_THREAD_POOL_DEFAULT_MAX_QUEUE  65536
+
+
+typedef struct
+{
+    ngx_array_t  pools;    /* array of ngx_thread_pool_t pointers */
+} ngx_thread_pool_conf_t;
+
+
+static void *ngx_thread_pool_create_conf(ngx_cycle_t *cycle);
+static char *ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf);
+static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_thread_pool_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp,
+                                      ngx_cycle_t *cycle);
+static void *ngx_thread_pool_cycle(void *data);
+static void ngx_thread_pool_handler(ngx_event_t *ev);
+
+
+static ngx_command_t  ngx_thread_pool_commands[] =
+{
+
+    {
+        ngx_string("thread_pool"),
+        NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE23,
+        ngx_thread_pool,
+        0,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_thread_pool_module_ctx =
+{
+    ngx_string("thread_pool"),
+    ngx_thread_pool_create_conf,
+    ngx_thread_pool_init_conf
+};
+
+
+ngx_module_t  ngx_thread_pool_module =
+{
+    NGX_MODULE,
+    &ngx_thread_pool_module_ctx,           /* module context */
+    ngx_thread_pool_commands,              /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init module */
+    ngx_thread_pool_init_process           /* init process */
+};
+
+
+static ngx_str_t  ngx_thread_pool_default = ngx_string("default");
+
+
+/*
+ * the pool threads of all pools put the done tasks to the one queue
+ * and notify the worker event loop through the eventfd
+ */
+
+static int                  ngx_thread_pool_eventfd = -1;
+static pthread_mutex_t      ngx_thread_pool_done_mutex =
+                                                    PTHREAD_MUTEX_INITIALIZER;
+static ngx_thread_task_t   *ngx_thread_pool_done;
+static ngx_thread_task_t  **ngx_thread_pool_done_last = &ngx_thread_pool_done;
+
+
+ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_uint_t               i;
+    ngx_thread_pool_t       *tp, **tpp;
+    ngx_thread_pool_conf_t  *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    tpp = tcf->pools.elts;
+    for (i = 0; i < tcf->pools.nelts; i++)
+    {
+        if (tpp[i]->name.len == name->len
+                && ngx_strncmp(tpp[i]->name.data, name->data, name->len) == 0)
+        {
+            return tpp[i];
+        }
+    }
+
+    if (!(tp = ngx_pcalloc(cf->pool, sizeof(ngx_thread_pool_t))))
+    {
+        return NULL;
+    }
+
+    tp->name = *name;
+    tp->file = cf->conf_file->file.name.data;
+    tp->line = cf->conf_file->line;
+
+    if (!(tpp = ngx_push_array(&tcf->pools)))
+    {
+        return NULL;
+    }
+
+    *tpp = tp;
+
+    return tp;
+}
+
+
+ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
+{
+    ngx_uint_t               i;
+    ngx_thread_pool_t      **tpp;
+    ngx_thread_pool_conf_t  *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    tpp = tcf->pools.elts;
+    for (i = 0; i < tcf->pools.nelts; i++)
+    {
+        if (tpp[i]->name.len == name->len
+                && ngx_strncmp(tpp[i]->name.data, name->data, name->len) == 0)
+        {
+            return tpp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_thread_task_t *ngx_thread_task_alloc(size_t size, ngx_log_t *log)
+{
+    ngx_thread_task_t  *task;
+
+    if (!(task = ngx_calloc(sizeof(ngx_thread_task_t) + size, log)))
+    {
+        return NULL;
+    }
+
+    task->ctx = task + 1;
+
+    return task;
+}
+
+
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task)
+{
+    ngx_err_t  err;
+
+    if (task->active)
+    {
+        ngx_log_error(NGX_LOG_ALERT, tp->log, 0,
+                      "the task " PTR_FMT " is already active", task);
+        return NGX_ERROR;
+    }
+
+    if ((err = pthread_mutex_lock(&tp->mutex)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                      "pthread_mutex_lock() failed");
+        return NGX_ERROR;
+    }
+
+    if (tp->waiting >= tp->max_queue)
+    {
+        (void) pthread_mutex_unlock(&tp->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, tp->log, 0,
+                      "thread pool \"%s\" queue overflow: %" NGX_UINT_T_FMT
+                      " tasks waiting", tp->name.data, tp->waiting);
+        return NGX_ERROR;
+    }
+
+    task->next = NULL;
+    task->active = 1;
+    task->complete = 0;
+
+    *tp->last = task;
+    tp->last = &task->next;
+
+    tp->waiting++;
+
+    if ((err = pthread_cond_signal(&tp->cond)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                      "pthread_cond_signal() failed");
+    }
+
+    (void) pthread_mutex_unlock(&tp->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, tp->log, 0,
+                   "task " PTR_FMT " added to thread pool \"%s\", "
+                   "waiting: %d", task, tp->name.data, tp->waiting);
+
+    return NGX_OK;
+}
+
+
+/*
+ * a task that is still queued or run by a thread can not be freed,
+ * it is orphaned and its completion frees it instead of an event handler
+ */
+
+void ngx_thread_task_free(ngx_thread_task_t *task)
+{
+    if (task->active)
+    {
+        task->orphan = 1;
+        return;
+    }
+
+    ngx_free(task);
+}
+
+
+static ngx_int_t ngx_thread_pool_init_process(ngx_cycle_t *cycle)
+{
+    ngx_err_t                err;
+    ngx_uint_t               i;
+    sigset_t                 set, old;
+    ngx_thread_pool_t      **tpp;
+    ngx_thread_pool_conf_t  *tcf;
+
+    tcf = (ngx_thread_pool_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_thread_pool_module);
+
+    if (tcf->pools.nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    ngx_thread_pool_eventfd = eventfd(0, 0);
+
+    if (ngx_thread_pool_eventfd == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(ngx_thread_pool_eventfd) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      ngx_nonblocking_n " eventfd failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_add_channel_event(cycle, ngx_thread_pool_eventfd, NGX_READ_EVENT,
+                              ngx_thread_pool_handler) == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the signals are handled by the worker itself only */
+
+    sigfillset(&set);
+
+    if ((err = pthread_sigmask(SIG_SETMASK, &set, &old)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_sigmask() failed");
+        return NGX_ERROR;
+    }
+
+    tpp = tcf->pools.elts;
+    for (i = 0; i < tcf->pools.nelts; i++)
+    {
+        if (ngx_thread_pool_init(tpp[i], cycle) == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if ((err = pthread_sigmask(SIG_SETMASK, &old, NULL)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_sigmask() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_thread_pool_init(ngx_thread_pool_t *tp,
+                                      ngx_cycle_t *cycle)
+{
+    ngx_err_t       err;
+    ngx_uint_t      n;
+    pthread_t       tid;
+    pthread_attr_t  attr;
+
+    tp->log = cycle->log;
+
+    tp->first = NULL;
+    tp->last = &tp->first;
+    tp->waiting = 0;
+
+    if ((err = pthread_mutex_init(&tp->mutex, NULL)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_mutex_init() failed");
+        return NGX_ERROR;
+    }
+
+    if ((err = pthread_cond_init(&tp->cond, NULL)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_cond_init() failed");
+        return NGX_ERROR;
+    }
+
+    if ((err = pthread_attr_init(&attr)))
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                      "pthread_attr_init() failed");
+        return NGX_ERROR;
+    }
+
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (n = 0; n < tp->threads; n++)
+    {
+        if ((err = pthread_create(&tid, &attr, ngx_thread_pool_cycle, tp)))
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, err,
+                          "pthread_create() failed");
+            (void) pthread_attr_destroy(&attr);
+            return NGX_ERROR;
+        }
+    }
+
+    (void) pthread_attr_destroy(&attr);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                   "thread pool \"%s\": %d threads",
+                   tp->name.data, tp->threads);
+
+    return NGX_OK;
+}
+
+
+static void *ngx_thread_pool_cycle(void *data)
+{
+    ngx_thread_pool_t *tp = data;
+
+    uint64_t            one;
+    ngx_err_t           err;
+    ngx_thread_task_t  *task;
+
+    one = 1;
+
+    for ( ;; )
+    {
+        if ((err = pthread_mutex_lock(&tp->mutex)))
+        {
+            ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                          "pthread_mutex_lock() failed");
+            return NULL;
+        }
+
+        while (tp->first == NULL)
+        {
+            if ((err = pthread_cond_wait(&tp->cond, &tp->mutex)))
+            {
+                (void) pthread_mutex_unlock(&tp->mutex);
+                ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                              "pthread_cond_wait() failed");
+                return NULL;
+            }
+        }
+
+        task = tp->first;
+        tp->first = task->next;
+
+        if (tp->first == NULL)
+        {
+            tp->last = &tp->first;
+        }
+
+        tp->waiting--;
+
+        (void) pthread_mutex_unlock(&tp->mutex);
+
+        task->handler(task->ctx);
+
+        task->next = NULL;
+
+        (void) pthread_mutex_lock(&ngx_thread_pool_done_mutex);
+
+        *ngx_thread_pool_done_last = task;
+        ngx_thread_pool_done_last = &task->next;
+
+        (void) pthread_mutex_unlock(&ngx_thread_pool_done_mutex);
+
+        if (write(ngx_thread_pool_eventfd, &one, sizeof(uint64_t)) == -1)
+        {
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN)
+            {
+                ngx_log_error(NGX_LOG_ALERT, tp->log, err,
+                              "write() to eventfd failed");
+            }
+        }
+    }
+}
+
+
+static void ngx_thread_pool_handler(ngx_event_t *ev)
+{
+    uint64_t            n;
+    ngx_err_t           err;
+    ngx_thread_task_t  *task, *next;
+
+    /* the read() resets the counter of the eventfd */
+
+    if (read(ngx_thread_pool_eventfd, &n, sizeof(uint64_t)) == -1)
+    {
+        err = ngx_errno;
+
+        if (err != NGX_EAGAIN)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() from eventfd failed");
+        }
+    }
+
+    (void) pthread_mutex_lock(&ngx_thread_pool_done_mutex);
+
+    task = ngx_thread_pool_done;
+    ngx_thread_pool_done = NULL;
+    ngx_thread_pool_done_last = &ngx_thread_pool_done;
+
+    (void) pthread_mutex_unlock(&ngx_thread_pool_done_mutex);
+
+    while (task)
+    {
+        next = task->next;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "thread pool task " PTR_FMT " done", task);
+
+        task->active = 0;
+        task->complete = 1;
+
+        if (task->orphan)
+        {
+            if (task->cleanup)
+            {
+                task->cleanup(task->ctx);
+            }
+
+            ngx_free(task);
+
+        }
+        else
+        {
+            task->event_handler(task);
+        }
+
+        task = next;
+    }
+}
+
+
+static void *ngx_thread_pool_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_thread_pool_conf_t  *tcf;
+
+    if (!(tcf = ngx_pcalloc(cycle->pool, sizeof(ngx_thread_pool_conf_t))))
+    {
+        return NULL;
+    }
+
+    ngx_init_array(tcf->pools, cycle->pool, 4, sizeof(ngx_thread_pool_t *),
+                   NULL);
+
+    return tcf;
+}
+
+
+/*
+ * the pools are referenced by name before or after their "thread_pool"
+ * directives, the "default" pool exists even if it is not declared
+ */
+
+static char *ngx_thread_pool_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_thread_pool_conf_t *tcf = conf;
+
+    ngx_uint_t           i;
+    ngx_thread_pool_t  **tpp;
+
+    tpp = tcf->pools.elts;
+    for (i = 0; i < tcf->pools.nelts; i++)
+    {
+        if (tpp[i]->threads)
+        {
+            continue;
+        }
+
+        if (tpp[i]->name.len == ngx_thread_pool_default.len
+                && ngx_strncmp(tpp[i]->name.data, ngx_thread_pool_default.data,
+                               ngx_thread_pool_default.len) == 0)
+        {
+            tpp[i]->threads = NGX_THREAD_POOL_DEFAULT_THREADS;
+            tpp[i]->max_queue = NGX_THREAD_POOL_DEFAULT_MAX_QUEUE;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "unknown thread pool \"%s\" in %s:%" NGX_UINT_T_FMT,
+                      tpp[i]->name.data, tpp[i]->file, tpp[i]->line);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * thread_pool name threads=number [max_queue=number];
+ */
+
+static char *ngx_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t           n;
+    ngx_str_t          *value;
+    ngx_uint_t          i;
+    ngx_thread_pool_t  *tp;
+
+    value = cf->args->elts;
+
+    if (!(tp = ngx_thread_pool_add(cf, &value[1])))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (tp->threads)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate thread pool \"%s\"", tp->name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    tp->max_queue = NGX_THREAD_POOL_DEFAULT_MAX_QUEUE;
+
+    for (i = 2; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0)
+        {
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (n == NGX_ERROR || n == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid threads value \"%s\"",
+                                   value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            tp->threads = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_queue=", 10) == 0)
+        {
+            n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+
+            if (n == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_queue value \"%s\"",
+                                   value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            tp->max_queue = n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%s\"", value[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (tp->threads == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%s\" must have \"threads\" parameter",
+                           cmd->name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,75 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#ifndef _NGX_THREAD_POOL_H_INCLUDED_
+#define _NGX_THREAD_POOL_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <pthread.h>
+
+
+/*
+ * the pool threads run the blocking file operations only, they do not
+ * touch the connections, the requests and their pools and logs, so a task
+ * carries everything it needs in its own memory allocated by malloc()
+ */
+
+struct ngx_thread_task_s
+{
+    ngx_thread_task_t   *next;
+
+    /* runs in a pool thread */
+    void               (*handler)(void *ctx);
+    void                *ctx;
+
+    /* runs in the worker when the task is done */
+    void               (*event_handler)(ngx_thread_task_t *task);
+    void                *data;
+
+    /* runs in the worker instead of event_handler for an orphaned task */
+    void               (*cleanup)(void *ctx);
+
+    unsigned             active:1;
+    unsigned             complete:1;
+    unsigned             orphan:1;
+};
+
+
+struct ngx_thread_pool_s
+{
+    pthread_mutex_t      mutex;
+    pthread_cond_t       cond;
+
+    ngx_thread_task_t   *first;
+    ngx_thread_task_t  **last;
+    ngx_uint_t           waiting;
+
+    ngx_str_t            name;
+    ngx_uint_t           threads;
+    ngx_uint_t           max_queue;
+
+    ngx_log_t           *log;
+
+    u_char              *file;
+    ngx_uint_t           line;
+};
+
+
+ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
+ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
+
+ngx_thread_task_t *ngx_thread_task_alloc(size_t size, ngx_log_t *log);
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
+void ngx_thread_task_free(ngx_thread_task_t *task);
+
+
+extern ngx_module_t  ngx_thread_pool_module;
+
+
+#endif /* _NGX_THREAD_POOL_H_INCLUDED_ */
@@ -81,7 +81,11 @@ ngx_atomic_t  *ngx_stat_active = &ngx_stat_active0;
 ngx_atomic_t   ngx_stat_reading0;
 ngx_atomic_t  *ngx_stat_reading = &ngx_stat_reading0;
 ngx_atomic_t   ngx_stat_writing0;
-ngx_atomic_t  *ngx_stat_writing = &ngx_stat_reading0;
+ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
+ngx_atomic_t   ngx_stat_open_file_hits0;
+ngx_atomic_t  *ngx_stat_open_file_hits = &ngx_stat_open_file_hits0;
+ngx_atomic_t   ngx_stat_open_file_misses0;
+ngx_atomic_t  *ngx_stat_open_file_misses = &ngx_stat_open_file_misses0;
 
 #endif
 
@@ -239,7 +243,9 @@ static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle)
             + 128          /* ngx_stat_requests */
             + 128          /* ngx_stat_active */
             + 128          /* ngx_stat_reading */
-            + 128;         /* ngx_stat_writing */
+            + 128          /* ngx_stat_writing */
+            + 128          /* ngx_stat_open_file_hits */
+            + 128;         /* ngx_stat_open_file_misses */
 
 #endif
 
@@ -258,6 +264,8 @@ static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_active = (ngx_atomic_t *) (shared + 4 * 128);
     ngx_stat_reading = (ngx_atomic_t *) (shared + 5 * 128);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 6 * 128);
+    ngx_stat_open_file_hits = (ngx_atomic_t *) (shared + 7 * 128);
+    ngx_stat_open_file_misses = (ngx_atomic_t *) (shared + 8 * 128);
 
 #endif
 
@@ -290,9 +298,22 @@ static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle)
 
     if (ngx_accept_mutex_ptr && ccf->worker_processes > 1 && ecf->accept_mutex)
     {
-        ngx_accept_mutex = ngx_accept_mutex_ptr;
-        ngx_accept_mutex_held = 0;
-        ngx_accept_mutex_delay = ecf->accept_mutex_delay;
+        /*
+         * the reuseport sockets are balanced by the kernel so the mutex
+         * is required only if there is a socket shared by the workers
+         */
+
+        s = cycle->listening.elts;
+        for (i = 0; i < cycle->listening.nelts; i++)
+        {
+            if (!s[i].reuseport)
+            {
+                ngx_accept_mutex = ngx_accept_mutex_ptr;
+                ngx_accept_mutex_held = 0;
+                ngx_accept_mutex_delay = ecf->accept_mutex_delay;
+                break;
+            }
+        }
     }
 
 #if (NGX_THREADS)
@@ -449,6 +470,16 @@ static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle)
             }
         }
 
+        if (s[i].reuseport && s[i].worker != ngx_worker)
+        {
+            /*
+             * the reuseport socket of another worker process, its events
+             * are zeroed only to be closed by ngx_close_listening_sockets()
+             */
+
+            continue;
+        }
+
 #if (WIN32)
 
         if (ngx_event_flags & NGX_USE_IOCP_EVENT)
@@ -481,7 +512,7 @@ static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle)
 
         rev->event_handler = &ngx_event_accept;
 
-        if (ngx_accept_mutex)
+        if (ngx_accept_mutex && !s[i].reuseport)
         {
             continue;
         }
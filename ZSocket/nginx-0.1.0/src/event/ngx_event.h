@@ -452,6 +452,8 @@ extern ngx_atomic_t  *ngx_stat_requests;
 extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
+extern ngx_atomic_t  *ngx_stat_open_file_hits;
+extern ngx_atomic_t  *ngx_stat_open_file_misses;
 
 #endif
 
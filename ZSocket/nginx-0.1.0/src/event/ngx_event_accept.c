@@ -148,7 +148,7 @@ void ngx_event_accept(ngx_event_t *ev)
         }
 
 #if (NGX_STAT_STUB)
-        (*ngx_stat_accepted)++;
+        ngx_atomic_inc(ngx_stat_accepted);
 #endif
 
         ngx_accept_disabled = (ngx_uint_t) s + NGX_ACCEPT_THRESHOLD
@@ -171,7 +171,7 @@ void ngx_event_accept(ngx_event_t *ev)
         }
 
 #if (NGX_STAT_STUB)
-        (*ngx_stat_active)++;
+        ngx_atomic_inc(ngx_stat_active);
 #endif
 
         /* set a blocking mode for aio and non-blocking mode for the others */
@@ -433,6 +433,12 @@ ngx_int_t ngx_enable_accept_events(ngx_cycle_t *cycle)
     for (i = 0; i < cycle->listening.nelts; i++)
     {
 
+        if (s[i].reuseport)
+        {
+            /* the reuseport socket is not under the accept mutex */
+            continue;
+        }
+
         /*
          * we do not need to handle the Winsock sockets here (divide a socket
          * number by 4) because this function would never called
@@ -470,6 +476,12 @@ ngx_int_t ngx_disable_accept_events(ngx_cycle_t *cycle)
     for (i = 0; i < cycle->listening.nelts; i++)
     {
 
+        if (s[i].reuseport)
+        {
+            /* the reuseport socket is not under the accept mutex */
+            continue;
+        }
+
         /*
          * we do not need to handle the Winsock sockets here (divide a socket
          * number by 4) because this function would never called
@@ -11,6 +11,20 @@
 #include <nginx.h>
 
 
+static ngx_int_t ngx_event_connect_get_peer(ngx_peer_connection_t *pc,
+        time_t now);
+static ngx_int_t ngx_event_connect_weighted_peer(ngx_peers_t *peers,
+        time_t now);
+static ngx_int_t ngx_event_connect_least_conn_peer(ngx_peers_t *peers,
+        time_t now);
+static ngx_int_t ngx_event_connect_hash_peer(ngx_peers_t *peers,
+        uint32_t hash, time_t now);
+static void ngx_event_connect_peer_busy(ngx_peer_connection_t *pc);
+static int ngx_cmp_peer_points(const void *one, const void *two);
+static void ngx_event_connect_peer_idle_handler(ngx_event_t *ev);
+static void ngx_event_connect_peer_close(ngx_connection_t *c);
+
+
 /* AF_INET only */
 
 int ngx_event_connect_peer(ngx_peer_connection_t *pc)
@@ -25,95 +39,78 @@ int ngx_event_connect_peer(ngx_peer_connection_t *pc)
     ngx_event_t         *rev, *wev;
     ngx_connection_t    *c;
     ngx_event_conf_t    *ecf;
+    ngx_int_t            i;
+    ngx_cached_peer_t   *cp;
     struct sockaddr_in   addr;
 
     now = ngx_time();
 
-    /* ngx_lock_mutex(pc->peers->mutex); */
+    /* a connection left from the previous try has been already closed */
 
-    if (pc->peers->last_cached)
-    {
+    ngx_event_connect_peer_free(pc);
 
-        /* cached connection */
+    pc->cached = 0;
+    pc->connection = NULL;
 
-        c = pc->peers->cached[pc->peers->last_cached];
-        pc->peers->last_cached--;
+    /* ngx_lock_mutex(pc->peers->mutex); */
 
+    if (ngx_event_connect_get_peer(pc, now) == NGX_ERROR)
+    {
         /* ngx_unlock_mutex(pc->peers->mutex); */
 
-#if (NGX_THREADS)
-        c->read->lock = c->read->own_lock;
-        c->write->lock = c->write->own_lock;
-#endif
-
-        pc->connection = c;
-        pc->cached = 1;
-        return NGX_OK;
+        return NGX_ERROR;
     }
 
-    pc->cached = 0;
-    pc->connection = NULL;
+    peer = &pc->peers->peers[pc->cur_peer];
 
-    if (pc->peers->number == 1)
-    {
-        peer = &pc->peers->peers[0];
+    /* an idle connection to the peer, the most recently used is the warmest */
 
-    }
-    else
+    for (i = pc->peers->last_cached - 1; i >= 0; i--)
     {
+        cp = &pc->peers->cached[i];
 
-        /* there are several peers */
-
-        if (pc->tries == pc->peers->number)
+        if (cp->peer != pc->cur_peer)
         {
+            continue;
+        }
 
-            /* it's a first try - get a current peer */
-
-            pc->cur_peer = pc->peers->current++;
+        c = cp->connection;
 
-            if (pc->peers->current >= pc->peers->number)
-            {
-                pc->peers->current = 0;
-            }
-        }
+        pc->peers->last_cached--;
 
-        if (pc->peers->max_fails == 0)
+        for ( /* void */ ; i < pc->peers->last_cached; i++)
         {
-            peer = &pc->peers->peers[pc->cur_peer];
-
+            pc->peers->cached[i] = pc->peers->cached[i + 1];
         }
-        else
-        {
 
-            /* the peers support a fault tolerance */
+        /* ngx_unlock_mutex(pc->peers->mutex); */
 
-            for ( ;; )
-            {
-                peer = &pc->peers->peers[pc->cur_peer];
+        if (c->read->timer_set)
+        {
+            ngx_del_timer(c->read);
+        }
 
-                if (peer->fails <= pc->peers->max_fails
-                        || (now - peer->accessed > pc->peers->fail_timeout))
-                {
-                    break;
-                }
+        c->data = NULL;
+        c->log = pc->log;
+        c->read->log = pc->log;
+        c->write->log = pc->log;
+        c->log_error = pc->log_error;
 
-                pc->cur_peer++;
+#if (NGX_THREADS)
+        c->read->lock = pc->lock;
+        c->write->lock = pc->lock;
+#endif
 
-                if (pc->cur_peer >= pc->peers->number)
-                {
-                    pc->cur_peer = 0;
-                }
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, pc->log, 0,
+                       "reuse connection to %s, #%d",
+                       peer->addr_port_text.data, c->number);
 
-                pc->tries--;
+        pc->connection = c;
+        pc->cached = 1;
 
-                if (pc->tries == 0)
-                {
-                    /* ngx_unlock_mutex(pc->peers->mutex); */
+        ngx_event_connect_peer_busy(pc);
 
-                    return NGX_ERROR;
-                }
-            }
-        }
+        return NGX_OK;
     }
 
     /* ngx_unlock_mutex(pc->peers->mutex); */
@@ -252,6 +249,8 @@ int ngx_event_connect_peer(ngx_peer_connection_t *pc)
 
     pc->connection = c;
 
+    ngx_event_connect_peer_busy(pc);
+
     /*
      * TODO: MT: - atomic increment (x86: lock xadd)
      *             or protection by critical section or mutex
@@ -394,10 +393,29 @@ int ngx_event_connect_peer(ngx_peer_connection_t *pc)
 
 void ngx_event_connect_peer_failed(ngx_peer_connection_t *pc)
 {
-    time_t  now;
+    time_t            now;
+    ngx_peer_stat_t  *stat;
 
     now = ngx_time();
 
+    if (pc->stat)
+    {
+        /* the failed tries are not counted in the response times */
+
+        pc->stat = 0;
+
+        stat = &pc->peers->stats[pc->cur_peer];
+
+        ngx_spinlock(&stat->lock, 1024);
+
+        stat->fails++;
+        stat->active--;
+
+        ngx_unlock(&stat->lock);
+    }
+
+    ngx_event_connect_peer_free(pc);
+
     /* ngx_lock_mutex(pc->peers->mutex); */
 
     pc->peers->peers[pc->cur_peer].fails++;
@@ -416,3 +434,690 @@ void ngx_event_connect_peer_failed(ngx_peer_connection_t *pc)
 
     return;
 }
+
+
+/*
+ * the peer is considered down while it has failed more than max_fails
+ * times and fail_timeout has not passed since the last failure
+ */
+
+#define ngx_event_connect_peer_down(peers, peer, now)                         \
+    ((peers)->max_fails                                                       \
+     && (peer)->fails > (peers)->max_fails                                    \
+     && (now) - (peer)->accessed <= (peers)->fail_timeout)
+
+
+static ngx_int_t ngx_event_connect_get_peer(ngx_peer_connection_t *pc,
+        time_t now)
+{
+    ngx_peer_t   *peer;
+    ngx_peers_t  *peers;
+
+    peers = pc->peers;
+
+    if (peers->number == 1)
+    {
+        pc->cur_peer = 0;
+        return NGX_OK;
+    }
+
+    /* there are several peers */
+
+    if (pc->tries == peers->number)
+    {
+
+        /* it's a first try - get a peer by the balancing strategy */
+
+        switch (peers->balance)
+        {
+
+        case NGX_PEERS_LEAST_CONN:
+            pc->cur_peer = ngx_event_connect_least_conn_peer(peers, now);
+            break;
+
+        case NGX_PEERS_HASH:
+            pc->cur_peer = ngx_event_connect_hash_peer(peers, pc->hash, now);
+            break;
+
+        default: /* NGX_PEERS_ROUND_ROBIN */
+
+            if (peers->weighted)
+            {
+                pc->cur_peer = ngx_event_connect_weighted_peer(peers, now);
+                break;
+            }
+
+            pc->cur_peer = peers->current++;
+
+            if (peers->current >= peers->number)
+            {
+                peers->current = 0;
+            }
+        }
+    }
+
+    if (peers->max_fails == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the peers support a fault tolerance: the next tries and the first one,
+     * if all the peers are down, go round the peers in order
+     */
+
+    for ( ;; )
+    {
+        peer = &peers->peers[pc->cur_peer];
+
+        if (!ngx_event_connect_peer_down(peers, peer, now))
+        {
+            return NGX_OK;
+        }
+
+        pc->cur_peer++;
+
+        if (pc->cur_peer >= peers->number)
+        {
+            pc->cur_peer = 0;
+        }
+
+        pc->tries--;
+
+        if (pc->tries == 0)
+        {
+            return NGX_ERROR;
+        }
+    }
+}
+
+
+/*
+ * the smooth weighted round robin: every peer gains its weight,
+ * the peer with the biggest gain is chosen and loses the total weight,
+ * so a peer with the weight 3 among ones with the weight 1 is chosen
+ * three times per round but not three times in a row
+ */
+
+static ngx_int_t ngx_event_connect_weighted_peer(ngx_peers_t *peers,
+        time_t now)
+{
+    ngx_int_t    i, best, total;
+    ngx_peer_t  *peer;
+
+    best = -1;
+    total = 0;
+
+    for (i = 0; i < peers->number; i++)
+    {
+        peer = &peers->peers[i];
+
+        if (ngx_event_connect_peer_down(peers, peer, now))
+        {
+            continue;
+        }
+
+        peer->current_weight += peer->weight;
+        total += peer->weight;
+
+        if (best == -1
+                || peer->current_weight > peers->peers[best].current_weight)
+        {
+            best = i;
+        }
+    }
+
+    if (best == -1)
+    {
+        return 0;
+    }
+
+    peers->peers[best].current_weight -= total;
+
+    return best;
+}
+
+
+/*
+ * the peer with the least active connections per a unit of the weight,
+ * the search starts from the next peer every time so the equally loaded
+ * peers are chosen in turn
+ */
+
+static ngx_int_t ngx_event_connect_least_conn_peer(ngx_peers_t *peers,
+        time_t now)
+{
+    ngx_int_t    i, n, best;
+    ngx_peer_t  *peer;
+
+    best = -1;
+    n = peers->current;
+
+    for (i = 0; i < peers->number; i++)
+    {
+        peer = &peers->peers[n];
+
+        if (!ngx_event_connect_peer_down(peers, peer, now)
+                && (best == -1
+                    || peers->conns[n] * peers->peers[best].weight
+                    < peers->conns[best] * peer->weight))
+        {
+            best = n;
+        }
+
+        if (++n >= peers->number)
+        {
+            n = 0;
+        }
+    }
+
+    if (++peers->current >= peers->number)
+    {
+        peers->current = 0;
+    }
+
+    if (best == -1)
+    {
+        return n;
+    }
+
+    return best;
+}
+
+
+/*
+ * the first point of the continuum not less than the key hash,
+ * the points of the down peers are skipped, so the keys of a down peer
+ * are spread among the others and return after it has recovered
+ */
+
+static ngx_int_t ngx_event_connect_hash_peer(ngx_peers_t *peers,
+        uint32_t hash, time_t now)
+{
+    ngx_uint_t         i, n, left, right;
+    ngx_peer_point_t  *point;
+
+    left = 0;
+    right = peers->npoints;
+
+    while (left < right)
+    {
+        n = (left + right) / 2;
+
+        if (peers->points[n].hash < hash)
+        {
+            left = n + 1;
+
+        }
+        else
+        {
+            right = n;
+        }
+    }
+
+    for (i = 0; i < peers->npoints; i++)
+    {
+        point = &peers->points[(left + i) % peers->npoints];
+
+        if (!ngx_event_connect_peer_down(peers, &peers->peers[point->peer],
+                                         now))
+        {
+            return point->peer;
+        }
+    }
+
+    return peers->points[left % peers->npoints].peer;
+}
+
+
+static void ngx_event_connect_peer_busy(ngx_peer_connection_t *pc)
+{
+    ngx_peer_stat_t  *stat;
+
+    if (pc->peers->stats)
+    {
+        stat = &pc->peers->stats[pc->cur_peer];
+
+        ngx_spinlock(&stat->lock, 1024);
+
+        stat->requests++;
+        stat->active++;
+
+        ngx_unlock(&stat->lock);
+
+        pc->start = ngx_elapsed_msec;
+        pc->stat = 1;
+    }
+
+    if (pc->peers->conns == NULL)
+    {
+        return;
+    }
+
+    if (pc->peers->shared_conns)
+    {
+        ngx_atomic_inc(&pc->peers->conns[pc->cur_peer]);
+
+    }
+    else
+    {
+        pc->peers->conns[pc->cur_peer]++;
+    }
+
+    pc->active = 1;
+}
+
+
+void ngx_event_connect_peer_free(ngx_peer_connection_t *pc)
+{
+    ngx_msec_t        time;
+    ngx_atomic_t      old;
+    ngx_atomic_t     *conns;
+    ngx_peer_stat_t  *stat;
+
+    if (pc->stat)
+    {
+        pc->stat = 0;
+
+        stat = &pc->peers->stats[pc->cur_peer];
+        time = (ngx_msec_t) (ngx_elapsed_msec - pc->start);
+
+        ngx_spinlock(&stat->lock, 1024);
+
+        stat->active--;
+        stat->response_time += time;
+
+        if (stat->max_response_time < time)
+        {
+            stat->max_response_time = time;
+        }
+
+        ngx_unlock(&stat->lock);
+    }
+
+    if (!pc->active)
+    {
+        return;
+    }
+
+    pc->active = 0;
+
+    conns = &pc->peers->conns[pc->cur_peer];
+
+    if (pc->peers->shared_conns)
+    {
+        do
+        {
+            old = *conns;
+        }
+        while (!ngx_atomic_cmp_set(conns, old, old - 1));
+
+        return;
+    }
+
+    (*conns)--;
+}
+
+
+/*
+ * prepare the peers for the balancing strategy: the peers with
+ * the different weights are balanced by the weighted round robin,
+ * the least connections need the counters and the hash needs
+ * the continuum of NGX_PEER_POINTS points per a unit of the weight
+ */
+
+ngx_int_t ngx_event_connect_init_peers(ngx_peers_t *peers, ngx_pool_t *pool,
+                                       ngx_log_t *log)
+{
+    size_t             len;
+    ngx_int_t          i, j;
+    ngx_uint_t         n;
+    ngx_peer_point_t  *point;
+    u_char             text[INET_ADDRSTRLEN + sizeof(":65535-")
+                            + NGX_INT_T_LEN];
+
+    n = 0;
+    peers->weighted = 0;
+
+    for (i = 0; i < peers->number; i++)
+    {
+        if (peers->peers[i].weight == 0)
+        {
+            peers->peers[i].weight = 1;
+        }
+
+        if (peers->peers[i].weight != peers->peers[0].weight)
+        {
+            peers->weighted = 1;
+        }
+
+        n += peers->peers[i].weight * NGX_PEER_POINTS;
+    }
+
+    if (peers->balance == NGX_PEERS_LEAST_CONN && peers->conns == NULL)
+    {
+        len = peers->number * sizeof(ngx_atomic_t);
+
+        if (peers->shared_conns)
+        {
+            /* the counters are shared by the workers */
+
+            if (!(peers->conns = ngx_create_shared_memory(len, log)))
+            {
+                return NGX_ERROR;
+            }
+
+        }
+        else
+        {
+            if (!(peers->conns = ngx_pcalloc(pool, len)))
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (peers->balance != NGX_PEERS_HASH
+            || peers->number == 1
+            || peers->points)
+    {
+        return NGX_OK;
+    }
+
+    if (!(peers->points = ngx_palloc(pool, n * sizeof(ngx_peer_point_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    peers->npoints = n;
+    point = peers->points;
+
+    for (i = 0; i < peers->number; i++)
+    {
+        for (j = 0; j < peers->peers[i].weight * NGX_PEER_POINTS; j++)
+        {
+            /* "addr:port-N" */
+
+            len = ngx_snprintf((char *) text, sizeof(text),
+                               "%s-%" NGX_INT_T_FMT,
+                               peers->peers[i].addr_port_text.data, j);
+
+            point->hash = ngx_event_connect_hash(text, len);
+            point->peer = i;
+            point++;
+        }
+    }
+
+    ngx_qsort(peers->points, peers->npoints, sizeof(ngx_peer_point_t),
+              ngx_cmp_peer_points);
+
+    return NGX_OK;
+}
+
+
+static int ngx_cmp_peer_points(const void *one, const void *two)
+{
+    ngx_peer_point_t  *first, *second;
+
+    first = (ngx_peer_point_t *) one;
+    second = (ngx_peer_point_t *) two;
+
+    if (first->hash < second->hash)
+    {
+        return -1;
+    }
+
+    if (first->hash > second->hash)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* FNV-1a with the final avalanche, the similar keys get the distant hashes */
+
+uint32_t ngx_event_connect_hash(u_char *data, size_t len)
+{
+    uint32_t  hash;
+
+    hash = 2166136261;
+
+    while (len--)
+    {
+        hash ^= *data++;
+        hash *= 16777619;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+
+/*
+ * keep the connection to the peer open for the next request.
+ * The connection is idle: the whole response has been read
+ * and the upstream is not expected to send anything until
+ * a new request.  If the cache is full then the longest idle
+ * connection is closed.
+ */
+
+ngx_int_t ngx_event_connect_peer_keepalive(ngx_peer_connection_t *pc)
+{
+    u_char              buf[1];
+    ssize_t             n;
+    ngx_int_t           i;
+    ngx_peers_t        *peers;
+    ngx_connection_t   *c;
+    ngx_cached_peer_t  *cp;
+
+    peers = pc->peers;
+    c = pc->connection;
+
+    if (peers->max_cached == 0
+            || c->read->eof || c->read->error || c->read->timedout
+            || c->write->error || c->write->timedout)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (c->read->timer_set)
+    {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set)
+    {
+        ngx_del_timer(c->write);
+    }
+
+    /* the upstream has already closed the connection or sent an extra data */
+
+    c->log_error = NGX_ERROR_IGNORE_ECONNRESET;
+
+    n = ngx_recv(c, buf, 1);
+
+    if (n != NGX_AGAIN)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) == NGX_ERROR)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* ngx_lock_mutex(peers->mutex); */
+
+    if (peers->last_cached == peers->max_cached)
+    {
+        ngx_event_connect_peer_close(peers->cached[0].connection);
+
+        peers->last_cached--;
+
+        for (i = 0; i < peers->last_cached; i++)
+        {
+            peers->cached[i] = peers->cached[i + 1];
+        }
+    }
+
+    cp = &peers->cached[peers->last_cached++];
+    cp->connection = c;
+    cp->peer = pc->cur_peer;
+
+    /* ngx_unlock_mutex(peers->mutex); */
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, pc->log, 0,
+                   "keepalive connection to %s, #%d",
+                   peers->peers[pc->cur_peer].addr_port_text.data, c->number);
+
+    /* the request pool and log are going to be freed */
+
+    c->data = peers;
+    c->pool = NULL;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+#if (NGX_THREADS)
+    c->read->lock = c->read->own_lock;
+    c->write->lock = c->write->own_lock;
+#endif
+
+    c->read->event_handler = ngx_event_connect_peer_idle_handler;
+    c->write->event_handler = ngx_event_connect_peer_idle_handler;
+
+    ngx_add_timer(c->read, peers->cached_timeout);
+
+    pc->connection = NULL;
+
+    return NGX_OK;
+}
+
+
+static void ngx_event_connect_peer_idle_handler(ngx_event_t *ev)
+{
+    u_char             buf[1];
+    ssize_t            n;
+    ngx_int_t          i;
+    ngx_peers_t       *peers;
+    ngx_connection_t  *c;
+
+    if (ev->write)
+    {
+        return;
+    }
+
+    c = ev->data;
+    peers = c->data;
+
+    if (!ev->timedout)
+    {
+        n = ngx_recv(c, buf, 1);
+
+        if (n == NGX_AGAIN)
+        {
+            if (ngx_handle_read_event(ev, 0) == NGX_OK)
+            {
+                return;
+            }
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "close idle connection #%d, timedout:%d",
+                   c->number, ev->timedout);
+
+    /* ngx_lock_mutex(peers->mutex); */
+
+    for (i = 0; i < peers->last_cached; i++)
+    {
+        if (peers->cached[i].connection == c)
+        {
+            break;
+        }
+    }
+
+    if (i < peers->last_cached)
+    {
+        peers->last_cached--;
+
+        for ( /* void */ ; i < peers->last_cached; i++)
+        {
+            peers->cached[i] = peers->cached[i + 1];
+        }
+    }
+
+    /* ngx_unlock_mutex(peers->mutex); */
+
+    ngx_event_connect_peer_close(c);
+}
+
+
+static void ngx_event_connect_peer_close(ngx_connection_t *c)
+{
+    ngx_socket_t  fd;
+
+    if (c->read->timer_set)
+    {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set)
+    {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_del_conn)
+    {
+        ngx_del_conn(c, NGX_CLOSE_EVENT);
+
+    }
+    else
+    {
+        if (c->read->active || c->read->disabled)
+        {
+            ngx_del_event(c->read, NGX_READ_EVENT, NGX_CLOSE_EVENT);
+        }
+
+        if (c->write->active || c->write->disabled)
+        {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, NGX_CLOSE_EVENT);
+        }
+    }
+
+    if (ngx_mutex_lock(ngx_posted_events_mutex) == NGX_OK)
+    {
+
+        if (c->read->prev)
+        {
+            ngx_delete_posted_event(c->read);
+        }
+
+        if (c->write->prev)
+        {
+            ngx_delete_posted_event(c->write);
+        }
+
+        c->read->closed = 1;
+        c->write->closed = 1;
+
+        ngx_mutex_unlock(ngx_posted_events_mutex);
+    }
+
+    fd = c->fd;
+    c->fd = (ngx_socket_t) -1;
+    c->data = NULL;
+
+    if (ngx_close_socket(fd) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+}
@@ -16,6 +16,14 @@
 #define NGX_CONNECT_ERROR   -10
 
 
+#define NGX_PEERS_ROUND_ROBIN  0
+#define NGX_PEERS_LEAST_CONN   1
+#define NGX_PEERS_HASH         2
+
+/* the points of the hash continuum per a unit of the peer weight */
+#define NGX_PEER_POINTS        160
+
+
 typedef struct
 {
     in_addr_t          addr;
@@ -25,19 +33,70 @@ typedef struct
 
     ngx_int_t          fails;
     time_t             accessed;
+
+    ngx_int_t          weight;
+    ngx_int_t          current_weight;
 } ngx_peer_t;
 
 
+typedef struct
+{
+    uint32_t           hash;
+    ngx_int_t          peer;
+} ngx_peer_point_t;
+
+
+/* the counters of a peer, they are kept in shared memory by the status module */
+
+typedef struct
+{
+    ngx_atomic_t       lock;
+
+    ngx_uint_t         requests;
+    ngx_uint_t         fails;
+    ngx_uint_t         active;
+
+    /* the times from the connect to the release of the connection */
+    ngx_msec_t         response_time;
+    ngx_msec_t         max_response_time;
+} ngx_peer_stat_t;
+
+
+typedef struct
+{
+    ngx_connection_t  *connection;
+    ngx_int_t          peer;
+} ngx_cached_peer_t;
+
+
 typedef struct
 {
     ngx_int_t           current;
     ngx_int_t           number;
     ngx_int_t           max_fails;
     ngx_int_t           fail_timeout;
+
+    ngx_uint_t          balance;
+    ngx_int_t           weighted;
+
+    /* the active connections of the peers, per worker or in shared memory */
+    ngx_int_t           shared_conns;
+    ngx_atomic_t       *conns;
+
+    /* the counters of the peers or NULL */
+    ngx_peer_stat_t    *stats;
+
+    /* the hash continuum sorted by the point hash */
+    ngx_uint_t          npoints;
+    ngx_peer_point_t   *points;
+
+    /* the idle connections, the most recently used is the last one */
     ngx_int_t           last_cached;
+    ngx_int_t           max_cached;
+    ngx_msec_t          cached_timeout;
 
     /* ngx_mutex_t        *mutex; */
-    ngx_connection_t  **cached;
+    ngx_cached_peer_t  *cached;
 
     ngx_peer_t          peers[1];
 } ngx_peers_t;
@@ -49,6 +108,12 @@ typedef struct
     ngx_int_t          cur_peer;
     ngx_int_t          tries;
 
+    /* the key hash for NGX_PEERS_HASH */
+    uint32_t           hash;
+
+    /* the time the peer was taken, for the peer counters */
+    ngx_epoch_msec_t   start;
+
     ngx_connection_t  *connection;
 #if (NGX_THREADS)
     ngx_atomic_t      *lock;
@@ -59,12 +124,19 @@ typedef struct
     ngx_log_t         *log;
 
     unsigned           cached:1;
+    unsigned           active:1;
+    unsigned           stat:1;
     unsigned           log_error:2;  /* ngx_connection_log_error_e */
 } ngx_peer_connection_t;
 
 
 int ngx_event_connect_peer(ngx_peer_connection_t *pc);
 void ngx_event_connect_peer_failed(ngx_peer_connection_t *pc);
+ngx_int_t ngx_event_connect_peer_keepalive(ngx_peer_connection_t *pc);
+void ngx_event_connect_peer_free(ngx_peer_connection_t *pc);
+ngx_int_t ngx_event_connect_init_peers(ngx_peers_t *peers, ngx_pool_t *pool,
+                                       ngx_log_t *log);
+uint32_t ngx_event_connect_hash(u_char *data, size_t len);
 
 
 #endif /* _NGX_EVENT_CONNECT_H_INCLUDED_ */
@@ -10,10 +10,34 @@
 #include <ngx_event_pipe.h>
 
 
+#if (NGX_THREAD_POOL)
+
+typedef struct
+{
+    ngx_fd_t     fd;
+    off_t        offset;
+    size_t       size;
+    ssize_t      n;
+    ngx_err_t    err;
+    u_char       buf[1];
+} ngx_event_pipe_thread_write_t;
+
+#endif
+
+
 static ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p);
 static ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p);
 
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p);
+static ngx_int_t ngx_event_pipe_temp_file_bufs(ngx_event_pipe_t *p,
+        ngx_chain_t *out);
+#if (NGX_THREAD_POOL)
+static ngx_int_t ngx_event_pipe_thread_write(ngx_event_pipe_t *p,
+        ngx_chain_t *out);
+static void ngx_event_pipe_thread_write_handler(void *data);
+static void ngx_event_pipe_thread_write_done(ngx_thread_task_t *task);
+#endif
+
 ngx_inline static void ngx_event_pipe_remove_shadow_links(ngx_buf_t *buf);
 ngx_inline static void ngx_event_pipe_free_shadow_raw_buf(ngx_chain_t **free,
         ngx_buf_t *buf);
@@ -93,13 +117,38 @@ ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 {
     int           n, rc, size;
     ngx_buf_t    *b;
-    ngx_chain_t  *chain, *cl, *tl;
+    ngx_chain_t  *chain, *cl, *tl, *unused;
 
     if (p->upstream_eof || p->upstream_error || p->upstream_done)
     {
         return NGX_OK;
     }
 
+    if (p->aio)
+    {
+
+        /*
+         * the bufs are being written to the temp file by the thread pool,
+         * the upstream is read again after the write is done
+         */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                       "pipe read upstream: aio");
+
+        if (ngx_event_flags & NGX_USE_LEVEL_EVENT
+                && p->upstream->read->active
+                && p->upstream->read->ready)
+        {
+            if (ngx_del_event(p->upstream->read, NGX_READ_EVENT, 0)
+                    == NGX_ERROR)
+            {
+                return NGX_ABORT;
+            }
+        }
+
+        return NGX_AGAIN;
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, p->log, 0,
                    "pipe read upstream: %d", p->upstream->read->ready);
 
@@ -111,6 +160,17 @@ ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
             break;
         }
 
+        if (p->length == 0)
+        {
+
+            /* the input filter has got the whole response */
+
+            p->upstream_done = 1;
+            p->read = 1;
+
+            break;
+        }
+
         if (p->preread_bufs == NULL && !p->upstream->read->ready)
         {
             break;
@@ -310,6 +370,7 @@ ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
 
         p->read_length += n;
         cl = chain;
+        unused = NULL;
 
         while (cl && n > 0)
         {
@@ -330,8 +391,24 @@ ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
                 }
 
                 n -= size;
+
+                tl = cl;
                 cl = cl->next;
 
+                if (tl->buf->shadow == NULL && !p->cachable)
+                {
+
+                    /*
+                     * the input filter has not taken anything from the buf,
+                     * e.g. the buf contained the HTTP/1.1 chunk sizes only
+                     */
+
+                    tl->buf->pos = tl->buf->start;
+                    tl->buf->last = tl->buf->start;
+                    tl->next = unused;
+                    unused = tl;
+                }
+
             }
             else
             {
@@ -341,6 +418,42 @@ ngx_int_t ngx_event_pipe_read_upstream(ngx_event_pipe_t *p)
         }
 
         p->free_raw_bufs = cl;
+
+        while (unused)
+        {
+            tl = unused->next;
+            ngx_event_pipe_add_free_buf(&p->free_raw_bufs, unused);
+            unused = tl;
+        }
+
+        if (p->length > 0
+                && p->free_raw_bufs
+                && p->free_raw_bufs->buf->last - p->free_raw_bufs->buf->pos
+                >= p->length)
+        {
+
+            /*
+             * the partially filled buf may contain the end of the response,
+             * the length is the least number of the bytes needed to complete
+             */
+
+            cl = p->free_raw_bufs;
+            p->free_raw_bufs = cl->next;
+
+            /* STUB */ cl->buf->num = p->num++;
+
+            if (p->input_filter(p, cl->buf) == NGX_ERROR)
+            {
+                return NGX_ABORT;
+            }
+
+            if (cl->buf->shadow == NULL && !p->cachable)
+            {
+                cl->buf->pos = cl->buf->start;
+                cl->buf->last = cl->buf->start;
+                ngx_event_pipe_add_free_buf(&p->free_raw_bufs, cl);
+            }
+        }
     }
 
 #if (NGX_DEBUG)
@@ -445,7 +558,9 @@ ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
                 p->out = NULL;
             }
 
-            if (p->in)
+            /* the bufs that follow the bufs being written are dropped */
+
+            if (p->in && !p->aio)
             {
                 ngx_log_debug0(NGX_LOG_DEBUG_EVENT, p->log, 0,
                                "pipe write downstream flush in");
@@ -506,7 +621,7 @@ ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
                                                    cl->buf);
 
             }
-            else if (!p->cachable && p->in)
+            else if (!p->cachable && p->in && !p->aio)
             {
                 cl = p->in;
 
@@ -589,8 +704,10 @@ ngx_int_t ngx_event_pipe_write_to_downstream(ngx_event_pipe_t *p)
 static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
 {
     ssize_t       size, bsize;
-    ngx_buf_t    *b;
-    ngx_chain_t  *cl, *tl, *next, *out, **ll, **last_free, fl;
+    ngx_chain_t  *cl, *out, **ll, fl;
+#if (NGX_THREAD_POOL)
+    ngx_int_t     rc;
+#endif
 
     if (p->buf_to_file)
     {
@@ -656,16 +773,25 @@ static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
         p->last_in = &p->in;
     }
 
-    if (ngx_write_chain_to_temp_file(p->temp_file, out) == NGX_ERROR)
+#if (NGX_THREAD_POOL)
+
+    if (p->thread_pool && !p->cachable && p->buf_to_file == NULL)
     {
-        return NGX_ABORT;
+        rc = ngx_event_pipe_thread_write(p, out);
+
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+
+        /* the queue is full, write the file in the worker */
     }
 
-    for (last_free = &p->free_raw_bufs;
-            *last_free != NULL;
-            last_free = &(*last_free)->next)
+#endif
+
+    if (ngx_write_chain_to_temp_file(p->temp_file, out) == NGX_ERROR)
     {
-        /* void */
+        return NGX_ABORT;
     }
 
     if (p->buf_to_file)
@@ -675,6 +801,28 @@ static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
         out = out->next;
     }
 
+    return ngx_event_pipe_temp_file_bufs(p, out);
+}
+
+
+/*
+ * the bufs written to the temp file are moved to the p->out chain
+ * and their shadow raw bufs are freed
+ */
+
+static ngx_int_t ngx_event_pipe_temp_file_bufs(ngx_event_pipe_t *p,
+        ngx_chain_t *out)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *tl, *next, **last_free;
+
+    for (last_free = &p->free_raw_bufs;
+            *last_free != NULL;
+            last_free = &(*last_free)->next)
+    {
+        /* void */
+    }
+
     for (cl = out; cl; cl = next)
     {
         next = cl->next;
@@ -704,6 +852,163 @@ static ngx_int_t ngx_event_pipe_write_chain_to_temp_file(ngx_event_pipe_t *p)
 }
 
 
+#if (NGX_THREAD_POOL)
+
+/*
+ * the chain is copied to the task memory and is written to the dup()ed fd,
+ * so the pool thread does not depend on the request that may be closed
+ * while the write is in progress; the written range of the temp file
+ * is reserved until the write is done to prevent the cyclic temp file reuse
+ */
+
+static ngx_int_t ngx_event_pipe_thread_write(ngx_event_pipe_t *p,
+        ngx_chain_t *out)
+{
+    u_char                         *last;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_chain_t                    *cl;
+    ngx_temp_file_t                *tf;
+    ngx_thread_task_t              *task;
+    ngx_event_pipe_thread_write_t  *wr;
+
+    tf = p->temp_file;
+
+    if (tf->file.fd == NGX_INVALID_FILE)
+    {
+        rc = ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                  tf->persistent);
+
+        if (rc == NGX_ERROR || rc == NGX_AGAIN)
+        {
+            return NGX_ABORT;
+        }
+
+        if (!tf->persistent && tf->warn)
+        {
+            ngx_log_error(NGX_LOG_WARN, tf->file.log, 0, tf->warn);
+        }
+    }
+
+    size = 0;
+    for (cl = out; cl; cl = cl->next)
+    {
+        size += cl->buf->last - cl->buf->pos;
+    }
+
+    if (!(task = ngx_thread_task_alloc(sizeof(ngx_event_pipe_thread_write_t)
+                                       + size, p->log)))
+    {
+        return NGX_ABORT;
+    }
+
+    wr = task->ctx;
+
+    wr->fd = dup(tf->file.fd);
+
+    if (wr->fd == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno, "dup() failed");
+        ngx_thread_task_free(task);
+        return NGX_DECLINED;
+    }
+
+    wr->offset = tf->offset;
+    wr->size = size;
+
+    last = wr->buf;
+    for (cl = out; cl; cl = cl->next)
+    {
+        last = ngx_cpymem(last, cl->buf->pos,
+                          (size_t) (cl->buf->last - cl->buf->pos));
+    }
+
+    task->handler = ngx_event_pipe_thread_write_handler;
+    task->event_handler = ngx_event_pipe_thread_write_done;
+    task->data = p;
+
+    if (ngx_thread_task_post(p->thread_pool, task) == NGX_ERROR)
+    {
+        close(wr->fd);
+        ngx_thread_task_free(task);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, p->log, 0,
+                   "pipe thread write: %d at %d", size, tf->offset);
+
+    p->writing = out;
+    p->thread_task = task;
+    p->aio = 1;
+
+    tf->offset += size;
+
+    return NGX_AGAIN;
+}
+
+
+static void ngx_event_pipe_thread_write_handler(void *data)
+{
+    ngx_event_pipe_thread_write_t *wr = data;
+
+    wr->n = pwrite(wr->fd, wr->buf, wr->size, wr->offset);
+    wr->err = (wr->n == -1) ? ngx_errno : 0;
+
+    close(wr->fd);
+}
+
+
+static void ngx_event_pipe_thread_write_done(ngx_thread_task_t *task)
+{
+    ngx_event_pipe_t *p = task->data;
+
+    size_t                          size;
+    ngx_chain_t                    *out;
+    ngx_event_pipe_thread_write_t  *wr;
+
+    wr = task->ctx;
+
+    out = p->writing;
+    size = wr->size;
+
+    p->writing = NULL;
+    p->thread_task = NULL;
+    p->aio = 0;
+
+    if (wr->n == -1)
+    {
+        ngx_log_error(NGX_LOG_CRIT, p->log, wr->err, "pwrite() failed");
+        p->upstream_error = 1;
+
+    }
+    else if ((size_t) wr->n != size)
+    {
+        ngx_log_error(NGX_LOG_CRIT, p->log, 0,
+                      "pwrite() has written only %d of %d", wr->n, size);
+        p->upstream_error = 1;
+
+    }
+    else
+    {
+        p->temp_file->offset -= size;
+        p->temp_file->file.offset += size;
+
+        if (ngx_event_pipe_temp_file_bufs(p, out) == NGX_ABORT)
+        {
+            p->upstream_error = 1;
+        }
+    }
+
+    ngx_thread_task_free(task);
+
+    /* send the written bufs and read the upstream again */
+
+    p->downstream->write->event_handler(p->downstream->write);
+}
+
+#endif
+
+
 /* the copy input filter */
 
 ngx_int_t ngx_event_pipe_copy_input_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
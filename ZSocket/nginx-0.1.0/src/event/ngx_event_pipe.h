@@ -58,6 +58,7 @@ struct ngx_event_pipe_s
     unsigned           downstream_done:1;
     unsigned           downstream_error:1;
     unsigned           cyclic_temp_file:1;
+    unsigned           aio:1;
 
     ngx_int_t          allocated;
     ngx_bufs_t         bufs;
@@ -67,6 +68,13 @@ struct ngx_event_pipe_s
 
     off_t              read_length;
 
+    /*
+     * the bytes that the input filter still needs to complete
+     * the response, or -1 if the response ends with the connection
+     */
+
+    off_t              length;
+
     off_t              max_temp_file_size;
     ssize_t            temp_file_write_size;
 
@@ -83,6 +91,13 @@ struct ngx_event_pipe_s
 
     ngx_temp_file_t   *temp_file;
 
+#if (NGX_THREAD_POOL)
+    /* the temp file writes of the not cachable response are run by the pool */
+    ngx_thread_pool_t *thread_pool;
+    ngx_thread_task_t *thread_task;
+    ngx_chain_t       *writing;
+#endif
+
     /* STUB */ int     num;
 };
 
@@ -21,11 +21,18 @@ typedef struct
 
 typedef struct
 {
-    ngx_array_t  *rules;     /* array of ngx_http_access_rule_t */
+    ngx_array_t       *rules;     /* array of ngx_http_access_rule_t */
+    ngx_radix_tree_t  *tree;      /* the rules compiled */
 } ngx_http_access_loc_conf_t;
 
 
+#define NGX_HTTP_ACCESS_ALLOW  0
+#define NGX_HTTP_ACCESS_DENY   1
+
+
 static ngx_int_t ngx_http_access_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_access_compile(ngx_conf_t *cf,
+                                         ngx_http_access_loc_conf_t *alcf);
 static char *ngx_http_access_rule(ngx_conf_t *cf, ngx_command_t *cmd,
                                   void *conf);
 static void *ngx_http_access_create_loc_conf(ngx_conf_t *cf);
@@ -88,14 +95,13 @@ ngx_module_t  ngx_http_access_module =
 
 static ngx_int_t ngx_http_access_handler(ngx_http_request_t *r)
 {
-    ngx_uint_t                   i;
+    uintptr_t                    rule;
     struct sockaddr_in          *addr_in;
-    ngx_http_access_rule_t      *rule;
     ngx_http_access_loc_conf_t  *alcf;
 
     alcf = ngx_http_get_module_loc_conf(r, ngx_http_access_module);
 
-    if (alcf->rules == NULL)
+    if (alcf->tree == NULL)
     {
         return NGX_OK;
     }
@@ -104,24 +110,68 @@ static ngx_int_t ngx_http_access_handler(ngx_http_request_t *r)
 
     addr_in = (struct sockaddr_in *) r->connection->sockaddr;
 
+    rule = ngx_radix32tree_find(alcf->tree, ntohl(addr_in->sin_addr.s_addr));
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "access: %08X %d",
+                   addr_in->sin_addr.s_addr, (int) rule);
+
+    if (rule == NGX_HTTP_ACCESS_DENY)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "access forbidden by rule");
+
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * The rules are compiled into the radix tree where the longest network
+ * wins, so the first match wins if a rule is not added when its network
+ * is already covered by a preceding rule: the more specific networks of
+ * the preceding rules stay in the tree and win over it.
+ */
+
+static ngx_int_t ngx_http_access_compile(ngx_conf_t *cf,
+                                         ngx_http_access_loc_conf_t *alcf)
+{
+    uint32_t                 addr, mask;
+    uintptr_t                value;
+    ngx_uint_t               i;
+    ngx_http_access_rule_t  *rule;
+
+    if (!(alcf->tree = ngx_radix_tree_create(cf->pool)))
+    {
+        return NGX_ERROR;
+    }
+
     rule = alcf->rules->elts;
     for (i = 0; i < alcf->rules->nelts; i++)
     {
+        addr = ntohl(rule[i].addr);
+        mask = ntohl(rule[i].mask);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "%08X %08X %08X",
-                       addr_in->sin_addr.s_addr, rule[i].mask, rule[i].addr);
+        if (addr & ~mask)
+        {
+            /* the network with the host bits set has never matched */
+            continue;
+        }
 
-        if ((addr_in->sin_addr.s_addr & rule[i].mask) == rule[i].addr)
+        if (ngx_radix32tree_find_prefix(alcf->tree, addr, mask)
+                != NGX_RADIX_NO_VALUE)
         {
-            if (rule[i].deny)
-            {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                              "access forbidden by rule");
+            continue;
+        }
 
-                return NGX_HTTP_FORBIDDEN;
-            }
+        value = rule[i].deny ? NGX_HTTP_ACCESS_DENY : NGX_HTTP_ACCESS_ALLOW;
 
-            return NGX_OK;
+        if (ngx_radix32tree_insert(alcf->tree, addr, mask, value)
+                == NGX_ERROR)
+        {
+            return NGX_ERROR;
         }
     }
 
@@ -207,9 +257,28 @@ static char *ngx_http_access_merge_loc_conf(ngx_conf_t *cf,
     ngx_http_access_loc_conf_t  *prev = parent;
     ngx_http_access_loc_conf_t  *conf = child;
 
+    /* the rules of the http level are compiled once for all servers */
+
+    if (prev->rules && prev->tree == NULL)
+    {
+        if (ngx_http_access_compile(cf, prev) == NGX_ERROR)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     if (conf->rules == NULL)
     {
         conf->rules = prev->rules;
+        conf->tree = prev->tree;
+    }
+
+    if (conf->rules && conf->tree == NULL)
+    {
+        if (ngx_http_access_compile(cf, conf) == NGX_ERROR)
+        {
+            return NGX_CONF_ERROR;
+        }
     }
 
     return NGX_CONF_OK;
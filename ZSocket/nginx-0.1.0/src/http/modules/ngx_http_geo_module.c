@@ -0,0 +1,370 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct
+{
+    ngx_str_t            name;
+    ngx_radix_tree_t    *tree;      /* the values are ngx_str_t pointers */
+} ngx_http_geo_t;
+
+
+typedef struct
+{
+    ngx_array_t          geos;      /* array of ngx_http_geo_t */
+} ngx_http_geo_main_conf_t;
+
+
+static ngx_str_t *ngx_http_geo_find(ngx_http_request_t *r, ngx_str_t *name);
+static u_char *ngx_http_geo_log_geo(ngx_http_request_t *r, u_char *buf,
+                                    uintptr_t data);
+static ngx_int_t ngx_http_geo_pre_conf(ngx_conf_t *cf);
+static void *ngx_http_geo_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+static char *ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+
+
+static ngx_command_t  ngx_http_geo_commands[] =
+{
+
+    {
+        ngx_string("geo"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+        ngx_http_geo_block,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+
+ngx_http_module_t  ngx_http_geo_module_ctx =
+{
+    ngx_http_geo_pre_conf,                 /* pre conf */
+
+    ngx_http_geo_create_main_conf,         /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_geo_module =
+{
+    NGX_MODULE,
+    &ngx_http_geo_module_ctx,              /* module context */
+    ngx_http_geo_commands,                 /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init module */
+    NULL                                   /* init process */
+};
+
+
+static ngx_http_log_op_name_t ngx_http_geo_log_fmt_ops[] =
+{
+    { ngx_string("geo"), NGX_HTTP_LOG_ARG, ngx_http_geo_log_geo },
+    { ngx_null_string, 0, NULL }
+};
+
+
+static ngx_str_t *ngx_http_geo_find(ngx_http_request_t *r, ngx_str_t *name)
+{
+    uintptr_t                  value;
+    ngx_uint_t                 i;
+    ngx_http_geo_t            *geo;
+    struct sockaddr_in        *addr_in;
+    ngx_http_geo_main_conf_t  *gmcf;
+
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_geo_module);
+
+    geo = gmcf->geos.elts;
+    for (i = 0; i < gmcf->geos.nelts; i++)
+    {
+        if (geo[i].name.len == name->len
+                && ngx_strncmp(geo[i].name.data, name->data, name->len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == gmcf->geos.nelts)
+    {
+        return NULL;
+    }
+
+    /* AF_INET only */
+
+    addr_in = (struct sockaddr_in *) r->connection->sockaddr;
+
+    value = ngx_radix32tree_find(geo[i].tree,
+                                 ntohl(addr_in->sin_addr.s_addr));
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "geo \"%s\": " PTR_FMT, geo[i].name.data, value);
+
+    if (value == NGX_RADIX_NO_VALUE)
+    {
+        return NULL;
+    }
+
+    return (ngx_str_t *) value;
+}
+
+
+/*
+ * the "%{name}geo" log format operation, the geo block may follow
+ * the log format so the name is looked up at the run time
+ */
+
+static u_char *ngx_http_geo_log_geo(ngx_http_request_t *r, u_char *buf,
+                                    uintptr_t data)
+{
+    ngx_str_t          *value;
+    ngx_http_log_op_t  *op;
+
+    if (r == NULL)
+    {
+        /* a format string compilation */
+
+        op = (ngx_http_log_op_t *) buf;
+
+        op->len = 0;
+        op->op = ngx_http_geo_log_geo;
+        op->data = data;
+
+        return NULL;
+    }
+
+    value = ngx_http_geo_find(r, (ngx_str_t *) data);
+
+    if (value == NULL || value->len == 0)
+    {
+        if (buf)
+        {
+            *buf = '-';
+        }
+
+        return buf + 1;
+    }
+
+    if (buf == NULL)
+    {
+        return (u_char *) value->len;
+    }
+
+    return ngx_cpymem(buf, value->data, value->len);
+}
+
+
+static ngx_int_t ngx_http_geo_pre_conf(ngx_conf_t *cf)
+{
+    ngx_http_log_op_name_t  *op;
+
+    for (op = ngx_http_geo_log_fmt_ops; op->name.len; op++)
+    {
+        /* void */
+    }
+    op->op = NULL;
+
+    for (op = ngx_http_log_fmt_ops; op->op; op++)
+    {
+        if (op->name.len == 0)
+        {
+            op = (ngx_http_log_op_name_t *) op->op;
+        }
+    }
+
+    op->op = (ngx_http_log_op_pt) ngx_http_geo_log_fmt_ops;
+
+    return NGX_OK;
+}
+
+
+static void *ngx_http_geo_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_geo_main_conf_t  *gmcf;
+
+    if (!(gmcf = ngx_palloc(cf->pool, sizeof(ngx_http_geo_main_conf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_init_array(gmcf->geos, cf->pool, 2, sizeof(ngx_http_geo_t),
+                   NGX_CONF_ERROR);
+
+    return gmcf;
+}
+
+
+/*
+ * geo name {
+ *     default        value;
+ *     192.168.1.0/24 value;
+ *     ...
+ * }
+ */
+
+static char *ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+    ngx_http_geo_main_conf_t *gmcf = conf;
+
+    char            *rv;
+    ngx_str_t       *value, name;
+    ngx_uint_t       i;
+    ngx_conf_t       pvcf;
+    ngx_http_geo_t  *geo;
+
+    value = cf->args->elts;
+
+    name = value[1];
+
+    if (name.data[0] == '$')
+    {
+        name.len--;
+        name.data++;
+    }
+
+    if (name.len == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid geo name \"%s\"", value[1].data);
+        return NGX_CONF_ERROR;
+    }
+
+    geo = gmcf->geos.elts;
+    for (i = 0; i < gmcf->geos.nelts; i++)
+    {
+        if (geo[i].name.len == name.len
+                && ngx_strcmp(geo[i].name.data, name.data) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate geo \"%s\"", name.data);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (!(geo = ngx_push_array(&gmcf->geos)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    geo->name = name;
+
+    if (!(geo->tree = ngx_radix_tree_create(cf->pool)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    pvcf = *cf;
+    cf->ctx = geo;
+    cf->handler = ngx_http_geo;
+    cf->handler_conf = conf;
+    rv = ngx_conf_parse(cf, NULL);
+    *cf = pvcf;
+
+    return rv;
+}
+
+
+/*
+ * unlike the access rules the longest network wins regardless of the order
+ */
+
+static char *ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    uint32_t          key, mask;
+    ngx_int_t         rc;
+    ngx_uint_t        i;
+    ngx_str_t        *value, *val, *old;
+    ngx_http_geo_t   *geo;
+    ngx_inet_cidr_t   in_cidr;
+
+    if (cf->args->nelts != 2)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameters number");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    geo = cf->ctx;
+
+    if (value[0].len == 7 && ngx_strcmp(value[0].data, "default") == 0)
+    {
+        key = 0;
+        mask = 0;
+
+    }
+    else
+    {
+        in_cidr.addr = inet_addr((char *) value[0].data);
+
+        if (in_cidr.addr != INADDR_NONE)
+        {
+            in_cidr.mask = 0xffffffff;
+
+        }
+        else if (ngx_ptocidr(&value[0], &in_cidr) == NGX_ERROR)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%s\"", value[0].data);
+            return NGX_CONF_ERROR;
+        }
+
+        mask = ntohl(in_cidr.mask);
+        key = ntohl(in_cidr.addr) & mask;
+    }
+
+    if (!(val = ngx_palloc(cf->pool, sizeof(ngx_str_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    *val = value[1];
+
+    for (i = 2; i; i--)
+    {
+        rc = ngx_radix32tree_insert(geo->tree, key, mask, (uintptr_t) val);
+
+        if (rc == NGX_OK)
+        {
+            return NGX_CONF_OK;
+        }
+
+        if (rc == NGX_ERROR)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        /* rc == NGX_BUSY */
+
+        old = (ngx_str_t *) ngx_radix32tree_find_prefix(geo->tree, key, mask);
+
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "duplicate parameter \"%s\", value: \"%s\", "
+                           "old value: \"%s\"",
+                           value[0].data, val->data, old->data);
+
+        if (ngx_radix32tree_delete(geo->tree, key, mask) == NGX_ERROR)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_ERROR;
+}
@@ -31,6 +31,9 @@ typedef struct
 #define NGX_HTTP_DEFAULT_INDEX   "index.html"
 
 
+static ngx_int_t ngx_http_index_open_cached(ngx_http_request_t *r,
+        ngx_http_core_loc_conf_t *clcf, ngx_str_t *name,
+        ngx_open_file_info_t *of);
 static ngx_int_t ngx_http_index_test_dir(ngx_http_request_t *r,
         ngx_http_index_ctx_t *ctx);
 static ngx_int_t ngx_http_index_error(ngx_http_request_t *r,
@@ -114,9 +117,10 @@ ngx_int_t ngx_http_index_handler(ngx_http_request_t *r)
     u_char                     *name;
     ngx_fd_t                    fd;
     ngx_int_t                   rc;
-    ngx_str_t                  *index;
+    ngx_str_t                  *index, file;
     ngx_err_t                   err;
     ngx_log_t                  *log;
+    ngx_open_file_info_t        of;
     ngx_http_index_ctx_t       *ctx;
     ngx_http_core_loc_conf_t   *clcf;
     ngx_http_index_loc_conf_t  *ilcf;
@@ -267,17 +271,50 @@ ngx_int_t ngx_http_index_handler(ngx_http_request_t *r)
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                        "open index \"%s\"", name);
 
-        fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN);
+        if (clcf->open_file_cache)
+        {
+            /*
+             * the descriptor is released at once, the static handler
+             * finds it in the cache again after the redirect
+             */
+
+            file.data = name;
+            file.len = ngx_strlen(name);
+
+            ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+            if (ngx_http_index_open_cached(r, clcf, &file, &of) == NGX_OK)
+            {
+                err = 0;
+
+            }
+            else if (of.err == 0)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+            }
+            else
+            {
+                err = of.err;
+            }
+
+            fd = NGX_INVALID_FILE;
 
-        if (fd == (ngx_fd_t) NGX_AGAIN)
+        }
+        else
         {
-            return NGX_AGAIN;
+            fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN);
+
+            if (fd == (ngx_fd_t) NGX_AGAIN)
+            {
+                return NGX_AGAIN;
+            }
+
+            err = (fd == NGX_INVALID_FILE) ? ngx_errno : 0;
         }
 
-        if (fd == NGX_INVALID_FILE)
+        if (err)
         {
-            err = ngx_errno;
-
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, err,
                            ngx_open_file_n " %s failed", name);
 
@@ -314,8 +351,7 @@ ngx_int_t ngx_http_index_handler(ngx_http_request_t *r)
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-
-        /* STUB: open file cache */
+        /* the fd is invalid if the descriptor is owned by the cache */
 
         r->file.name.data = name;
         r->file.fd = fd;
@@ -393,10 +429,34 @@ ngx_int_t ngx_http_index_handler(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t ngx_http_index_open_cached(ngx_http_request_t *r,
+        ngx_http_core_loc_conf_t *clcf, ngx_str_t *name,
+        ngx_open_file_info_t *of)
+{
+    ngx_int_t  rc;
+
+    of->valid = clcf->open_file_cache_valid;
+    of->errors = clcf->open_file_cache_errors;
+
+    rc = ngx_open_cached_file(clcf->open_file_cache, name, of,
+                              r->connection->log);
+
+    if (of->file)
+    {
+        ngx_close_cached_file(of->file);
+    }
+
+    return rc;
+}
+
+
 static ngx_int_t ngx_http_index_test_dir(ngx_http_request_t *r,
         ngx_http_index_ctx_t *ctx)
 {
-    ngx_err_t  err;
+    ngx_err_t                  err;
+    ngx_str_t                  dir;
+    ngx_open_file_info_t       of;
+    ngx_http_core_loc_conf_t  *clcf;
 
     ctx->path.data[ctx->path.len - 1] = '\0';
     ctx->path.data[ctx->path.len] = '\0';
@@ -404,6 +464,43 @@ static ngx_int_t ngx_http_index_test_dir(ngx_http_request_t *r,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http check dir: \"%s\"", ctx->path.data);
 
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->open_file_cache)
+    {
+        dir.data = ctx->path.data;
+        dir.len = ctx->path.len - 1;
+
+        ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+        of.test_dir = 1;
+
+        if (ngx_http_index_open_cached(r, clcf, &dir, &of) != NGX_OK)
+        {
+            if (of.err == NGX_ENOENT)
+            {
+                ctx->path.data[ctx->path.len - 1] = '/';
+                return ngx_http_index_error(r, ctx, of.err);
+            }
+
+            if (of.err)
+            {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
+                              "%s %s failed", of.failed, ctx->path.data);
+            }
+
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->path.data[ctx->path.len - 1] = '/';
+
+        if (of.is_dir)
+        {
+            return NGX_OK;
+        }
+
+        return ngx_http_index_error(r, ctx, 0);
+    }
+
     if (ngx_file_info(ctx->path.data, &r->file.info) == -1)
     {
 
@@ -0,0 +1,467 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* the client state in the shared memory zone, AF_INET only */
+
+typedef struct
+{
+    ngx_rbtree_t                    node;   /* node.key is the client address */
+    ngx_uint_t                      conn;
+} ngx_http_limit_conn_node_t;
+
+
+typedef struct
+{
+    ngx_rbtree_t                   *root;
+    ngx_rbtree_t                    sentinel;
+} ngx_http_limit_conn_sh_t;
+
+
+typedef struct
+{
+    ngx_http_limit_conn_sh_t       *sh;
+    ngx_slab_pool_t                *shpool;
+} ngx_http_limit_conn_zone_t;
+
+
+typedef struct
+{
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_uint_t                      conn;
+} ngx_http_limit_conn_loc_conf_t;
+
+
+typedef struct
+{
+    ngx_http_limit_conn_zone_t     *zone;
+    ngx_http_limit_conn_node_t     *node;
+} ngx_http_limit_conn_ctx_t;
+
+
+static void ngx_http_limit_conn_cleanup(void *data);
+static ngx_int_t ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone,
+                                               void *data);
+static void *ngx_http_limit_conn_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_conn_merge_loc_conf(ngx_conf_t *cf,
+        void *parent, void *child);
+static char *ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+static char *ngx_http_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+static ngx_int_t ngx_http_limit_conn_init(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_limit_conn_commands[] =
+{
+
+    {
+        ngx_string("limit_conn_zone"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+        ngx_http_limit_conn_zone,
+        0,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("limit_conn"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+        ngx_http_limit_conn,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+
+ngx_http_module_t  ngx_http_limit_conn_module_ctx =
+{
+    NULL,                                  /* pre conf */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_limit_conn_create_loc_conf,   /* create location configuration */
+    ngx_http_limit_conn_merge_loc_conf     /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_conn_module =
+{
+    NGX_MODULE,
+    &ngx_http_limit_conn_module_ctx,       /* module context */
+    ngx_http_limit_conn_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    ngx_http_limit_conn_init,              /* init module */
+    NULL                                   /* init process */
+};
+
+
+static ngx_int_t ngx_http_limit_conn_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        key;
+    ngx_rbtree_t                    *node, *sentinel;
+    struct sockaddr_in              *addr_in;
+    ngx_http_cleanup_t              *cln;
+    ngx_http_limit_conn_sh_t        *sh;
+    ngx_http_limit_conn_ctx_t       *ctx;
+    ngx_http_limit_conn_node_t      *lc;
+    ngx_http_limit_conn_zone_t      *zone;
+    ngx_http_limit_conn_loc_conf_t  *lccf;
+
+    if (ngx_http_get_module_ctx(r, ngx_http_limit_conn_module))
+    {
+        /* the access phase is run again, the request is already counted */
+        return NGX_DECLINED;
+    }
+
+    lccf = ngx_http_get_module_loc_conf(r, ngx_http_limit_conn_module);
+
+    if (lccf->shm_zone == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    zone = lccf->shm_zone->data;
+    sh = zone->sh;
+    sentinel = &sh->sentinel;
+
+    ngx_http_create_ctx(r, ctx, ngx_http_limit_conn_module,
+                        sizeof(ngx_http_limit_conn_ctx_t),
+                        NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    /* the cleanup is allocated before the counter is incremented */
+
+    if (!(cln = ngx_push_array(&r->cleanup)))
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->valid = 0;
+
+    /* AF_INET only */
+
+    addr_in = (struct sockaddr_in *) r->connection->sockaddr;
+    key = (ngx_int_t) addr_in->sin_addr.s_addr;
+
+    ngx_slab_lock(zone->shpool);
+
+    for (node = sh->root; node != sentinel; /* void */)
+    {
+
+        if (key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        break;
+    }
+
+    if (node != sentinel)
+    {
+        lc = (ngx_http_limit_conn_node_t *) node;
+
+        if (lc->conn >= lccf->conn)
+        {
+            ngx_slab_unlock(zone->shpool);
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "limiting connections by zone \"%s\"",
+                          lccf->shm_zone->name.data);
+
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        lc->conn++;
+
+    }
+    else
+    {
+        lc = ngx_slab_alloc_locked(zone->shpool,
+                                   sizeof(ngx_http_limit_conn_node_t));
+        if (lc == NULL)
+        {
+            ngx_slab_unlock(zone->shpool);
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "the \"%s\" zone has no memory "
+                          "to limit connections",
+                          lccf->shm_zone->name.data);
+
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        lc->node.key = key;
+        lc->conn = 1;
+
+        ngx_rbtree_insert(&sh->root, sentinel, &lc->node);
+    }
+
+    ngx_slab_unlock(zone->shpool);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "limit_conn: %" NGX_UINT_T_FMT, lc->conn);
+
+    ctx->zone = zone;
+    ctx->node = lc;
+
+    cln->data.handler.handler = ngx_http_limit_conn_cleanup;
+    cln->data.handler.data = ctx;
+    cln->valid = 1;
+    cln->cache = 0;
+    cln->handler = 1;
+
+    return NGX_DECLINED;
+}
+
+
+static void ngx_http_limit_conn_cleanup(void *data)
+{
+    ngx_http_limit_conn_ctx_t  *ctx = data;
+
+    ngx_http_limit_conn_sh_t    *sh;
+    ngx_http_limit_conn_node_t  *lc;
+
+    sh = ctx->zone->sh;
+    lc = ctx->node;
+
+    ngx_slab_lock(ctx->zone->shpool);
+
+    if (--lc->conn == 0)
+    {
+        ngx_rbtree_delete(&sh->root, &sh->sentinel, &lc->node);
+        ngx_slab_free_locked(ctx->zone->shpool, lc);
+    }
+
+    ngx_slab_unlock(ctx->zone->shpool);
+}
+
+
+static ngx_int_t ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone,
+                                               void *data)
+{
+    ngx_http_limit_conn_zone_t  *ozone = data;
+
+    ngx_http_limit_conn_sh_t    *sh;
+    ngx_http_limit_conn_zone_t  *zone;
+
+    zone = shm_zone->data;
+    zone->shpool = shm_zone->shpool;
+
+    if (ozone)
+    {
+        /* the requests of the old workers are still counted in the zone */
+
+        zone->sh = ozone->sh;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(zone->shpool, sizeof(ngx_http_limit_conn_sh_t));
+    if (sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the calloc()ed sentinel is black */
+
+    sh->root = &sh->sentinel;
+
+    zone->sh = sh;
+    zone->shpool->data = sh;
+
+    return NGX_OK;
+}
+
+
+static void *ngx_http_limit_conn_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_conn_loc_conf_t  *conf;
+
+    if (!(conf = ngx_pcalloc(cf->pool,
+                             sizeof(ngx_http_limit_conn_loc_conf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* conf->shm_zone = NULL; */
+
+    return conf;
+}
+
+
+static char *ngx_http_limit_conn_merge_loc_conf(ngx_conf_t *cf,
+        void *parent, void *child)
+{
+    ngx_http_limit_conn_loc_conf_t  *prev = parent;
+    ngx_http_limit_conn_loc_conf_t  *conf = child;
+
+    if (conf->shm_zone == NULL)
+    {
+        *conf = *prev;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * limit_conn_zone $remote_addr zone=name:size
+ */
+
+static char *ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf)
+{
+    u_char                      *p;
+    ssize_t                      size;
+    ngx_str_t                   *value, name, s;
+    ngx_shm_zone_t              *shm_zone;
+    ngx_http_limit_conn_zone_t  *zone;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "$remote_addr") != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the limiting key \"%s\" is not supported, "
+                           "only \"$remote_addr\" is", value[1].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strncmp(value[2].data, "zone=", 5) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%s\"", value[2].data);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[2].data + 5;
+
+    for (p = name.data; *p && *p != ':'; p++)
+    {
+        /* void */
+    }
+
+    name.len = p - name.data;
+    size = 0;
+
+    if (*p == ':')
+    {
+        *p++ = '\0';
+
+        s.len = value[2].data + value[2].len - p;
+        s.data = p;
+
+        size = ngx_parse_size(&s);
+    }
+
+    if (name.len == 0 || size == NGX_ERROR || size == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%s\"", value[2].data);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_limit_conn_module);
+    if (shm_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%s\"", name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (!(zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_conn_zone_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_limit_conn_init_zone;
+    shm_zone->data = zone;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * limit_conn name number
+ */
+
+static char *ngx_http_limit_conn(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf)
+{
+    ngx_http_limit_conn_loc_conf_t *lccf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (lccf->shm_zone)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lccf->shm_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                           &ngx_http_limit_conn_module);
+    if (lccf->shm_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    n = ngx_atoi(value[2].data, value[2].len);
+
+    if (n == NGX_ERROR || n == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%s\"",
+                           value[2].data);
+        return NGX_CONF_ERROR;
+    }
+
+    lccf->conn = n;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t ngx_http_limit_conn_init(ngx_cycle_t *cycle)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
+
+    h = ngx_push_array(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limit_conn_handler;
+
+    return NGX_OK;
+}
@@ -0,0 +1,696 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct ngx_http_limit_req_node_s  ngx_http_limit_req_node_t;
+
+/* the client state in the shared memory zone, AF_INET only */
+
+struct ngx_http_limit_req_node_s
+{
+    ngx_rbtree_t                  node;     /* node.key is the client address */
+
+    ngx_http_limit_req_node_t    *prev;     /* the LRU list */
+    ngx_http_limit_req_node_t    *next;
+
+    ngx_epoch_msec_t              last;
+    ngx_uint_t                    excess;   /* in 1/1000 of a request */
+};
+
+
+typedef struct
+{
+    ngx_rbtree_t                 *root;
+    ngx_rbtree_t                  sentinel;
+    ngx_http_limit_req_node_t     lru;      /* the most recently used first */
+} ngx_http_limit_req_sh_t;
+
+
+typedef struct
+{
+    ngx_http_limit_req_sh_t      *sh;
+    ngx_slab_pool_t              *shpool;
+    ngx_uint_t                    rate;     /* in 1/1000 of a request per sec */
+} ngx_http_limit_req_zone_t;
+
+
+typedef struct
+{
+    ngx_shm_zone_t               *shm_zone;
+    ngx_uint_t                    burst;    /* in 1/1000 of a request */
+    ngx_uint_t                    nodelay;
+} ngx_http_limit_req_loc_conf_t;
+
+
+typedef struct
+{
+    ngx_msec_t                    delay;
+} ngx_http_limit_req_ctx_t;
+
+
+static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_zone_t *zone,
+        ngx_int_t key, ngx_epoch_msec_t now, ngx_uint_t burst,
+        ngx_uint_t *ep);
+static void ngx_http_limit_req_expire(ngx_http_limit_req_zone_t *zone,
+                                      ngx_epoch_msec_t now, ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone,
+                                              void *data);
+static void *ngx_http_limit_req_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_req_merge_loc_conf(ngx_conf_t *cf,
+        void *parent, void *child);
+static char *ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
+static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+static ngx_int_t ngx_http_limit_req_init(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_limit_req_commands[] =
+{
+
+    {
+        ngx_string("limit_req_zone"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+        ngx_http_limit_req_zone,
+        0,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("limit_req"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+        ngx_http_limit_req,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+
+ngx_http_module_t  ngx_http_limit_req_module_ctx =
+{
+    NULL,                                  /* pre conf */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_limit_req_create_loc_conf,    /* create location configuration */
+    ngx_http_limit_req_merge_loc_conf      /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_req_module =
+{
+    NGX_MODULE,
+    &ngx_http_limit_req_module_ctx,        /* module context */
+    ngx_http_limit_req_commands,           /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    ngx_http_limit_req_init,               /* init module */
+    NULL                                   /* init process */
+};
+
+
+static ngx_int_t ngx_http_limit_req_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_uint_t                      excess;
+    ngx_msec_t                      delay;
+    ngx_event_t                    *wev;
+    ngx_epoch_msec_t                now;
+    struct sockaddr_in             *addr_in;
+    ngx_http_limit_req_ctx_t       *ctx;
+    ngx_http_limit_req_zone_t      *zone;
+    ngx_http_limit_req_loc_conf_t  *lrcf;
+
+    wev = r->connection->write;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_limit_req_module);
+
+    if (ctx)
+    {
+        /* the access phase is run again after the delay */
+
+        if (wev->timer_set)
+        {
+            return NGX_AGAIN;
+        }
+
+        wev->timedout = 0;
+
+        return NGX_DECLINED;
+    }
+
+    lrcf = ngx_http_get_module_loc_conf(r, ngx_http_limit_req_module);
+
+    if (lrcf->shm_zone == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    zone = lrcf->shm_zone->data;
+
+    /* AF_INET only */
+
+    addr_in = (struct sockaddr_in *) r->connection->sockaddr;
+
+    /* ngx_start_msec is set in each worker so the sum is the epoch time */
+
+    now = ngx_start_msec + ngx_elapsed_msec;
+
+    ngx_slab_lock(zone->shpool);
+
+    ngx_http_limit_req_expire(zone, now, 1);
+
+    rc = ngx_http_limit_req_lookup(zone,
+                                   (ngx_int_t) addr_in->sin_addr.s_addr,
+                                   now, lrcf->burst, &excess);
+
+    ngx_slab_unlock(zone->shpool);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "limit_req: %" NGX_INT_T_FMT " %" NGX_UINT_T_FMT
+                   ".%03" NGX_UINT_T_FMT,
+                   rc, excess / 1000, excess % 1000);
+
+    if (rc == NGX_BUSY)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "limiting requests, excess: %" NGX_UINT_T_FMT
+                      ".%03" NGX_UINT_T_FMT " by zone \"%s\"",
+                      excess / 1000, excess % 1000,
+                      lrcf->shm_zone->name.data);
+
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (rc == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the \"%s\" zone has no memory to limit requests",
+                      lrcf->shm_zone->name.data);
+
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (lrcf->nodelay)
+    {
+        return NGX_DECLINED;
+    }
+
+    delay = (ngx_msec_t) ((ngx_epoch_msec_t) excess * 1000 / zone->rate);
+
+    if (delay == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_create_ctx(r, ctx, ngx_http_limit_req_module,
+                        sizeof(ngx_http_limit_req_ctx_t),
+                        NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    ctx->delay = delay;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "delaying request for %" NGX_INT_T_FMT " ms, excess: %"
+                  NGX_UINT_T_FMT ".%03" NGX_UINT_T_FMT " by zone \"%s\"",
+                  ctx->delay, excess / 1000, excess % 1000,
+                  lrcf->shm_zone->name.data);
+
+    /*
+     * the phase event handler is already set as the write event handler,
+     * it runs the phases again when the timer expires
+     */
+
+    ngx_add_timer(wev, ctx->delay);
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * the leaky bucket: the excess of a client leaks at the zone rate and
+ * grows by one with each request, a request that overflows the burst is
+ * rejected and does not change the state
+ */
+
+static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_zone_t *zone,
+        ngx_int_t key, ngx_epoch_msec_t now, ngx_uint_t burst,
+        ngx_uint_t *ep)
+{
+    ngx_uint_t                  excess;
+    ngx_rbtree_t               *node, *sentinel;
+    ngx_epoch_msec_t            ms, leak;
+    ngx_http_limit_req_sh_t    *sh;
+    ngx_http_limit_req_node_t  *lr;
+
+    sh = zone->sh;
+    sentinel = &sh->sentinel;
+
+    for (node = sh->root; node != sentinel; /* void */)
+    {
+
+        if (key < node->key)
+        {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key)
+        {
+            node = node->right;
+            continue;
+        }
+
+        lr = (ngx_http_limit_req_node_t *) node;
+
+        /* the workers update their cached time independently */
+
+        ms = (now > lr->last) ? now - lr->last : 0;
+
+        leak = (ngx_epoch_msec_t) zone->rate * ms / 1000;
+
+        excess = lr->excess + 1000;
+        excess = (leak < excess) ? excess - (ngx_uint_t) leak : 0;
+
+        *ep = excess;
+
+        if (excess > burst)
+        {
+            return NGX_BUSY;
+        }
+
+        lr->excess = excess;
+        lr->last = now;
+
+        /* move to the head of the LRU list */
+
+        lr->prev->next = lr->next;
+        lr->next->prev = lr->prev;
+
+        lr->next = sh->lru.next;
+        lr->prev = &sh->lru;
+        sh->lru.next->prev = lr;
+        sh->lru.next = lr;
+
+        return NGX_OK;
+    }
+
+    *ep = 0;
+
+    lr = ngx_slab_alloc_locked(zone->shpool, sizeof(ngx_http_limit_req_node_t));
+
+    if (lr == NULL)
+    {
+        /* drop the least recently used client and try again */
+
+        ngx_http_limit_req_expire(zone, now, 0);
+
+        lr = ngx_slab_alloc_locked(zone->shpool,
+                                   sizeof(ngx_http_limit_req_node_t));
+        if (lr == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    lr->node.key = key;
+    lr->last = now;
+    lr->excess = 0;
+
+    ngx_rbtree_insert(&sh->root, sentinel, &lr->node);
+
+    lr->next = sh->lru.next;
+    lr->prev = &sh->lru;
+    sh->lru.next->prev = lr;
+    sh->lru.next = lr;
+
+    return NGX_OK;
+}
+
+
+/*
+ * n == 1 deletes up to two idle clients from the tail of the LRU list,
+ * n == 0 deletes the least recently used client unconditionally as well
+ */
+
+static void ngx_http_limit_req_expire(ngx_http_limit_req_zone_t *zone,
+                                      ngx_epoch_msec_t now, ngx_uint_t n)
+{
+    ngx_epoch_msec_t            ms;
+    ngx_http_limit_req_sh_t    *sh;
+    ngx_http_limit_req_node_t  *lr;
+
+    sh = zone->sh;
+
+    while (n < 3)
+    {
+        lr = sh->lru.prev;
+
+        if (lr == &sh->lru)
+        {
+            return;
+        }
+
+        if (n++ != 0)
+        {
+            ms = (now > lr->last) ? now - lr->last : 0;
+
+            if (ms < 60000)
+            {
+                return;
+            }
+
+            if ((ngx_epoch_msec_t) zone->rate * ms / 1000 < lr->excess)
+            {
+                return;
+            }
+        }
+
+        lr->prev->next = lr->next;
+        lr->next->prev = lr->prev;
+
+        ngx_rbtree_delete(&sh->root, &sh->sentinel, &lr->node);
+
+        ngx_slab_free_locked(zone->shpool, lr);
+    }
+}
+
+
+static ngx_int_t ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone,
+                                              void *data)
+{
+    ngx_http_limit_req_zone_t  *ozone = data;
+
+    ngx_http_limit_req_sh_t    *sh;
+    ngx_http_limit_req_zone_t  *zone;
+
+    zone = shm_zone->data;
+    zone->shpool = shm_zone->shpool;
+
+    if (ozone)
+    {
+        /* the clients state is kept over the reconfiguration */
+
+        zone->sh = ozone->sh;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(zone->shpool, sizeof(ngx_http_limit_req_sh_t));
+    if (sh == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the calloc()ed sentinel is black */
+
+    sh->root = &sh->sentinel;
+    sh->lru.next = &sh->lru;
+    sh->lru.prev = &sh->lru;
+
+    zone->sh = sh;
+    zone->shpool->data = sh;
+
+    return NGX_OK;
+}
+
+
+static void *ngx_http_limit_req_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req_loc_conf_t  *conf;
+
+    if (!(conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_loc_conf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* conf->shm_zone = NULL; */
+
+    return conf;
+}
+
+
+static char *ngx_http_limit_req_merge_loc_conf(ngx_conf_t *cf,
+        void *parent, void *child)
+{
+    ngx_http_limit_req_loc_conf_t  *prev = parent;
+    ngx_http_limit_req_loc_conf_t  *conf = child;
+
+    if (conf->shm_zone == NULL)
+    {
+        *conf = *prev;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * limit_req_zone $remote_addr zone=name:size rate=number r/s|r/m
+ */
+
+static char *ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf)
+{
+    u_char                     *p;
+    ssize_t                     size;
+    ngx_int_t                   rate, scale;
+    ngx_str_t                  *value, name, s;
+    ngx_uint_t                  i;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_http_limit_req_zone_t  *zone;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "$remote_addr") != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the limiting key \"%s\" is not supported, "
+                           "only \"$remote_addr\" is", value[1].data);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = 0;
+    size = 0;
+    rate = 0;
+    scale = 1;
+
+    for (i = 2; i < cf->args->nelts; i++)
+    {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0)
+        {
+            name.data = value[i].data + 5;
+
+            for (p = name.data; *p && *p != ':'; p++)
+            {
+                /* void */
+            }
+
+            name.len = p - name.data;
+
+            if (*p == ':')
+            {
+                *p++ = '\0';
+
+                s.len = value[i].data + value[i].len - p;
+                s.data = p;
+
+                size = ngx_parse_size(&s);
+            }
+
+            if (name.len == 0 || size == NGX_ERROR || size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone \"%s\"", value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0)
+        {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            if (s.len > 3
+                    && ngx_strcmp(s.data + s.len - 3, "r/s") == 0)
+            {
+                scale = 1;
+                s.len -= 3;
+
+            }
+            else if (s.len > 3
+                    && ngx_strcmp(s.data + s.len - 3, "r/m") == 0)
+            {
+                scale = 60;
+                s.len -= 3;
+            }
+
+            rate = ngx_atoi(s.data, s.len);
+
+            if (rate == NGX_ERROR || rate == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%s\"", value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%s\"", value[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0 || rate == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%s\" must have the \"zone\" and \"rate\" "
+                           "parameters", cmd->name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_limit_req_module);
+    if (shm_zone == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%s\"", name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (!(zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_zone_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    zone->rate = rate * 1000 / scale;
+
+    if (zone->rate == 0)
+    {
+        zone->rate = 1;
+    }
+
+    shm_zone->init = ngx_http_limit_req_init_zone;
+    shm_zone->data = zone;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * limit_req zone=name [burst=number] [nodelay]
+ */
+
+static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+    ngx_http_limit_req_loc_conf_t *lrcf = conf;
+
+    ngx_int_t    burst;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (lrcf->shm_zone)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    burst = 0;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0)
+        {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            lrcf->shm_zone = ngx_shared_memory_add(cf, &s, 0,
+                                                   &ngx_http_limit_req_module);
+            if (lrcf->shm_zone == NULL)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0)
+        {
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (burst == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst \"%s\"", value[i].data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "nodelay") == 0)
+        {
+            lrcf->nodelay = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%s\"", value[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lrcf->shm_zone == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%s\" must have the \"zone\" parameter",
+                           cmd->name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    lrcf->burst = burst * 1000;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t ngx_http_limit_req_init(ngx_cycle_t *cycle)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module);
+
+    h = ngx_push_array(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+    if (h == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limit_req_handler;
+
+    return NGX_OK;
+}
@@ -15,7 +15,53 @@ typedef struct
 } ngx_http_static_loc_conf_t;
 
 
+#if (NGX_THREAD_POOL)
+
+/*
+ * the task context is allocated by malloc() with the task
+ * and keeps the copy of the name because the request may be closed
+ * while a thread opens the file
+ */
+
+typedef struct
+{
+    ngx_fd_t                     fd;
+    ngx_file_info_t              fi;
+    ngx_err_t                    err;
+    ngx_uint_t                   info;    /* ngx_fd_info() has failed */
+    u_char                       name[1];
+} ngx_http_static_open_t;
+
+
+typedef struct
+{
+    ngx_http_request_t          *request;
+    ngx_str_t                    name;
+    ngx_str_t                    location;
+    ngx_thread_task_t           *task;
+} ngx_http_static_thread_ctx_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_static_open_cached(ngx_http_request_t *r,
+        ngx_http_core_loc_conf_t *clcf, ngx_str_t *name, ngx_str_t *location,
+        ngx_http_cleanup_t *file_cleanup);
+static ngx_int_t ngx_http_static_open_error(ngx_http_request_t *r,
+        ngx_err_t err, char *failed, u_char *name);
+static ngx_int_t ngx_http_static_redirect(ngx_http_request_t *r,
+        ngx_str_t *location);
+static ngx_int_t ngx_http_static_send_file(ngx_http_request_t *r,
+        ngx_fd_t fd, off_t size, time_t mtime);
+#if (NGX_THREAD_POOL)
+static ngx_int_t ngx_http_static_thread_open(ngx_http_request_t *r,
+        ngx_thread_pool_t *tp, ngx_str_t *name, ngx_str_t *location);
+static void ngx_http_static_open_thread_handler(void *data);
+static void ngx_http_static_open_thread_done(ngx_thread_task_t *task);
+static void ngx_http_static_open_thread_cleanup(void *data);
+static void ngx_http_static_thread_cancel(void *data);
+#endif
 static void *ngx_http_static_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_static_merge_loc_conf(ngx_conf_t *cf,
         void *parent, void *child);
@@ -74,20 +120,18 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
     u_char                      *last;
     ngx_fd_t                     fd;
     ngx_int_t                    rc;
-    ngx_uint_t                   level;
     ngx_str_t                    name, location;
+#if (WIN9X)
     ngx_err_t                    err;
+#endif
     ngx_log_t                   *log;
-    ngx_buf_t                   *b;
-    ngx_chain_t                  out;
     ngx_file_info_t              fi;
     ngx_http_cleanup_t          *file_cleanup, *redirect_cleanup;
-    ngx_http_log_ctx_t          *ctx;
     ngx_http_core_loc_conf_t    *clcf;
     ngx_http_static_loc_conf_t  *slcf;
 #if (NGX_HTTP_CACHE)
-    uint32_t                     file_crc, redirect_crc;
-    ngx_http_cache_t            *file, *redirect;
+    uint32_t                     redirect_crc;
+    ngx_http_cache_t            *redirect;
 #endif
 
     if (r->uri.data[r->uri.len - 1] == '/')
@@ -212,29 +256,6 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
 
 #if (NGX_HTTP_CACHE)
 
-    /* look up an open files cache */
-
-    if (clcf->open_files)
-    {
-        file = ngx_http_cache_get(clcf->open_files, file_cleanup,
-                                  &name, &file_crc);
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "http open file cache get: " PTR_FMT, file);
-
-        if (file && !file->expired)
-        {
-            r->cache = file;
-            return ngx_http_send_cached(r);
-        }
-
-    }
-    else
-    {
-        file = NULL;
-    }
-
-
     /* look up an redirect cache */
 
     if (slcf->redirect_cache)
@@ -275,6 +296,37 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
 
 #endif
 
+#if (NGX_THREAD_POOL)
+
+    /*
+     * the open and cache lookups are not offloaded together,
+     * the caches are locked by the worker only
+     */
+
+    if (clcf->aio
+            && r->main == NULL
+            && clcf->open_file_cache == NULL
+            && slcf->redirect_cache == NULL)
+    {
+        rc = ngx_http_static_thread_open(r, clcf->thread_pool,
+                                         &name, &location);
+
+        if (rc != NGX_DECLINED)
+        {
+            return rc;
+        }
+
+        /* the queue is full, open the file in the worker */
+    }
+
+#endif
+
+    if (clcf->open_file_cache)
+    {
+        return ngx_http_static_open_cached(r, clcf, &name, &location,
+                                           file_cleanup);
+    }
+
     /* open file */
 
 #if (WIN9X)
@@ -338,30 +390,8 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
 
     if (fd == NGX_INVALID_FILE)
     {
-        err = ngx_errno;
-
-        if (err == NGX_ENOENT || err == NGX_ENOTDIR)
-        {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_NOT_FOUND;
-
-        }
-        else if (err == NGX_EACCES)
-        {
-            level = NGX_LOG_ERR;
-            rc = NGX_HTTP_FORBIDDEN;
-
-        }
-        else
-        {
-            level = NGX_LOG_CRIT;
-            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        ngx_log_error(level, log, err,
-                      ngx_open_file_n " \"%s\" failed", name.data);
-
-        return rc;
+        return ngx_http_static_open_error(r, ngx_errno, ngx_open_file_n,
+                                          name.data);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "http static fd: %d", fd);
@@ -473,81 +503,144 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
 
 #endif
 
+    file_cleanup->data.file.fd = fd;
+    file_cleanup->data.file.name = name.data;
+    file_cleanup->valid = 1;
+    file_cleanup->cache = 0;
+    file_cleanup->handler = 0;
 
-#if (NGX_HTTP_CACHE)
+    return ngx_http_static_send_file(r, fd, ngx_file_size(&fi),
+                                     ngx_file_mtime(&fi));
+}
 
-    if (clcf->open_files)
-    {
 
-#if (NGX_USE_HTTP_FILE_CACHE_UNIQ)
+/*
+ * the cached descriptor is shared by the requests and is released
+ * by the cleanup handler instead of being closed
+ */
 
-        if (file && file->uniq == ngx_file_uniq(&fi))
-        {
-            if (ngx_close_file(fd) == NGX_FILE_ERROR)
-            {
-                ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                              ngx_close_file_n " \"%s\" failed", name.data);
-            }
-            file->accessed = ngx_cached_time;
-            file->updated = ngx_cached_time;
-            file->expired = 0;
-            r->cache = file;
+static ngx_int_t ngx_http_static_open_cached(ngx_http_request_t *r,
+        ngx_http_core_loc_conf_t *clcf, ngx_str_t *name, ngx_str_t *location,
+        ngx_http_cleanup_t *file_cleanup)
+{
+    ngx_open_file_info_t  of;
 
-            return ngx_http_send_cached(r);
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
 
-        }
-        else
-        {
-            if (file)
-            {
-                ngx_http_cache_unlock(clcf->open_files, file, log);
-                file = NULL;
-            }
+    of.valid = clcf->open_file_cache_valid;
+    of.errors = clcf->open_file_cache_errors;
 
-            file = ngx_http_cache_alloc(clcf->open_files, file,
-                                        file_cleanup,
-                                        &name, file_crc, NULL, log);
-            if (file)
-            {
-                file->uniq = ngx_file_uniq(&fi);
-            }
+    if (ngx_open_cached_file(clcf->open_file_cache, name, &of,
+                             r->connection->log) != NGX_OK)
+    {
+        if (of.err == 0)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-#else
-        file = ngx_http_cache_alloc(clcf->open_files, file,
-                                    file_cleanup,
-                                    &name, file_crc, NULL, log);
-#endif
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
-                       "http open file cache alloc: " PTR_FMT, file);
+        return ngx_http_static_open_error(r, of.err, of.failed, name->data);
+    }
 
-        if (file)
-        {
-            file->fd = fd;
-            file->data.size = ngx_file_size(&fi);
-            file->accessed = ngx_cached_time;
-            file->last_modified = ngx_file_mtime(&fi);
-            file->updated = ngx_cached_time;
-            r->cache = file;
-        }
+    if (of.is_dir)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http dir");
 
-        return ngx_http_send_cached(r);
+        return ngx_http_static_redirect(r, location);
     }
 
-#endif
+    if (!of.is_file)
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "%s is not a regular file", name->data);
 
-    ctx = log->data;
-    ctx->action = "sending response to client";
+        return NGX_HTTP_NOT_FOUND;
+    }
 
-    file_cleanup->data.file.fd = fd;
-    file_cleanup->data.file.name = name.data;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http static cached fd: %d", of.fd);
+
+    file_cleanup->data.handler.handler = ngx_close_cached_file;
+    file_cleanup->data.handler.data = of.file;
     file_cleanup->valid = 1;
     file_cleanup->cache = 0;
+    file_cleanup->handler = 1;
+
+    return ngx_http_static_send_file(r, of.fd, of.size, of.mtime);
+}
+
+
+static ngx_int_t ngx_http_static_open_error(ngx_http_request_t *r,
+        ngx_err_t err, char *failed, u_char *name)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  level;
+
+    if (err == NGX_ENOENT || err == NGX_ENOTDIR)
+    {
+        level = NGX_LOG_ERR;
+        rc = NGX_HTTP_NOT_FOUND;
+
+    }
+    else if (err == NGX_EACCES)
+    {
+        level = NGX_LOG_ERR;
+        rc = NGX_HTTP_FORBIDDEN;
+
+    }
+    else
+    {
+        level = NGX_LOG_CRIT;
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_error(level, r->connection->log, err,
+                  "%s \"%s\" failed", failed, name);
+
+    return rc;
+}
+
+
+/* the location has the reserved byte for the trailing '/' */
+
+static ngx_int_t ngx_http_static_redirect(ngx_http_request_t *r,
+        ngx_str_t *location)
+{
+    u_char  *last;
+
+    last = location->data + location->len - 1;
+    *last++ = '/';
+    *last = '\0';
+
+    r->headers_out.location = ngx_list_push(&r->headers_out.headers);
+    if (r->headers_out.location == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.location->value = *location;
+
+    return NGX_HTTP_MOVED_PERMANENTLY;
+}
+
+
+static ngx_int_t ngx_http_static_send_file(ngx_http_request_t *r,
+        ngx_fd_t fd, off_t size, time_t mtime)
+{
+    ngx_int_t            rc;
+    ngx_log_t           *log;
+    ngx_buf_t           *b;
+    ngx_chain_t          out;
+    ngx_http_log_ctx_t  *ctx;
+
+    log = r->connection->log;
+
+    ctx = log->data;
+    ctx->action = "sending response to client";
 
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = ngx_file_size(&fi);
-    r->headers_out.last_modified_time = ngx_file_mtime(&fi);
+    r->headers_out.content_length_n = size;
+    r->headers_out.last_modified_time = mtime;
 
     if (r->headers_out.content_length_n == 0)
     {
@@ -595,7 +688,7 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
     }
 
     b->file_pos = 0;
-    b->file_last = ngx_file_size(&fi);
+    b->file_last = size;
 
     b->file->fd = fd;
     b->file->log = log;
@@ -607,6 +700,210 @@ static ngx_int_t ngx_http_static_handler(ngx_http_request_t *r)
 }
 
 
+#if (NGX_THREAD_POOL)
+
+static ngx_int_t ngx_http_static_thread_open(ngx_http_request_t *r,
+        ngx_thread_pool_t *tp, ngx_str_t *name, ngx_str_t *location)
+{
+    ngx_thread_task_t             *task;
+    ngx_http_cleanup_t            *cln;
+    ngx_http_static_open_t        *op;
+    ngx_http_static_thread_ctx_t  *ctx;
+
+    if (!(ctx = ngx_palloc(r->pool, sizeof(ngx_http_static_thread_ctx_t))))
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!(cln = ngx_push_array(&r->cleanup)))
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->valid = 0;
+
+    task = ngx_thread_task_alloc(sizeof(ngx_http_static_open_t) + name->len,
+                                 r->connection->log);
+    if (task == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    op = task->ctx;
+    op->fd = NGX_INVALID_FILE;
+    ngx_memcpy(op->name, name->data, name->len + 1);
+
+    task->handler = ngx_http_static_open_thread_handler;
+    task->event_handler = ngx_http_static_open_thread_done;
+    task->cleanup = ngx_http_static_open_thread_cleanup;
+    task->data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_thread_task_free(task);
+        return NGX_DECLINED;
+    }
+
+    ctx->request = r;
+    ctx->name = *name;
+    ctx->location = *location;
+    ctx->task = task;
+
+    cln->data.handler.handler = ngx_http_static_thread_cancel;
+    cln->data.handler.data = ctx;
+    cln->valid = 1;
+    cln->cache = 0;
+    cln->handler = 1;
+
+    r->connection->write->event_handler = ngx_http_empty_handler;
+
+    return NGX_DONE;
+}
+
+
+static void ngx_http_static_open_thread_handler(void *data)
+{
+    ngx_http_static_open_t *op = data;
+
+    op->fd = ngx_open_file(op->name, NGX_FILE_RDONLY, NGX_FILE_OPEN);
+
+    if (op->fd == NGX_INVALID_FILE)
+    {
+        op->err = ngx_errno;
+        return;
+    }
+
+    if (ngx_fd_info(op->fd, &op->fi) == NGX_FILE_ERROR)
+    {
+        op->err = ngx_errno;
+        op->info = 1;
+
+        (void) ngx_close_file(op->fd);
+        op->fd = NGX_INVALID_FILE;
+    }
+}
+
+
+static void ngx_http_static_open_thread_done(ngx_thread_task_t *task)
+{
+    ngx_http_static_thread_ctx_t *ctx = task->data;
+
+    ngx_fd_t                 fd;
+    ngx_int_t                rc;
+    ngx_log_t               *log;
+    ngx_file_info_t          fi;
+    ngx_http_request_t      *r;
+    ngx_http_cleanup_t      *file_cleanup;
+    ngx_http_static_open_t  *op;
+
+    r = ctx->request;
+    log = r->connection->log;
+
+    op = task->ctx;
+    fd = op->fd;
+    fi = op->fi;
+
+    ctx->task = NULL;
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        if (op->info)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, op->err,
+                          ngx_fd_info_n " \"%s\" failed", ctx->name.data);
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        }
+        else
+        {
+            rc = ngx_http_static_open_error(r, op->err, ngx_open_file_n,
+                                            ctx->name.data);
+        }
+
+        ngx_thread_task_free(task);
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    ngx_thread_task_free(task);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "http static thread fd: %d", fd);
+
+    /* the fd is closed by the cleanup on all paths */
+
+    if (!(file_cleanup = ngx_push_array(&r->cleanup)))
+    {
+        if (ngx_close_file(fd) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", ctx->name.data);
+        }
+
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    file_cleanup->data.file.fd = fd;
+    file_cleanup->data.file.name = ctx->name.data;
+    file_cleanup->valid = 1;
+    file_cleanup->cache = 0;
+    file_cleanup->handler = 0;
+
+    if (ngx_is_dir(&fi))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "http dir");
+
+        rc = ngx_http_static_redirect(r, &ctx->location);
+
+    }
+    else if (!ngx_is_file(&fi))
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      "%s is not a regular file", ctx->name.data);
+
+        rc = NGX_HTTP_NOT_FOUND;
+
+    }
+    else
+    {
+        rc = ngx_http_static_send_file(r, fd, ngx_file_size(&fi),
+                                       ngx_file_mtime(&fi));
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static void ngx_http_static_open_thread_cleanup(void *data)
+{
+    ngx_http_static_open_t *op = data;
+
+    if (op->fd == NGX_INVALID_FILE)
+    {
+        return;
+    }
+
+    if (ngx_close_file(op->fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", op->name);
+    }
+}
+
+
+static void ngx_http_static_thread_cancel(void *data)
+{
+    ngx_http_static_thread_ctx_t *ctx = data;
+
+    if (ctx->task)
+    {
+        ngx_thread_task_free(ctx->task);
+        ctx->task = NULL;
+    }
+}
+
+#endif
+
+
 static void *ngx_http_static_create_loc_conf(ngx_conf_t *cf)
 {
     ngx_http_static_loc_conf_t  *conf;
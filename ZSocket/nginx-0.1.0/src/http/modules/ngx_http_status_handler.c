@@ -0,0 +1,414 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include <ngx_http.h>
+
+
+static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_status_peers(u_char *p, u_char *last,
+                                     ngx_http_status_main_conf_t *smcf);
+static ngx_int_t ngx_http_status_init_zone(ngx_shm_zone_t *zone, void *data);
+static void *ngx_http_status_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+static ngx_command_t  ngx_http_status_commands[] =
+{
+
+    {
+        ngx_string("status"),
+        NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+        ngx_http_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    ngx_null_command
+};
+
+
+ngx_http_module_t  ngx_http_status_module_ctx =
+{
+    NULL,                                  /* pre conf */
+
+    ngx_http_status_create_main_conf,      /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_status_module =
+{
+    NGX_MODULE,
+    &ngx_http_status_module_ctx,           /* module context */
+    ngx_http_status_commands,              /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init module */
+    NULL                                   /* init process */
+};
+
+
+static ngx_str_t  ngx_http_status_zone_name = ngx_string("status");
+
+
+static char  ngx_http_status_peers_header[] =
+    "upstream peer requests fails active avg_time max_time" CRLF;
+
+
+static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
+{
+    size_t                        size;
+    ngx_int_t                     rc, active, reading, writing, waiting;
+    ngx_uint_t                    i, n, hits, misses, rate;
+    ngx_buf_t                    *b;
+    ngx_chain_t                   out;
+    ngx_http_status_peers_t      *sp;
+    ngx_http_status_main_conf_t  *smcf;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD)
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_body(r);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+    {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+
+    size = sizeof("Active connections:  " CRLF) + NGX_INT_T_LEN
+           + sizeof("server accepts requests" CRLF) - 1
+           + sizeof("   " CRLF) + 2 * NGX_INT_T_LEN
+           + sizeof("Reading:  Writing:  Waiting:  " CRLF) + 3 * NGX_INT_T_LEN
+           + sizeof("open_file_cache hits misses hit_rate" CRLF) - 1
+           + sizeof("   % " CRLF) + 3 * NGX_INT_T_LEN;
+
+    if (smcf->peers.nelts)
+    {
+        size += sizeof(ngx_http_status_peers_header) - 1;
+
+        sp = smcf->peers.elts;
+        for (i = 0; i < smcf->peers.nelts; i++)
+        {
+            for (n = 0; n < (ngx_uint_t) sp[i].peers->number; n++)
+            {
+                size += sp[i].name.len
+                        + INET_ADDRSTRLEN + sizeof(":65535") - 1
+                        + sizeof("       " CRLF) + 5 * NGX_INT_T_LEN;
+            }
+        }
+    }
+
+    if (!(b = ngx_create_temp_buf(r->pool, size)))
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    active = *ngx_stat_active;
+    reading = *ngx_stat_reading;
+    writing = *ngx_stat_writing;
+
+    /* the counters are not read at once */
+
+    waiting = active - reading - writing;
+
+    if (waiting < 0)
+    {
+        waiting = 0;
+    }
+
+    hits = *ngx_stat_open_file_hits;
+    misses = *ngx_stat_open_file_misses;
+
+    rate = (hits + misses) ? hits * 100 / (hits + misses) : 0;
+
+    b->last += ngx_snprintf((char *) b->last, b->end - b->last,
+                            "Active connections: %" NGX_INT_T_FMT " " CRLF
+                            "server accepts requests" CRLF
+                            " %u %u " CRLF
+                            "Reading: %" NGX_INT_T_FMT
+                            " Writing: %" NGX_INT_T_FMT
+                            " Waiting: %" NGX_INT_T_FMT " " CRLF
+                            "open_file_cache hits misses hit_rate" CRLF
+                            " %" NGX_UINT_T_FMT " %" NGX_UINT_T_FMT
+                            " %" NGX_UINT_T_FMT "%% " CRLF,
+                            active,
+                            *ngx_stat_accepted, *ngx_stat_requests,
+                            reading, writing, waiting,
+                            hits, misses, rate);
+
+    if (smcf->peers.nelts)
+    {
+        b->last = ngx_http_status_peers(b->last, b->end, smcf);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    r->headers_out.content_type = ngx_list_push(&r->headers_out.headers);
+    if (r->headers_out.content_type == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.content_type->key.len = sizeof("Content-Type") - 1;
+    r->headers_out.content_type->key.data = (u_char *) "Content-Type";
+    r->headers_out.content_type->value.len = sizeof("text/plain") - 1;
+    r->headers_out.content_type->value.data = (u_char *) "text/plain";
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    {
+        return rc;
+    }
+
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *ngx_http_status_peers(u_char *p, u_char *last,
+                                     ngx_http_status_main_conf_t *smcf)
+{
+    ngx_msec_t                    avg;
+    ngx_uint_t                    i, k;
+    ngx_int_t                     n;
+    ngx_peer_t                   *peer;
+    ngx_peer_stat_t               stat, *stats;
+    ngx_http_status_peers_t      *sp;
+
+    p = ngx_cpymem(p, ngx_http_status_peers_header,
+                   sizeof(ngx_http_status_peers_header) - 1);
+
+    sp = smcf->peers.elts;
+
+    for (i = 0; i < smcf->peers.nelts; i++)
+    {
+        stats = sp[i].peers->stats;
+
+        if (stats == NULL)
+        {
+            continue;
+        }
+
+        /* the locations that proxy to the same upstream share the counters */
+
+        for (k = 0; k < i; k++)
+        {
+            if (sp[k].peers->stats == stats)
+            {
+                break;
+            }
+        }
+
+        if (k < i)
+        {
+            continue;
+        }
+
+        for (n = 0; n < sp[i].peers->number; n++)
+        {
+            peer = &sp[i].peers->peers[n];
+
+            ngx_spinlock(&stats[n].lock, 1024);
+            stat = stats[n];
+            ngx_unlock(&stats[n].lock);
+
+            avg = 0;
+
+            if (stat.requests > stat.fails)
+            {
+                avg = stat.response_time
+                      / (ngx_msec_t) (stat.requests - stat.fails);
+            }
+
+            p = ngx_cpymem(p, sp[i].name.data, sp[i].name.len);
+
+            p += ngx_snprintf((char *) p, last - p,
+                              " %s %" NGX_UINT_T_FMT " %" NGX_UINT_T_FMT
+                              " %" NGX_UINT_T_FMT " %" NGX_INT_T_FMT
+                              " %" NGX_INT_T_FMT CRLF,
+                              peer->addr_port_text.data,
+                              stat.requests, stat.fails, stat.active,
+                              avg, stat.max_response_time);
+        }
+    }
+
+    return p;
+}
+
+
+/*
+ * the upstream of the same name and the same number of peers keeps its
+ * counters in the zone inherited over the reconfiguration
+ */
+
+static ngx_int_t ngx_http_status_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+    ngx_http_status_main_conf_t *smcf = zone->data;
+
+    ngx_uint_t                    i;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_status_peers_t      *sp;
+    ngx_http_status_upstream_t   *u;
+
+    shpool = zone->shpool;
+
+    sp = smcf->peers.elts;
+
+    for (i = 0; i < smcf->peers.nelts; i++)
+    {
+
+        for (u = shpool->data; u; u = u->next)
+        {
+            if (u->number == sp[i].peers->number
+                    && u->name.len == sp[i].name.len
+                    && ngx_strncmp(u->name.data, sp[i].name.data,
+                                   sp[i].name.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (u == NULL)
+        {
+            u = ngx_slab_calloc(shpool, sizeof(ngx_http_status_upstream_t));
+            if (u == NULL)
+            {
+                goto failed;
+            }
+
+            u->name.data = ngx_slab_alloc(shpool, sp[i].name.len);
+            if (u->name.data == NULL)
+            {
+                goto failed;
+            }
+
+            ngx_memcpy(u->name.data, sp[i].name.data, sp[i].name.len);
+            u->name.len = sp[i].name.len;
+
+            u->number = sp[i].peers->number;
+
+            u->stats = ngx_slab_calloc(shpool,
+                                       u->number * sizeof(ngx_peer_stat_t));
+            if (u->stats == NULL)
+            {
+                goto failed;
+            }
+
+            u->next = shpool->data;
+            shpool->data = u;
+        }
+
+        sp[i].peers->stats = u->stats;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_EMERG, ngx_cycle->log, 0,
+                  "the \"%s\" shared memory zone is too small",
+                  zone->name.data);
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t ngx_http_status_add_peers(ngx_conf_t *cf, ngx_str_t *name,
+                                    ngx_peers_t *peers)
+{
+    ngx_uint_t                    i;
+    ngx_http_status_peers_t      *sp;
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+
+    sp = smcf->peers.elts;
+    for (i = 0; i < smcf->peers.nelts; i++)
+    {
+        if (sp[i].peers == peers)
+        {
+            /* the peers are inherited by a nested location */
+            return NGX_OK;
+        }
+    }
+
+    if (smcf->zone == NULL)
+    {
+        smcf->zone = ngx_shared_memory_add(cf, &ngx_http_status_zone_name, 0,
+                                           &ngx_http_status_module);
+        if (smcf->zone == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        smcf->zone->size = 8 * ngx_pagesize;
+        smcf->zone->init = ngx_http_status_init_zone;
+        smcf->zone->data = smcf;
+    }
+
+    if (!(sp = ngx_push_array(&smcf->peers)))
+    {
+        return NGX_ERROR;
+    }
+
+    sp->name = *name;
+    sp->peers = peers;
+
+    /* the slab rounds the allocations up to a power of two or to the pages */
+
+    smcf->zone->size += 2 * (sizeof(ngx_http_status_upstream_t) + name->len
+                             + peers->number * sizeof(ngx_peer_stat_t))
+                        + ngx_pagesize;
+
+    return NGX_OK;
+}
+
+
+static void *ngx_http_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_main_conf_t  *smcf;
+
+    if (!(smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_status_main_conf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_init_array(smcf->peers, cf->pool, 4, sizeof(ngx_http_status_peers_t),
+                   NGX_CONF_ERROR);
+
+    return smcf;
+}
+
+
+static char *ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,53 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ */
+
+
+#ifndef _NGX_HTTP_STATUS_H_INCLUDED_
+#define _NGX_HTTP_STATUS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include <ngx_http.h>
+
+
+typedef struct ngx_http_status_upstream_s  ngx_http_status_upstream_t;
+
+/* the counters of an upstream in the status zone */
+
+struct ngx_http_status_upstream_s
+{
+    ngx_http_status_upstream_t  *next;
+
+    ngx_str_t                    name;
+    ngx_int_t                    number;
+    ngx_peer_stat_t             *stats;
+};
+
+
+typedef struct
+{
+    ngx_str_t                    name;
+    ngx_peers_t                 *peers;
+} ngx_http_status_peers_t;
+
+
+typedef struct
+{
+    ngx_array_t                  peers;    /* array of ngx_http_status_peers_t */
+    ngx_shm_zone_t              *zone;
+} ngx_http_status_main_conf_t;
+
+
+ngx_int_t ngx_http_status_add_peers(ngx_conf_t *cf, ngx_str_t *name,
+                                    ngx_peers_t *peers);
+
+
+extern ngx_module_t  ngx_http_status_module;
+
+
+#endif /* _NGX_HTTP_STATUS_H_INCLUDED_ */
@@ -26,6 +26,12 @@ static char *ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf,
 
 static char *ngx_http_proxy_set_pass(ngx_conf_t *cf, ngx_command_t *cmd,
                                      void *conf);
+static char *ngx_http_proxy_set_balance(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+static char *ngx_http_proxy_set_peer_weight(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char *ngx_http_proxy_init_peers(ngx_conf_t *cf,
+                                       ngx_http_proxy_loc_conf_t *conf);
 static char *ngx_http_proxy_parse_upstream(ngx_str_t *url,
         ngx_http_proxy_upstream_conf_t *u);
 
@@ -134,6 +140,42 @@ static ngx_command_t  ngx_http_proxy_commands[] =
         NULL
     },
 
+    {
+        ngx_string("proxy_keepalive"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_proxy_loc_conf_t, keepalive),
+        NULL
+    },
+
+    {
+        ngx_string("proxy_keepalive_timeout"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_proxy_loc_conf_t, keepalive_timeout),
+        NULL
+    },
+
+    {
+        ngx_string("proxy_balance"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+        ngx_http_proxy_set_balance,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("proxy_peer_weight"),
+        NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+        ngx_http_proxy_set_peer_weight,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     {
         ngx_string("proxy_buffers"),
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
@@ -318,47 +360,64 @@ static ngx_http_log_op_name_t ngx_http_proxy_log_fmt_ops[] =
 
 ngx_http_header_t ngx_http_proxy_headers_in[] =
 {
-    { ngx_string("Date"), offsetof(ngx_http_proxy_headers_in_t, date) },
-    { ngx_string("Server"), offsetof(ngx_http_proxy_headers_in_t, server) },
+    { ngx_string("Date"), offsetof(ngx_http_proxy_headers_in_t, date), NULL },
+    {
+        ngx_string("Server"),
+        offsetof(ngx_http_proxy_headers_in_t, server), NULL
+    },
 
-    { ngx_string("Expires"), offsetof(ngx_http_proxy_headers_in_t, expires) },
+    {
+        ngx_string("Expires"),
+        offsetof(ngx_http_proxy_headers_in_t, expires), NULL
+    },
     {
         ngx_string("Cache-Control"),
-        offsetof(ngx_http_proxy_headers_in_t, cache_control)
+        offsetof(ngx_http_proxy_headers_in_t, cache_control), NULL
     },
-    { ngx_string("ETag"), offsetof(ngx_http_proxy_headers_in_t, etag) },
+    { ngx_string("ETag"), offsetof(ngx_http_proxy_headers_in_t, etag), NULL },
     {
         ngx_string("X-Accel-Expires"),
-        offsetof(ngx_http_proxy_headers_in_t, x_accel_expires)
+        offsetof(ngx_http_proxy_headers_in_t, x_accel_expires), NULL
     },
 
     {
         ngx_string("Connection"),
-        offsetof(ngx_http_proxy_headers_in_t, connection)
+        offsetof(ngx_http_proxy_headers_in_t, connection), NULL
+    },
+    {
+        ngx_string("Keep-Alive"),
+        offsetof(ngx_http_proxy_headers_in_t, keep_alive), NULL
+    },
+    {
+        ngx_string("Transfer-Encoding"),
+        offsetof(ngx_http_proxy_headers_in_t, transfer_encoding), NULL
     },
     {
         ngx_string("Content-Type"),
-        offsetof(ngx_http_proxy_headers_in_t, content_type)
+        offsetof(ngx_http_proxy_headers_in_t, content_type), NULL
     },
     {
         ngx_string("Content-Length"),
-        offsetof(ngx_http_proxy_headers_in_t, content_length)
+        offsetof(ngx_http_proxy_headers_in_t, content_length), NULL
     },
     {
         ngx_string("Last-Modified"),
-        offsetof(ngx_http_proxy_headers_in_t, last_modified)
+        offsetof(ngx_http_proxy_headers_in_t, last_modified), NULL
     },
     {
         ngx_string("Location"),
-        offsetof(ngx_http_proxy_headers_in_t, location)
+        offsetof(ngx_http_proxy_headers_in_t, location), NULL
     },
     {
         ngx_string("Accept-Ranges"),
-        offsetof(ngx_http_proxy_headers_in_t, accept_ranges)
+        offsetof(ngx_http_proxy_headers_in_t, accept_ranges), NULL
+    },
+    {
+        ngx_string("X-Pad"),
+        offsetof(ngx_http_proxy_headers_in_t, x_pad), NULL
     },
-    { ngx_string("X-Pad"), offsetof(ngx_http_proxy_headers_in_t, x_pad) },
 
-    { ngx_null_string, 0 }
+    { ngx_null_string, 0, NULL }
 };
 
 
@@ -732,13 +791,29 @@ void ngx_http_proxy_close_connection(ngx_http_proxy_ctx_t *p)
     ngx_connection_t  *c;
 
     c = p->upstream->peer.connection;
-    p->upstream->peer.connection = NULL;
+
+    ngx_event_connect_peer_free(&p->upstream->peer);
 
     if (p->lcf->busy_lock)
     {
         p->lcf->busy_lock->busy--;
     }
 
+    /* the whole response has been read, so the connection may be reused */
+
+    if (p->upstream->keepalive
+            && p->request_done
+            && p->upstream->event_pipe
+            && p->upstream->event_pipe->upstream_done
+            && ngx_event_connect_peer_keepalive(&p->upstream->peer) == NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, p->request->connection->log, 0,
+                       "http proxy keepalive connection: %d", c->fd);
+        return;
+    }
+
+    p->upstream->peer.connection = NULL;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http proxy close connection: %d", c->fd);
 
@@ -1021,6 +1096,9 @@ static void *ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
 
     conf->upstreams = NULL;
     conf->peers = NULL;
+    conf->peer_weights = NULL;
+
+    conf->hash_key = 0;
 
     conf->cache_path = NULL;
     conf->temp_path = NULL;
@@ -1038,6 +1116,10 @@ static void *ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
 
     conf->header_buffer_size = NGX_CONF_UNSET_SIZE;
     conf->read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    conf->keepalive = NGX_CONF_UNSET;
+    conf->balance = NGX_CONF_UNSET;
+    conf->balance_shared = NGX_CONF_UNSET;
     conf->busy_buffers_size = NGX_CONF_UNSET_SIZE;
 
     /*
@@ -1082,6 +1164,43 @@ static char *ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf,
 
     ngx_conf_merge_msec_value(conf->read_timeout, prev->read_timeout, 60000);
 
+    ngx_conf_merge_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout,
+                              prev->keepalive_timeout, 60000);
+
+    /* the idle connections are cached per worker in the peers of proxy_pass */
+
+    if (conf->peers && conf->keepalive && conf->peers->cached == NULL)
+    {
+        conf->peers->cached = ngx_pcalloc(cf->pool,
+                                          conf->keepalive
+                                          * sizeof(ngx_cached_peer_t));
+        if (conf->peers->cached == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->peers->max_cached = conf->keepalive;
+        conf->peers->cached_timeout = conf->keepalive_timeout;
+    }
+
+    if (conf->balance == NGX_CONF_UNSET)
+    {
+        conf->hash_key = prev->hash_key;
+        conf->hash_header = prev->hash_header;
+    }
+
+    ngx_conf_merge_value(conf->balance, prev->balance, NGX_PEERS_ROUND_ROBIN);
+    ngx_conf_merge_value(conf->balance_shared, prev->balance_shared, 0);
+
+    if (conf->peers)
+    {
+        if (ngx_http_proxy_init_peers(cf, conf) != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     ngx_conf_merge_size_value(conf->header_buffer_size,
                               prev->header_buffer_size, (size_t) ngx_pagesize);
 
@@ -1376,6 +1495,249 @@ static char *ngx_http_proxy_set_pass(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+static char *ngx_http_proxy_set_balance(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf)
+{
+    ngx_http_proxy_loc_conf_t *lcf = conf;
+
+    ngx_uint_t   i;
+    ngx_str_t   *value;
+
+    if (lcf->balance != NGX_CONF_UNSET)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "round_robin") == 0)
+    {
+        if (cf->args->nelts != 2)
+        {
+            return "invalid number of parameters";
+        }
+
+        lcf->balance = NGX_PEERS_ROUND_ROBIN;
+        lcf->balance_shared = 0;
+
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "least_conn") == 0)
+    {
+        lcf->balance = NGX_PEERS_LEAST_CONN;
+        lcf->balance_shared = 0;
+
+        if (cf->args->nelts == 2)
+        {
+            return NGX_CONF_OK;
+        }
+
+        if (ngx_strcmp(value[2].data, "shared") != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%s\"", value[2].data);
+            return NGX_CONF_ERROR;
+        }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"shared\" needs the atomic operations "
+                           "that are not supported on this platform");
+        return NGX_CONF_ERROR;
+
+#else
+
+        lcf->balance_shared = 1;
+
+        return NGX_CONF_OK;
+
+#endif
+    }
+
+    if (ngx_strcmp(value[1].data, "hash") != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid balancing method \"%s\"", value[1].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts != 3)
+    {
+        return "needs the hash key";
+    }
+
+    lcf->balance = NGX_PEERS_HASH;
+    lcf->balance_shared = 0;
+
+    if (ngx_strcmp(value[2].data, "uri") == 0)
+    {
+        lcf->hash_key = NGX_HTTP_PROXY_HASH_URI;
+
+    }
+    else if (ngx_strcmp(value[2].data, "remote_addr") == 0)
+    {
+        lcf->hash_key = NGX_HTTP_PROXY_HASH_REMOTE_ADDR;
+
+    }
+    else if (ngx_strcmp(value[2].data, "host") == 0)
+    {
+        lcf->hash_key = NGX_HTTP_PROXY_HASH_HOST;
+
+    }
+    else if (ngx_strncmp(value[2].data, "http_", 5) == 0 && value[2].len > 5)
+    {
+
+        /* "http_x_session_id" is the "X-Session-Id" header */
+
+        lcf->hash_key = NGX_HTTP_PROXY_HASH_HEADER;
+
+        lcf->hash_header.len = value[2].len - 5;
+        lcf->hash_header.data = value[2].data + 5;
+
+        for (i = 0; i < lcf->hash_header.len; i++)
+        {
+            if (lcf->hash_header.data[i] == '_')
+            {
+                lcf->hash_header.data[i] = '-';
+            }
+        }
+
+    }
+    else
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid hash key \"%s\"", value[2].data);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *ngx_http_proxy_set_peer_weight(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf)
+{
+    ngx_http_proxy_loc_conf_t *lcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_proxy_peer_weight_t  *pw;
+
+    value = cf->args->elts;
+
+    if (lcf->peer_weights == NULL)
+    {
+        lcf->peer_weights = ngx_create_array(cf->pool, 4,
+                                             sizeof(ngx_http_proxy_peer_weight_t));
+        if (lcf->peer_weights == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (!(pw = ngx_push_array(lcf->peer_weights)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    pw->addr = value[1];
+    pw->weight = ngx_atoi(value[2].data, value[2].len);
+
+    if (pw->weight == NGX_ERROR || pw->weight == 0 || pw->weight > 100)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid weight \"%s\", it must be from 1 to 100",
+                           value[2].data);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * the weights are set to the addresses the "proxy_pass" host is resolved to,
+ * an address without a port matches the peer on any port
+ */
+
+static char *ngx_http_proxy_init_peers(ngx_conf_t *cf,
+                                       ngx_http_proxy_loc_conf_t *conf)
+{
+    ngx_int_t                      n;
+    ngx_uint_t                     i, found;
+    in_addr_t                      addr;
+    ngx_peer_t                    *peer;
+    ngx_http_proxy_peer_weight_t  *pw;
+
+    if (conf->peer_weights)
+    {
+        pw = conf->peer_weights->elts;
+
+        for (i = 0; i < conf->peer_weights->nelts; i++)
+        {
+            /* INADDR_NONE for "addr:port" */
+
+            addr = inet_addr((char *) pw[i].addr.data);
+
+            found = 0;
+
+            for (n = 0; n < conf->peers->number; n++)
+            {
+                peer = &conf->peers->peers[n];
+
+                if (addr == INADDR_NONE)
+                {
+                    if (ngx_strcmp(pw[i].addr.data,
+                                   peer->addr_port_text.data) != 0)
+                    {
+                        continue;
+                    }
+
+                }
+                else if (addr != peer->addr)
+                {
+                    continue;
+                }
+
+                peer->weight = pw[i].weight;
+                found = 1;
+            }
+
+            if (!found)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"proxy_peer_weight\" address \"%s\" is "
+                                   "not the address of \"%s\"",
+                                   pw[i].addr.data, conf->upstream->url.data);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    conf->peers->balance = conf->balance;
+    conf->peers->shared_conns = conf->balance_shared;
+
+    if (ngx_event_connect_init_peers(conf->peers, cf->pool, cf->log)
+            == NGX_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HTTP_STATUS)
+
+    if (ngx_http_status_add_peers(cf, &conf->upstream->url, conf->peers)
+            == NGX_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
 static char *ngx_http_proxy_parse_upstream(ngx_str_t *url,
         ngx_http_proxy_upstream_conf_t *u)
 {
@@ -56,6 +56,22 @@ typedef struct
 } ngx_http_proxy_upstream_conf_t;
 
 
+typedef enum
+{
+    NGX_HTTP_PROXY_HASH_URI = 1,
+    NGX_HTTP_PROXY_HASH_REMOTE_ADDR,
+    NGX_HTTP_PROXY_HASH_HOST,
+    NGX_HTTP_PROXY_HASH_HEADER
+} ngx_http_proxy_hash_key_e;
+
+
+typedef struct
+{
+    ngx_str_t                        addr;
+    ngx_int_t                        weight;
+} ngx_http_proxy_peer_weight_t;
+
+
 typedef struct
 {
     size_t                           header_buffer_size;
@@ -66,9 +82,16 @@ typedef struct
     ngx_msec_t                       connect_timeout;
     ngx_msec_t                       send_timeout;
     ngx_msec_t                       read_timeout;
+    ngx_msec_t                       keepalive_timeout;
     time_t                           default_expires;
 
     ngx_int_t                        lm_factor;
+    ngx_int_t                        keepalive;
+
+    ngx_int_t                        balance;
+    ngx_flag_t                       balance_shared;
+    ngx_http_proxy_hash_key_e        hash_key;
+    ngx_str_t                        hash_header;
 
     ngx_uint_t                       next_upstream;
     ngx_uint_t                       use_stale;
@@ -91,6 +114,9 @@ typedef struct
 
     ngx_http_proxy_upstream_conf_t  *upstream;
     ngx_peers_t                     *peers;
+
+    /* "proxy_peer_weight" may precede "proxy_pass" in the location */
+    ngx_array_t                     *peer_weights;
 } ngx_http_proxy_loc_conf_t;
 
 
@@ -133,6 +159,8 @@ typedef struct
     ngx_table_elt_t                 *x_accel_expires;
 
     ngx_table_elt_t                 *connection;
+    ngx_table_elt_t                 *keep_alive;
+    ngx_table_elt_t                 *transfer_encoding;
     ngx_table_elt_t                 *content_type;
     ngx_table_elt_t                 *content_length;
     ngx_table_elt_t                 *last_modified;
@@ -165,6 +193,12 @@ typedef struct
     ngx_event_pipe_t                *event_pipe;
 
     ngx_http_proxy_headers_in_t      headers_in;
+
+    /* the body length, -1 if the body ends with the connection */
+    off_t                            length;
+
+    unsigned                         chunked:1;
+    unsigned                         keepalive:1;
 } ngx_http_proxy_upstream_t;
 
 
@@ -190,6 +224,7 @@ struct ngx_http_proxy_ctx_s
     unsigned                      valid_header_in:1;
 
     unsigned                      request_sent:1;
+    unsigned                      request_done:1;
     unsigned                      header_sent:1;
 
 
@@ -199,6 +234,12 @@ struct ngx_http_proxy_ctx_s
     u_char                       *status_end;
     ngx_uint_t                    status_count;
     ngx_uint_t                    parse_state;
+    ngx_uint_t                    http_major;
+    ngx_uint_t                    http_minor;
+
+    /* used to parse an upstream HTTP/1.1 chunked body */
+    ngx_uint_t                    chunk_state;
+    off_t                         chunk_size;
 
     ngx_http_proxy_state_t       *state;
     ngx_array_t                   states;    /* of ngx_http_proxy_state_t */
@@ -54,6 +54,24 @@ int ngx_http_proxy_copy_header(ngx_http_proxy_ctx_t *p,
                 continue;
             }
 
+            if (&h[i] == headers_in->keep_alive)
+            {
+                continue;
+            }
+
+            /* a chunked body is passed to the client without the chunks */
+
+            if (&h[i] == headers_in->transfer_encoding)
+            {
+                continue;
+            }
+
+            if (&h[i] == headers_in->content_length
+                    && headers_in->transfer_encoding)
+            {
+                continue;
+            }
+
             if (&h[i] == headers_in->x_pad)
             {
                 continue;
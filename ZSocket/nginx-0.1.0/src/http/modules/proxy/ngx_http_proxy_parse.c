@@ -105,6 +105,7 @@ int ngx_http_proxy_parse_status_line(ngx_http_proxy_ctx_t *p)
                 return NGX_HTTP_PROXY_PARSE_NO_HEADER;
             }
 
+            p->http_major = ch - '0';
             state = sw_major_digit;
             break;
 
@@ -121,6 +122,7 @@ int ngx_http_proxy_parse_status_line(ngx_http_proxy_ctx_t *p)
                 return NGX_HTTP_PROXY_PARSE_NO_HEADER;
             }
 
+            p->http_major = p->http_major * 10 + ch - '0';
             break;
 
         /* the first digit of minor HTTP version */
@@ -130,6 +132,7 @@ int ngx_http_proxy_parse_status_line(ngx_http_proxy_ctx_t *p)
                 return NGX_HTTP_PROXY_PARSE_NO_HEADER;
             }
 
+            p->http_minor = ch - '0';
             state = sw_minor_digit;
             break;
 
@@ -146,6 +149,7 @@ int ngx_http_proxy_parse_status_line(ngx_http_proxy_ctx_t *p)
                 return NGX_HTTP_PROXY_PARSE_NO_HEADER;
             }
 
+            p->http_minor = p->http_minor * 10 + ch - '0';
             break;
 
         /* HTTP status code */
@@ -16,6 +16,7 @@
 static ngx_chain_t *ngx_http_proxy_create_request(ngx_http_proxy_ctx_t *p);
 static void ngx_http_proxy_init_upstream(void *data);
 static void ngx_http_proxy_reinit_upstream(ngx_http_proxy_ctx_t *p);
+static uint32_t ngx_http_proxy_hash_key(ngx_http_proxy_ctx_t *p);
 static void ngx_http_proxy_connect(ngx_http_proxy_ctx_t *p);
 static void ngx_http_proxy_send_request(ngx_http_proxy_ctx_t *p);
 static void ngx_http_proxy_send_request_handler(ngx_event_t *wev);
@@ -24,7 +25,15 @@ static void ngx_http_proxy_process_upstream_status_line(ngx_event_t *rev);
 static void ngx_http_proxy_process_upstream_headers(ngx_event_t *rev);
 static ssize_t ngx_http_proxy_read_upstream_header(ngx_http_proxy_ctx_t *);
 static void ngx_http_proxy_send_response(ngx_http_proxy_ctx_t *p);
+static void ngx_http_proxy_set_body_length(ngx_http_proxy_ctx_t *p);
+static ngx_int_t ngx_http_proxy_copy_filter(ngx_event_pipe_t *ep,
+        ngx_buf_t *buf);
+static ngx_int_t ngx_http_proxy_chunked_filter(ngx_event_pipe_t *ep,
+        ngx_buf_t *buf);
 static void ngx_http_proxy_process_body(ngx_event_t *ev);
+#if (NGX_THREAD_POOL)
+static void ngx_http_proxy_thread_cancel(void *data);
+#endif
 static void ngx_http_proxy_next_upstream(ngx_http_proxy_ctx_t *p, int ft_type);
 
 
@@ -43,13 +52,27 @@ static char *upstream_header_errors[] =
 };
 
 
-static char  http_version[] = " HTTP/1.0" CRLF;
+static char  http_version[] = " HTTP/1.1" CRLF;
 static char  host_header[] = "Host: ";
 static char  x_real_ip_header[] = "X-Real-IP: ";
 static char  x_forwarded_for_header[] = "X-Forwarded-For: ";
 static char  connection_close_header[] = "Connection: close" CRLF;
 
 
+/*
+ * the client body is already read and is sent with "Content-Length",
+ * so these client headers are not passed to an upstream
+ */
+
+static ngx_str_t  hop_by_hop_headers[] =
+{
+    ngx_string("Expect"),
+    ngx_string("TE"),
+    ngx_string("Transfer-Encoding"),
+    ngx_null_string
+};
+
+
 int ngx_http_proxy_request_upstream(ngx_http_proxy_ctx_t *p)
 {
     int                         rc;
@@ -67,6 +90,8 @@ int ngx_http_proxy_request_upstream(ngx_http_proxy_ctx_t *p)
 
     p->upstream = u;
 
+    u->length = -1;
+
     u->peer.log_error = NGX_ERROR_ERR;
     u->peer.peers = p->lcf->peers;
     u->peer.tries = p->lcf->peers->number;
@@ -74,6 +99,11 @@ int ngx_http_proxy_request_upstream(ngx_http_proxy_ctx_t *p)
     u->peer.lock = &r->connection->lock;
 #endif
 
+    if (p->lcf->balance == NGX_PEERS_HASH)
+    {
+        u->peer.hash = ngx_http_proxy_hash_key(p);
+    }
+
     u->method = r->method;
 
     if (!(rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t))))
@@ -122,7 +152,7 @@ int ngx_http_proxy_request_upstream(ngx_http_proxy_ctx_t *p)
 static ngx_chain_t *ngx_http_proxy_create_request(ngx_http_proxy_ctx_t *p)
 {
     size_t                           len;
-    ngx_uint_t                       i;
+    ngx_uint_t                       i, n;
     ngx_buf_t                       *b;
     ngx_chain_t                     *chain;
     ngx_list_part_t                 *part;
@@ -147,9 +177,12 @@ static ngx_chain_t *ngx_http_proxy_create_request(ngx_http_proxy_ctx_t *p)
            + r->uri.len - uc->location->len
            + 1 + r->args.len                                 /* 1 is for "?" */
            + sizeof(http_version) - 1
-           + sizeof(connection_close_header) - 1
            + 2;                         /* 2 is for "\r\n" at the header end */
 
+    if (p->lcf->keepalive == 0)
+    {
+        len += sizeof(connection_close_header) - 1;
+    }
 
     if (p->lcf->preserve_host && r->headers_in.host)
     {
@@ -257,10 +290,16 @@ static ngx_chain_t *ngx_http_proxy_create_request(ngx_http_proxy_ctx_t *p)
     b->last = ngx_cpymem(b->last, http_version, sizeof(http_version) - 1);
 
 
-    /* the "Connection: close" header */
+    /*
+     * the "Connection: close" header,
+     * an HTTP/1.1 connection is persistent by default
+     */
 
-    b->last = ngx_cpymem(b->last, connection_close_header,
-                         sizeof(connection_close_header) - 1);
+    if (p->lcf->keepalive == 0)
+    {
+        b->last = ngx_cpymem(b->last, connection_close_header,
+                             sizeof(connection_close_header) - 1);
+    }
 
 
     /* the "Host" header */
@@ -371,6 +410,21 @@ static ngx_chain_t *ngx_http_proxy_create_request(ngx_http_proxy_ctx_t *p)
             continue;
         }
 
+        for (n = 0; hop_by_hop_headers[n].len; n++)
+        {
+            if (header[i].key.len == hop_by_hop_headers[n].len
+                    && ngx_strcasecmp(header[i].key.data,
+                                      hop_by_hop_headers[n].data) == 0)
+            {
+                break;
+            }
+        }
+
+        if (hop_by_hop_headers[n].len)
+        {
+            continue;
+        }
+
         b->last = ngx_cpymem(b->last, header[i].key.data, header[i].key.len);
 
         *(b->last++) = ':';
@@ -558,6 +612,10 @@ static void ngx_http_proxy_reinit_upstream(ngx_http_proxy_ctx_t *p)
 
     p->status = 0;
     p->status_count = 0;
+
+    p->upstream->length = -1;
+    p->upstream->chunked = 0;
+    p->upstream->keepalive = 0;
 }
 
 
@@ -675,6 +733,92 @@ void ngx_http_proxy_upstream_busy_lock(ngx_http_proxy_ctx_t *p)
 #endif
 
 
+/*
+ * the key of "proxy_balance hash", a request without the key
+ * gets the hash of the empty string, so all such requests go
+ * to the same peer
+ */
+
+static uint32_t ngx_http_proxy_hash_key(ngx_http_proxy_ctx_t *p)
+{
+    uint32_t             hash;
+    ngx_uint_t           i;
+    ngx_str_t           *key;
+    ngx_list_part_t     *part;
+    ngx_table_elt_t     *header;
+    ngx_http_request_t  *r;
+
+    r = p->request;
+    key = NULL;
+
+    switch (p->lcf->hash_key)
+    {
+
+    case NGX_HTTP_PROXY_HASH_URI:
+        key = &r->uri;
+        break;
+
+    case NGX_HTTP_PROXY_HASH_REMOTE_ADDR:
+        key = &r->connection->addr_text;
+        break;
+
+    case NGX_HTTP_PROXY_HASH_HOST:
+        if (r->headers_in.host)
+        {
+            key = &r->headers_in.host->value;
+        }
+        break;
+
+    case NGX_HTTP_PROXY_HASH_HEADER:
+
+        part = &r->headers_in.headers.part;
+        header = part->elts;
+
+        for (i = 0; /* void */; i++)
+        {
+
+            if (i >= part->nelts)
+            {
+                if (part->next == NULL)
+                {
+                    break;
+                }
+
+                part = part->next;
+                header = part->elts;
+                i = 0;
+            }
+
+            if (header[i].key.len == p->lcf->hash_header.len
+                    && ngx_strncasecmp(header[i].key.data,
+                                       p->lcf->hash_header.data,
+                                       header[i].key.len) == 0)
+            {
+                key = &header[i].value;
+                break;
+            }
+        }
+
+        break;
+    }
+
+    if (key == NULL)
+    {
+        hash = ngx_event_connect_hash((u_char *) "", 0);
+
+    }
+    else
+    {
+        hash = ngx_event_connect_hash(key->data, key->len);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy hash: %08X", hash);
+
+    return hash;
+}
+
+
 static void ngx_http_proxy_connect(ngx_http_proxy_ctx_t *p)
 {
     int                      rc;
@@ -726,7 +870,12 @@ static void ngx_http_proxy_connect(ngx_http_proxy_ctx_t *p)
     writer->connection = c;
     writer->limit = OFF_T_MAX_VALUE;
 
-    if (p->upstream->peer.tries > 1 && p->request_sent)
+    /*
+     * a request that has failed on a stale cached connection
+     * is retried without the decreasing of the tries
+     */
+
+    if (p->request_sent)
     {
         ngx_http_proxy_reinit_upstream(p);
     }
@@ -759,6 +908,7 @@ static void ngx_http_proxy_connect(ngx_http_proxy_ctx_t *p)
     }
 
     p->request_sent = 0;
+    p->request_done = 0;
 
     if (rc == NGX_AGAIN)
     {
@@ -843,6 +993,8 @@ static void ngx_http_proxy_send_request(ngx_http_proxy_ctx_t *p)
 
     /* rc == NGX_OK */
 
+    p->request_done = 1;
+
     if (c->tcp_nopush == NGX_TCP_NOPUSH_SET)
     {
         if (ngx_tcp_push(c->fd) == NGX_ERROR)
@@ -1213,6 +1365,8 @@ static void ngx_http_proxy_process_upstream_headers(ngx_event_t *rev)
 
             /* TODO: hook to process the upstream header */
 
+            ngx_http_proxy_set_body_length(p);
+
 #if (NGX_HTTP_CACHE)
 
             if (p->cachable)
@@ -1308,6 +1462,9 @@ static void ngx_http_proxy_send_response(ngx_http_proxy_ctx_t *p)
     ngx_http_request_t           *r;
     ngx_http_cache_header_t      *header;
     ngx_http_core_loc_conf_t     *clcf;
+#if (NGX_THREAD_POOL)
+    ngx_http_cleanup_t           *cln;
+#endif
 
     r = p->request;
 
@@ -1366,7 +1523,28 @@ static void ngx_http_proxy_send_response(ngx_http_proxy_ctx_t *p)
 
     p->upstream->event_pipe = ep;
 
-    ep->input_filter = ngx_event_pipe_copy_input_filter;
+    if (p->upstream->chunked)
+    {
+        p->chunk_state = 0;
+        p->chunk_size = 0;
+
+        ep->input_filter = ngx_http_proxy_chunked_filter;
+        ep->length = 1;
+
+    }
+    else if (p->upstream->length != -1)
+    {
+        ep->input_filter = ngx_http_proxy_copy_filter;
+        ep->length = p->upstream->length;
+
+    }
+    else
+    {
+        ep->input_filter = ngx_event_pipe_copy_input_filter;
+        ep->length = -1;
+    }
+
+    ep->input_ctx = p;
     ep->output_filter = (ngx_event_pipe_output_filter_pt)
                         ngx_http_output_filter;
     ep->output_ctx = r;
@@ -1467,6 +1645,27 @@ static void ngx_http_proxy_send_response(ngx_http_proxy_ctx_t *p)
     ep->send_timeout = clcf->send_timeout;
     ep->send_lowat = clcf->send_lowat;
 
+#if (NGX_THREAD_POOL)
+
+    if (clcf->aio && !p->cachable)
+    {
+        if (!(cln = ngx_push_array(&r->cleanup)))
+        {
+            ngx_http_proxy_finalize_request(p, 0);
+            return;
+        }
+
+        cln->data.handler.handler = ngx_http_proxy_thread_cancel;
+        cln->data.handler.data = ep;
+        cln->valid = 1;
+        cln->cache = 0;
+        cln->handler = 1;
+
+        ep->thread_pool = clcf->thread_pool;
+    }
+
+#endif
+
     p->upstream->peer.connection->read->event_handler =
         ngx_http_proxy_process_body;
     r->connection->write->event_handler = ngx_http_proxy_process_body;
@@ -1477,6 +1676,350 @@ static void ngx_http_proxy_send_response(ngx_http_proxy_ctx_t *p)
 }
 
 
+static void ngx_http_proxy_set_body_length(ngx_http_proxy_ctx_t *p)
+{
+    ngx_table_elt_t            *h;
+    ngx_http_proxy_upstream_t  *u;
+
+    u = p->upstream;
+
+    u->length = -1;
+    u->chunked = 0;
+    u->keepalive = 0;
+    u->headers_in.content_length_n = -1;
+
+    h = u->headers_in.transfer_encoding;
+
+    if (h)
+    {
+
+        /* "chunked" must be the last transfer coding */
+
+        if (h->value.len >= sizeof("chunked") - 1
+                && ngx_strcasecmp(h->value.data + h->value.len
+                                  - (sizeof("chunked") - 1),
+                                  "chunked") == 0)
+        {
+            u->chunked = 1;
+        }
+
+    }
+    else if (u->headers_in.content_length)
+    {
+        u->headers_in.content_length_n =
+            ngx_atoi(u->headers_in.content_length->value.data,
+                     u->headers_in.content_length->value.len);
+
+        if (u->headers_in.content_length_n != NGX_ERROR)
+        {
+            u->length = u->headers_in.content_length_n;
+        }
+    }
+
+    if (u->method == NGX_HTTP_HEAD
+            || u->status < NGX_HTTP_OK
+            || u->status == NGX_HTTP_NO_CONTENT
+            || u->status == NGX_HTTP_NOT_MODIFIED)
+    {
+        u->chunked = 0;
+        u->length = 0;
+    }
+
+    if (p->lcf->keepalive == 0
+            || p->http_major * 1000 + p->http_minor < NGX_HTTP_VERSION_11
+            || (!u->chunked && u->length == -1))
+    {
+        return;
+    }
+
+    h = u->headers_in.connection;
+
+    if (h && ngx_strcasecmp(h->value.data, "close") == 0)
+    {
+        return;
+    }
+
+    if (u->length == 0 && p->header_in->pos != p->header_in->last)
+    {
+        return;
+    }
+
+    u->keepalive = 1;
+}
+
+
+static ngx_int_t ngx_http_proxy_copy_filter(ngx_event_pipe_t *ep,
+        ngx_buf_t *buf)
+{
+    ngx_http_proxy_ctx_t  *p;
+
+    p = ep->input_ctx;
+
+    if (buf->last - buf->pos > ep->length)
+    {
+        ngx_log_error(NGX_LOG_WARN, ep->log, 0,
+                      "upstream sent more data than specified in "
+                      "\"Content-Length\" header");
+
+        buf->last = buf->pos + ep->length;
+        p->upstream->keepalive = 0;
+    }
+
+    ep->length -= buf->last - buf->pos;
+
+    return ngx_event_pipe_copy_input_filter(ep, buf);
+}
+
+
+/*
+ * the chunked filter passes the chunk data only, a buf may have several
+ * chunks so every chunk data gets its own shadow buf and the last of them
+ * returns the raw buf to the event pipe
+ */
+
+static ngx_int_t ngx_http_proxy_chunked_filter(ngx_event_pipe_t *ep,
+        ngx_buf_t *buf)
+{
+    u_char                 ch, c, *pos;
+    size_t                 size;
+    ngx_buf_t             *b, **prev;
+    ngx_chain_t           *cl;
+    ngx_http_proxy_ctx_t  *p;
+    enum
+    {
+        sw_chunk_start = 0,
+        sw_chunk_size,
+        sw_chunk_extension,
+        sw_chunk_data,
+        sw_after_data,
+        sw_after_data_almost_done,
+        sw_last_chunk_extension,
+        sw_trailer,
+        sw_trailer_header,
+        sw_trailer_almost_done,
+        sw_done
+    } state;
+
+    p = ep->input_ctx;
+    state = p->chunk_state;
+
+    b = NULL;
+    prev = &buf->shadow;
+    pos = buf->pos;
+
+    while (pos < buf->last && state < sw_done)
+    {
+        if (state == sw_chunk_data)
+        {
+            size = buf->last - pos;
+
+            if ((off_t) size > p->chunk_size)
+            {
+                size = (size_t) p->chunk_size;
+            }
+
+            if (ep->free)
+            {
+                b = ep->free->buf;
+                ep->free = ep->free->next;
+
+            }
+            else
+            {
+                if (!(b = ngx_alloc_buf(ep->pool)))
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+            ngx_memcpy(b, buf, sizeof(ngx_buf_t));
+            b->pos = pos;
+            b->last = pos + size;
+            b->shadow = NULL;
+            b->tag = ep->tag;
+            b->last_shadow = 0;
+            b->recycled = 1;
+
+            *prev = b;
+            prev = &b->shadow;
+
+            ngx_alloc_link_and_set_buf(cl, b, ep->pool, NGX_ERROR);
+
+            ngx_chain_add_link(ep->in, ep->last_in, cl);
+
+            pos += size;
+            p->chunk_size -= size;
+
+            if (p->chunk_size == 0)
+            {
+                state = sw_after_data;
+            }
+
+            continue;
+        }
+
+        ch = *pos++;
+
+        switch (state)
+        {
+
+        /* the first digit of the chunk size */
+        case sw_chunk_start:
+        case sw_chunk_size:
+            c = (u_char) (ch | 0x20);
+
+            if (ch >= '0' && ch <= '9')
+            {
+                c = ch - '0';
+
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                c = c - 'a' + 10;
+
+            }
+            else if (state == sw_chunk_size)
+            {
+                state = p->chunk_size ? sw_chunk_extension:
+                        sw_last_chunk_extension;
+                pos--;
+                break;
+
+            }
+            else
+            {
+                goto invalid;
+            }
+
+            if (p->chunk_size > OFF_T_MAX_VALUE / 32)
+            {
+                goto invalid;
+            }
+
+            p->chunk_size = p->chunk_size * 16 + c;
+            state = sw_chunk_size;
+            break;
+
+        /* a chunk extension or CR until the end of the line */
+        case sw_chunk_extension:
+            if (ch == LF)
+            {
+                state = sw_chunk_data;
+            }
+            break;
+
+        case sw_after_data:
+            switch (ch)
+            {
+            case CR:
+                state = sw_after_data_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_start;
+                break;
+            default:
+                goto invalid;
+            }
+            break;
+
+        case sw_after_data_almost_done:
+            if (ch != LF)
+            {
+                goto invalid;
+            }
+            state = sw_chunk_start;
+            break;
+
+        case sw_last_chunk_extension:
+            if (ch == LF)
+            {
+                state = sw_trailer;
+            }
+            break;
+
+        /* the trailer headers are ignored */
+        case sw_trailer:
+            switch (ch)
+            {
+            case CR:
+                state = sw_trailer_almost_done;
+                break;
+            case LF:
+                state = sw_done;
+                break;
+            default:
+                state = sw_trailer_header;
+            }
+            break;
+
+        case sw_trailer_header:
+            if (ch == LF)
+            {
+                state = sw_trailer;
+            }
+            break;
+
+        case sw_trailer_almost_done:
+            if (ch != LF)
+            {
+                goto invalid;
+            }
+            state = sw_done;
+            break;
+
+        /* suppress warning */
+        case sw_chunk_data:
+        case sw_done:
+            break;
+        }
+    }
+
+    if (b)
+    {
+        b->shadow = buf;
+        b->last_shadow = 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ep->log, 0, "buf #%d", b->num);
+    }
+
+    p->chunk_state = state;
+
+    if (state == sw_done)
+    {
+        if (pos != buf->last)
+        {
+            ngx_log_error(NGX_LOG_WARN, ep->log, 0,
+                          "upstream sent data after the last chunk");
+            p->upstream->keepalive = 0;
+        }
+
+        ep->length = 0;
+
+    }
+    else if (state == sw_chunk_data)
+    {
+
+        /* the rest of the chunk, LF, "0", LF and LF at least */
+
+        ep->length = p->chunk_size + 4;
+
+    }
+    else
+    {
+        ep->length = 1;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, ep->log, 0,
+                  "upstream sent invalid chunked response");
+
+    return NGX_ERROR;
+}
+
+
 static void ngx_http_proxy_process_body(ngx_event_t *ev)
 {
     ngx_connection_t      *c;
@@ -1562,6 +2105,12 @@ static void ngx_http_proxy_process_body(ngx_event_t *ev)
 
 #endif
 
+        if (ep->upstream_eof && ep->length > 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream prematurely closed connection");
+        }
+
         if (ep->upstream_done || ep->upstream_eof || ep->upstream_error)
         {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
@@ -1584,6 +2133,22 @@ static void ngx_http_proxy_process_body(ngx_event_t *ev)
 }
 
 
+#if (NGX_THREAD_POOL)
+
+static void ngx_http_proxy_thread_cancel(void *data)
+{
+    ngx_event_pipe_t *ep = data;
+
+    if (ep->thread_task)
+    {
+        ngx_thread_task_free(ep->thread_task);
+        ep->thread_task = NULL;
+    }
+}
+
+#endif
+
+
 static void ngx_http_proxy_next_upstream(ngx_http_proxy_ctx_t *p, int ft_type)
 {
     int  status;
@@ -1593,7 +2158,8 @@ static void ngx_http_proxy_next_upstream(ngx_http_proxy_ctx_t *p, int ft_type)
 
     ngx_http_busy_unlock(p->lcf->busy_lock, &p->busy_lock);
 
-    if (ft_type != NGX_HTTP_PROXY_FT_HTTP_404)
+    if (ft_type != NGX_HTTP_PROXY_FT_HTTP_404
+            && !(p->upstream->peer.cached && ft_type == NGX_HTTP_PROXY_FT_ERROR))
     {
         ngx_event_connect_peer_failed(&p->upstream->peer);
     }
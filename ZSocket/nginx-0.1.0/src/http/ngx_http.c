@@ -16,6 +16,13 @@ static char *ngx_http_merge_locations(ngx_conf_t *cf,
                                       void **loc_conf,
                                       ngx_http_module_t *module,
                                       ngx_uint_t ctx_index);
+static char *ngx_http_init_headers_in_hash(ngx_conf_t *cf,
+        ngx_http_core_main_conf_t *cmcf);
+static ngx_http_virtual_names_t *ngx_http_init_virtual_names(ngx_conf_t *cf,
+        ngx_array_t *names);
+static ngx_int_t ngx_http_add_virtual_name(ngx_conf_t *cf,
+        ngx_http_virtual_names_hash_t *hash, ngx_http_server_name_t *name,
+        u_char *key, size_t len);
 
 int         ngx_http_max_module;
 
@@ -267,6 +274,14 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     /* we needed "http"'s cf->ctx while merging configuration */
     *cf = pcf;
 
+    /* the modules have added their request headers by now */
+
+    rv = ngx_http_init_headers_in_hash(cf, cmcf);
+    if (rv != NGX_CONF_OK)
+    {
+        return rv;
+    }
+
     /* init lists of the handlers */
 
     ngx_init_array(cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers,
@@ -384,6 +399,11 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                 in_addr[a].default_server = 1;
                             }
 
+                            if (lscf[l].reuseport)
+                            {
+                                in_addr[a].reuseport = 1;
+                            }
+
                             addr_found = 1;
 
                             break;
@@ -407,6 +427,7 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
                             in_addr[a].addr = lscf[l].addr;
                             in_addr[a].default_server = lscf[l].default_server;
+                            in_addr[a].reuseport = lscf[l].reuseport;
                             in_addr[a].core_srv_conf = cscfp[s];
 
                             /*
@@ -438,6 +459,7 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
                         inaddr->addr = lscf[l].addr;
                         inaddr->default_server = lscf[l].default_server;
+                        inaddr->reuseport = lscf[l].reuseport;
                         inaddr->core_srv_conf = cscfp[s];
 
                         /*
@@ -483,6 +505,7 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
                 inaddr->addr = lscf[l].addr;
                 inaddr->default_server = lscf[l].default_server;
+                inaddr->reuseport = lscf[l].reuseport;
                 inaddr->core_srv_conf = cscfp[s];
 
                 /*
@@ -531,6 +554,15 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             if (!virtual_names)
             {
                 in_addr[a].names.nelts = 0;
+                in_addr[a].virtual_names = NULL;
+                continue;
+            }
+
+            in_addr[a].virtual_names = ngx_http_init_virtual_names(cf,
+                                       &in_addr[a].names);
+            if (in_addr[a].virtual_names == NULL)
+            {
+                return NGX_CONF_ERROR;
             }
         }
 
@@ -569,6 +601,7 @@ static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
 #endif
             ls->addr_ntop = 1;
+            ls->reuseport = in_addr[a].reuseport;
 
             ls->handler = ngx_http_init_connection;
 
@@ -699,3 +732,320 @@ static char *ngx_http_merge_locations(ngx_conf_t *cf,
 
     return NGX_CONF_OK;
 }
+
+
+/*
+ * add a request header that is set in r->headers_in at the offset
+ * or is processed by the handler, the module header replaces
+ * the standard one with the same name
+ */
+
+ngx_int_t ngx_http_add_header_in(ngx_conf_t *cf, ngx_http_header_t *header)
+{
+    ngx_uint_t                  i;
+    ngx_http_header_t          *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = cmcf->headers_in.elts;
+
+    for (i = 0; i < cmcf->headers_in.nelts; i++)
+    {
+        if (h[i].name.len == header->name.len
+                && ngx_strncasecmp(h[i].name.data, header->name.data,
+                                   header->name.len) == 0)
+        {
+            h[i] = *header;
+            return NGX_OK;
+        }
+    }
+
+    if (!(h = ngx_push_array(&cmcf->headers_in)))
+    {
+        return NGX_ERROR;
+    }
+
+    *h = *header;
+
+    return NGX_OK;
+}
+
+
+ngx_uint_t ngx_http_header_hash_key(u_char *data, size_t len)
+{
+    u_char      c;
+    ngx_uint_t  i, key;
+
+    key = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        c = data[i];
+
+        if (c >= 'A' && c <= 'Z')
+        {
+            c |= 0x20;
+        }
+
+        key = ngx_http_header_hash(key, c);
+    }
+
+    return key;
+}
+
+
+/*
+ * the hash size is the least one where the known headers do not collide,
+ * so a header line is found by the single name comparison
+ */
+
+static char *ngx_http_init_headers_in_hash(ngx_conf_t *cf,
+        ngx_http_core_main_conf_t *cmcf)
+{
+    ngx_uint_t          i, j, n, size, *keys;
+    ngx_http_header_t  *header, *h, **hash;
+
+    h = cmcf->headers_in.elts;
+
+    n = cmcf->headers_in.nelts;
+    for (i = 0; ngx_http_headers_in[i].name.len; i++)
+    {
+        n++;
+    }
+
+    if (!(header = ngx_palloc(cf->pool, n * sizeof(ngx_http_header_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the module headers override the standard ones */
+
+    n = 0;
+
+    for (i = 0; ngx_http_headers_in[i].name.len; i++)
+    {
+        for (j = 0; j < cmcf->headers_in.nelts; j++)
+        {
+            if (h[j].name.len == ngx_http_headers_in[i].name.len
+                    && ngx_strncasecmp(h[j].name.data,
+                                       ngx_http_headers_in[i].name.data,
+                                       h[j].name.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (j == cmcf->headers_in.nelts)
+        {
+            header[n++] = ngx_http_headers_in[i];
+        }
+    }
+
+    for (j = 0; j < cmcf->headers_in.nelts; j++)
+    {
+        header[n++] = h[j];
+    }
+
+    if (!(keys = ngx_palloc(cf->pool, n * sizeof(ngx_uint_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        keys[i] = ngx_http_header_hash_key(header[i].name.data,
+                                           header[i].name.len);
+    }
+
+    hash = ngx_palloc(cf->pool,
+                      NGX_HTTP_HEADERS_IN_HASH_MAX * sizeof(ngx_http_header_t *));
+    if (hash == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (size = n; size <= NGX_HTTP_HEADERS_IN_HASH_MAX; size++)
+    {
+        ngx_memzero(hash, size * sizeof(ngx_http_header_t *));
+
+        for (i = 0; i < n; i++)
+        {
+            if (hash[keys[i] % size])
+            {
+                break;
+            }
+
+            hash[keys[i] % size] = &header[i];
+        }
+
+        if (i == n)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                           "http headers in hash: %d headers, size %d",
+                           n, size);
+
+            cmcf->headers_in_hash = hash;
+            cmcf->headers_in_hash_size = size;
+
+            return NGX_CONF_OK;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "could not build the request headers hash "
+                  "for %d headers, the hash size is limited by %d",
+                  n, NGX_HTTP_HEADERS_IN_HASH_MAX);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * the server names of the address:port are hashed at the configuration
+ * time: the exact names, "*.example.com" by "example.com" and
+ * "www.example.*" by "www.example", so the run-time lookup does not
+ * depend on the number of names
+ */
+
+static ngx_http_virtual_names_t *ngx_http_init_virtual_names(ngx_conf_t *cf,
+        ngx_array_t *names)
+{
+    ngx_uint_t                 i, n, head, tail;
+    ngx_http_server_name_t    *name;
+    ngx_http_virtual_names_t  *vn;
+
+    if (!(vn = ngx_pcalloc(cf->pool, sizeof(ngx_http_virtual_names_t))))
+    {
+        return NULL;
+    }
+
+    n = 0;
+    head = 0;
+    tail = 0;
+
+    name = names->elts;
+    for (i = 0; i < names->nelts; i++)
+    {
+        if (name[i].name.len > 2
+                && name[i].name.data[0] == '*'
+                && name[i].name.data[1] == '.')
+        {
+            head++;
+
+        }
+        else if (name[i].name.len > 2
+                 && name[i].name.data[name[i].name.len - 2] == '.'
+                 && name[i].name.data[name[i].name.len - 1] == '*')
+        {
+            tail++;
+
+        }
+        else
+        {
+            n++;
+        }
+    }
+
+    vn->names.size = n;
+    vn->head_wildcards.size = head;
+    vn->tail_wildcards.size = tail;
+
+    if (n && !(vn->names.buckets = ngx_pcalloc(cf->pool,
+                                   n * sizeof(ngx_http_virtual_name_t *))))
+    {
+        return NULL;
+    }
+
+    if (head && !(vn->head_wildcards.buckets = ngx_pcalloc(cf->pool,
+                                   head * sizeof(ngx_http_virtual_name_t *))))
+    {
+        return NULL;
+    }
+
+    if (tail && !(vn->tail_wildcards.buckets = ngx_pcalloc(cf->pool,
+                                   tail * sizeof(ngx_http_virtual_name_t *))))
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < names->nelts; i++)
+    {
+        if (name[i].name.len > 2
+                && name[i].name.data[0] == '*'
+                && name[i].name.data[1] == '.')
+        {
+            if (ngx_http_add_virtual_name(cf, &vn->head_wildcards, &name[i],
+                                          name[i].name.data + 2,
+                                          name[i].name.len - 2) == NGX_ERROR)
+            {
+                return NULL;
+            }
+
+        }
+        else if (name[i].name.len > 2
+                 && name[i].name.data[name[i].name.len - 2] == '.'
+                 && name[i].name.data[name[i].name.len - 1] == '*')
+        {
+            if (ngx_http_add_virtual_name(cf, &vn->tail_wildcards, &name[i],
+                                          name[i].name.data,
+                                          name[i].name.len - 2) == NGX_ERROR)
+            {
+                return NULL;
+            }
+
+        }
+        else
+        {
+            if (ngx_http_add_virtual_name(cf, &vn->names, &name[i],
+                                          name[i].name.data,
+                                          name[i].name.len) == NGX_ERROR)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    return vn;
+}
+
+
+static ngx_int_t ngx_http_add_virtual_name(ngx_conf_t *cf,
+        ngx_http_virtual_names_hash_t *hash, ngx_http_server_name_t *name,
+        u_char *key, size_t len)
+{
+    ngx_uint_t                k;
+    ngx_http_virtual_name_t  *vn, **last;
+
+    k = ngx_http_header_hash_key(key, len) % hash->size;
+
+    for (last = &hash->buckets[k]; *last; last = &(*last)->next)
+    {
+        if ((*last)->key.len == len
+                && ngx_strncasecmp((*last)->key.data, key, len) == 0)
+        {
+            if ((*last)->server_name->core_srv_conf != name->core_srv_conf)
+            {
+                ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                              "conflicting server name \"%s\", ignored",
+                              name->name.data);
+            }
+
+            return NGX_OK;
+        }
+    }
+
+    if (!(vn = ngx_palloc(cf->pool, sizeof(ngx_http_virtual_name_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    vn->key.len = len;
+    vn->key.data = key;
+    vn->server_name = name;
+    vn->next = NULL;
+
+    *last = vn;
+
+    return NGX_OK;
+}
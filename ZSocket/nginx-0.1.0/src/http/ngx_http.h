@@ -14,6 +14,7 @@
 
 typedef struct ngx_http_request_s  ngx_http_request_t;
 typedef struct ngx_http_cleanup_s  ngx_http_cleanup_t;
+typedef struct ngx_http_virtual_names_s  ngx_http_virtual_names_t;
 
 #if (NGX_HTTP_CACHE)
 #include <ngx_http_cache.h>
@@ -31,6 +32,10 @@ typedef struct ngx_http_cleanup_s  ngx_http_cleanup_t;
 #include <ngx_http_ssl_module.h>
 #endif
 
+#if (NGX_HTTP_STATUS)
+#include <ngx_http_status_handler.h>
+#endif
+
 
 typedef struct
 {
@@ -69,6 +74,8 @@ ngx_int_t ngx_http_parse_complex_uri(ngx_http_request_t *r);
 ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b);
 
 ngx_int_t ngx_http_find_server_conf(ngx_http_request_t *r);
+ngx_int_t ngx_http_add_header_in(ngx_conf_t *cf, ngx_http_header_t *header);
+ngx_uint_t ngx_http_header_hash_key(u_char *data, size_t len);
 void ngx_http_handler(ngx_http_request_t *r);
 void ngx_http_finalize_request(ngx_http_request_t *r, int error);
 void ngx_http_writer(ngx_event_t *wev);
@@ -82,6 +82,7 @@ ngx_http_cache_t *ngx_http_cache_get(ngx_http_cache_hash_t *hash,
                 cleanup->data.cache.cache = &c[i];
                 cleanup->valid = 1;
                 cleanup->cache = 1;
+                cleanup->handler = 0;
             }
 
             return &c[i];
@@ -206,6 +207,7 @@ ngx_http_cache_t *ngx_http_cache_alloc(ngx_http_cache_hash_t *hash,
         cleanup->data.cache.cache = cache;
         cleanup->valid = 1;
         cleanup->cache = 1;
+        cleanup->handler = 0;
     }
 
     ngx_mutex_unlock(&hash->mutex);
@@ -19,6 +19,10 @@ static void *ngx_http_copy_filter_create_conf(ngx_conf_t *cf);
 static char *ngx_http_copy_filter_merge_conf(ngx_conf_t *cf,
         void *parent, void *child);
 static ngx_int_t ngx_http_copy_filter_init(ngx_cycle_t *cycle);
+#if (NGX_THREAD_POOL)
+static void ngx_http_copy_thread_handler(void *data);
+static void ngx_http_copy_thread_cancel(void *data);
+#endif
 
 
 static ngx_command_t  ngx_http_copy_filter_commands[] =
@@ -70,6 +74,10 @@ ngx_int_t ngx_http_copy_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     ngx_output_chain_ctx_t       *ctx;
     ngx_http_copy_filter_conf_t  *conf;
+#if (NGX_THREAD_POOL)
+    ngx_http_cleanup_t           *cln;
+    ngx_http_core_loc_conf_t     *clcf;
+#endif
 
     if (r->connection->write->error)
     {
@@ -98,12 +106,68 @@ ngx_int_t ngx_http_copy_filter(ngx_http_request_t *r, ngx_chain_t *in)
         ctx->output_filter = (ngx_output_chain_filter_pt) ngx_http_next_filter;
         ctx->filter_ctx = r;
 
+#if (NGX_THREAD_POOL)
+
+        clcf = ngx_http_get_module_loc_conf(r->main ? r->main : r,
+                                            ngx_http_core_module);
+
+        if (clcf->aio)
+        {
+            if (!(cln = ngx_push_array(&r->cleanup)))
+            {
+                return NGX_ERROR;
+            }
+
+            cln->data.handler.handler = ngx_http_copy_thread_cancel;
+            cln->data.handler.data = ctx;
+            cln->valid = 1;
+            cln->cache = 0;
+            cln->handler = 1;
+
+            ctx->thread_pool = clcf->thread_pool;
+            ctx->thread_handler = ngx_http_copy_thread_handler;
+            ctx->thread_data = r->main ? r->main : r;
+        }
+
+#endif
     }
 
     return ngx_output_chain(ctx, in);
 }
 
 
+#if (NGX_THREAD_POOL)
+
+/* the thread read is done, the output is resumed by the connection writer */
+
+static void ngx_http_copy_thread_handler(void *data)
+{
+    ngx_http_request_t *r = data;
+
+    ngx_event_t  *wev;
+
+    wev = r->connection->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0, "http copy thread done");
+
+    wev->event_handler(wev);
+}
+
+
+static void ngx_http_copy_thread_cancel(void *data)
+{
+    ngx_output_chain_ctx_t *ctx = data;
+
+    if (ctx->thread_task)
+    {
+        ngx_thread_task_free(ctx->thread_task);
+        ctx->thread_task = NULL;
+    }
+}
+
+#endif
+
+
 static void *ngx_http_copy_filter_create_conf(ngx_conf_t *cf)
 {
     ngx_http_copy_filter_conf_t *conf;
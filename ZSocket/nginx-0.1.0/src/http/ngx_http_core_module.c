@@ -19,7 +19,7 @@
 static void ngx_http_phase_event_handler(ngx_event_t *rev);
 static void ngx_http_run_phases(ngx_http_request_t *r);
 static ngx_int_t ngx_http_find_location(ngx_http_request_t *r,
-                                        ngx_array_t *locations, size_t len);
+        ngx_http_location_tree_t *tree);
 
 static void *ngx_http_core_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_core_init_main_conf(ngx_conf_t *cf, void *conf);
@@ -32,6 +32,10 @@ static char *ngx_http_core_merge_loc_conf(ngx_conf_t *cf,
 
 static char *ngx_server_block(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static int ngx_cmp_locations(const void *first, const void *second);
+static ngx_int_t ngx_http_init_locations(ngx_conf_t *cf,
+        ngx_array_t *locations, ngx_http_location_tree_t **tree);
+static ngx_http_location_node_t *ngx_http_create_location_node(ngx_conf_t *cf,
+        ngx_http_core_loc_conf_t **clcfp, ngx_uint_t n, size_t depth);
 static char *ngx_location_block(ngx_conf_t *cf, ngx_command_t *cmd,
                                 void *dummy);
 static char *ngx_types_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -43,6 +47,9 @@ static char *ngx_set_root(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_set_error_page(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_set_error_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_set_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_set_aio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_set_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
 
 static char *ngx_http_lowat_check(ngx_conf_t *cf, void *post, void *data);
 
@@ -147,7 +154,7 @@ static ngx_command_t  ngx_http_core_commands[] =
 #if 0
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
 #else
-        NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+        NGX_HTTP_SRV_CONF|NGX_CONF_TAKE12,
 #endif
         ngx_set_listen,
         NGX_HTTP_SRV_CONF_OFFSET,
@@ -246,6 +253,15 @@ static ngx_command_t  ngx_http_core_commands[] =
         NULL
     },
 
+    {
+        ngx_string("aio"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_set_aio,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+
     {
         ngx_string("send_timeout"),
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -345,18 +361,32 @@ static ngx_command_t  ngx_http_core_commands[] =
         NULL
     },
 
-#if (NGX_HTTP_CACHE)
-
     {
         ngx_string("open_file_cache"),
-        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE4,
-        ngx_http_set_cache_slot,
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+        ngx_set_open_file_cache,
         NGX_HTTP_LOC_CONF_OFFSET,
-        offsetof(ngx_http_core_loc_conf_t, open_files),
+        0,
         NULL
     },
 
-#endif
+    {
+        ngx_string("open_file_cache_valid"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_core_loc_conf_t, open_file_cache_valid),
+        NULL
+    },
+
+    {
+        ngx_string("open_file_cache_errors"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_core_loc_conf_t, open_file_cache_errors),
+        NULL
+    },
 
     ngx_null_command
 };
@@ -578,7 +608,7 @@ ngx_int_t ngx_http_find_location_config(ngx_http_request_t *r)
 
     cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
 
-    rc = ngx_http_find_location(r, &cscf->locations, 0);
+    rc = ngx_http_find_location(r, cscf->location_tree);
 
     if (rc == NGX_HTTP_INTERNAL_SERVER_ERROR)
     {
@@ -651,83 +681,108 @@ ngx_int_t ngx_http_find_location_config(ngx_http_request_t *r)
 
 
 static ngx_int_t ngx_http_find_location(ngx_http_request_t *r,
-                                        ngx_array_t *locations, size_t len)
+        ngx_http_location_tree_t *tree)
 {
+    u_char                    *uri;
+    size_t                     rest;
     ngx_int_t                  n, rc;
-    ngx_uint_t                 i, found;
-    ngx_http_core_loc_conf_t  *clcf, **clcfp;
+    ngx_uint_t                 i, left, right, found;
+    ngx_http_location_node_t  *node, *child;
+    ngx_http_core_loc_conf_t  *clcf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "find location");
 
     found = 0;
 
-    clcfp = locations->elts;
-    for (i = 0; i < locations->nelts; i++)
+    uri = r->uri.data;
+    rest = r->uri.len;
+    node = tree->root;
+
+    /* the longest prefix location, the walk is O(URI length) */
+
+    while (node)
     {
+        if (node->inclusive)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "find location: \"%s\"",
+                           node->inclusive->name.data);
 
-#if (HAVE_PCRE)
-        if (clcfp[i]->regex)
+            r->loc_conf = node->inclusive->loc_conf;
+            found = 1;
+        }
+
+        if (rest == 0 && node->exact)
         {
-            break;
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "find location: = \"%s\"",
+                           node->exact->name.data);
+
+            r->loc_conf = node->exact->loc_conf;
+            return NGX_HTTP_LOCATION_EXACT;
         }
-#endif
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "find location: %s\"%s\"",
-                       clcfp[i]->exact_match ? "= " : "",
-                       clcfp[i]->name.data);
+        /* the child by the next URI byte, "/" if the URI has ended */
 
-        if (clcfp[i]->auto_redirect
-                && r->uri.len == clcfp[i]->name.len - 1
-                && ngx_strncmp(r->uri.data, clcfp[i]->name.data,
-                               clcfp[i]->name.len - 1) == 0)
+        left = 0;
+        right = node->nchildren;
+        child = NULL;
+
+        while (left < right)
         {
-            /* the locations are lexicographically sorted */
+            i = (left + right) / 2;
 
-            r->loc_conf = clcfp[i]->loc_conf;
+            if (node->children[i]->name[0] < (rest ? uri[0] : '/'))
+            {
+                left = i + 1;
+                continue;
+            }
 
-            return NGX_HTTP_LOCATION_AUTO_REDIRECT;
-        }
+            if (node->children[i]->name[0] == (rest ? uri[0] : '/'))
+            {
+                child = node->children[i];
+            }
 
-        if (r->uri.len < clcfp[i]->name.len)
-        {
-            continue;
+            right = i;
         }
 
-        n = ngx_strncmp(r->uri.data, clcfp[i]->name.data, clcfp[i]->name.len);
-
-        if (n < 0)
+        if (child == NULL)
         {
-            /* the locations are lexicographically sorted */
             break;
         }
 
-        if (n == 0)
+        /* the URI lacks the trailing "/" of the location, e.g. "/dir" */
+
+        if (child->len == rest + 1
+                && child->name[rest] == '/'
+                && ngx_strncmp(uri, child->name, rest) == 0)
         {
-            if (clcfp[i]->exact_match && r->uri.len == clcfp[i]->name.len)
-            {
-                r->loc_conf = clcfp[i]->loc_conf;
-                return NGX_HTTP_LOCATION_EXACT;
-            }
+            clcf = child->exact ? child->exact : child->inclusive;
 
-            if (len > clcfp[i]->name.len)
+            if (clcf && clcf->auto_redirect)
             {
-                /* the previous match is longer */
-                break;
+                r->loc_conf = clcf->loc_conf;
+                return NGX_HTTP_LOCATION_AUTO_REDIRECT;
             }
+        }
 
-            r->loc_conf = clcfp[i]->loc_conf;
-            found = 1;
+        if (child->len > rest || ngx_strncmp(uri, child->name, child->len) != 0)
+        {
+            break;
         }
+
+        uri += child->len;
+        rest -= child->len;
+        node = child;
     }
 
     if (found)
     {
         clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-        if (clcf->locations.nelts)
+        if (clcf->location_tree)
         {
-            rc = ngx_http_find_location(r, &clcf->locations, len);
+            rc = ngx_http_find_location(r, clcf->location_tree);
 
             if (rc != NGX_OK)
             {
@@ -740,19 +795,13 @@ static ngx_int_t ngx_http_find_location(ngx_http_request_t *r,
 
     /* regex matches */
 
-    for (/* void */; i < locations->nelts; i++)
+    for (i = 0; i < tree->nregex; i++)
     {
-
-        if (!clcfp[i]->regex)
-        {
-            continue;
-        }
-
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "find location: ~ \"%s\"",
-                       clcfp[i]->name.data);
+                       tree->regex[i]->name.data);
 
-        n = ngx_regex_exec(clcfp[i]->regex, &r->uri, NULL, 0);
+        n = ngx_regex_exec(tree->regex[i]->regex, &r->uri, NULL, 0);
 
         if (n == NGX_DECLINED)
         {
@@ -764,13 +813,13 @@ static ngx_int_t ngx_http_find_location(ngx_http_request_t *r,
             ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
                           ngx_regex_exec_n
                           " failed: %d on \"%s\" using \"%s\"",
-                          n, r->uri.data, clcfp[i]->name.data);
+                          n, r->uri.data, tree->regex[i]->name.data);
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
         /* match */
 
-        r->loc_conf = clcfp[i]->loc_conf;
+        r->loc_conf = tree->regex[i]->loc_conf;
 
         return NGX_HTTP_LOCATION_REGEX;
     }
@@ -1107,8 +1156,11 @@ static char *ngx_server_block(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
         return rv;
     }
 
-    ngx_qsort(cscf->locations.elts, (size_t) cscf->locations.nelts,
-              sizeof(ngx_http_core_loc_conf_t *), ngx_cmp_locations);
+    if (ngx_http_init_locations(cf, &cscf->locations, &cscf->location_tree)
+            == NGX_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
 
     return rv;
 }
@@ -1122,31 +1174,200 @@ static int ngx_cmp_locations(const void *one, const void *two)
     first = *(ngx_http_core_loc_conf_t **) one;
     second = *(ngx_http_core_loc_conf_t **) two;
 
-#if (HAVE_PCRE)
+    /* the regex locations are never sorted, they keep the config order */
 
-    if (first->regex && !second->regex)
+    rc = ngx_strcmp(first->name.data, second->name.data);
+
+    if (rc != 0)
     {
-        /* shift the regex matches to the end */
-        return 1;
+        return rc;
     }
 
-    if (first->regex || second->regex)
+    /* an exact match must be before the same inclusive one */
+
+    return (int) second->exact_match - (int) first->exact_match;
+}
+
+
+/*
+ * compile the locations of the level and, recursively, the nested ones:
+ * the prefix and the exact locations go to the trie, the regex ones keep
+ * their order and are tried after the trie lookup
+ */
+
+static ngx_int_t ngx_http_init_locations(ngx_conf_t *cf,
+        ngx_array_t *locations, ngx_http_location_tree_t **tree)
+{
+    ngx_uint_t                  i, n;
+    ngx_http_location_tree_t   *lt;
+    ngx_http_core_loc_conf_t  **clcfp, **prefix;
+
+    if (!(lt = ngx_pcalloc(cf->pool, sizeof(ngx_http_location_tree_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    *tree = lt;
+
+    if (locations->nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    prefix = ngx_palloc(cf->pool,
+                        locations->nelts * sizeof(ngx_http_core_loc_conf_t *));
+    if (prefix == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    lt->regex = ngx_palloc(cf->pool,
+                           locations->nelts * sizeof(ngx_http_core_loc_conf_t *));
+    if (lt->regex == NULL)
     {
-        /* do not sort the regex matches */
-        return 0;
+        return NGX_ERROR;
     }
 
+    n = 0;
+
+    clcfp = locations->elts;
+    for (i = 0; i < locations->nelts; i++)
+    {
+        if (clcfp[i]->locations.nelts)
+        {
+            if (ngx_http_init_locations(cf, &clcfp[i]->locations,
+                                        &clcfp[i]->location_tree) == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+#if (HAVE_PCRE)
+        if (clcfp[i]->regex)
+        {
+            lt->regex[lt->nregex++] = clcfp[i];
+            continue;
+        }
 #endif
 
-    rc = ngx_strcmp(first->name.data, second->name.data);
+        prefix[n++] = clcfp[i];
+    }
+
+    /*
+     * ngx_qsort() is not stable, so only the prefix locations are sorted,
+     * after the regex ones have been picked out in the config order
+     */
+
+    ngx_qsort(prefix, (size_t) n, sizeof(ngx_http_core_loc_conf_t *),
+              ngx_cmp_locations);
 
-    if (rc == 0 && second->exact_match)
+    lt->root = ngx_http_create_location_node(cf, prefix, n, 0);
+    if (lt->root == NULL)
     {
-        /* an exact match must be before the same inclusive one */
-        return 1;
+        return NGX_ERROR;
     }
 
-    return rc;
+    return NGX_OK;
+}
+
+
+/*
+ * the node for the sorted locations that have the common prefix
+ * of the "depth" length: the locations of this very length are
+ * attached to the node and the rest are grouped by the next byte,
+ * the label of a child is the longest common prefix of its group
+ */
+
+static ngx_http_location_node_t *ngx_http_create_location_node(ngx_conf_t *cf,
+        ngx_http_core_loc_conf_t **clcfp, ngx_uint_t n, size_t depth)
+{
+    size_t                     len;
+    ngx_uint_t                 i, j, groups;
+    ngx_http_location_node_t  *node;
+    ngx_http_core_loc_conf_t  *first, *last;
+
+    if (!(node = ngx_pcalloc(cf->pool, sizeof(ngx_http_location_node_t))))
+    {
+        return NULL;
+    }
+
+    /* the locations equal to the prefix are sorted before the longer ones */
+
+    for (i = 0; i < n && clcfp[i]->name.len == depth; i++)
+    {
+        if (clcfp[i]->exact_match)
+        {
+            node->exact = clcfp[i];
+
+        }
+        else
+        {
+            node->inclusive = clcfp[i];
+        }
+    }
+
+    groups = 0;
+
+    for (j = i; j < n; j++)
+    {
+        if (j == i || clcfp[j]->name.data[depth] != clcfp[j - 1]->name.data[depth])
+        {
+            groups++;
+        }
+    }
+
+    if (groups == 0)
+    {
+        return node;
+    }
+
+    node->children = ngx_palloc(cf->pool,
+                                groups * sizeof(ngx_http_location_node_t *));
+    if (node->children == NULL)
+    {
+        return NULL;
+    }
+
+    while (i < n)
+    {
+        for (j = i + 1; j < n; j++)
+        {
+            if (clcfp[j]->name.data[depth] != clcfp[i]->name.data[depth])
+            {
+                break;
+            }
+        }
+
+        /* the common prefix of the sorted group is that of its ends */
+
+        first = clcfp[i];
+        last = clcfp[j - 1];
+
+        for (len = depth + 1;
+             len < first->name.len
+             && len < last->name.len
+             && first->name.data[len] == last->name.data[len];
+             len++)
+        {
+            /* void */
+        }
+
+        node->children[node->nchildren] =
+            ngx_http_create_location_node(cf, &clcfp[i], j - i, len);
+
+        if (node->children[node->nchildren] == NULL)
+        {
+            return NULL;
+        }
+
+        node->children[node->nchildren]->name = first->name.data + depth;
+        node->children[node->nchildren]->len = len - depth;
+        node->nchildren++;
+
+        i = j;
+    }
+
+    return node;
 }
 
 
@@ -1395,6 +1616,10 @@ static void *ngx_http_core_create_main_conf(ngx_conf_t *cf)
                    5, sizeof(ngx_http_core_srv_conf_t *),
                    NGX_CONF_ERROR);
 
+    ngx_init_array(cmcf->headers_in, cf->pool,
+                   5, sizeof(ngx_http_header_t),
+                   NGX_CONF_ERROR);
+
     return cmcf;
 }
 
@@ -1469,6 +1694,7 @@ static char *ngx_http_core_merge_srv_conf(ngx_conf_t *cf,
         l->port = (getuid() == 0) ? 80 : 8000;
 #endif
         l->family = AF_INET;
+        l->reuseport = 0;
     }
 
     if (conf->server_names.nelts == 0)
@@ -1559,6 +1785,7 @@ static void *ngx_http_core_create_loc_conf(ngx_conf_t *cf)
     lcf->client_body_timeout = NGX_CONF_UNSET_MSEC;
     lcf->sendfile = NGX_CONF_UNSET;
     lcf->tcp_nopush = NGX_CONF_UNSET;
+    lcf->aio = NGX_CONF_UNSET;
     lcf->send_timeout = NGX_CONF_UNSET_MSEC;
     lcf->send_lowat = NGX_CONF_UNSET_SIZE;
     lcf->postpone_output = NGX_CONF_UNSET_SIZE;
@@ -1569,6 +1796,9 @@ static void *ngx_http_core_create_loc_conf(ngx_conf_t *cf)
     lcf->lingering_timeout = NGX_CONF_UNSET_MSEC;
     lcf->reset_timedout_connection = NGX_CONF_UNSET;
     lcf->msie_padding = NGX_CONF_UNSET;
+    lcf->open_file_cache = NGX_CONF_UNSET_PTR;
+    lcf->open_file_cache_valid = NGX_CONF_UNSET;
+    lcf->open_file_cache_errors = NGX_CONF_UNSET;
 
     return lcf;
 }
@@ -1662,6 +1892,15 @@ static char *ngx_http_core_merge_loc_conf(ngx_conf_t *cf,
                               prev->client_body_timeout, 60000);
     ngx_conf_merge_value(conf->sendfile, prev->sendfile, 0);
     ngx_conf_merge_value(conf->tcp_nopush, prev->tcp_nopush, 0);
+
+#if (NGX_THREAD_POOL)
+    if (conf->aio == NGX_CONF_UNSET)
+    {
+        conf->thread_pool = prev->thread_pool;
+    }
+#endif
+
+    ngx_conf_merge_value(conf->aio, prev->aio, 0);
     ngx_conf_merge_msec_value(conf->send_timeout, prev->send_timeout, 60000);
     ngx_conf_merge_size_value(conf->send_lowat, prev->send_lowat, 0);
     ngx_conf_merge_size_value(conf->postpone_output, prev->postpone_output,
@@ -1680,11 +1919,21 @@ static char *ngx_http_core_merge_loc_conf(ngx_conf_t *cf,
                          prev->reset_timedout_connection, 0);
     ngx_conf_merge_value(conf->msie_padding, prev->msie_padding, 1);
 
-    if (conf->open_files == NULL)
+    if (conf->open_file_cache == NGX_CONF_UNSET_PTR)
     {
-        conf->open_files = prev->open_files;
+        conf->open_file_cache = prev->open_file_cache;
+
+        if (conf->open_file_cache == NGX_CONF_UNSET_PTR)
+        {
+            conf->open_file_cache = NULL;
+        }
     }
 
+    ngx_conf_merge_sec_value(conf->open_file_cache_valid,
+                             prev->open_file_cache_valid, 60);
+    ngx_conf_merge_value(conf->open_file_cache_errors,
+                         prev->open_file_cache_errors, 0);
+
     return NGX_CONF_OK;
 }
 
@@ -1716,8 +1965,28 @@ static char *ngx_set_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ls->default_server = 0;
     ls->file_name = cf->conf_file->file.name;
     ls->line = cf->conf_file->line;
+    ls->reuseport = 0;
 
     args = cf->args->elts;
+
+    if (cf->args->nelts == 3)
+    {
+        if (ngx_strcmp(args[2].data, "reuseport") != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%s\"", args[2].data);
+            return NGX_CONF_ERROR;
+        }
+
+#if (HAVE_REUSEPORT)
+        ls->reuseport = 1;
+#else
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"reuseport\" is not supported "
+                           "on this platform, ignored");
+#endif
+    }
+
     addr = args[1].data;
 
     for (p = 0; p < args[1].len; p++)
@@ -2018,6 +2287,154 @@ static char *ngx_set_error_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+/*
+ * aio off | threads | threads=pool;
+ */
+
+static char *ngx_set_aio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *lcf = conf;
+
+    ngx_str_t  *value;
+#if (NGX_THREAD_POOL)
+    ngx_str_t   name;
+#endif
+
+    if (lcf->aio != NGX_CONF_UNSET)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0)
+    {
+        lcf->aio = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) != 0
+            || (value[1].len > 7 && value[1].data[7] != '='))
+    {
+        return "invalid value";
+    }
+
+#if (NGX_THREAD_POOL)
+
+    if (value[1].len > 8)
+    {
+        name.len = value[1].len - 8;
+        name.data = value[1].data + 8;
+
+    }
+    else
+    {
+        name.len = sizeof("default") - 1;
+        name.data = (u_char *) "default";
+    }
+
+    if (!(lcf->thread_pool = ngx_thread_pool_add(cf, &name)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->aio = 1;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "\"aio threads\" requires the thread pool, ignored");
+
+    lcf->aio = 0;
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * open_file_cache max=N [inactive=time] | off;
+ */
+
+static char *ngx_set_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf)
+{
+    ngx_http_core_loc_conf_t *lcf = conf;
+
+    time_t       inactive;
+    ngx_str_t   *value, s;
+    ngx_int_t    max;
+    ngx_uint_t   i;
+
+    if (lcf->open_file_cache != NGX_CONF_UNSET_PTR)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 60;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0)
+        {
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max == NGX_ERROR || max == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0)
+        {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == NGX_ERROR || inactive == NGX_PARSE_LARGE_TIME)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0 && cf->args->nelts == 2)
+        {
+            lcf->open_file_cache = NULL;
+            return NGX_CONF_OK;
+        }
+
+    invalid:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"open_file_cache\" parameter \"%s\"",
+                           value[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (max == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"open_file_cache\" must have \"max\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->open_file_cache = ngx_open_file_cache_init(cf->pool, max, inactive);
+    if (lcf->open_file_cache == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *ngx_http_lowat_check(ngx_conf_t *cf, void *post, void *data)
 {
 #if (HAVE_LOWAT_EVENT)
@@ -22,6 +22,7 @@ typedef struct
     int        line;
 
     unsigned   default_server:1;
+    unsigned   reuseport:1;
 } ngx_http_listen_t;
 
 
@@ -52,10 +53,20 @@ typedef struct
     ngx_http_phase_t  phases[NGX_HTTP_LAST_PHASE];
     ngx_array_t       index_handlers;
 
+    /* the headers added by the modules, ngx_http_header_t */
+    ngx_array_t          headers_in;
+
+    /* the perfect hash of the known request headers by the name hash */
+    ngx_http_header_t  **headers_in_hash;
+    ngx_uint_t           headers_in_hash_size;
+
     size_t            max_server_name_len;
 } ngx_http_core_main_conf_t;
 
 
+typedef struct ngx_http_location_tree_s  ngx_http_location_tree_t;
+
+
 typedef struct
 {
     /*
@@ -64,6 +75,9 @@ typedef struct
      */
     ngx_array_t           locations;
 
+    /* the same locations compiled for the run-time lookup */
+    ngx_http_location_tree_t  *location_tree;
+
     /* "listen", array of ngx_http_listen_t */
     ngx_array_t           listen;
 
@@ -103,7 +117,11 @@ typedef struct
     ngx_http_core_srv_conf_t  *core_srv_conf;  /* default server conf
                                                   for this address:port */
 
+    /* NULL if the all names point to the default server */
+    ngx_http_virtual_names_t  *virtual_names;
+
     unsigned                   default_server:1;
+    unsigned                   reuseport:1;
 } ngx_http_in_addr_t;
 
 
@@ -114,6 +132,36 @@ typedef struct
 } ngx_http_server_name_t;
 
 
+typedef struct ngx_http_virtual_name_s  ngx_http_virtual_name_t;
+
+struct ngx_http_virtual_name_s
+{
+    ngx_str_t                  key;
+    ngx_http_server_name_t    *server_name;
+    ngx_http_virtual_name_t   *next;
+};
+
+
+typedef struct
+{
+    ngx_http_virtual_name_t  **buckets;
+    ngx_uint_t                 size;
+} ngx_http_virtual_names_hash_t;
+
+
+/*
+ * the exact names, the "*.example.com" names by "example.com"
+ * and the "www.example.*" names by "www.example"
+ */
+
+struct ngx_http_virtual_names_s
+{
+    ngx_http_virtual_names_hash_t  names;
+    ngx_http_virtual_names_hash_t  head_wildcards;
+    ngx_http_virtual_names_hash_t  tail_wildcards;
+};
+
+
 #define NGX_HTTP_TYPES_HASH_PRIME  13
 
 #define ngx_http_types_hash_key(key, ext)                                   \
@@ -141,6 +189,36 @@ typedef struct
 
 
 typedef struct ngx_http_core_loc_conf_s  ngx_http_core_loc_conf_t;
+typedef struct ngx_http_location_node_s  ngx_http_location_node_t;
+
+
+/*
+ * the prefix and the exact locations of the level are compiled
+ * into a compressed trie: the edge from the parent node is labeled
+ * by the "name", the children are sorted by the first byte of the label
+ */
+
+struct ngx_http_location_node_s
+{
+    u_char                     *name;
+    size_t                      len;
+
+    ngx_http_core_loc_conf_t   *exact;
+    ngx_http_core_loc_conf_t   *inclusive;
+
+    ngx_uint_t                  nchildren;
+    ngx_http_location_node_t  **children;
+};
+
+
+struct ngx_http_location_tree_s
+{
+    ngx_http_location_node_t   *root;
+
+    /* the regex locations in the configuration order */
+    ngx_uint_t                  nregex;
+    ngx_http_core_loc_conf_t  **regex;
+};
 
 struct ngx_http_core_loc_conf_s
 {
@@ -156,6 +234,7 @@ struct ngx_http_core_loc_conf_s
 
     /* array of inclusive ngx_http_core_loc_conf_t */
     ngx_array_t   locations;
+    ngx_http_location_tree_t  *location_tree;
 
     /* pointer to the modules' loc_conf */
     void        **loc_conf ;
@@ -183,12 +262,19 @@ struct ngx_http_core_loc_conf_s
 
     ngx_flag_t    sendfile;                /* sendfile */
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
+    ngx_flag_t    aio;                     /* aio */
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
     ngx_flag_t    msie_padding;            /* msie_padding */
 
     ngx_array_t  *error_pages;             /* error_page */
 
-    ngx_http_cache_hash_t  *open_files;
+    ngx_open_file_cache_t  *open_file_cache;  /* open_file_cache */
+    time_t        open_file_cache_valid;   /* open_file_cache_valid */
+    ngx_flag_t    open_file_cache_errors;  /* open_file_cache_errors */
+
+#if (NGX_THREAD_POOL)
+    ngx_thread_pool_t      *thread_pool;   /* aio threads */
+#endif
 
     ngx_log_t    *err_log;
 
@@ -99,37 +99,40 @@ static ngx_str_t http_codes[] =
 
 ngx_http_header_t  ngx_http_headers_out[] =
 {
-    { ngx_string("Server"), offsetof(ngx_http_headers_out_t, server) },
-    { ngx_string("Date"), offsetof(ngx_http_headers_out_t, date) },
+    { ngx_string("Server"), offsetof(ngx_http_headers_out_t, server), NULL },
+    { ngx_string("Date"), offsetof(ngx_http_headers_out_t, date), NULL },
     {
         ngx_string("Content-Type"),
-        offsetof(ngx_http_headers_out_t, content_type)
+        offsetof(ngx_http_headers_out_t, content_type), NULL
     },
     {
         ngx_string("Content-Length"),
-        offsetof(ngx_http_headers_out_t, content_length)
+        offsetof(ngx_http_headers_out_t, content_length), NULL
     },
     {
         ngx_string("Content-Encoding"),
-        offsetof(ngx_http_headers_out_t, content_encoding)
+        offsetof(ngx_http_headers_out_t, content_encoding), NULL
+    },
+    {
+        ngx_string("Location"),
+        offsetof(ngx_http_headers_out_t, location), NULL
     },
-    { ngx_string("Location"), offsetof(ngx_http_headers_out_t, location) },
     {
         ngx_string("Last-Modified"),
-        offsetof(ngx_http_headers_out_t, last_modified)
+        offsetof(ngx_http_headers_out_t, last_modified), NULL
     },
     {
         ngx_string("Accept-Ranges"),
-        offsetof(ngx_http_headers_out_t, accept_ranges)
+        offsetof(ngx_http_headers_out_t, accept_ranges), NULL
     },
-    { ngx_string("Expires"), offsetof(ngx_http_headers_out_t, expires) },
+    { ngx_string("Expires"), offsetof(ngx_http_headers_out_t, expires), NULL },
     {
         ngx_string("Cache-Control"),
-        offsetof(ngx_http_headers_out_t, cache_control)
+        offsetof(ngx_http_headers_out_t, cache_control), NULL
     },
-    { ngx_string("ETag"), offsetof(ngx_http_headers_out_t, etag) },
+    { ngx_string("ETag"), offsetof(ngx_http_headers_out_t, etag), NULL },
 
-    { ngx_null_string, 0 }
+    { ngx_null_string, 0, NULL }
 };
 
 
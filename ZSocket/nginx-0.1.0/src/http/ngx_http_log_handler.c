@@ -9,6 +9,10 @@
 #include <ngx_http.h>
 #include <nginx.h>
 
+#if (NGX_HTTP_GZIP)
+#include <zlib.h>
+#endif
+
 
 static u_char *ngx_http_log_addr(ngx_http_request_t *r, u_char *buf,
                                  uintptr_t data);
@@ -42,6 +46,19 @@ static u_char *ngx_http_log_header_out(ngx_http_request_t *r, u_char *buf,
 static u_char *ngx_http_log_unknown_header_out(ngx_http_request_t *r, u_char *buf,
         uintptr_t data);
 
+static u_char *ngx_http_log_copy(ngx_http_request_t *r, u_char *buf,
+                                 ngx_http_log_t *log);
+static void ngx_http_log_write(ngx_open_file_t *file, u_char *buf, size_t len,
+                               ngx_log_t *log);
+static void ngx_http_log_write_fd(ngx_open_file_t *file, u_char *buf,
+                                  size_t len, ngx_log_t *log);
+#if (NGX_HTTP_GZIP)
+static void ngx_http_log_gzip(ngx_open_file_t *file, u_char *buf, size_t len,
+                              ngx_int_t level, ngx_log_t *log);
+#endif
+static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_flush_handler(ngx_event_t *ev);
+
 static ngx_int_t ngx_http_log_pre_conf(ngx_conf_t *cf);
 static void *ngx_http_log_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_log_create_loc_conf(ngx_conf_t *cf);
@@ -69,7 +86,7 @@ static ngx_command_t  ngx_http_log_commands[] =
 
     {
         ngx_string("access_log"),
-        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
         ngx_http_log_set_log,
         NGX_HTTP_LOC_CONF_OFFSET,
         0,
@@ -109,6 +126,18 @@ ngx_module_t  ngx_http_log_module =
 static ngx_str_t http_access_log = ngx_string(NGX_HTTP_LOG_PATH);
 
 
+/* the flush timer is not bound to a connection */
+static ngx_connection_t  ngx_http_log_dumb;
+
+
+#if (NGX_HTTP_GZIP)
+
+static u_char  ngx_http_log_gzheader[10] =
+    { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+
+#endif
+
+
 static ngx_str_t ngx_http_combined_fmt =
     ngx_string("%addr - - [%time] \"%request\" %status %apache_length "
                "\"%{Referer}i\" \"%{User-Agent}i\"");
@@ -137,15 +166,12 @@ ngx_http_log_op_name_t ngx_http_log_fmt_ops[] =
 ngx_int_t ngx_http_log_handler(ngx_http_request_t *r)
 {
     ngx_uint_t                i, l;
-    uintptr_t                 data;
     u_char                   *line, *p;
     size_t                    len;
     ngx_http_log_t           *log;
     ngx_http_log_op_t        *op;
+    ngx_http_log_buf_t       *buffer;
     ngx_http_log_loc_conf_t  *lcf;
-#if (WIN32)
-    u_long                    written;
-#endif
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http log handler");
@@ -182,44 +208,280 @@ ngx_int_t ngx_http_log_handler(ngx_http_request_t *r)
         len++;
 #endif
 
-        ngx_test_null(line, ngx_palloc(r->pool, len), NGX_ERROR);
-        p = line;
+        buffer = log[l].file->data;
 
-        for (i = 0; i < log[l].ops->nelts; i++)
+        if (buffer)
         {
-            if (op[i].op == NGX_HTTP_LOG_COPY_SHORT)
+            if (len > (size_t) (buffer->last - buffer->pos))
+            {
+                ngx_http_log_flush(log[l].file, r->connection->log);
+            }
+
+            if (len <= (size_t) (buffer->last - buffer->pos))
             {
-                len = op[i].len;
-                data = op[i].data;
-                while (len--)
+                if (buffer->pos == buffer->start && buffer->flush)
                 {
-                    *p++ = (char) (data & 0xff);
-                    data >>= 8;
+                    ngx_add_timer(&buffer->event, buffer->flush);
                 }
 
-            }
-            else if (op[i].op == NGX_HTTP_LOG_COPY_LONG)
-            {
-                p = ngx_cpymem(p, (void *) op[i].data, op[i].len);
+                buffer->pos = ngx_http_log_copy(r, buffer->pos, &log[l]);
 
+                continue;
             }
-            else
+
+            /* the entry does not fit even in the empty buffer */
+        }
+
+        ngx_test_null(line, ngx_palloc(r->pool, len), NGX_ERROR);
+
+        p = ngx_http_log_copy(r, line, &log[l]);
+
+        ngx_http_log_write(log[l].file, line, p - line, r->connection->log);
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *ngx_http_log_copy(ngx_http_request_t *r, u_char *buf,
+                                 ngx_http_log_t *log)
+{
+    size_t              len;
+    uintptr_t           data;
+    ngx_uint_t          i;
+    ngx_http_log_op_t  *op;
+
+    op = log->ops->elts;
+    for (i = 0; i < log->ops->nelts; i++)
+    {
+        if (op[i].op == NGX_HTTP_LOG_COPY_SHORT)
+        {
+            len = op[i].len;
+            data = op[i].data;
+            while (len--)
             {
-                p = op[i].op(r, p, op[i].data);
+                *buf++ = (char) (data & 0xff);
+                data >>= 8;
             }
+
+        }
+        else if (op[i].op == NGX_HTTP_LOG_COPY_LONG)
+        {
+            buf = ngx_cpymem(buf, (void *) op[i].data, op[i].len);
+
+        }
+        else
+        {
+            buf = op[i].op(r, buf, op[i].data);
         }
+    }
 
 #if (WIN32)
-        *p++ = CR;
-        *p++ = LF;
-        WriteFile(log[l].file->fd, line, p - line, &written, NULL);
+    *buf++ = CR;
+#endif
+    *buf++ = LF;
+
+    return buf;
+}
+
+
+static void ngx_http_log_write(ngx_open_file_t *file, u_char *buf, size_t len,
+                               ngx_log_t *log)
+{
+#if (NGX_HTTP_GZIP)
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer && buffer->gzip)
+    {
+        ngx_http_log_gzip(file, buf, len, buffer->gzip, log);
+        return;
+    }
+#endif
+
+    ngx_http_log_write_fd(file, buf, len, log);
+}
+
+
+static void ngx_http_log_write_fd(ngx_open_file_t *file, u_char *buf,
+                                  size_t len, ngx_log_t *log)
+{
+    ssize_t  n;
+#if (WIN32)
+    u_long   written;
+
+    if (WriteFile(file->fd, buf, len, &written, NULL) == 0)
+    {
+        n = -1;
+    }
+    else
+    {
+        n = (ssize_t) written;
+    }
 #else
-        *p++ = LF;
-        write(log[l].file->fd, line, p - line);
+
+    n = write(file->fd, buf, len);
 #endif
+
+    if (n == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "write() to \"%s\" failed", file->name.data);
+        return;
     }
 
-    return NGX_OK;
+    if ((size_t) n != len)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "write() to \"%s\" was incomplete: %d of %d",
+                      file->name.data, (int) n, (int) len);
+    }
+}
+
+
+#if (NGX_HTTP_GZIP)
+
+/*
+ * every flushed buffer is written as a separate gzip member,
+ * so the file stays valid for gunzip and zcat after each write
+ */
+
+static void ngx_http_log_gzip(ngx_open_file_t *file, u_char *buf, size_t len,
+                              ngx_int_t level, ngx_log_t *log)
+{
+    int        rc, wbits, memlevel;
+    u_char    *out, *p;
+    size_t     size;
+    uint32_t   crc;
+    z_stream   zstream;
+
+    wbits = MAX_WBITS;
+    memlevel = MAX_MEM_LEVEL - 1;
+
+    /* a small buffer does not need the whole window */
+
+    while ((ssize_t) len < ((1 << (wbits - 1)) - 262))
+    {
+        wbits--;
+        memlevel--;
+    }
+
+    ngx_memzero(&zstream, sizeof(z_stream));
+
+    rc = deflateInit2(&zstream, (int) level, Z_DEFLATED, -wbits, memlevel,
+                      Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "deflateInit2() failed: %d", rc);
+        return;
+    }
+
+    /*
+     * the deflate() worst case for these wbits and memlevel,
+     * plus the gzip header and trailer
+     */
+
+    size = deflateBound(&zstream, len) + 10 + 8;
+
+    if (!(out = ngx_alloc(size, log)))
+    {
+        deflateEnd(&zstream);
+        return;
+    }
+
+    p = ngx_cpymem(out, ngx_http_log_gzheader, 10);
+
+    zstream.next_in = buf;
+    zstream.avail_in = len;
+    zstream.next_out = p;
+    zstream.avail_out = size - 10 - 8;
+
+    rc = deflate(&zstream, Z_FINISH);
+
+    if (rc != Z_STREAM_END)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "deflate(Z_FINISH) failed: %d", rc);
+        deflateEnd(&zstream);
+        ngx_free(out);
+        return;
+    }
+
+    p = zstream.next_out;
+
+    rc = deflateEnd(&zstream);
+
+    if (rc != Z_OK)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "deflateEnd() failed: %d", rc);
+        ngx_free(out);
+        return;
+    }
+
+    crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, buf, len);
+
+    *p++ = (u_char) (crc & 0xff);
+    *p++ = (u_char) ((crc >> 8) & 0xff);
+    *p++ = (u_char) ((crc >> 16) & 0xff);
+    *p++ = (u_char) ((crc >> 24) & 0xff);
+
+    *p++ = (u_char) (len & 0xff);
+    *p++ = (u_char) ((len >> 8) & 0xff);
+    *p++ = (u_char) ((len >> 16) & 0xff);
+    *p++ = (u_char) ((len >> 24) & 0xff);
+
+    ngx_http_log_write_fd(file, out, p - out, log);
+
+    ngx_free(out);
+}
+
+#endif
+
+
+/*
+ * the buffer is flushed when an entry does not fit into it, by the flush
+ * timer, before the file is reopened and when the process exits
+ */
+
+static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    size_t               len;
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    len = buffer->pos - buffer->start;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log flush \"%s\": %d", file->name.data, (int) len);
+
+    if (buffer->event.timer_set)
+    {
+        ngx_del_timer(&buffer->event);
+    }
+
+    if (len == 0)
+    {
+        return;
+    }
+
+    ngx_http_log_write(file, buffer->start, len, log);
+
+    buffer->pos = buffer->start;
+}
+
+
+static void ngx_http_log_flush_handler(ngx_event_t *ev)
+{
+    ngx_http_log_buf_t  *buffer;
+
+    buffer = (ngx_http_log_buf_t *)
+             ((char *) ev - offsetof(ngx_http_log_buf_t, event));
+
+    ngx_http_log_flush(buffer->file, ev->log);
 }
 
 
@@ -356,7 +618,8 @@ static u_char *ngx_http_log_header_in(ngx_http_request_t *r, u_char *buf,
 
     for (i = 0; ngx_http_headers_in[i].name.len != 0; i++)
     {
-        if (ngx_http_headers_in[i].name.len != s->len)
+        if (ngx_http_headers_in[i].name.len != s->len
+                || ngx_http_headers_in[i].handler)
         {
             continue;
         }
@@ -829,16 +1092,26 @@ static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
 {
     ngx_http_log_loc_conf_t *llcf = conf;
 
+    ngx_int_t                  size, gzip;
+    ngx_msec_t                 flush;
     ngx_uint_t                 i;
-    ngx_str_t                 *value, name;
+    ngx_str_t                 *value, name, s;
     ngx_http_log_t            *log;
     ngx_http_log_fmt_t        *fmt;
+    ngx_http_log_buf_t        *buffer;
     ngx_http_log_main_conf_t  *lmcf;
 
     value = cf->args->elts;
 
     if (ngx_strcmp(value[1].data, "off") == 0)
     {
+        if (cf->args->nelts != 2)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%s\"", value[2].data);
+            return NGX_CONF_ERROR;
+        }
+
         llcf->off = 1;
         return NGX_CONF_OK;
     }
@@ -864,7 +1137,7 @@ static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
         return NGX_CONF_ERROR;
     }
 
-    if (cf->args->nelts == 3)
+    if (cf->args->nelts >= 3)
     {
         name = value[2];
     }
@@ -874,6 +1147,8 @@ static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
         name.data = (u_char *) "combined";
     }
 
+    log->ops = NULL;
+
     fmt = lmcf->formats.elts;
     for (i = 0; i < lmcf->formats.nelts; i++)
     {
@@ -881,10 +1156,148 @@ static char *ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
                 && ngx_strcasecmp(fmt[i].name.data, name.data) == 0)
         {
             log->ops = fmt[i].ops;
-            return NGX_CONF_OK;
+            break;
         }
     }
 
+    if (log->ops == NULL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown log format \"%s\"", name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    flush = 0;
+    gzip = 0;
+
+    for (i = 3; i < cf->args->nelts; i++)
+    {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0)
+        {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%s\"", s.data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0)
+        {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            flush = ngx_parse_time(&s, 0);
+            if (flush == NGX_ERROR || flush == NGX_PARSE_LARGE_TIME
+                || flush == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid flush time \"%s\"", s.data);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "gzip", 4) == 0
+            && (value[i].len == 4 || value[i].data[4] == '='))
+        {
+#if (NGX_HTTP_GZIP)
+            if (value[i].len == 4)
+            {
+                gzip = Z_BEST_SPEED;
+                continue;
+            }
+
+            gzip = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (gzip == NGX_ERROR || gzip < 1 || gzip > 9)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid compression level \"%s\"",
+                                   value[i].data + 5);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"gzip\" requires the gzip module");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%s\"", value[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    if (gzip && size == 0)
+    {
+        size = NGX_HTTP_LOG_GZIP_BUFFER;
+    }
+
+    if (size == 0)
+    {
+        if (flush)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"flush\" requires \"buffer\"");
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (log->file->data)
+    {
+        buffer = log->file->data;
+
+        if ((ngx_int_t) (buffer->last - buffer->start) != size
+            || buffer->flush != flush
+            || buffer->gzip != gzip)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "access_log \"%s\" already defined "
+                               "with conflicting parameters",
+                               value[1].data);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (!(buffer = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_buf_t))))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (!(buffer->start = ngx_palloc(cf->pool, size)))
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + size;
+    buffer->file = log->file;
+    buffer->flush = flush;
+    buffer->gzip = gzip;
+
+    buffer->event.event_handler = ngx_http_log_flush_handler;
+    buffer->event.data = &ngx_http_log_dumb;
+    buffer->event.log = cf->cycle->log;
+    ngx_http_log_dumb.fd = (ngx_socket_t) -1;
+
+    log->file->flush = ngx_http_log_flush;
+    log->file->data = buffer;
+
     return NGX_CONF_OK;
 }
 
@@ -21,6 +21,8 @@ typedef u_char *(*ngx_http_log_op_pt) (ngx_http_request_t *r, u_char *buf,
 
 #define NGX_HTTP_LOG_ARG         (u_int) -1
 
+#define NGX_HTTP_LOG_GZIP_BUFFER  65536
+
 
 typedef struct
 {
@@ -58,6 +60,26 @@ typedef struct
 } ngx_http_log_t;
 
 
+/*
+ * the buffer is shared by all access_log directives that write to the same
+ * file and is hooked to the file as its file->data
+ */
+
+typedef struct
+{
+    u_char              *start;
+    u_char              *pos;
+    u_char              *last;
+
+    ngx_open_file_t     *file;
+
+    ngx_event_t          event;      /* the flush timer */
+    ngx_msec_t           flush;
+
+    ngx_int_t            gzip;       /* the compression level or 0 */
+} ngx_http_log_buf_t;
+
+
 typedef struct
 {
     ngx_array_t         *logs;       /* array of ngx_http_log_t */
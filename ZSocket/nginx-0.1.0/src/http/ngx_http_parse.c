@@ -489,7 +489,8 @@ ngx_int_t ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
 
 ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
 {
-    u_char  c, ch, *p;
+    u_char      c, ch, *p;
+    ngx_uint_t  hash;
     enum
     {
         sw_start = 0,
@@ -505,6 +506,7 @@ ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
     } state;
 
     state = r->state;
+    hash = r->header_hash;
     p = b->pos;
 
     while (p < b->last && state < sw_done)
@@ -533,16 +535,19 @@ ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
                 c = (u_char) (ch | 0x20);
                 if (c >= 'a' && c <= 'z')
                 {
+                    hash = c;
                     break;
                 }
 
                 if (ch == '-' || ch == '_' || ch == '~' || ch == '.')
                 {
+                    hash = ch;
                     break;
                 }
 
                 if (ch >= '0' && ch <= '9')
                 {
+                    hash = ch;
                     break;
                 }
 
@@ -556,6 +561,7 @@ ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
             c = (u_char) (ch | 0x20);
             if (c >= 'a' && c <= 'z')
             {
+                hash = ngx_http_header_hash(hash, c);
                 break;
             }
 
@@ -568,11 +574,13 @@ ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
 
             if (ch == '-' || ch == '_' || ch == '~' || ch == '.')
             {
+                hash = ngx_http_header_hash(hash, ch);
                 break;
             }
 
             if (ch >= '0' && ch <= '9')
             {
+                hash = ngx_http_header_hash(hash, ch);
                 break;
             }
 
@@ -690,6 +698,7 @@ ngx_int_t ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b)
     }
 
     b->pos = p;
+    r->header_hash = hash;
 
     if (state == sw_done)
     {
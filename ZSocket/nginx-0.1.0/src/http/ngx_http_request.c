@@ -20,6 +20,13 @@ static ssize_t ngx_http_read_request_header(ngx_http_request_t *r);
 static ngx_int_t ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
         ngx_uint_t request_line);
 static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_process_cookie(ngx_http_request_t *r,
+        ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_http_server_name_t *ngx_http_find_virtual_name(
+        ngx_http_virtual_names_t *vn, u_char *host, size_t len);
+static ngx_http_server_name_t *ngx_http_lookup_virtual_name(
+        ngx_http_virtual_names_hash_t *hash, u_char *name, size_t len);
+static ngx_int_t ngx_http_wildcard_name(ngx_str_t *name);
 
 static void ngx_http_set_write_handler(ngx_http_request_t *r);
 
@@ -58,46 +65,60 @@ static char *client_header_errors[] =
 
 ngx_http_header_t  ngx_http_headers_in[] =
 {
-    { ngx_string("Host"), offsetof(ngx_http_headers_in_t, host) },
-    { ngx_string("Connection"), offsetof(ngx_http_headers_in_t, connection) },
+    { ngx_string("Host"), offsetof(ngx_http_headers_in_t, host), NULL },
+    {
+        ngx_string("Connection"),
+        offsetof(ngx_http_headers_in_t, connection), NULL
+    },
     {
         ngx_string("If-Modified-Since"),
-        offsetof(ngx_http_headers_in_t, if_modified_since)
+        offsetof(ngx_http_headers_in_t, if_modified_since), NULL
+    },
+    {
+        ngx_string("User-Agent"),
+        offsetof(ngx_http_headers_in_t, user_agent), NULL
     },
-    { ngx_string("User-Agent"), offsetof(ngx_http_headers_in_t, user_agent) },
-    { ngx_string("Referer"), offsetof(ngx_http_headers_in_t, referer) },
+    { ngx_string("Referer"), offsetof(ngx_http_headers_in_t, referer), NULL },
     {
         ngx_string("Content-Length"),
-        offsetof(ngx_http_headers_in_t, content_length)
+        offsetof(ngx_http_headers_in_t, content_length), NULL
     },
 
-    { ngx_string("Range"), offsetof(ngx_http_headers_in_t, range) },
+    { ngx_string("Range"), offsetof(ngx_http_headers_in_t, range), NULL },
 #if 0
-    { ngx_string("If-Range"), offsetof(ngx_http_headers_in_t, if_range) },
+    {
+        ngx_string("If-Range"),
+        offsetof(ngx_http_headers_in_t, if_range), NULL
+    },
 #endif
 
 #if (NGX_HTTP_GZIP)
     {
         ngx_string("Accept-Encoding"),
-        offsetof(ngx_http_headers_in_t, accept_encoding)
+        offsetof(ngx_http_headers_in_t, accept_encoding), NULL
     },
-    { ngx_string("Via"), offsetof(ngx_http_headers_in_t, via) },
+    { ngx_string("Via"), offsetof(ngx_http_headers_in_t, via), NULL },
 #endif
 
     {
         ngx_string("Authorization"),
-        offsetof(ngx_http_headers_in_t, authorization) },
+        offsetof(ngx_http_headers_in_t, authorization), NULL },
 
-    { ngx_string("Keep-Alive"), offsetof(ngx_http_headers_in_t, keep_alive) },
+    {
+        ngx_string("Keep-Alive"),
+        offsetof(ngx_http_headers_in_t, keep_alive), NULL
+    },
+
+    { ngx_string("Cookie"), 0, ngx_http_process_cookie },
 
 #if (NGX_HTTP_PROXY)
     {
         ngx_string("X-Forwarded-For"),
-        offsetof(ngx_http_headers_in_t, x_forwarded_for)
+        offsetof(ngx_http_headers_in_t, x_forwarded_for), NULL
     },
 #endif
 
-    { ngx_null_string, 0 }
+    { ngx_null_string, 0, NULL }
 };
 
 
@@ -151,7 +172,7 @@ void ngx_http_init_connection(ngx_connection_t *c)
         }
 
 #if (NGX_STAT_STUB)
-        (*ngx_stat_reading)++;
+        ngx_atomic_inc(ngx_stat_reading);
 #endif
 
         ngx_http_init_request(rev);
@@ -180,7 +201,7 @@ void ngx_http_init_connection(ngx_connection_t *c)
 #endif
 
 #if (NGX_STAT_STUB)
-    (*ngx_stat_reading)++;
+    ngx_atomic_inc(ngx_stat_reading);
 #endif
 
 }
@@ -210,7 +231,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
         ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
 
 #if (NGX_STAT_STUB)
-        (*ngx_stat_reading)--;
+        ngx_atomic_dec(ngx_stat_reading);
 #endif
 
         ngx_http_close_connection(c);
@@ -223,7 +244,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
     {
 
 #if (NGX_STAT_STUB)
-        (*ngx_stat_reading)++;
+        ngx_atomic_inc(ngx_stat_reading);
 #endif
 
     }
@@ -233,7 +254,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
         {
 
 #if (NGX_STAT_STUB)
-            (*ngx_stat_reading)--;
+            ngx_atomic_dec(ngx_stat_reading);
 #endif
 
             ngx_http_close_connection(c);
@@ -261,7 +282,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
         {
 
 #if (NGX_STAT_STUB)
-            (*ngx_stat_reading)--;
+            ngx_atomic_dec(ngx_stat_reading);
 #endif
 
             ngx_http_close_connection(c);
@@ -345,7 +366,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
         r->in_addr = in_addr[0].addr;
     }
 
-    r->virtual_names = &in_addr[i].names;
+    r->virtual_names = in_addr[i].virtual_names;
 
     /* the default server configuration for the address:port */
     cscf = in_addr[i].core_srv_conf;
@@ -459,7 +480,7 @@ static void ngx_http_init_request(ngx_event_t *rev)
     r->http_state = NGX_HTTP_READING_REQUEST_STATE;
 
 #if (NGX_STAT_STUB)
-    (*ngx_stat_requests)++;
+    ngx_atomic_inc(ngx_stat_requests);
 #endif
 
     rev->event_handler(rev);
@@ -795,15 +816,19 @@ static void ngx_http_process_request_line(ngx_event_t *rev)
 
 static void ngx_http_process_request_headers(ngx_event_t *rev)
 {
-    ssize_t              n;
-    ngx_int_t            rc, rv, i;
-    ngx_table_elt_t     *h, **cookie;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    ssize_t                     n;
+    ngx_int_t                   rc, rv;
+    ngx_table_elt_t            *h;
+    ngx_connection_t           *c;
+    ngx_http_header_t          *hh;
+    ngx_http_request_t         *r;
+    ngx_http_core_main_conf_t  *cmcf;
 
     c = rev->data;
     r = c->data;
 
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
                    "http process request header line");
 
@@ -873,36 +898,28 @@ static void ngx_http_process_request_headers(ngx_event_t *rev)
             h->value.data = r->header_start;
             h->value.data[h->value.len] = '\0';
 
-            if (h->key.len == sizeof("Cookie") - 1
-                    && ngx_strcasecmp(h->key.data, "Cookie") == 0)
-            {
-                if (!(cookie = ngx_array_push(&r->headers_in.cookies)))
-                {
-                    ngx_http_close_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-                    ngx_http_close_connection(c);
-                    return;
-                }
-
-                *cookie = h;
+            hh = cmcf->headers_in_hash[r->header_hash
+                                       % cmcf->headers_in_hash_size];
 
-            }
-            else
+            if (hh
+                    && hh->name.len == h->key.len
+                    && ngx_strcasecmp(hh->name.data, h->key.data) == 0)
             {
-
-                for (i = 0; ngx_http_headers_in[i].name.len != 0; i++)
+                if (hh->handler)
                 {
-                    if (ngx_http_headers_in[i].name.len != h->key.len)
+                    if (hh->handler(r, h, hh->offset) != NGX_OK)
                     {
-                        continue;
+                        ngx_http_close_request(r,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                        ngx_http_close_connection(c);
+                        return;
                     }
 
-                    if (ngx_strcasecmp(ngx_http_headers_in[i].name.data,
-                                       h->key.data) == 0)
-                    {
-                        *((ngx_table_elt_t **) ((char *) &r->headers_in
-                                                + ngx_http_headers_in[i].offset)) = h;
-                        break;
-                    }
+                }
+                else
+                {
+                    *((ngx_table_elt_t **)
+                      ((char *) &r->headers_in + hh->offset)) = h;
                 }
             }
 
@@ -937,9 +954,9 @@ static void ngx_http_process_request_headers(ngx_event_t *rev)
             }
 
 #if (NGX_STAT_STUB)
-            (*ngx_stat_reading)--;
+            ngx_atomic_dec(ngx_stat_reading);
             r->stat_reading = 0;
-            (*ngx_stat_writing)++;
+            ngx_atomic_inc(ngx_stat_writing);
             r->stat_writing = 1;
 #endif
 
@@ -984,6 +1001,22 @@ static void ngx_http_process_request_headers(ngx_event_t *rev)
 }
 
 
+static ngx_int_t ngx_http_process_cookie(ngx_http_request_t *r,
+        ngx_table_elt_t *h, ngx_uint_t offset)
+{
+    ngx_table_elt_t  **cookie;
+
+    if (!(cookie = ngx_array_push(&r->headers_in.cookies)))
+    {
+        return NGX_ERROR;
+    }
+
+    *cookie = h;
+
+    return NGX_OK;
+}
+
+
 static ssize_t ngx_http_read_request_header(ngx_http_request_t *r)
 {
     ssize_t                    n;
@@ -1205,7 +1238,6 @@ static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r)
 {
     u_char                    *ua, *user_agent;
     size_t                     len;
-    ngx_uint_t                 i;
     ngx_http_server_name_t    *name;
     ngx_http_core_srv_conf_t  *cscf;
     ngx_http_core_loc_conf_t  *clcf;
@@ -1220,37 +1252,35 @@ static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r)
             }
         }
         r->headers_in.host_name_len = len;
+        r->headers_in.host_name.len = len;
+        r->headers_in.host_name.data = r->headers_in.host->value.data;
 
         /* find the name based server configuration */
 
-        name = r->virtual_names->elts;
-        for (i = 0; i < r->virtual_names->nelts; i++)
-        {
-            if (r->headers_in.host_name_len != name[i].name.len)
-            {
-                continue;
-            }
+        name = NULL;
 
-            if (ngx_strncasecmp(r->headers_in.host->value.data,
-                                name[i].name.data,
-                                r->headers_in.host_name_len) == 0)
-            {
-                r->srv_conf = name[i].core_srv_conf->ctx->srv_conf;
-                r->loc_conf = name[i].core_srv_conf->ctx->loc_conf;
-                r->server_name = &name[i].name;
+        if (r->virtual_names)
+        {
+            name = ngx_http_find_virtual_name(r->virtual_names,
+                                              r->headers_in.host->value.data,
+                                              r->headers_in.host_name_len);
+        }
 
-                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-                r->connection->log->file = clcf->err_log->file;
-                if (!(r->connection->log->log_level & NGX_LOG_DEBUG_CONNECTION))
-                {
-                    r->connection->log->log_level = clcf->err_log->log_level;
-                }
+        if (name)
+        {
+            r->srv_conf = name->core_srv_conf->ctx->srv_conf;
+            r->loc_conf = name->core_srv_conf->ctx->loc_conf;
+            r->server_name = &name->name;
 
-                break;
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+            r->connection->log->file = clcf->err_log->file;
+            if (!(r->connection->log->log_level & NGX_LOG_DEBUG_CONNECTION))
+            {
+                r->connection->log->log_level = clcf->err_log->log_level;
             }
-        }
 
-        if (i == r->virtual_names->nelts)
+        }
+        else
         {
             cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
 
@@ -1260,6 +1290,16 @@ static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r)
             }
         }
 
+        /*
+         * "*.example.com" or "www.example.*" is not a host name,
+         * so the redirects use the name the client has asked for
+         */
+
+        if (len && ngx_http_wildcard_name(r->server_name))
+        {
+            r->server_name = &r->headers_in.host_name;
+        }
+
     }
     else
     {
@@ -1371,6 +1411,99 @@ static ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r)
 }
 
 
+/*
+ * the exact name is looked up first, then the longest "*.example.com"
+ * suffix and then the longest "www.example.*" prefix, label by label
+ */
+
+static ngx_http_server_name_t *ngx_http_find_virtual_name(
+        ngx_http_virtual_names_t *vn, u_char *host, size_t len)
+{
+    size_t                   i;
+    ngx_http_server_name_t  *name;
+
+    if (vn->names.size)
+    {
+        name = ngx_http_lookup_virtual_name(&vn->names, host, len);
+        if (name)
+        {
+            return name;
+        }
+    }
+
+    if (vn->head_wildcards.size)
+    {
+        for (i = 0; i < len; i++)
+        {
+            if (host[i] != '.')
+            {
+                continue;
+            }
+
+            name = ngx_http_lookup_virtual_name(&vn->head_wildcards,
+                                                host + i + 1, len - i - 1);
+            if (name)
+            {
+                return name;
+            }
+        }
+    }
+
+    if (vn->tail_wildcards.size)
+    {
+        for (i = len; i > 0; i--)
+        {
+            if (host[i - 1] != '.')
+            {
+                continue;
+            }
+
+            name = ngx_http_lookup_virtual_name(&vn->tail_wildcards,
+                                                host, i - 1);
+            if (name)
+            {
+                return name;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_server_name_t *ngx_http_lookup_virtual_name(
+        ngx_http_virtual_names_hash_t *hash, u_char *name, size_t len)
+{
+    ngx_http_virtual_name_t  *vn;
+
+    vn = hash->buckets[ngx_http_header_hash_key(name, len) % hash->size];
+
+    for ( /* void */ ; vn; vn = vn->next)
+    {
+        if (vn->key.len == len
+                && ngx_strncasecmp(vn->key.data, name, len) == 0)
+        {
+            return vn->server_name;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t ngx_http_wildcard_name(ngx_str_t *name)
+{
+    if (name->len <= 2)
+    {
+        return 0;
+    }
+
+    return (name->data[0] == '*' && name->data[1] == '.')
+           || (name->data[name->len - 2] == '.'
+               && name->data[name->len - 1] == '*');
+}
+
+
 void ngx_http_finalize_request(ngx_http_request_t *r, int rc)
 {
     ngx_http_core_loc_conf_t  *clcf;
@@ -2189,12 +2322,12 @@ void ngx_http_close_request(ngx_http_request_t *r, int error)
 #if (NGX_STAT_STUB)
     if (r->stat_reading)
     {
-        (*ngx_stat_reading)--;
+        ngx_atomic_dec(ngx_stat_reading);
     }
 
     if (r->stat_writing)
     {
-        (*ngx_stat_writing)--;
+        ngx_atomic_dec(ngx_stat_writing);
     }
 #endif
 
@@ -2213,6 +2346,12 @@ void ngx_http_close_request(ngx_http_request_t *r, int error)
             continue;
         }
 
+        if (cleanup[i].handler)
+        {
+            cleanup[i].data.handler.handler(cleanup[i].data.handler.data);
+            continue;
+        }
+
 #if (NGX_HTTP_CACHE)
 
         if (cleanup[i].cache)
@@ -2315,7 +2454,7 @@ void ngx_http_close_connection(ngx_connection_t *c)
                    "close http connection: %d", c->fd);
 
 #if (NGX_STAT_STUB)
-    (*ngx_stat_active)--;
+    ngx_atomic_dec(ngx_stat_active);
 #endif
 
     ngx_close_connection(c);
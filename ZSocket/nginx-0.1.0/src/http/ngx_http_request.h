@@ -46,6 +46,7 @@
 
 
 #define NGX_HTTP_OK                        200
+#define NGX_HTTP_NO_CONTENT                204
 #define NGX_HTTP_PARTIAL_CONTENT           206
 
 #define NGX_HTTP_SPECIAL_RESPONSE          300
@@ -119,10 +120,27 @@ typedef enum
 } ngx_http_state_e;
 
 
+/*
+ * the header name hash is calculated by ngx_http_parse_header_line()
+ * over the lowercased name
+ */
+
+#define ngx_http_header_hash(key, c)  ((ngx_uint_t) (key) * 31 + (c))
+
+#define NGX_HTTP_HEADERS_IN_HASH_MAX  1024
+
+
+typedef ngx_int_t (*ngx_http_header_handler_pt)(ngx_http_request_t *r,
+        ngx_table_elt_t *h, ngx_uint_t offset);
+
+
 typedef struct
 {
-    ngx_str_t         name;
-    ngx_uint_t        offset;
+    ngx_str_t                    name;
+    ngx_uint_t                   offset;
+
+    /* NULL means to set the ngx_table_elt_t pointer at the offset */
+    ngx_http_header_handler_pt   handler;
 } ngx_http_header_t;
 
 
@@ -155,6 +173,7 @@ typedef struct
     ngx_array_t       cookies;
 
     size_t            host_name_len;
+    ngx_str_t         host_name;        /* Host without the port */
     ssize_t           content_length_n;
     size_t            connection_type;
     ssize_t           keep_alive_n;
@@ -215,6 +234,8 @@ typedef struct
 } ngx_http_request_body_t;
 
 
+typedef void (*ngx_http_cleanup_pt)(void *data);
+
 struct ngx_http_cleanup_s
 {
     union
@@ -230,10 +251,17 @@ struct ngx_http_cleanup_s
             ngx_http_cache_hash_t   *hash;
             ngx_http_cache_t        *cache;
         } cache;
+
+        struct
+        {
+            ngx_http_cleanup_pt      handler;
+            void                    *data;
+        } handler;
     } data;
 
     unsigned                         valid:1;
     unsigned                         cache:1;
+    unsigned                         handler:1;
 };
 
 
@@ -297,7 +325,7 @@ struct ngx_http_request_s
     ngx_uint_t           port;
     ngx_str_t           *port_text;    /* ":80" */
     ngx_str_t           *server_name;
-    ngx_array_t         *virtual_names;
+    ngx_http_virtual_names_t  *virtual_names;
 
     ngx_uint_t           phase;
     ngx_int_t            phase_handler;
@@ -357,6 +385,7 @@ struct ngx_http_request_s
 
     /* used to parse HTTP headers */
     ngx_uint_t           state;
+    ngx_uint_t           header_hash;
     u_char              *uri_start;
     u_char              *uri_end;
     u_char              *uri_ext;
@@ -41,8 +41,6 @@ static ngx_inline uint32_t ngx_atomic_inc(ngx_atomic_t *value)
 }
 
 
-#if 0
-
 static ngx_inline uint32_t ngx_atomic_dec(ngx_atomic_t *value)
 {
     uint32_t  old;
@@ -50,7 +48,7 @@ static ngx_inline uint32_t ngx_atomic_dec(ngx_atomic_t *value)
     __asm__ volatile (
 
         NGX_SMP_LOCK
-        "   xaddl  %0, %1;   "
+        "   xaddl  %0, %2;   "
         "   decl   %0;       "
 
         : "=q" (old) : "0" (-1), "m" (*value));
@@ -58,8 +56,6 @@ static ngx_inline uint32_t ngx_atomic_dec(ngx_atomic_t *value)
     return old;
 }
 
-#endif
-
 
 static ngx_inline uint32_t ngx_atomic_cmp_set(ngx_atomic_t *lock,
         ngx_atomic_t old,
@@ -115,6 +111,34 @@ static ngx_inline uint32_t ngx_atomic_inc(ngx_atomic_t *value)
 }
 
 
+static ngx_inline uint32_t ngx_atomic_dec(ngx_atomic_t *value)
+{
+    uint32_t  old, new, res;
+
+    old = *value;
+
+    for ( ;; )
+    {
+
+        new = old - 1;
+        res = new;
+
+        __asm__ volatile (
+
+            "casa [%1] 0x80, %2, %0"
+
+            : "+r" (res) : "r" (value), "r" (old));
+
+        if (res == old)
+        {
+            return new;
+        }
+
+        old = res;
+    }
+}
+
+
 static ngx_inline uint32_t ngx_atomic_cmp_set(ngx_atomic_t *lock,
         ngx_atomic_t old,
         ngx_atomic_t set)
@@ -137,6 +161,7 @@ static ngx_inline uint32_t ngx_atomic_cmp_set(ngx_atomic_t *lock,
 typedef volatile uint32_t  ngx_atomic_t;
 
 #define ngx_atomic_inc(x)  ++(*(x));
+#define ngx_atomic_dec(x)  --(*(x));
 
 static ngx_inline uint32_t ngx_atomic_cmp_set(ngx_atomic_t *lock,
         ngx_atomic_t old,
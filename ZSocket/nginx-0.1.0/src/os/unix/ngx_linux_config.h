@@ -85,6 +85,13 @@ extern ssize_t sendfile(int s, int fd, int32_t *offset, size_t size);
 #endif
 
 
+/* Linux 3.9+ balances the connections between the SO_REUSEPORT sockets */
+
+#if defined SO_REUSEPORT && !defined HAVE_REUSEPORT
+#define HAVE_REUSEPORT  1
+#endif
+
+
 #ifndef HAVE_INHERITED_NONBLOCK
 #define HAVE_INHERITED_NONBLOCK  0
 #endif
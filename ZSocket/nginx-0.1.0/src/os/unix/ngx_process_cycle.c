@@ -24,6 +24,7 @@ static void *ngx_worker_thread_cycle(void *data);
 
 
 ngx_uint_t    ngx_process;
+ngx_uint_t    ngx_worker;
 ngx_pid_t     ngx_pid;
 ngx_uint_t    ngx_threaded;
 
@@ -337,7 +338,10 @@ static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n,
 
     while (n--)
     {
-        ngx_spawn_process(cycle, ngx_worker_process_cycle, NULL,
+        /* the worker number selects its own reuseport listening sockets */
+
+        ngx_spawn_process(cycle, ngx_worker_process_cycle,
+                          (void *) (uintptr_t) n,
                           "worker process", type);
 
         ch.pid = ngx_processes[ngx_process_slot].pid;
@@ -603,6 +607,8 @@ static ngx_uint_t ngx_reap_childs(ngx_cycle_t *cycle)
 
 static void ngx_master_exit(ngx_cycle_t *cycle, ngx_master_ctx_t *ctx)
 {
+    ngx_flush_files(cycle);
+
     ngx_delete_pidfile(cycle);
 
     ngx_log_error(NGX_LOG_INFO, cycle->log, 0, "exit");
@@ -633,6 +639,7 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
 
 
     ngx_process = NGX_PROCESS_WORKER;
+    ngx_worker = (ngx_uint_t) (uintptr_t) data;
 
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
@@ -807,6 +814,8 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
             ngx_wakeup_worker_threads(cycle);
 #endif
 
+            ngx_flush_files(cycle);
+
             /*
              * we do not destroy cycle->pool here because a signal handler
              * that uses cycle->log can be called at this point
@@ -826,6 +835,8 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
             ngx_wakeup_worker_threads(cycle);
 #endif
 
+            ngx_flush_files(cycle);
+
             /*
              * we do not destroy cycle->pool here because a signal handler
              * that uses cycle->log can be called at this point
@@ -13,6 +13,7 @@
 
 
 void *ngx_create_shared_memory(size_t size, ngx_log_t *log);
+void ngx_free_shared_memory(void *p, size_t size, ngx_log_t *log);
 
 
 #endif /* _NGX_SHARED_H_INCLUDED_ */
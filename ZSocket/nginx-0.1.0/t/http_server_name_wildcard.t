@@ -0,0 +1,130 @@
+#!/usr/bin/perl
+
+# Redirects of a server with wildcard server names: the Location header
+# carries the host the client has asked for, not the "*.example.com"
+# pattern.
+#
+# Run from the source directory after make:  perl t/http_server_name_wildcard.t
+
+use warnings;
+use strict;
+
+use File::Temp qw/ tempdir /;
+use IO::Socket::INET;
+use POSIX qw/ WNOHANG /;
+
+my $nginx = $ENV{TEST_NGINX_BINARY} || 'objs/nginx';
+my $port = $ENV{TEST_NGINX_PORT} || 8081;
+
+unless (-x $nginx) {
+    print "1..0 # SKIP no $nginx\n";
+    exit 0;
+}
+
+my $d = tempdir('nginx-test-XXXXXXXX', TMPDIR => 1, CLEANUP => 1);
+
+# the default "nobody" group does not exist everywhere
+my $user = getpwuid($>);
+my $group = getgrgid($) + 0);
+
+mkdir "$d/html";
+mkdir "$d/html/dir";
+
+open my $fh, '>', "$d/nginx.conf" or die "Can't create nginx.conf: $!\n";
+print $fh <<"END";
+
+user            $user  $group;
+daemon          off;
+master_process  off;
+error_log       $d/error.log  debug;
+pid             $d/nginx.pid;
+
+events {
+    connections  64;
+}
+
+http {
+    access_log       $d/access.log;
+    proxy_temp_path  $d/proxy_temp;
+
+    server {
+        listen       127.0.0.1:$port;
+        server_name  *.example.com  www.example.*;
+
+        location / {
+            root  $d/html;
+        }
+    }
+
+    server {
+        listen       127.0.0.1:$port;
+        server_name  localhost;
+
+        location / {
+            root  $d/html;
+        }
+    }
+}
+
+END
+close $fh;
+
+my $pid = fork();
+die "Can't fork: $!\n" unless defined $pid;
+
+if ($pid == 0) {
+    exec($nginx, '-c', "$d/nginx.conf") or die "Can't exec $nginx: $!\n";
+}
+
+my $up = 0;
+for (1 .. 50) {
+    if (IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port")) {
+        $up = 1;
+        last;
+    }
+    select undef, undef, undef, 0.1;
+}
+
+sub location {
+    my ($host) = @_;
+
+    my $s = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port")
+        or return '';
+
+    print $s "GET /dir HTTP/1.0\r\nHost: $host\r\n\r\n";
+
+    local $/;
+    my $reply = <$s> || '';
+
+    return $reply =~ /^Location: (.*?)\r$/m ? $1 : '';
+}
+
+my @tests = (
+    [ 'www.example.com', "http://www.example.com:$port/dir/",
+        'leading wildcard' ],
+    [ 'a.b.example.com:' . $port, "http://a.b.example.com:$port/dir/",
+        'leading wildcard, port in Host' ],
+    [ 'www.example.org', "http://www.example.org:$port/dir/",
+        'trailing wildcard' ],
+    [ 'localhost', "http://localhost:$port/dir/",
+        'exact name' ],
+);
+
+print '1..', scalar @tests, "\n";
+
+my $n = 0;
+for my $t (@tests) {
+    my ($host, $expect, $name) = @$t;
+    my $got = $up ? location($host) : '';
+
+    $n++;
+    print $got eq $expect ? "ok $n - $name\n"
+        : "not ok $n - $name\n# got \"$got\", expected \"$expect\"\n";
+}
+
+kill 'TERM', $pid;
+for (1 .. 50) {
+    last if waitpid($pid, WNOHANG) != 0;
+    select undef, undef, undef, 0.1;
+}
+kill 'KILL', $pid if waitpid($pid, WNOHANG) == 0;